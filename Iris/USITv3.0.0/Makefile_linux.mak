@@ -5,7 +5,7 @@ CXX=g++
 #CXXFLAGS=-O3 -Wall -fmessage-length=0  -s
 DEBUGFLAGS=
 #DEBUGFLAGS=-rdynamic -DDEBUG
-CXXFLAGS=${EXTRAFLAGS} ${DEBUGFLAGS} -gdwarf-3 -Wall -std=c++11 -Wformat
+CXXFLAGS=${EXTRAFLAGS} ${DEBUGFLAGS} -gdwarf-3 -Wall -std=c++11 -Wformat -pthread
 LINKFLAGS=-L/opt/local/lib \
 		  -lopencv_core \
 		  -lopencv_highgui \
@@ -19,14 +19,21 @@ LINKFLAGS=-L/opt/local/lib \
 		  -lboost_regex \
 		  -lopencv_photo \
 
-COMPILETARGETS=lbp lbpc sift siftc surf surfc cg caht wahet gfcf lg hd hdverify qsw ko koc cb cbc cr dct dctc maskcmp ifpp manuseg cahtlog2manuseg wahetlog2manuseg cahtvis
+COMPILETARGETS=lbp lbpc sift siftc surf surfc cg caht wahet gfcf lg hd hdverify hdmerge qsw ko koc cb cbc cr dct dctc maskcmp ifpp manuseg cahtlog2manuseg wahetlog2manuseg cahtvis
 
 ALLTARGETS= ${COMPILETARGETS} gen_stats_np.py
 
+TESTTARGETS=tests/caht_test tests/cahtvis_test tests/wahet_test tests/ifpp_test
+
 %:%.cpp version.h
 	$(CXX) -o $@ $(CXXFLAGS) $< $(LINKFLAGS)
 
+tests/%_test: tests/%_test.cpp %.cpp $(wildcard tests/*.h) version.h
+	$(CXX) -o $@ $(CXXFLAGS) $< $(LINKFLAGS)
+
 all: ${ALLTARGETS}
+caht cahtvis wahet manuseg cr tests/caht_test tests/cahtvis_test tests/wahet_test: clahe.h
+caht cahtvis wahet ifpp manuseg cr tests/caht_test tests/cahtvis_test tests/wahet_test tests/ifpp_test: batch.h
 install: all
 	mkdir -p ${HOME}/bin
 	@echo "installing"
@@ -39,8 +46,11 @@ uninstall: INSTALL.LOG
 	@echo "The following files will be removed"
 	@cat $< | sed 's/^/    /'
 	@rm -I ${RMLIST} $<
+test: ${TESTTARGETS}
+	@for t in ${TESTTARGETS}; do ./$$t || exit 1; done
 clean:
 	rm ${COMPILETARGETS}
+	rm -f ${TESTTARGETS}
 
 gen_stats_np.py:
 	@:
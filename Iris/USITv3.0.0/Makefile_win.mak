@@ -93,6 +93,9 @@ LINKFLAGS= ${LINK_OPENCV} \
 bin/%.exe: %.cpp version.h
 	$(CXX) $< -o $@ $(CXXFLAGS) $(LINKFLAGS)
 
-all: bin/lbp.exe bin/lbpc.exe bin/surf.exe bin/surfc.exe bin/sift.exe bin/siftc.exe bin/caht.exe bin/wahet.exe bin/gfcf.exe bin/lg.exe bin/cg.exe bin/hd.exe bin/hdverify.exe bin/qsw.exe bin/ko.exe bin/koc.exe bin/cb.exe bin/cbc.exe bin/cr.exe bin/dct.exe bin/dctc.exe bin/maskcmp.exe bin/ifpp.exe bin/manuseg.exe bin/cahtlog2manuseg.exe bin/wahetlog2manuseg.exe bin/cahtvis.exe
+all: bin/lbp.exe bin/lbpc.exe bin/surf.exe bin/surfc.exe bin/sift.exe bin/siftc.exe bin/caht.exe bin/wahet.exe bin/gfcf.exe bin/lg.exe bin/cg.exe bin/hd.exe bin/hdverify.exe bin/hdmerge.exe bin/qsw.exe bin/ko.exe bin/koc.exe bin/cb.exe bin/cbc.exe bin/cr.exe bin/dct.exe bin/dctc.exe bin/maskcmp.exe bin/ifpp.exe bin/manuseg.exe bin/cahtlog2manuseg.exe bin/wahetlog2manuseg.exe bin/cahtvis.exe
+
+bin/caht.exe bin/cahtvis.exe bin/wahet.exe bin/manuseg.exe bin/cr.exe: clahe.h
+bin/caht.exe bin/cahtvis.exe bin/wahet.exe bin/ifpp.exe bin/manuseg.exe bin/cr.exe: batch.h
 
 
@@ -0,0 +1,283 @@
+/*
+ * batch.h
+ *
+ * Batch processing of input files with worker threads, parallel loops and
+ * profiling of the processing stages, shared by the segmentation tools (caht,
+ * cahtvis, wahet, ifpp) and clahe.h
+ *
+ */
+#ifndef USIT_BATCH_H
+#define USIT_BATCH_H
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+#include <opencv2/core/core.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+/*
+ * Runs a task for each index in [0, count) distributing the indices to worker threads in interleaved order
+ *
+ * count: number of indices
+ * threads: number of worker threads
+ * task: functor called with each index
+ */
+template <typename Task>
+void parallelFor(const int count, const int threads, const Task& task){
+	if (threads <= 1 || count <= 1){
+		for (int i = 0; i < count; i++) task(i);
+		return;
+	}
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads && t < count; t++){
+		workers.push_back(std::thread([&task, t, count, threads](){
+			for (int i = t; i < count; i += threads) task(i);
+		}));
+	}
+	for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+}
+
+/*
+ * Processes a list of input files with a pool of worker threads. Each worker loads, segments
+ * and stores one file at a time and takes the next unprocessed file when done, so expensive
+ * images do not stall the others. Log lines of each file are collected separately and handed
+ * to commit in input order from the calling thread. The first error stops all workers and is
+ * rethrown after they have finished.
+ *
+ * files: input files
+ * jobs: number of worker threads (1 processes all files in the calling thread)
+ * process: function(file, worker, logLines) processing one file in worker thread worker (0 to jobs-1),
+ *          writing its log lines to logLines
+ * commit: function(logLines) called with the log lines of each file in input order
+ */
+template<typename Process, typename Commit>
+void batchProcess(const std::vector<std::string>& files, int jobs, Process process, Commit commit){
+	size_t count = files.size();
+	if (jobs <= 1 || count <= 1){
+		for (size_t i = 0; i < count; i++){
+			std::ostringstream logLines;
+			process(files[i], 0, logLines);
+			commit(logLines.str());
+		}
+		return;
+	}
+	std::vector<std::string> logs(count);
+	std::vector<char> done(count, 0);
+	size_t next = 0;
+	bool failed = false;
+	std::exception_ptr error;
+	std::mutex lock;
+	std::condition_variable finished;
+	std::vector<std::thread> workers;
+	for (int j = 0; j < jobs && j < (int) count; j++){
+		workers.push_back(std::thread([&, j](){
+			while (true){
+				size_t i;
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					if (failed || next >= count) return;
+					i = next++;
+				}
+				std::ostringstream logLines;
+				try {
+					process(files[i], j, logLines);
+				}
+				catch (...){
+					std::lock_guard<std::mutex> guard(lock);
+					if (!failed) error = std::current_exception();
+					failed = true;
+					finished.notify_all();
+					return;
+				}
+				std::lock_guard<std::mutex> guard(lock);
+				logs[i] = logLines.str();
+				done[i] = 1;
+				finished.notify_all();
+			}
+		}));
+	}
+	for (size_t i = 0; i < count; i++){
+		std::string logLines;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			finished.wait(guard, [&](){ return done[i] || failed; });
+			if (failed) break;
+			logLines.swap(logs[i]);
+		}
+		commit(logLines);
+	}
+	for (size_t j = 0; j < workers.size(); j++) workers[j].join();
+	if (failed) std::rethrow_exception(error);
+}
+
+/*
+ * Collects the wall time of the processing stages of each image (-prof). Every finished
+ * stage is written as one JSON line {"file","stage","thread","start","duration"} with times
+ * in microseconds since program start. summary() appends per-stage statistics
+ * {"summary","count","mean","p50","p95","p99"} to the file and prints them (unless quiet).
+ * Stages may be added from several threads.
+ */
+class Profile{
+public:
+	/** true if a profile file has been opened **/
+	bool enabled;
+
+	/*
+	 * Default constructor, profiling is disabled until open() is called
+	 */
+	Profile(){
+		enabled = false;
+		start = boost::posix_time::microsec_clock::universal_time();
+	}
+
+	/*
+	 * Opens the profile file (JSON lines) and enables profiling
+	 *
+	 * filename: path of the profile file
+	 */
+	void open(const std::string& filename){
+		file.open(filename.c_str(),std::ios::out | std::ios::trunc);
+		if (!file) CV_Error(CV_StsError,"Could not open profile file '" + filename + "'");
+		enabled = true;
+	}
+
+	/*
+	 * Returns the time in microseconds since the construction of the profile
+	 */
+	long long now() const {
+		return (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds();
+	}
+
+	/*
+	 * Records a finished stage
+	 *
+	 * filename: image the stage was executed for
+	 * stage: name of the stage
+	 * begin: start time as returned by now()
+	 * end: end time as returned by now()
+	 */
+	void add(const std::string& filename, const std::string& stage, long long begin, long long end){
+		std::lock_guard<std::mutex> guard(lock);
+		std::map<std::thread::id,int>::iterator it = threads.find(std::this_thread::get_id());
+		if (it == threads.end()) it = threads.insert(std::make_pair(std::this_thread::get_id(),(int)threads.size())).first;
+		file << "{\"file\":\"" << escape(filename) << "\",\"stage\":\"" << stage << "\",\"thread\":" << it->second << ",\"start\":" << begin << ",\"duration\":" << (end - begin) << "}\n";
+		std::map<std::string,std::vector<long long> >::iterator d = durations.find(stage);
+		if (d == durations.end()){
+			d = durations.insert(std::make_pair(stage,std::vector<long long>())).first;
+			stages.push_back(stage);
+		}
+		d->second.push_back(end - begin);
+	}
+
+	/*
+	 * Writes and prints count, mean and the 50th, 95th and 99th percentile of the duration
+	 * of each stage (in order of first appearance)
+	 *
+	 * quiet: only write the statistics to the profile file
+	 */
+	void summary(const bool quiet){
+		if (!enabled) return;
+		std::lock_guard<std::mutex> guard(lock);
+		if (!quiet) printf("%-24s %7s %11s %11s %11s %11s\n","stage","count","mean [ms]","p50 [ms]","p95 [ms]","p99 [ms]");
+		for (std::vector<std::string>::iterator it = stages.begin(); it != stages.end(); ++it){
+			std::vector<long long>& d = durations[*it];
+			std::sort(d.begin(),d.end());
+			double mean = 0;
+			for (size_t i = 0; i < d.size(); i++) mean += d[i];
+			mean /= d.size();
+			long long p50 = percentile(d,50), p95 = percentile(d,95), p99 = percentile(d,99);
+			file << "{\"summary\":\"" << *it << "\",\"count\":" << d.size() << ",\"mean\":" << (long long) mean << ",\"p50\":" << p50 << ",\"p95\":" << p95 << ",\"p99\":" << p99 << "}\n";
+			if (!quiet) printf("%-24s %7d %11.3f %11.3f %11.3f %11.3f\n",it->c_str(),(int)d.size(),mean / 1000,p50 / 1000.,p95 / 1000.,p99 / 1000.);
+		}
+		file.flush();
+	}
+private:
+	/** profile file **/
+	std::ofstream file;
+	/** program start **/
+	boost::posix_time::ptime start;
+	/** guards file and statistics **/
+	std::mutex lock;
+	/** small numbers for the worker threads **/
+	std::map<std::thread::id,int> threads;
+	/** stage durations **/
+	std::map<std::string,std::vector<long long> > durations;
+	/** stage names in order of first appearance **/
+	std::vector<std::string> stages;
+
+	/*
+	 * Returns the nearest-rank percentile of sorted values
+	 */
+	static long long percentile(const std::vector<long long>& sorted, int p){
+		size_t rank = (sorted.size() * p + 99) / 100;
+		return sorted[(rank > 0) ? rank - 1 : 0];
+	}
+
+	/*
+	 * Escapes a string for use in JSON
+	 */
+	static std::string escape(const std::string& s){
+		std::string res;
+		for (size_t i = 0; i < s.size(); i++){
+			if (s[i] == '"' || s[i] == '\\') res.append(1,'\\');
+			res.append(1,s[i]);
+		}
+		return res;
+	}
+};
+
+/*
+ * Times the consecutive stages of processing one image: each call of stage() ends the
+ * previous stage and starts the next one, destruction ends the last stage and records
+ * the total time of the image. Does nothing if profiling is disabled.
+ */
+class ProfileTimer{
+public:
+	/*
+	 * Starts timing an image
+	 *
+	 * profile: profile to record the stages in
+	 * filename: image being processed
+	 */
+	ProfileTimer(Profile& profile, const std::string& filename) : profile(profile), filename(filename){
+		begin = first = (profile.enabled) ? profile.now() : 0;
+	}
+
+	/*
+	 * Ends timing the image
+	 */
+	~ProfileTimer(){
+		if (!profile.enabled) return;
+		long long end = profile.now();
+		if (!current.empty()) profile.add(filename,current,begin,end);
+		profile.add(filename,"total",first,end);
+	}
+
+	/*
+	 * Ends the current stage and starts the next one
+	 *
+	 * name: name of the next stage
+	 */
+	void stage(const char * name){
+		if (!profile.enabled) return;
+		long long now = profile.now();
+		if (!current.empty()) profile.add(filename,current,begin,now);
+		current = name;
+		begin = now;
+	}
+private:
+	Profile& profile;
+	std::string filename;
+	std::string current;
+	long long begin, first;
+};
+
+#endif //USIT_BATCH_H
@@ -7,14 +7,22 @@
  *
  */
 #include "version.h"
+#include "clahe.h"
+#include "batch.h"
 #include <cstdio>
 #include <map>
 #include <vector>
 #include <string>
 #include <cstring>
+#include <algorithm>
 #include <ctime>
 #include <fstream>
 #include <iostream>
+#include <thread>
+#include <sstream>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -61,6 +69,10 @@ void printUsage() {
     printf("| -e   |            | 1 | Y | enhance iris texture on (off)                   |\n");
     printf("| -q   |            | 1 | Y | quiet mode on (off)                             |\n");
     printf("| -t   |            | 1 | Y | time progress on (off)                          |\n");
+    printf("| -j   | jobs       | 1 | Y | number of files processed in parallel (1)       |\n");
+    printf("|      |            |   |   | (console messages interleave, use with -q)      |\n");
+    printf("| -prof | proffile  | 1 | Y | write the wall time of each stage and image as  |\n");
+    printf("|      |            |   |   | JSON lines, print p50/p95/p99 per stage (off)   |\n");
     printf("| -po  | polarfile  | 1 | Y | write polar image (off)                         |\n");
     printf("| -bm  | binmaskfile| 1 | Y | write binary segmentation mask (off)            |\n");
     printf("| -sr  | segresfile | 1 | Y | write segmentation result (off)                 |\n");
@@ -86,6 +98,12 @@ void printUsage() {
     printf("| -l   | logfile    | 1 | N | log parameters for unrolling to this file.      |\n");
     printf("| -noscale |        |   |   | Disable automatic downscaleing to 320x280.      |\n");
     printf("|      |            |   |   | Downscale happens if image larger than 480x420. |\n");
+    printf("| -dv  | degrees    | 1 | Y | directed Hough voting: edge pixels only vote    |\n");
+    printf("|      |            |   |   | within +-degrees of their gradient direction    |\n");
+    printf("|      |            |   |   | (off, i.e. along the full circle)               |\n");
+    printf("| -pyr | levels     | 1 | Y | coarse-to-fine Hough search: find candidates on |\n");
+    printf("|      |            |   |   | the edge map downscaled by 2^levels (1 or 2),   |\n");
+    printf("|      |            |   |   | refine them at full resolution (0 = off)        |\n");
     printf("+------+------------+---+---+-------------------------------------------------+\n");
     printf("|                                                                             |\n");
     printf("| EXAMPLE USAGE                                                               |\n");
@@ -243,70 +261,68 @@ void adjust_luminance(Mat& image, int black, int white)
 }
 
 /*
- * Make light areas lighter
+ * Make light areas lighter: each pixel is set to the sum of the cw x ch window
+ * around it (clipped to the image), saturated at 255. Column sums and the
+ * window sum are updated incrementally, so the cost does not depend on the
+ * window size.
+ * inverted: store 255 minus the result (replaces a subsequent invert)
  */
-void cumulate(const Mat& image, Mat& result, int cw, int ch)
+void cumulate(const Mat& image, Mat& result, int cw, int ch, bool inverted = false)
 {
 	CV_Assert(image.size() == result.size());
 
     int w = image.cols;
     int h = image.rows;
-    int step = image.step;
-    uchar* data = image.data;
-    uchar* a = result.data;
     int ox = cw / 2;
     int oy = ch / 2;
-    for (int y = 0; y < h; y++)
+    /* sums of the window rows y - oy .. y - oy + ch - 1 for each column */
+    vector<int> cols(w, 0);
+    for (int j = 0; j < ch - oy - 1 && j < h; j++)
     {
-        int ay, by;
-        if (y < oy)
-        {
-            ay = oy - y;
-        }
-        else
+        const uchar* row = image.ptr<uchar>(j);
+        for (int x = 0; x < w; x++)
         {
-            ay = 0;
+            cols[x] += row[x];
         }
-        if (y + ch - oy > h)
+    }
+    for (int y = 0; y < h; y++)
+    {
+        int enter = y - oy + ch - 1;
+        if (enter >= 0 && enter < h)
         {
-            by = h + oy - y;
+            const uchar* row = image.ptr<uchar>(enter);
+            for (int x = 0; x < w; x++)
+            {
+                cols[x] += row[x];
+            }
         }
-        else
+        uchar* a = result.ptr<uchar>(y);
+        int sum = 0;
+        for (int i = 0; i < cw - ox - 1 && i < w; i++)
         {
-            by = ch;
+            sum += cols[i];
         }
         for (int x = 0; x < w; x++)
         {
-            int sum = 0;
-            int ax, bx;
-            if (x < ox)
-            {
-                ax = ox - x;
-            }
-            else
+            if (x - ox + cw - 1 < w)
             {
-                ax = 0;
+                sum += cols[x - ox + cw - 1];
             }
-            if (x + cw - ox > w)
+            int v = (sum > 255) ? 255 : sum;
+            a[x] = (inverted) ? 255 - v : v;
+            if (x - ox >= 0)
             {
-                bx = w + ox - x;
+                sum -= cols[x - ox];
             }
-            else
-            {
-                bx = cw;
-            }
-            for (int j = ay; j < by; j++)
-            {
-                for (int i = ax; i < bx; i++)
-                {
-                    sum += data[(y + j - oy) * step + (x + i - ox)];
-                }
-            }
-            if (sum > 255)
+        }
+        int leave = y - oy;
+        if (leave >= 0)
+        {
+            const uchar* row = image.ptr<uchar>(leave);
+            for (int x = 0; x < w; x++)
             {
-                sum = 255;
+                cols[x] -= row[x];
             }
-            a[y * step + x] = sum;
         }
     }
 }
@@ -388,313 +404,239 @@ int longest_vertical_run(const Mat& image, int border, int threshold)
 
 
 /*
- * Returns the result of convoluting image with kernel.
- * The border is handled by treating all outside pixels as the nearest picture
- * pixel.
+ * Returns a new image of size w times h with the result of a gaussian
+ * smoothing operation. The 2D kernel is the product of two 1D kernels, so the
+ * image is convolved row-wise and then column-wise (2 * size instead of
+ * size * size multiply-adds per pixel). As in convolution_brute, taps outside
+ * the image are replaced by the center row or column; only pixels near the
+ * border check the tap positions. tests/gaussian_smooth.h compares the result
+ * to the 2D convolution.
+ * temp: buffer for the row-wise pass (allocated if necessary)
  */
-void convolution_brute(const Mat& image, Mat& res, const Mat& kernel)
+void gaussian_smooth(Mat& image, Mat& res, double sigma, int size, Mat& temp)
 {
+    double sigma2 = sigma * sigma;
     int w = image.cols;
     int h = image.rows;
-    int step = image.step / sizeof (float);
-    int kw = kernel.cols;
-    int kh = kernel.rows;
-    int kstep = kernel.step / sizeof (float);
-    float *data = (float*)image.data;
-    float *kdata = (float*)kernel.data;
-    int ox = -kw / 2;
-    int oy = -kh / 2;
-    float *result = (float*)res.data;
-    int rstep = res.step / sizeof (float);
-    for (int y = oy; y < h + oy; y++)
+    int o = -size / 2;
+    /* factors of exp(-(i * i + j * j) / (2 * sigma2)) / (2 * M_PI * sigma2) */
+    vector<float> kx(size), ky(size);
+    for (int i = 0; i < size; i++)
+    {
+        double g = exp(-((i + o) * (i + o)) / (2 * sigma2));
+        kx[i] = g;
+        ky[i] = g / (2 * M_PI * sigma2);
+    }
+    /* pixels [x0,x1) of a row have all horizontal taps inside the image */
+    int x0 = std::min(-o, w);
+    int x1 = std::max(x0, w - size + 1 - o);
+    temp.create(h, w, CV_32FC1);
+    for (int y = 0; y < h; y++)
     {
-        for (int x = ox; x < w + ox; x++)
+        const float *src = image.ptr<float>(y);
+        float *dst = temp.ptr<float>(y);
+        for (int x = 0; x < w; x++)
+        {
+            dst[x] = 0;
+        }
+        for (int i = 0; i < size; i++)
+        {
+            float k = kx[i];
+            const float *s = src + i + o;
+            for (int x = x0; x < x1; x++)
+            {
+                dst[x] += k * s[x];
+            }
+        }
+        for (int x = 0; x < w; x++)
         {
+            if (x == x0) x = x1;
+            if (x >= w) break;
             float sum = 0;
-            for (int j = 0; j < kh; j++)
+            for (int i = 0; i < size; i++)
             {
-                int yj;
-                if (y + j >= 0 && y + j < h)
-                {
-                    yj = y + j;
-                }
-                else
-                {
-                    yj = y - oy;
-                }
-                for (int i = 0; i < kw; i++)
-                {
-                    int xi;
-                    if (x + i >= 0 && x + i < w)
-                    {
-                        xi = x + i;
-                    }
-                    else
-                    {
-                        xi = x - ox;
-                    }
-                    float v = data[step * yj + xi];
-                    float k = kdata[j * kstep + i];
-                    sum += v * k;
-                }
+                int xi = x + i + o;
+                sum += kx[i] * src[(xi >= 0 && xi < w) ? xi : x];
             }
-            result[(y - oy) * rstep + x - ox] = sum;
+            dst[x] = sum;
         }
     }
-}
-
-/*
- * Returns a new image of size w times h with the result of a gaussian
- * smoothing operation.
- * TODO: Should do this in frequency domain, especially for big radius.
- */
-void gaussian_smooth(Mat& image, Mat& res, double sigma, int size)
-{
-    double sigma2 = sigma * sigma;
-    int kw = size;
-    int kh = size;
-    Mat kernel(kh,kw,CV_32FC1);
-    float *pos = (float *) kernel.data;
-    int off = (kernel.step / sizeof(float)) - kernel.cols;
-    int o = -size / 2;
-    for (int j = o; j < kh + o; j++, pos+=off)
+    for (int y = 0; y < h; y++)
     {
-        for (int i = o; i < kw + o; i++, pos++)
-        /* This is 2D (for 1D, sqrt the factor) */
+        float *dst = res.ptr<float>(y);
+        for (int x = 0; x < w; x++)
+        {
+            dst[x] = 0;
+        }
+        for (int j = 0; j < size; j++)
         {
-            *pos = exp(-(i * i + j * j) / (2 * sigma2)) / (2 * M_PI * sigma2);
+            int yj = y + j + o;
+            float k = ky[j];
+            const float *s = temp.ptr<float>((yj >= 0 && yj < h) ? yj : y);
+            for (int x = 0; x < w; x++)
+            {
+                dst[x] += k * s[x];
+            }
         }
     }
-    convolution_brute(image, res, kernel);
 }
 
 /*
- * Generates horizontal Sobel Kernel
+ * Computes the horizontal and vertical Sobel responses of pixel x of a row.
+ * Taps outside the image are replaced by the center row or column (as the
+ * caller passes above, below, xl and xr accordingly). All nine products are
+ * summed in kernel order, so the results are identical to a 3x3 convolution.
  */
-void horizontal_sobel(Mat& image, Mat& res)
+static inline void sobel_pixel(const float *above, const float *row, const float *below, int xl, int x, int xr, float *sobelh, float *sobelv)
 {
-    float kdata[] = { -1, 0, 1, -2, 0, 2, -1, 0, 1 };
-    Mat kernel(3, 3, CV_32FC1, &kdata);
-    convolution_brute(image, res, kernel);
+    float h = 0, v = 0;
+    h += above[xl] * -1.f; h += above[x] * 0.f; h += above[xr] * 1.f;
+    h += row[xl] * -2.f;   h += row[x] * 0.f;   h += row[xr] * 2.f;
+    h += below[xl] * -1.f; h += below[x] * 0.f; h += below[xr] * 1.f;
+    v += above[xl] * 1.f;  v += above[x] * 2.f; v += above[xr] * 1.f;
+    v += row[xl] * 0.f;    v += row[x] * 0.f;   v += row[xr] * 0.f;
+    v += below[xl] * -1.f; v += below[x] * -2.f; v += below[xr] * -1.f;
+    *sobelh = h;
+    *sobelv = v;
 }
 
 /*
- * Generates vertical Sobel Kernel
- */
-void vertical_sobel(Mat& image, Mat& res)
+ * Quantize an orientation into 4 bins:
+ * 0 right
+ * 1 right up
+ * 2 up
+ * 3 left up
+ * Those are all we need for pixel-edge-tracking  */
+static inline uchar edge_direction(float a)
 {
-	float kdata[] = { 1, 2, 1, 0, 0, 0, -1, -2, -1 };
-    Mat kernel(3, 3, CV_32FC1, &kdata);
-    convolution_brute(image, res, kernel);
+    /* not 2*M_PI, left/right both is horizontal */
+    if (a < 0)
+    {
+        a += M_PI;
+    }
+    if (a > M_PI * 0.875)
+    {
+        return 0;
+    }
+    else if (a > M_PI * 0.625)
+    {
+        return 3;
+    }
+    else if (a > M_PI * 0.375)
+    {
+        return 2;
+    }
+    else if (a > M_PI * 0.125)
+    {
+        return 1;
+    }
+    return 0;
 }
 
 /*
  * Use vertical and horizontal sobel operators to estimate the gradient, and
- * return it as  magnitude an orientation maps.
+ * return it as  magnitude an orientation maps, together with the orientation
+ * quantized by edge_direction (CV_8UC1 dirs). Rows are distributed to threads.
+ * The Sobel sums of a row are computed first in a branch-free loop (into the
+ * magnitude and orientation rows), then converted in place.
  */
-void get_gradient(Mat& image, Mat& mag, Mat& orient, float hfactor, float vfactor)
+void get_gradient(Mat& image, Mat& mag, Mat& orient, Mat& dirs, float hfactor, float vfactor, int threads)
 {
     int w = image.cols;
     int h = image.rows;
-    Mat imsobelh(h,w,CV_32FC1);
-    Mat imsobelv(h,w,CV_32FC1);
-    int w_sobelh = imsobelh.step / sizeof(float);
-    int w_sobelv = imsobelv.step / sizeof(float);
-    int w_mag = mag.step / sizeof(float);
-    int w_orient = orient.step / sizeof(float);
-    horizontal_sobel(image,imsobelh);
-    vertical_sobel(image,imsobelv);
-
-    float* sobelh = (float*) imsobelh.data;
-    float* sobelv = (float*) imsobelv.data;
-    float* magnitude = (float*) mag.data;
-    float* orientation = (float*) orient.data;
-    for (int j = 0; j < h; j++)
+    mag.create(h,w,CV_32FC1);
+    orient.create(h,w,CV_32FC1);
+    dirs.create(h,w,CV_8UC1);
+    parallelFor(h, threads, [&](int j)
     {
+        const float *above = image.ptr<float>((j > 0) ? j - 1 : j);
+        const float *row = image.ptr<float>(j);
+        const float *below = image.ptr<float>((j < h - 1) ? j + 1 : j);
+        float *magnitude = mag.ptr<float>(j);
+        float *orientation = orient.ptr<float>(j);
+        uchar *dir = dirs.ptr<uchar>(j);
+        sobel_pixel(above, row, below, 0, 0, std::min(1, w - 1), &magnitude[0], &orientation[0]);
+        for (int i = 1; i < w - 1; i++)
+        {
+            sobel_pixel(above, row, below, i - 1, i, i + 1, &magnitude[i], &orientation[i]);
+        }
+        if (w > 1)
+        {
+            sobel_pixel(above, row, below, w - 2, w - 1, w - 1, &magnitude[w - 1], &orientation[w - 1]);
+        }
         for (int i = 0; i < w; i++)
         {
-            float x = sobelh[i + w_sobelh * j];
-            float y = sobelv[i + w_sobelv * j];
+            float x = magnitude[i];
+            float y = orientation[i];
             float m = sqrt(x * x * hfactor + y * y * vfactor);
             /* if m > 255: m = 255 */
             m /= 4;
-            magnitude[i + w_mag * j] = m;
+            magnitude[i] = m;
             double a = atan2(y, x);
-            orientation[i + w_orient * j] = a;
+            orientation[i] = a;
+            dir[i] = edge_direction(orientation[i]);
         }
-    }
+    });
 }
 
 /*
- * Returns gradient neighbors
+ * Neighbors compared by the non maximum suppression for each edge direction
  */
-static inline void get_gradient_neighbors(float o, int i, int j, int *i_, int *j_, int *i__, int *j__)
-{
-    if (o == 0)
-    {
-        *i_ = i + 1;
-        *i__ = i - 1;
-        *j_ = *j__ = j;
-    }
-    else if (o == 1)
-    {
-        *i_ = i + 1;
-        *i__ = i - 1;
-        *j_ = j - 1;
-        *j__ = j + 1;
-    }
-    else if (o == 2)
-    {
-        *i_ = *i__ = i;
-        *j_ = j - 1;
-        *j__ = j + 1;
-    }
-    else if (o == 3)
-    {
-        *i_ = i - 1;
-        *i__ = i + 1;
-        *j_ = j - 1;
-        *j__ = j + 1;
-    }
-    else
-    {
-        assert(0);
-    }
-}
+static const int nms_dx1[] = { +1, +1,  0, -1 };
+static const int nms_dy1[] = {  0, -1, -1, -1 };
+static const int nms_dx2[] = { -1, -1,  0, +1 };
+static const int nms_dy2[] = {  0, +1, +1, +1 };
 
 /*
- * Performs Border check
+ * For each pixel, if either neighbor along the quantized gradient direction is
+ * brighter, set it to 0. That way, only thinned areas of maximum brightness are
+ * left. Neighbors outside the image are replaced by the pixel itself. The result
+ * is rounded and saturated to CV_8UC1 (as convertTo). Rows are distributed to
+ * threads.
  */
-static inline void suppress_gradient_with_border_check(float* gradient, float* orientation, int i, int j, float* result, int gradstep, int orientstep, int resstep, int w, int h)
-{
-    float g = gradient[i + gradstep * j];
-    float o = orientation[i + orientstep * j];
-    int i_, j_, i__, j__;
-    get_gradient_neighbors(o, i, j, &i_, &j_, &i__, &j__);
-    float g1 = g, g2 = g;
-    if (i_ >= 0 && i_ < w && j_ >= 0 && j_ < h)
-    {
-        g1 = gradient[i_ + gradstep * j_];
-    }
-    if (i__ >= 0 && i__ < w && j__ >= 0 && j__ < h)
-    {
-        g2 = gradient[i__ + gradstep * j__];
-    }
-    if (g < g1 || g < g2)
-    {
-        result[i + resstep * j] = 0;
-    }
-    else
-    {
-        result[i + resstep * j] = g;
-    }
-}
-
-/*
- * For each pixel, if either the left or right neighbor is brighter, set it to
- * 0. That way, only thinned areas of maximum brightness are left. Because
- * left/right neighbors are used, this is biased to create vertical lines.
- */
-void non_maximum_suppression(Mat& gradient, Mat& orientation, Mat& res)
+void non_maximum_suppression(Mat& gradient, Mat& dirs, Mat& res, int threads)
 {
     int w = gradient.cols;
     int h = gradient.rows;
-    float* result = (float*) res.data;
-    float * gdata = (float*) gradient.data;
-    float * odata = (float*) orientation.data;
-    int gstep = gradient.step/sizeof(float);
-    int ostep = orientation.step/sizeof(float);
-    int rstep = res.step/sizeof(float);
-
-    /* handle border pixels in a special way first */
-    for (int j = 0; j < h; j += h - 1)
+    res.create(h,w,CV_8UC1);
+    parallelFor(h, threads, [&](int j)
     {
+        const float *rows[3] = { gradient.ptr<float>((j > 0) ? j - 1 : j), gradient.ptr<float>(j), gradient.ptr<float>((j < h - 1) ? j + 1 : j) };
+        const float *row = rows[1];
+        const uchar *dir = dirs.ptr<uchar>(j);
+        uchar *result = res.ptr<uchar>(j);
+        bool border = (j == 0 || j == h - 1);
         for (int i = 0; i < w; i++)
         {
-            suppress_gradient_with_border_check(gdata, odata, i, j, result,gstep,ostep,rstep,w,h);
-        }
-    }
-    for (int i = 0; i < w; i += w - 1)
-    {
-        for (int j = 1; j < h - 1; j++)
-        {
-            suppress_gradient_with_border_check(gdata, odata, i, j, result,gstep,ostep,rstep,w,h);
-            /* now remaining pixels, without check */
-        }
-    }
-    for (int j = 1; j < h - 1; j++)
-    {
-        for (int i = 1; i < w - 1; i++)
-        {
-            float g = gdata[i + gstep * j];
-            float o = odata[i + ostep * j];
-            int i_, j_, i__, j__;
-            get_gradient_neighbors(o, i, j, &i_, &j_, &i__, &j__);
-            float g1 = gdata[i_ + gstep * j_];
-            float g2 = gdata[i__ + gstep * j__];
-            if (g < g1 || g < g2)
+            float g = row[i];
+            int d = dir[i];
+            float g1, g2;
+            if (border || i == 0 || i == w - 1)
             {
-                result[i + rstep * j] = 0;
+                /* handle border pixels in a special way */
+                int i_ = i + nms_dx1[d], j_ = j + nms_dy1[d];
+                int i__ = i + nms_dx2[d], j__ = j + nms_dy2[d];
+                g1 = (i_ >= 0 && i_ < w && j_ >= 0 && j_ < h) ? rows[1 + nms_dy1[d]][i_] : g;
+                g2 = (i__ >= 0 && i__ < w && j__ >= 0 && j__ < h) ? rows[1 + nms_dy2[d]][i__] : g;
             }
             else
             {
-                result[i + rstep * j] = g;
+                g1 = rows[1 + nms_dy1[d]][i + nms_dx1[d]];
+                g2 = rows[1 + nms_dy2[d]][i + nms_dx2[d]];
             }
+            result[i] = saturate_cast<uchar>((g < g1 || g < g2) ? 0.f : g);
         }
-    }
+    });
 }
 
 /*
- * Quantize the orientations into 4 bins:
- * 0 right
- * 1 right up
- * 2 up
- * 3 left up
- * Those are all we need for pixel-edge-tracking  */
-void edge_directions(Mat& orientation, Mat& res)
+ * Intermediate images of canny, kept by the caller to reuse their memory
+ * between calls on images of the same size
+ */
+struct CannyBuffers
 {
-    int w = orientation.cols;
-    int h = orientation.rows;
-    float *e = (float*)res.data;
-    float *o = (float*)orientation.data;
-    int estep = res.step / sizeof(float);
-    int ostep = orientation.step / sizeof(float);
-
-    for (int j = 0; j < h; j++)
-    {
-        for (int i = 0; i < w; i++)
-        {
-            float a = o[i + ostep * j];
-            float c;
-            /* not 2*M_PI, left/right both is horizontal */
-            if (a < 0)
-            {
-                a += M_PI;
-            }
-            if (a > M_PI * 0.875)
-            {
-                c = 0;
-            }
-            else if (a > M_PI * 0.625)
-            {
-                c = 3;
-            }
-            else if (a > M_PI * 0.375)
-            {
-                c = 2;
-            }
-            else if (a > M_PI * 0.125)
-            {
-                c = 1;
-            }
-            else
-            {
-                c = 0;
-            }
-            e[i + estep * j] = c;
-        }
-    }
-}
+    Mat image, smooth, temp, dirs;
+};
 
 /*
  * Returns a new image of size w times h with the result of a canny edge
@@ -704,166 +646,176 @@ void edge_directions(Mat& orientation, Mat& res)
  *   should compare to e.g. differential gaussian instead)
  * - Localize edges.
  * - fix edges
+ * buffers: intermediate images (allocated if necessary)
+ * threads: worker threads of the gradient and suppression (0 = choose by image size)
  */
-void canny(Mat& raster, Mat& magnitude, Mat& orientation, Mat& res, double gauss_sigma, int gauss_size, double hfactor, double vfactor)
+void canny(Mat& raster, Mat& magnitude, Mat& orientation, Mat& res, double gauss_sigma, int gauss_size, double hfactor, double vfactor, CannyBuffers& buffers, int threads = 0)
 {
-	Mat image(raster.rows,raster.cols,CV_32FC1);
+	Mat& image = buffers.image;
 	raster.convertTo(image,CV_32FC1);
-	Mat smooth(raster.rows,raster.cols,CV_32FC1);
-    gaussian_smooth(image, smooth, gauss_sigma, gauss_size);
-    //Mat magnitude(raster.rows,raster.cols,CV_32FC1);
-    //Mat orientation(raster.rows,raster.cols,CV_32FC1);
-    get_gradient(smooth, magnitude, orientation, hfactor, vfactor);
-    Mat dirs(raster.rows,raster.cols,CV_32FC1);
-    edge_directions(orientation,dirs);
-    Mat thinned(raster.rows,raster.cols,CV_32FC1);
-    non_maximum_suppression(magnitude, dirs,thinned);
+	Mat& smooth = buffers.smooth;
+	smooth.create(raster.rows,raster.cols,CV_32FC1);
+    gaussian_smooth(image, smooth, gauss_sigma, gauss_size, buffers.temp);
+    if (threads <= 0)
+    {
+        threads = std::min(std::max(1, (int) thread::hardware_concurrency()), std::max(1, raster.rows * raster.cols / (1 << 15)));
+    }
+    get_gradient(smooth, magnitude, orientation, buffers.dirs, hfactor, vfactor, threads);
     /* binarize(thinned, w, h, 10) */
-    thinned.convertTo(res,CV_8UC1);
+    non_maximum_suppression(magnitude, buffers.dirs, res, threads);
 }
 
 /*
- * Follows a streak
+ * Size and bounding box of a streak (8-connected set of edge pixels)
  */
-int follow_streak(Mat& image, int x, int y, int *dirs, int *mark, int tag, int kill, int *ax, int *ay, int *bx, int *by)
+struct Streak
 {
-	vector<Point> stack;
-    int w = image.cols;
-    int h = image.rows;
-    uchar * data = image.data;
-    int dx[] = {+1, +1,  0, -1, -1, -1,  0, +1, +1};
-    int dy[] = { 0, -1, -1, -1,  0, +1, +1, +1,  0};
-    /*  */
-    /* xxxxx */
-    /* x...x */
-    /* x.x.x */
-    /* x...x */
-    /* xxxxx */
-    /*  */
-    unsigned int first = 0;
-    stack.push_back(Point(x,y));
-    if (kill)
-    {
-        data[x + w * y] = 0;
-    }
-    else
+    int size;
+    int ax, ay, bx, by;
+};
+
+/*
+ * Returns the root label of a streak label (with path halving)
+ */
+static inline int streak_root(vector<int>& parent, int l)
+{
+    while (parent[l] != l)
     {
-        mark[x + w * y] = tag;
+        parent[l] = parent[parent[l]];
+        l = parent[l];
     }
-    *ax = x;
-    *ay = y;
-    *bx = x;
-    *by = y;
-    while (first < stack.size())
+    return l;
+}
+
+/*
+ * Merges the streaks of two labels, the smaller root becomes the root of both
+ */
+static inline int streak_union(vector<int>& parent, int a, int b)
+{
+    a = streak_root(parent, a);
+    b = streak_root(parent, b);
+    if (a < b)
     {
-    	Point n = stack[first++];
-        for (int i = 0; i < 8; i++)
-        {
-            int nx = n.x + dx[i];
-            int ny = n.y + dy[i];
-            if (nx >= 0 && ny >= 0 && nx < w && ny < h)
-            {
-                int ok;
-                if (kill)
-                {
-                    ok = (mark[nx + w * ny] == tag);
-                }
-                else
-                {
-                    ok = (mark[nx + w * ny] == 0);
-                }
-                if (ok && data[nx + w * ny])
-                {
-                    if (kill)
-                    {
-                        data[nx + w * ny] = 0;
-                    }
-                    else
-                    {
-                        mark[nx + w * ny] = tag;
-                    }
-                    dirs[i]++;
-                    stack.push_back(Point(nx,ny));
-                    if (nx < *ax)
-                    {
-                        *ax = nx;
-                    }
-                    if (nx > *bx)
-                    {
-                        *bx = nx;
-                    }
-                    if (ny < *ay)
-                    {
-                        *ay = ny;
-                    }
-                    if (ny > *by)
-                    {
-                        *by = ny;
-                    }
-                }
-            }
-        }
+        parent[b] = a;
+        return a;
     }
-    return stack.size();
+    parent[a] = b;
+    return b;
 }
 
 /*
  * We trace some edges and remove them if they certainly aren't part of the
  * wanted feature, but could confuse the hough transform later.
+ * Streaks are labelled in one raster scan with a union-find forest over the
+ * 8-neighbors above and to the left, the size and bounding box of each streak
+ * are collected in a second scan and the rejected streaks are removed in a
+ * third one.
  */
 void remove_streaks(Mat& image, int minpixels, int min_w_pixels, int min_h_pixels, int max_horizontal, int max_vertical, int max_slash, int max_backslash, int max_bound_w, int max_bound_h)
 {
     int w = image.cols;
     int h = image.rows;
-    int mark[w * h];
-    uchar * data = image.data;
-    memset(mark, 0, w * h * sizeof(int));
-    int tag = 1;
+    vector<int> labels(w * h, 0);
+    /* label 0 is the background */
+    vector<int> parent(1, 0);
     for (int j = 0; j < h; j++)
     {
+        const uchar *data = image.ptr<uchar>(j);
+        int *label = &labels[j * w];
+        const int *above = (j > 0) ? label - w : label;
         for (int i = 0; i < w; i++)
         {
-            if (! mark[i + j * w] && data[i + j * w])
+            if (! data[i])
             {
-                int dirs[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-                int ax, ay, bx, by;
-                int size = follow_streak(image, i, j, dirs, mark, tag, 0, &ax, &ay, &bx, &by);
-                int kill = 0;
-                /* Seems, using just the bounding box is enough (so we can get */
-                /* rid of all the dirs counting). And using the bounding box, */
-                /* instead of just the ratio, we could also already do the test for */
-                /* min/max radius. */
-                if (size >= minpixels && bx - ax >= min_w_pixels && by - ay >= min_h_pixels)
-                /* int ho = dirs[0] + dirs[4] */
-                /* int ve = dirs[2] + dirs[6] */
-                /* int d1 = dirs[1] + dirs[5] */
-                /* int d2 = dirs[3] + dirs[7] */
-                /* printf("%d/%d: %d %d %d %d\n", i, j, ho, ve, d1, d2) */
-                /* We don't want to remove the pupil here under no */
-                /* circumstances, even if it is degenerated to just a small */
-                /* arc - so must be quite conservative. */
-                /* if ho > ve * max_horizontal or ve > ho * max_vertical: */
-                /* d1 > d2 * max_slash or d2 > d1 * max_backslash or\ */
+                continue;
+            }
+            int l = 0;
+            if (i > 0 && label[i - 1])
+            {
+                l = label[i - 1];
+            }
+            if (j > 0)
+            {
+                for (int k = std::max(0, i - 1); k <= std::min(w - 1, i + 1); k++)
                 {
-                    if ((bx - ax) > max_bound_w * (by - ay) || (by - ay) > max_bound_h * (bx - ax))
+                    if (above[k])
                     {
-                        kill = 1;
+                        l = (l) ? streak_union(parent, l, above[k]) : above[k];
                     }
                 }
-                else
-                {
-                    kill = 1;
-                }
-                if (kill)
-                {
-                    follow_streak(image, i, j, dirs, mark, tag, 1, &ax, &ay, &bx, &by);
-                }
-                tag++;
+            }
+            if (! l)
+            {
+                l = parent.size();
+                parent.push_back(l);
+            }
+            label[i] = l;
+        }
+    }
+    vector<Streak> streaks(parent.size());
+    for (size_t l = 1; l < parent.size(); l++)
+    {
+        Streak s = {0, w, h, -1, -1};
+        streaks[l] = s;
+    }
+    for (int j = 0; j < h; j++)
+    {
+        int *label = &labels[j * w];
+        for (int i = 0; i < w; i++)
+        {
+            if (label[i])
+            {
+                int l = streak_root(parent, label[i]);
+                label[i] = l;
+                Streak& s = streaks[l];
+                s.size++;
+                s.ax = std::min(s.ax, i);
+                s.ay = std::min(s.ay, j);
+                s.bx = std::max(s.bx, i);
+                s.by = std::max(s.by, j);
+            }
+        }
+    }
+    vector<uchar> kill(parent.size(), 0);
+    for (size_t l = 1; l < parent.size(); l++)
+    {
+        const Streak& s = streaks[l];
+        if (s.size == 0)
+        {
+            continue;
+        }
+        /* Seems, using just the bounding box is enough (so we can get */
+        /* rid of all the dirs counting). And using the bounding box, */
+        /* instead of just the ratio, we could also already do the test for */
+        /* min/max radius. */
+        /* We don't want to remove the pupil here under no */
+        /* circumstances, even if it is degenerated to just a small */
+        /* arc - so must be quite conservative. */
+        if (s.size >= minpixels && s.bx - s.ax >= min_w_pixels && s.by - s.ay >= min_h_pixels)
+        {
+            if ((s.bx - s.ax) > max_bound_w * (s.by - s.ay) || (s.by - s.ay) > max_bound_h * (s.bx - s.ax))
+            {
+                kill[l] = 1;
+            }
+        }
+        else
+        {
+            kill[l] = 1;
+        }
+    }
+    for (int j = 0; j < h; j++)
+    {
+        uchar *data = image.ptr<uchar>(j);
+        const int *label = &labels[j * w];
+        for (int i = 0; i < w; i++)
+        {
+            if (kill[label[i]])
+            {
+                data[i] = 0;
             }
         }
     }
 }
-
 /*
  * thresholds
  */
@@ -921,39 +873,249 @@ struct HoughCircle
     /* existed at maximum intensity */
 };
 
-static int ** lookup_table(int min_r, int max_r)
+/*
+ * Offsets of the circle pixels to the center for one radius (pixel resolution
+ * of the circumference), x and y offsets are stored in separate arrays
+ */
+struct CircleTable
 {
-    int nr = 1 + max_r - min_r;
-    int **lut = (int**) malloc(nr * sizeof *lut);
+    /* number of angles */
+    int na;
+    vector<int> dx, dy;
+};
+
+/*
+ * Returns the circle table of radius r from a process-wide cache. Tables are
+ * computed on first use and never released, so the returned reference stays
+ * valid and can be shared by all threads.
+ */
+static const CircleTable& circle_table(int r)
+{
+    static mutex lock;
+    static map<int, CircleTable> tables;
+    lock_guard<mutex> guard(lock);
+    map<int, CircleTable>::iterator it = tables.find(r);
+    if (it != tables.end())
+    {
+        return it->second;
+    }
+    CircleTable& table = tables[r];
+    /* we use pixel resolution for the circumference of the circle */
+    int na = 2 * M_PI * r;
+    table.na = na;
+    table.dx.resize(na);
+    table.dy.resize(na);
+    double a = 0, da = 2 * M_PI / na;
+    for (int ia = 0; ia < na; ia++)
+    {
+        table.dx[ia] = round(r * cos(a));
+        table.dy[ia] = round(r * sin(a));
+        a += da;
+    }
+    return table;
+}
+
+/*
+ * Collects the circle tables of the radii min_r .. max_r
+ */
+static void lookup_table(int min_r, int max_r, vector<const CircleTable*>& lut)
+{
+    lut.resize(1 + max_r - min_r);
     for (int r = min_r; r <= max_r; r++)
     {
-        int ir = r - min_r;
-        /* we use pixel resolution for the circumference of the circle */
-        int na = 2 * M_PI * r;
-        lut[ir] = (int*) malloc((1 + na) * 2 * sizeof *lut[ir]);
-        lut[ir][0] = na;
-        double a = 0, da = 2 * M_PI / na;
-        for (int ia = 0; ia < na; ia++)
+        lut[r - min_r] = &circle_table(r);
+    }
+}
+
+/*
+ * Edge pixels voting in the Hough transform
+ */
+struct HoughEdges
+{
+    vector<Point> points;
+    vector<uchar> values;
+    /* gradient direction in full turns of the lookup table angle (directed voting only) */
+    vector<float> turns;
+    /* half width of the voting window in radians (0 votes along the full circle) */
+    double window;
+};
+
+/*
+ * Smoothes the accumulator with a 3x7 box in place. The rows above and the
+ * pixels to the left of the current one contribute with their already smoothed
+ * values (as the direct summation did), column and window sums are updated
+ * with each written value, so a pixel costs a constant number of operations.
+ */
+static void smooth_accumulator(int *hough, int nx, int ny, vector<int>& cols)
+{
+    if (nx < 7) return;
+    cols.resize(nx);
+    for (int j = 1; j < ny - 1; j++)
+    {
+        int *above = hough + (j - 1) * nx;
+        int *row = hough + j * nx;
+        int *below = hough + (j + 1) * nx;
+        for (int i = 0; i < nx; i++)
+        {
+            cols[i] = above[i] + row[i] + below[i];
+        }
+        int sum = 0;
+        for (int i = 0; i < 7; i++)
+        {
+            sum += cols[i];
+        }
+        for (int i = 3; i < nx - 3; i++)
+        {
+            int v = sum / 21;
+            int d = v - row[i];
+            row[i] = v;
+            cols[i] += d;
+            sum += d;
+            if (i + 4 < nx)
+            {
+                sum += cols[i + 4] - cols[i - 3];
+            }
+        }
+    }
+}
+
+/*
+ * Hough transform for a single radius, the circles found are appended to res
+ * hough, cols: accumulator (nx * ny) and column sums of the calling thread
+ */
+static void hough_circle_radius(const HoughEdges& edges, const CircleTable& table, int r, int *hough, vector<int>& cols, vector<HoughCircle>& res, int min_cx, int max_cx, int min_cy, int max_cy, int threshold, int hint_r, int hint_x, int hint_y)
+{
+    int nx = 1 + max_cx - min_cx;
+    int ny = 1 + max_cy - min_cy;
+    memset(hough, 0, nx * ny * sizeof(int));
+    int na = table.na;
+    const int *tdx = table.dx.data();
+    const int *tdy = table.dy.data();
+    /* half width of the voting window in lookup table steps */
+    int nw = (edges.window > 0) ? (int) ceil(edges.window * na / (2 * M_PI)) : na;
+    int nedges = edges.points.size();
+    /* ok, draw some circles */
+    for (int e = 0; e < nedges; e++)
+    {
+        int i = edges.points[e].x;
+        int j = edges.points[e].y;
+        uchar c = edges.values[e];
+        if (4 * nw + 2 >= na)
+        {
+            for (int ia = 0; ia < na; ia++)
+            {
+                int a = i - tdx[ia];
+                int b = j - tdy[ia];
+                if (a >= min_cx && a <= max_cx && b >= min_cy && b <= max_cy)
+                {
+                    hough[a - min_cx + nx * (b - min_cy)] += c;
+                    /* Since we draw non-antialiased and rather crude circles, pixels likely */
+                    /* can be off by a pixel or so. Therefore we collect neighbor */
+                    /* pixels for each pixel as well. */
+                }
+            }
+        }
+        else
+        {
+            /* dark-to-bright and bright-to-dark outlines */
+            for (int polarity = 0; polarity < 2; polarity++)
+            {
+                int ic = (int) floor((edges.turns[e] + 0.5f * polarity) * na + 0.5f);
+                for (int ia = ic - nw; ia <= ic + nw; ia++)
+                {
+                    int ja = ((ia % na) + na) % na;
+                    int a = i - tdx[ja];
+                    int b = j - tdy[ja];
+                    if (a >= min_cx && a <= max_cx && b >= min_cy && b <= max_cy)
+                    {
+                        hough[a - min_cx + nx * (b - min_cy)] += c;
+                    }
+                }
+            }
+        }
+    }
+    smooth_accumulator(hough, nx, ny, cols);
+    if (hint_r)
+    {
+        int rr = hint_r * hint_r;
+        for (int j = 0; j < ny; j++)
+        {
+            for (int i = 0; i < nx; i++)
+            {
+                int dx = min_cx + i - hint_x;
+                int dy = min_cy + j - hint_y;
+                if (dx * dx + dy * dy > rr)
+                {
+                    hough[i + j * nx] = 0;
+                    /* find maximum accumulator value */
+                }
+            }
+        }
+    }
+    int max = 1;
+    for (int j = 0; j < ny; j++)
+    {
+        for (int i = 0; i < nx; i++)
+        {
+            if (hough[i + j * nx] > max)
+            {
+                max = hough[i + j * nx];
+                /* TODO: As we actually will get slight ellipses most of the time, instead */
+                /* of non-maximum suppression, some kind of averaging would be better. */
+                /* _ _ */
+                /* / X \ */
+                /* | | | | */
+                /* \_X_/ */
+                /* A B */
+                /* _ */
+                /* / \ */
+                /* |   | */
+                /* \_/ */
+                /* C */
+                /*  */
+                /* Instead of choosing either one of found circles A and B at the two */
+                /* ends of the ellipse, we want C averaged by them (maybe with the */
+                /* radius slightly compensated). */
+                /* create a grayscale image, with non-maxima suppressed and faint circles */
+                /* thresholded */
+            }
+        }
+    }
+    for (int j = 0; j < ny; j++)
+    {
+        for (int i = 0; i < nx; i++)
         {
-            int rcos = round(r * cos(a));
-            int rsin = round(r * sin(a));
-            lut[ir][1 + ia * 2 + 0] = rcos;
-            lut[ir][1 + ia * 2 + 1] = rsin;
-            a += da;
+            int v = hough[i + j * nx];
+            if (i < nx - 1 && hough[i + 1 + j * nx] > v)
+            {
+                v = 0;
+            }
+            if (j > 0 && hough[i + (j - 1) * nx] > v)
+            {
+                v = 0;
+            }
+            if (i > 0 && hough[i - 1 + j * nx] > v)
+            {
+                v = 0;
+            }
+            if (j < ny - 1 && hough[i + (j + 1) * nx] > v)
+            {
+                v = 0;
+            }
+            int cv = v * 255 / max;
+            if (cv < threshold)
+            {
+                v = 0;
+                /* cv = 0 */
+            }
+            if (v)
+            {
+                HoughCircle c = {min_cx + i, min_cy + j, r, (int)(2 * M_PI * r), v, (int)(2 * M_PI * r * 255)};
+                //printf("found x: %i y: %i r: %i pix: %i acc: %i max: %i\n",c.x,c.y,c.radius,c.pixels,c.accum,c.max);
+                res.push_back(c);
+            }
         }
     }
-    return lut;
-}
-
-void free_lookup_table(int **lut, int min_r, int max_r)
-{
-    for (int r = min_r; r <= max_r; r++)
-    {
-        int ir = r - min_r;
-        /* we use pixel resolution for the circumference of the circle */
-        free(lut[ir]);
-    }
-    free(lut);
 }
 
 /*
@@ -976,153 +1138,77 @@ void free_lookup_table(int **lut, int min_r, int max_r)
  * The min/max parameters are ranges for the radius and the center position
  * relative to the image. The radius as well as the center range may also
  * extend to outside the image area.
+ *
+ * If an orientation map (as computed by canny) and a window are given, a pixel
+ * only votes for the centers within +-window (radians) around its gradient
+ * direction, for both polarities. As the gradient of a circle outline points
+ * to (or away from) its center, this keeps the votes for the true center but
+ * saves most of the votes along the circumference.
  */
-void hough_circle(Mat& image, vector<HoughCircle>& res, int min_r, int max_r, int min_cx, int max_cx, int min_cy, int max_cy, int threshold, int hint_r, int hint_x, int hint_y)
+void hough_circle(Mat& image, vector<HoughCircle>& res, int min_r, int max_r, int min_cx, int max_cx, int min_cy, int max_cy, int threshold, int hint_r, int hint_x, int hint_y, const Mat& orient = Mat(), double window = 0, int threads = 0)
 {
-
     int w = image.cols;
     int h = image.rows;
     uchar *data = image.data;
     int nx = 1 + max_cx - min_cx;
     int ny = 1 + max_cy - min_cy;
-    if (nx <=0 or ny <=0 ) return;
+    if (nx <=0 or ny <=0 or max_r < min_r) return;
 
-    Mat houghAccu(1,nx * ny,CV_32SC1);
-    int *hough = (int*)houghAccu.data;
-    
-    int **lut = lookup_table(min_r, max_r);
-
-    for (int r = min_r; r <= max_r; r++)
+    /* collect the edge pixels once for all radii */
+    HoughEdges edges;
+    edges.window = (orient.empty()) ? 0 : window;
+    for (int j = 0; j < h; j++)
     {
-    	houghAccu.setTo(0);
-        int ir = r - min_r;
-        int *rlut = lut[ir];
-        /* ok, draw some circles */
-        for (int j = 0; j < h; j++)
-        {
-            for (int i = 0; i < w; i++)
-            {
-                uchar c = data[j * w + i];
-                if (c)
-                {
-                    int na = rlut[0];
-                    for (int ia = 0; ia < na; ia++)
-                    {
-                        int rcos = rlut[1 + 2 * ia + 0];
-                        int rsin = rlut[1 + 2 * ia + 1];
-                        int a = i - rcos;
-                        int b = j - rsin;
-                        if (a >= min_cx && a <= max_cx && b >= min_cy && b <= max_cy)
-                        {
-                            hough[a - min_cx + nx * (b - min_cy)] += c;
-                            /* Since we draw non-antialiased and rather crude circles, pixels likely */
-                            /* can be off by a pixel or so. Therefore we collect neighbor */
-                            /* pixels for each pixel as well. */
-                        }
-                    }
-                }
-            }
-        }
-        for (int j = 1; j < ny - 1; j++)
-        {
-            for (int i = 3; i < nx - 3; i++)
-            {
-                int sum = 0;
-                for (int k = -1; k <= 1; k++)
-                {
-                    for (int l = -3; l <= 3; l++)
-                    {
-                        sum += hough[(i + l) + (j + k) * nx];
-                    }
-                }
-                hough[i + j * nx] = sum / 21;
-                /* If we have a hint circle, anything outside is discarded. */
-            }
-        }
-        if (hint_r)
-        {
-            int rr = hint_r * hint_r;
-            for (int j = 0; j < ny; j++)
-            {
-                for (int i = 0; i < nx; i++)
-                {
-                    int dx = min_cx + i - hint_x;
-                    int dy = min_cy + j - hint_y;
-                    if (dx * dx + dy * dy > rr)
-                    {
-                        hough[i + j * nx] = 0;
-                        /* find maximum accumulator value */
-                    }
-                }
-            }
-        }
-        int max = 1;
-        for (int j = 0; j < ny; j++)
+        for (int i = 0; i < w; i++)
         {
-            for (int i = 0; i < nx; i++)
+            uchar c = data[j * w + i];
+            if (c)
             {
-                if (hough[i + j * nx] > max)
+                edges.points.push_back(Point(i, j));
+                edges.values.push_back(c);
+                if (edges.window > 0)
                 {
-                    max = hough[i + j * nx];
-                    /* TODO: As we actually will get slight ellipses most of the time, instead */
-                    /* of non-maximum suppression, some kind of averaging would be better. */
-                    /* _ _ */
-                    /* / X \ */
-                    /* | | | | */
-                    /* \_X_/ */
-                    /* A B */
-                    /* _ */
-                    /* / \ */
-                    /* |   | */
-                    /* \_/ */
-                    /* C */
-                    /*  */
-                    /* Instead of choosing either one of found circles A and B at the two */
-                    /* ends of the ellipse, we want C averaged by them (maybe with the */
-                    /* radius slightly compensated). */
-                    /* create a grayscale image, with non-maxima suppressed and faint circles */
-                    /* thresholded */
+                    /* orientation is measured with the y axis pointing up, the lookup */
+                    /* table angle with the y axis pointing down */
+                    float turn = -orient.at<float>(j, i) / (2 * M_PI);
+                    edges.turns.push_back(turn - floor(turn));
                 }
             }
         }
-        for (int j = 0; j < ny; j++)
+    }
+
+    vector<const CircleTable*> lut;
+    lookup_table(min_r, max_r, lut);
+    int nr = 1 + max_r - min_r;
+    if (threads <= 0)
+    {
+        threads = thread::hardware_concurrency();
+    }
+    threads = std::max(1, std::min(threads, nr));
+    /* radii are interleaved between the threads (the cost grows with the radius), */
+    /* each one with its own accumulator. The circles are merged in radius order. */
+    vector<vector<HoughCircle> > circles(nr);
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++)
+    {
+        workers.push_back(thread([&, t]()
         {
-            for (int i = 0; i < nx; i++)
+            vector<int> houghAccu(nx * ny);
+            vector<int> cols;
+            for (int ir = t; ir < nr; ir += threads)
             {
-                int v = hough[i + j * nx];
-                if (i < nx - 1 && hough[i + 1 + j * nx] > v)
-                {
-                    v = 0;
-                }
-                if (j > 0 && hough[i + (j - 1) * nx] > v)
-                {
-                    v = 0;
-                }
-                if (i > 0 && hough[i - 1 + j * nx] > v)
-                {
-                    v = 0;
-                }
-                if (j < ny - 1 && hough[i + (j + 1) * nx] > v)
-                {
-                    v = 0;
-                }
-                int cv = v * 255 / max;
-                if (cv < threshold)
-                {
-                    v = 0;
-                    /* cv = 0 */
-                }
-                if (v)
-                {
-                    HoughCircle c = {min_cx + i, min_cy + j, r, (int)(2 * M_PI * r), v, (int)(2 * M_PI * r * 255)};
-                    //printf("found x: %i y: %i r: %i pix: %i acc: %i max: %i\n",c.x,c.y,c.radius,c.pixels,c.accum,c.max);
-                    res.push_back(c);
-                }
+                hough_circle_radius(edges, *lut[ir], min_r + ir, &houghAccu[0], cols, circles[ir], min_cx, max_cx, min_cy, max_cy, threshold, hint_r, hint_x, hint_y);
             }
-        }
+        }));
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        workers[t].join();
+    }
+    for (int ir = 0; ir < nr; ir++)
+    {
+        res.insert(res.end(), circles[ir].begin(), circles[ir].end());
     }
-
-    free_lookup_table(lut, min_r, max_r);
 }
 
 /*
@@ -1225,6 +1311,134 @@ int find_best_circle(vector<HoughCircle>& circles, int* x, int* y, int* r, int h
     return 1;
 }
 
+/*
+ * Evaluates the Hough accumulator directly for the centers within +-d pixels of
+ * (cx, cy) and the radii r - d .. r + d. Instead of voting, the edge values along
+ * each circle are summed up (which yields the same accumulator values) and
+ * smoothed as in hough_circle. The best center of each radius is appended to res.
+ * The remaining parameters restrict the search as for hough_circle.
+ */
+void hough_circle_refine(Mat& image, vector<HoughCircle>& res, int cx, int cy, int r, int d, int min_r, int max_r, int min_cx, int max_cx, int min_cy, int max_cy, int hint_r, int hint_x, int hint_y)
+{
+    int w = image.cols;
+    int h = image.rows;
+    uchar *data = image.data;
+    /* the accumulator patch includes the border used by the 3x7 smoothing */
+    int ax = std::max(min_cx, cx - d - 3);
+    int bx = std::min(max_cx, cx + d + 3);
+    int ay = std::max(min_cy, cy - d - 1);
+    int by = std::min(max_cy, cy + d + 1);
+    int lr = std::max(min_r, r - d);
+    int hr = std::min(max_r, r + d);
+    int nx = 1 + bx - ax;
+    int ny = 1 + by - ay;
+    if (nx <= 0 || ny <= 0 || hr < lr) return;
+    vector<const CircleTable*> lut;
+    lookup_table(lr, hr, lut);
+    vector<int> hough(nx * ny);
+    vector<int> cols;
+    for (int rr = lr; rr <= hr; rr++)
+    {
+        const CircleTable& table = *lut[rr - lr];
+        int na = table.na;
+        const int *tdx = table.dx.data();
+        const int *tdy = table.dy.data();
+        for (int b = ay; b <= by; b++)
+        {
+            for (int a = ax; a <= bx; a++)
+            {
+                int sum = 0;
+                for (int ia = 0; ia < na; ia++)
+                {
+                    int i = a + tdx[ia];
+                    int j = b + tdy[ia];
+                    if (i >= 0 && i < w && j >= 0 && j < h)
+                    {
+                        sum += data[j * w + i];
+                    }
+                }
+                hough[a - ax + nx * (b - ay)] = sum;
+            }
+        }
+        smooth_accumulator(&hough[0], nx, ny, cols);
+        HoughCircle best = {0, 0, rr, (int)(2 * M_PI * rr), 0, (int)(2 * M_PI * rr * 255)};
+        for (int b = std::max(ay, cy - d); b <= std::min(by, cy + d); b++)
+        {
+            for (int a = std::max(ax, cx - d); a <= std::min(bx, cx + d); a++)
+            {
+                int dx = a - hint_x;
+                int dy = b - hint_y;
+                if (hint_r && dx * dx + dy * dy > hint_r * hint_r)
+                {
+                    continue;
+                }
+                int v = hough[a - ax + nx * (b - ay)];
+                if (v > best.accum)
+                {
+                    best.x = a;
+                    best.y = b;
+                    best.accum = v;
+                }
+            }
+        }
+        if (best.accum > 0)
+        {
+            res.push_back(best);
+        }
+    }
+}
+
+/*
+ * Coarse-to-fine variant of hough_circle: the circles are searched on the edge map
+ * downscaled by 2^levels (maximum of each block) with all radii and centers scaled
+ * accordingly. The candidates with the best score (accumulator times coverage) are
+ * refined at full resolution within one block around their center and radius.
+ * levels: number of pyramid levels (0 runs hough_circle at full resolution)
+ * threads: worker threads of hough_circle (0 = all cores)
+ * candidates: number of coarse circles to refine
+ */
+void hough_circle_pyramid(Mat& image, vector<HoughCircle>& res, int min_r, int max_r, int min_cx, int max_cx, int min_cy, int max_cy, int threshold, int hint_r, int hint_x, int hint_y, const Mat& orient, double window, int levels, int threads = 0, unsigned int candidates = 5)
+{
+    if (levels <= 0)
+    {
+        hough_circle(image, res, min_r, max_r, min_cx, max_cx, min_cy, max_cy, threshold, hint_r, hint_x, hint_y, orient, window, threads);
+        return;
+    }
+    int f = 1 << levels;
+    int cw = (image.cols + f - 1) / f;
+    int ch = (image.rows + f - 1) / f;
+    Mat coarse(ch, cw, CV_8UC1, Scalar(0));
+    Mat coarseOrient(ch, cw, CV_32FC1, Scalar(0));
+    for (int j = 0; j < image.rows; j++)
+    {
+        for (int i = 0; i < image.cols; i++)
+        {
+            uchar c = image.at<uchar>(j, i);
+            if (c > coarse.at<uchar>(j / f, i / f))
+            {
+                /* the strongest pixel of the block determines its direction */
+                coarse.at<uchar>(j / f, i / f) = c;
+                if (!orient.empty()) coarseOrient.at<float>(j / f, i / f) = orient.at<float>(j, i);
+            }
+        }
+    }
+    vector<HoughCircle> circles;
+    hough_circle(coarse, circles, min_r / f, (max_r + f - 1) / f, cvFloor(min_cx / (double) f), cvCeil(max_cx / (double) f), cvFloor(min_cy / (double) f), cvCeil(max_cy / (double) f), threshold, (hint_r + f - 1) / f, hint_x / f, hint_y / f, (orient.empty()) ? Mat() : coarseOrient, window, threads);
+    if (circles.size() > candidates)
+    {
+        partial_sort(circles.begin(), circles.begin() + candidates, circles.end(), [](const HoughCircle& a, const HoughCircle& b)
+        {
+            return (long long) a.accum * a.accum * b.max > (long long) b.accum * b.accum * a.max;
+        });
+        circles.resize(candidates);
+    }
+    for (unsigned int i = 0; i < circles.size(); i++)
+    {
+        HoughCircle c = circles[i];
+        hough_circle_refine(image, res, c.x * f + f / 2, c.y * f + f / 2, c.radius * f + f / 2, f, min_r, max_r, min_cx, max_cx, min_cy, max_cy, hint_r, hint_x, hint_y);
+    }
+}
+
 /** ------------------------------- Iris boundary fitting ------------------------------- **/
 
 
@@ -1407,7 +1621,7 @@ vector<std::pair<int,int> > scan_edge(Mat& image, int x, int y, int dx, int dy,
  * Right now, this is a somewhat over-zealous algorithm, often cutting away
  * more than needed, especially in the presence of eyelashes.
  */
-void mask_lids(const Mat& orig_image, Mat& mask, int px, int py, int pr, int ix, int iy, int ir)
+void mask_lids(const Mat& orig_image, Mat& mask, int px, int py, int pr, int ix, int iy, int ir, int threads = 0)
 {
 
     int oxl = ix - ir;
@@ -1427,7 +1641,8 @@ void mask_lids(const Mat& orig_image, Mat& mask, int px, int py, int pr, int ix,
     int min_r = pr * 1.5;
     /* Blackout the pupil */
     black_out_circle(img, px-xl, py-yl, pr, min_r);
-    canny(img,mag,orient,edges, 3, 15, 0, 1);
+    CannyBuffers buffers;
+    canny(img,mag,orient,edges, 3, 15, 0, 1, buffers, threads);
     threshold_below(edges, 6, 0);
     threshold_above(edges, 7, 255);
     remove_streaks(edges, 30, 30, 0, 1, 1, 1, 1, 100, 1);
@@ -1524,336 +1739,176 @@ int histquant2u(const Mat& histogram, const int count, const float quantile){
 	return p;
 }
 
-/** ------------------------------- Clahe ------------------------------- **/
+/** ------------------------------- Rubbersheet transform ------------------------------- **/
 
 /*
- * Retrieves the (bilinear) interpolated byte from 4 bytes
- *
- * x: distance to left byte
- * y: distance to right byte
- * r: distance to upper byte
- * s: distance to lower byte
- * b1: upper left byte
- * b2: upper right byte
- * b3: lower left byte
- * b4: lower right byte
- */
-uchar interp(const double x, const double y, const double r, const double s, const uchar b1, const uchar b2, const uchar b3, const uchar b4) {
-  double w1 = (x + y);
-  double w2 = x / w1;
-  w1 = y / w1;
-  double w3 = (r + s);
-  double w4 = r / w3;
-  w3 = s / w3;
-  return saturate_cast<uchar>(w3 * (w1 * b1 + w2 * b2) + w4 * (w1 * b3 + w2 * b4));
-}
+ * interpolation mode for rubbersheet repeating the last pixel for a given angle if no values are available
+ * (otherwise behaves like INTER_LINEAR)
+ */
+//static const int INTER_LINEAR_REPEAT = 82;
+
+/** fractional bits of the bilinear weights of a rubbersheet map **/
+static const int RUBBERSHEET_BITS = 11;
 
 /*
- * Retrieves the bilinear interpolated byte from 2 bytes
- *
- * x:  distance to left byte
- * y:  distance to right byte
- * b1: left byte
- * b2: right byte
- */
-uchar interp(const double x, const double y, const uchar b1, const uchar b2) {
-  double w1 = (x + y);
-  double w2 = x / w1;
-  w1 = y / w1;
-  return saturate_cast<uchar>(w1 * b1 + w2 * b2);
-}
+ * Sampling positions of a rubbersheet transform, computed once per segmentation and
+ * shared by all images sampled with it. Positions are pixel indices into the source
+ * image padded by one pixel on each side (with row length srcwidth + 2), so samples
+ * overlapping the border need no special treatment. Positions out of the image are -1.
+ */
+struct RubbersheetMap {
+	int width, height; // size of the polar image
+	int srcwidth, srcheight; // size of the source image
+	vector<int> linear; // upper-left pixel of the bilinear neighbourhood
+	vector<short> wx, wy; // horizontal and vertical weights of the right and lower pixels
+	vector<int> nearest; // nearest pixel
+};
 
 /*
- * Inplace histogram clipping according to Zuiderveld (counts excess and redistributes excess by adding the average increment)
+ * Computes the sampling positions of a rubbersheet transform.
  *
- * hist: CV_32SC1 1 x 256 histogram matrix
- * clipFactor: between 0 (maximum slope M/N, where M #pixel in window, N #bins) and 1 (maximum slope M)
- * pixelCount: number of pixels in window
- */
-void clipHistogram(Mat& hist, const float clipFactor, const int pixelCount) {
-	double minSlope = ((double) pixelCount) / 256;
-	int clipLimit = std::min(pixelCount, std::max(1, cvCeil(minSlope + clipFactor * (pixelCount - minSlope))));
-	int distributeCount = 0;
-	MatIterator_<int> p = hist.begin<int>();
-	MatIterator_<int> e = hist.end<int>();
-	for (; p!=e; p++){
-		int binsExcess = *p - clipLimit;
-		if (binsExcess > 0) {
-			distributeCount += binsExcess;
-			*p = clipLimit;
-		}
-	}
-	int avgInc = distributeCount / 256;
-	int maxBins = clipLimit - avgInc;
-	for (p = hist.begin<int>(); p!=e; p++){
-		if (*p <= maxBins) {
-			distributeCount -= avgInc;
-			*p += avgInc;
-		}
-		else if (*p < clipLimit) {
-			distributeCount -= (clipLimit - *p);
-			*p = clipLimit;
-		}
-	}
-	while (distributeCount > 0) {
-		for (p = hist.begin<int>(); p!=e && distributeCount > 0; p++){
-			if (*p < clipLimit) {
-				(*p)++;
-				distributeCount--;
+ * inner: CV_32FC2 inner cartesian coordinates
+ * outer: CV_32FC2 outer cartesian coordinates
+ * dstSize: size of the polar image
+ * srcSize: size of the cartesian source image
+ * sheet: sampling positions
+ */
+void rubbersheetMap(const Mat& inner, const Mat& outer, const Size& dstSize, const Size& srcSize, RubbersheetMap& sheet) {
+	int dstheight = dstSize.height;
+	int dstwidth = dstSize.width;
+	int srcheight = srcSize.height;
+	int srcwidth = srcSize.width;
+	int pwidth = srcwidth + 2;
+	const float scale = 1 << RUBBERSHEET_BITS;
+	sheet.width = dstwidth;
+	sheet.height = dstheight;
+	sheet.srcwidth = srcwidth;
+	sheet.srcheight = srcheight;
+	sheet.linear.resize(dstwidth * dstheight);
+	sheet.wx.resize(dstwidth * dstheight);
+	sheet.wy.resize(dstwidth * dstheight);
+	sheet.nearest.resize(dstwidth * dstheight);
+	float roffset = 1.f / dstheight;
+	float r = 0;
+	for (int y=0, idx=0; y < dstheight; y++, r+= roffset){
+		float * pinner = (float *) inner.data;
+		float * pouter = (float *) outer.data;
+		for (int x=0; x < dstwidth; x++, idx++, pinner++, pouter++){
+			float a = *pinner + r * (*pouter - *pinner);
+			pinner++; pouter++;
+			float b =  *pinner + r * (*pouter - *pinner);
+			// clamp far away positions to keep the integer conversions in range
+			a = std::min(std::max(a,-2.f),srcwidth + 1.f);
+			b = std::min(std::max(b,-2.f),srcheight + 1.f);
+			int coordX = cvRound(a);
+			int coordY = cvRound(b);
+			sheet.nearest[idx] = (coordX < 0 || coordY < 0 || coordX >= srcwidth || coordY >= srcheight) ? -1 : (coordY + 1) * pwidth + coordX + 1;
+			coordX = cvFloor(a);
+			coordY = cvFloor(b);
+			if (coordX < -1 || coordY < -1 || coordX >= srcwidth || coordY >= srcheight){
+				sheet.linear[idx] = -1;
+				sheet.wx[idx] = 0;
+				sheet.wy[idx] = 0;
+			}
+			else {
+				sheet.linear[idx] = (coordY + 1) * pwidth + coordX + 1;
+				sheet.wx[idx] = (short) cvRound((a - coordX) * scale);
+				sheet.wy[idx] = (short) cvRound((b - coordY) * scale);
 			}
 		}
 	}
 }
 
 /*
- * Contrast-limited adaptive histogram equalization (supports in-place)
+ * Samples a (polar) image from a rubbersheet sheet. The source is padded by one pixel of
+ * fill (INTER_NEAREST, INTER_LINEAR) or of its border pixels (INTER_LINEAR_REPEAT, where
+ * positions out of the image repeat the pixel of the row above).
  *
- * src: CV_8UC1 image
- * dst: CV_8UC1 image (in-place operation is possible)
- * cellWidth: patch size in x direction (greater or equal to 2)
- * cellHeight: patch size in y direction (greater or equal to 2)
- * clipFactor: histogram clip factor between 0 and 1
+ * src: CV_8U (cartesian) source image (possibly multi-channel)
+ * dst: CV_8U (polar) destination image of the size of the map
+ * sheet: sampling positions
+ * interpolation: interpolation mode (INTER_NEAREST, INTER_LINEAR or INTER_LINEAR_REPEAT)
+ * fill: fill value for pixels out of the image
  */
-void clahe(const Mat& src, Mat& dst, const int cellWidth = 10, const int cellHeight = 10, const float clipFactor = 1.){
-	Mat hist(1,256,CV_32SC1);
-	Mat roi;
-	uchar * sp, * dp;
-	int height = src.rows;
-	int width = src.cols;
-	int gridWidth = width / cellWidth + (width % cellWidth == 0 ? 0 : 1);
-	int gridHeight = height / cellHeight + (height % cellHeight == 0 ? 0 : 1);
-	int bufSize = (gridWidth + 2)*256;
-	int bufOffsetLeft = bufSize - 256;
-	int bufOffsetTop = bufSize - gridWidth * 256;
-	int bufOffsetTopLeft = bufSize - (gridWidth + 1) * 256;
-	Mat buf(1, bufSize, CV_8UC1);
-	MatIterator_<uchar> pbuf = buf.begin<uchar>(), ebuf = buf.end<uchar>();
-	MatIterator_<int> phist, ehist = hist.end<int>();
-	uchar * curr, * topleft, * top, * left;
-	int pixelCount, cX, cY, cWidth, cHeight, cellOrigin, cellOffset;
-	double sum;
-	// process first row, first cell
-	cX = 0;
-	cY = 0;
-	cWidth = min(cellWidth, width);
-	cHeight = min(cellHeight, height);
-	pixelCount = cWidth*cHeight;
-	sum = 0;
-	roi = Mat(src,Rect(cX,cY,cWidth,cHeight));
-	hist2u(roi,hist);
-	if (clipFactor < 1) clipHistogram(hist,clipFactor,pixelCount);
-	// equalization
-	for(phist = hist.begin<int>(); phist!=ehist; phist++, pbuf++){
-		sum += *phist;
-		*pbuf = saturate_cast<uchar>(sum * 255 / pixelCount);
-	}
-	// paint first corner cell
-	cWidth = min(cellWidth / 2, cWidth);
-	cHeight = min(cellHeight / 2, cHeight);
-	cellOrigin = src.step * cY + cX;
-	cellOffset = src.step - cWidth;
-	sp = (uchar *)(src.data + cellOrigin);
-	dp = (uchar *)(dst.data + cellOrigin);
-	curr = buf.data;
-	for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-	  for (int a=0; a < cWidth; a++, sp++, dp++){
-		*dp = curr[*sp];
-	  }
-	}
-	// process first row, other cells
-	for (int x = 1; x < gridWidth; x++) {
-		cX = x*cellWidth;
-		cWidth = min(cellWidth, width - x*cellWidth);
-		cHeight = min(cellHeight, height);
-		pixelCount = cWidth*cHeight;
-		sum = 0;
-		roi.release();
-		roi = Mat(src,Rect(cX,cY,cWidth,cHeight));
-		hist2u(roi,hist);
-		if (clipFactor < 1) clipHistogram(hist,clipFactor,pixelCount);
-		// equalization
-		for(phist = hist.begin<int>(); phist!=ehist; phist++, pbuf++){
-			sum += *phist;
-			*pbuf = saturate_cast<uchar>(sum * 255 / pixelCount);
-		}
-		// paint first row, other cells
-		cX += cellWidth/2 - cellWidth;
-		cWidth = min(cellWidth, width - x*cellWidth + cellWidth/2);
-		cHeight = min(cellHeight / 2, height);
-		cellOrigin = src.step * cY + cX;
-		cellOffset = src.step - cWidth;
-		sp = (uchar *)(src.data + cellOrigin);
-		dp = (uchar *)(dst.data + cellOrigin);
-		curr = buf.data + (curr - buf.data + 256) % bufSize;
-		left = buf.data + (curr - buf.data + bufOffsetLeft) % bufSize;
-		for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-		  for (int a=0; a < cWidth; a++, sp++, dp++){
-			  *dp = interp(a,cWidth-a,left[*sp], curr[*sp]);
-		  }
-		}
-	}
-	// process (i.e. paint) first row, last cell (only if necessary)
-	if (width % cellWidth > cellWidth / 2 || width % cellWidth == 0) {
-		cWidth = (width - cellWidth / 2) % cellWidth;
-		cHeight = min(cellHeight / 2, height);
-		cX = width-cWidth;
-		cellOrigin = src.step * cY + cX;
-		cellOffset = src.step - cWidth;
-		sp = (uchar *)(src.data + cellOrigin);
-		dp = (uchar *)(dst.data + cellOrigin);
-		for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-		  for (int a=0; a < cWidth; a++, sp++, dp++){
-			*dp = curr[*sp];
-		  }
-		}
-	}
-	// process rest of rows
-	for (int y = 1; y < gridHeight; y++) {
-		// process other rows, first cell
-		cX = 0;
-		cY = y*cellHeight;
-		cWidth = min(cellWidth, width);
-		cHeight = min(cellHeight, height - y*cellHeight);
-		pixelCount = cWidth*cHeight;
-		sum = 0;
-		roi.release();
-		roi = Mat(src,Rect(cX,cY,cWidth,cHeight));
-		hist2u(roi,hist);
-		if (clipFactor < 1) clipHistogram(hist,clipFactor,pixelCount);
-		// equalization
-		if (pbuf == ebuf) pbuf = buf.begin<uchar>();
-		for(phist = hist.begin<int>(); phist!=ehist; phist++, pbuf++){
-			sum += *phist;
-			*pbuf = saturate_cast<uchar>(sum * 255 / pixelCount);
-		}
-		// paint other rows, first cell
-		cY += cellHeight/2 - cellHeight;
-		cWidth = min(cellWidth / 2, width);
-		cHeight = min(cellHeight, height - y*cellHeight + cellHeight/2);
-		cellOrigin = src.step * cY + cX;
-		cellOffset = src.step - cWidth;
-		sp = (uchar *)(src.data + cellOrigin);
-		dp = (uchar *)(dst.data + cellOrigin);
-		curr = buf.data + (curr - buf.data + 256) % bufSize;
-		top = buf.data + (curr - buf.data + bufOffsetTop) % bufSize;
-		for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-		  for (int a=0; a < cWidth; a++, sp++, dp++){
-			  *dp = interp(b,cHeight-b,top[*sp], curr[*sp]);
-		  }
-		}
-		// process other rows, rest of cells
-		for (int x = 1; x < gridWidth; x++) {
-			cX = x*cellWidth;
-			cY = y*cellHeight;
-			cWidth = min(cellWidth, width - x*cellWidth);
-			cHeight = min(cellHeight, height - y*cellHeight);
-			pixelCount = cWidth*cHeight;
-			sum = 0;
-			roi.release();
-			roi = Mat(src,Rect(cX,cY,cWidth,cHeight));
-			hist2u(roi,hist);
-			if (clipFactor < 1) clipHistogram(hist,clipFactor,pixelCount);
-			// equalization
-			if (pbuf == ebuf) pbuf = buf.begin<uchar>();
-			for(phist = hist.begin<int>(); phist!=ehist; phist++, pbuf++){
-				sum += *phist;
-				*pbuf = saturate_cast<uchar>(sum * 255 / pixelCount);
-			}
-			// paint other rows, rest of cells
-			cX += cellWidth/2 - cellWidth;
-			cY += cellHeight/2 - cellHeight;
-			cWidth = min(cellWidth, width - x*cellWidth + cellWidth/2);
-			cHeight = min(cellHeight, height - y*cellHeight + cellHeight/2);
-			cellOrigin = src.step * cY + cX;
-			cellOffset = src.step - cWidth;
-			sp = (uchar *)(src.data + cellOrigin);
-			dp = (uchar *)(dst.data + cellOrigin);
-			curr = buf.data + (curr - buf.data + 256) % bufSize;
-			top = buf.data + (curr - buf.data + bufOffsetTop) % bufSize;
-			topleft = buf.data + (curr - buf.data + bufOffsetTopLeft) % bufSize;
-			left = buf.data + (curr - buf.data + bufOffsetLeft) % bufSize;
-			for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-			  for (int a=0; a < cWidth; a++, sp++, dp++){
-				  *dp = interp(a, cWidth-a,b,cHeight-b,topleft[*sp],top[*sp],left[*sp],curr[*sp]);
-			  }
-			}
-		}
-		// process (i.e. paint) other rows, last cell (only if necessary)
-		if (width % cellWidth > cellWidth / 2 || width % cellWidth == 0) {
-			cWidth = (width - cellWidth / 2) % cellWidth;
-			cHeight = min(cellHeight, height - y*cellHeight + cellHeight/2);
-			cX = width-cWidth;
-			cellOrigin = src.step * cY + cX;
-			cellOffset = src.step - cWidth;
-			sp = (uchar *)(src.data + cellOrigin);
-			dp = (uchar *)(dst.data + cellOrigin);
-			top = buf.data + (curr - buf.data + bufOffsetTop) % bufSize;
-			for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-			  for (int a=0; a < cWidth; a++, sp++, dp++){
-				  *dp = interp(b,cHeight-b,top[*sp], curr[*sp]);
-			  }
+void rubbersheetRemap(const Mat& src, Mat& dst, const RubbersheetMap& sheet, const int interpolation = INTER_LINEAR, const uchar fill = 0) {
+	CV_Assert(src.depth() == CV_8U && src.type() == dst.type());
+	CV_Assert(src.cols == sheet.srcwidth && src.rows == sheet.srcheight && dst.cols == sheet.width && dst.rows == sheet.height);
+	int nChannels = src.channels();
+	bool repeat = (interpolation != INTER_NEAREST && interpolation != INTER_LINEAR);
+	Mat padded;
+	copyMakeBorder(src,padded,1,1,1,1,(repeat) ? BORDER_REPLICATE : BORDER_CONSTANT,Scalar::all(fill));
+	const uchar * psrc = padded.data;
+	int pstep = padded.step;
+	const int half = 1 << (2 * RUBBERSHEET_BITS - 1);
+	const int one = 1 << RUBBERSHEET_BITS;
+	for (int y=0, idx=0; y < sheet.height; y++){
+		uchar * pdst = dst.ptr<uchar>(y);
+		if (interpolation == INTER_NEAREST){
+			for (int x=0; x < sheet.width; x++, idx++){
+				int pos = sheet.nearest[idx];
+				for (int i=0; i< nChannels; i++,pdst++){
+					*pdst = (pos < 0) ? fill : psrc[pos * nChannels + i];
+				}
 			}
+			continue;
 		}
-	}
-	// process (i.e. paint) last row (only if necessary)
-	if (height % cellHeight > cellHeight / 2 || height % cellHeight == 0) {
-		// paint last row, first cell
-		cWidth =  min(cellWidth / 2, width);
-		cHeight = (height - cellHeight / 2) % cellHeight;
-		cX = 0;
-		cY = height-cHeight;
-		cellOrigin = src.step * cY + cX;
-		cellOffset = src.step - cWidth;
-		sp = (uchar *)(src.data + cellOrigin);
-		dp = (uchar *)(dst.data + cellOrigin);
-		curr = buf.data + (curr - buf.data + bufOffsetTop + 256) % bufSize;
-		for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-		  for (int a=0; a < cWidth; a++, sp++, dp++){
-			*dp = curr[*sp];
-		  }
-		}
-		// paint last row, other cells
-		for (int x = 1; x < gridWidth; x++) {
-			cX = (x-1)*cellWidth + cellWidth/2;
-			cWidth = min(cellWidth, width - x*cellWidth + cellWidth/2);
-			cHeight = (height - cellHeight / 2) % cellHeight;
-			cellOrigin = src.step * cY + cX;
-			cellOffset = src.step - cWidth;
-			sp = (uchar *)(src.data + cellOrigin);
-			dp = (uchar *)(dst.data + cellOrigin);
-			left = curr;
-			curr = buf.data + (curr - buf.data + 256) % bufSize;
-			for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-			  for (int a=0; a < cWidth; a++, sp++, dp++){
-				  *dp = interp(a,cWidth-a,left[*sp], curr[*sp]);
-			  }
+		for (int x=0; x < sheet.width; x++, idx++){
+			int pos = sheet.linear[idx];
+			if (pos < 0){
+				for (int i=0; i< nChannels; i++,pdst++){
+					*pdst = (repeat && y > 0) ? *(pdst - dst.step) : fill; // one row above
+				}
+				continue;
 			}
-		}
-		// paint last row, last cell (only if necessary)
-		if (width % cellWidth > cellWidth / 2 || width % cellWidth == 0) {
-			cWidth = (width - cellWidth / 2) % cellWidth;
-			cHeight = (height - cellHeight / 2) % cellHeight;
-			cX = width-cWidth;
-			cellOrigin = src.step * cY + cX;
-			cellOffset = src.step - cWidth;
-			sp = (uchar *)(src.data + cellOrigin);
-			dp = (uchar *)(dst.data + cellOrigin);
-			for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-			  for (int a=0; a < cWidth; a++, sp++, dp++){
-				  *dp = curr[*sp];
-			  }
+			int dx = sheet.wx[idx], dy = sheet.wy[idx];
+			int w00 = (one - dx) * (one - dy), w01 = dx * (one - dy), w10 = (one - dx) * dy, w11 = dx * dy;
+			const uchar * p = psrc + pos * nChannels;
+			for (int i=0; i< nChannels; i++,pdst++,p++){
+				*pdst = (uchar)((w00 * p[0] + w01 * p[nChannels] + w10 * p[pstep] + w11 * p[pstep + nChannels] + half) >> (2 * RUBBERSHEET_BITS));
 			}
 		}
 	}
 }
 
-/** ------------------------------- Rubbersheet transform ------------------------------- **/
-
 /*
- * interpolation mode for rubbersheet repeating the last pixel for a given angle if no values are available
- * (otherwise behaves like INTER_LINEAR)
+ * Samples the texture (INTER_LINEAR) and the noise mask (INTER_NEAREST) of a segmentation
+ * from a rubbersheet map in one pass, pixels out of the image are 0.
+ *
+ * src: CV_8UC1 (cartesian) source image
+ * dst: CV_8UC1 (polar) texture of the size of the map
+ * mask: CV_8UC1 (cartesian) noise mask of the size of src
+ * maskDst: CV_8UC1 (polar) noise mask of the size of the map
+ * sheet: sampling positions
  */
-//static const int INTER_LINEAR_REPEAT = 82;
+void rubbersheetRemap(const Mat& src, Mat& dst, const Mat& mask, Mat& maskDst, const RubbersheetMap& sheet) {
+	CV_Assert(src.type() == CV_8UC1 && dst.type() == CV_8UC1 && mask.type() == CV_8UC1 && maskDst.type() == CV_8UC1);
+	CV_Assert(src.size() == mask.size() && dst.size() == maskDst.size());
+	CV_Assert(src.cols == sheet.srcwidth && src.rows == sheet.srcheight && dst.cols == sheet.width && dst.rows == sheet.height);
+	Mat padded, paddedMask;
+	copyMakeBorder(src,padded,1,1,1,1,BORDER_CONSTANT,Scalar::all(0));
+	copyMakeBorder(mask,paddedMask,1,1,1,1,BORDER_CONSTANT,Scalar::all(0));
+	const uchar * psrc = padded.data;
+	const uchar * pmask = paddedMask.data;
+	int pstep = padded.step;
+	const int half = 1 << (2 * RUBBERSHEET_BITS - 1);
+	const int one = 1 << RUBBERSHEET_BITS;
+	for (int y=0, idx=0; y < sheet.height; y++){
+		uchar * pdst = dst.ptr<uchar>(y);
+		uchar * pmaskdst = maskDst.ptr<uchar>(y);
+		for (int x=0; x < sheet.width; x++, idx++){
+			int npos = sheet.nearest[idx];
+			pmaskdst[x] = (npos < 0) ? 0 : pmask[npos];
+			int pos = sheet.linear[idx];
+			if (pos < 0){
+				pdst[x] = 0;
+				continue;
+			}
+			int dx = sheet.wx[idx], dy = sheet.wy[idx];
+			const uchar * p = psrc + pos;
+			pdst[x] = (uchar)(((one - dx) * (one - dy) * p[0] + dx * (one - dy) * p[1] + (one - dx) * dy * p[pstep] + dx * dy * p[pstep + 1] + half) >> (2 * RUBBERSHEET_BITS));
+		}
+	}
+}
 
 /*
  * Calculates the mapped (polar) image of source using two transformation contours.
@@ -1866,343 +1921,9 @@ void clahe(const Mat& src, Mat& dst, const int cellWidth = 10, const int cellHei
  * fill: fill value for pixels out of the image
  */
 void rubbersheet(const Mat& src, Mat& dst, const Mat& inner, const Mat& outer, const int interpolation = INTER_LINEAR, const uchar fill = 0) {
-	int nChannels = src.channels();
-	int dstheight = dst.rows;
-	int dstwidth = dst.cols;
-	int srcheight = src.rows;
-	int srcwidth = src.cols;
-	uchar * pdst = dst.data;
-	int dstoffset = dst.step - dstwidth * nChannels;
-	int srcstep = src.step;
-	float roffset = 1.f / dstheight;
-	float r = 0;
-	if (interpolation == INTER_NEAREST){
-		for (int y=0; y < dstheight; y++, pdst+= dstoffset, r+=roffset){
-			float * pinner = (float *) inner.data;
-			float * pouter = (float *) outer.data;
-			for (int x=0; x < dstwidth; x++, pinner++, pouter++){
-				float a = *pinner + r * (*pouter - *pinner);
-				pinner++; pouter++;
-				float b =  *pinner + r * (*pouter - *pinner);
-				int coordX = cvRound(a);
-				int coordY = cvRound(b);
-				if (coordX < 0 || coordY < 0 || coordX >= srcwidth || coordY >= srcheight){
-					for (int i=0; i< nChannels; i++,pdst++){
-						*pdst = fill;
-					}
-				}
-				else {
-					uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-					for (int i=0; i< nChannels; i++,pdst++,psrc++){
-						*pdst = *psrc;
-					}
-				}
-			}
-		}
-	}
-	else if (interpolation == INTER_LINEAR){
-		for (int y=0; y < dstheight; y++, pdst+= dstoffset, r+= roffset){
-			float * pinner = (float *) inner.data;
-			float * pouter = (float *) outer.data;
-			for (int x=0; x < dstwidth; x++, pinner++, pouter++){
-				float a = *pinner + r * (*pouter - *pinner);
-				pinner++; pouter++;
-				float b =  *pinner + r * (*pouter - *pinner);
-				int coordX = cvFloor(a);
-				int coordY = cvFloor(b);
-				if (coordX >= 0){
-					if (coordY >= 0){
-						if (coordX < srcwidth-1){
-							if (coordY < srcheight-1){
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(*psrc)) + dx*(float)(psrc[nChannels]))+ dy*((1-dx)*((float)(psrc[srcstep])) + dx*(float)(psrc[nChannels+srcstep])));
-								}
-							}
-							else if (coordY == srcheight-1){ // bottom out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(*psrc)) + dx*(float)(psrc[nChannels])) + dy * ((float) fill));
-								}
-							}
-							else {
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = fill;
-								}
-							}
-						}
-						else if (coordX == srcwidth-1){
-							if (coordY < srcheight-1){// right out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dx)*((1-dy)*((float)(*psrc))+ dy*((float)(psrc[srcstep]))) + dx * ((float) fill));
-								}
-							}
-							else if (coordY == srcheight-1){ // bottom right out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(*psrc)) + dx * ((float)fill)) + dy * ((float) fill));
-								}
-							}
-							else {
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = fill;
-								}
-							}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = fill;
-							}
-						}
-					}
-					else if (coordY == -1){
-						if (coordX < srcwidth-1){// top out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((dy)*((1-dx)*((float)(psrc[srcstep])) + dx*(float)(psrc[nChannels+srcstep])) + (1-dy) * ((float) fill));
-								}
-						}
-						else if (coordX == srcwidth-1){// top right out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((dy)*((1-dx)*((float)(psrc[srcstep])) + dx * ((float)fill)) + (1-dy) * ((float) fill));
-								}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = fill;
-							}
-						}
-					}
-					else {
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = fill;
-						}
-					}
-				}
-				else if (coordX == -1){
-					if (coordY >= 0){
-						if (coordY < srcheight-1){// left out
-							float dx = a-coordX;
-							float dy = b-coordY;
-							uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-							for (int i=0; i< nChannels; i++,pdst++,psrc++){
-								*pdst = saturate_cast<uchar>(dx*((1-dy)*(float)(psrc[nChannels]) + dy*(float)(psrc[nChannels+srcstep])) + (1-dx) * ((float) fill));
-							}
-						}
-						else if (coordY == srcheight-1){ // left bottom out
-							float dx = a-coordX;
-							float dy = b-coordY;
-							uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-							for (int i=0; i< nChannels; i++,pdst++,psrc++){
-								*pdst = saturate_cast<uchar>((1-dy)*((dx)*((float)(psrc[nChannels])) + (1-dx) * ((float) fill)) + dy * ((float) fill));
-							}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = fill;
-							}
-						}
-					}
-					else if (coordY == -1){ // left top out
-						float dx = a-coordX;
-						float dy = b-coordY;
-						uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-						for (int i=0; i< nChannels; i++,pdst++,psrc++){
-							*pdst = saturate_cast<uchar>((dy)*((dx)*((float)(psrc[nChannels+srcstep])) + (1-dx) * ((float) fill)) + (1-dy) * ((float) fill));
-						}
-					}
-					else {
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = fill;
-						}
-					}
-				}
-				else {
-					for (int i=0; i< nChannels; i++,pdst++){
-						*pdst = fill;
-					}
-				}
-			}
-		}
-	}
-	else { // INTER_LINEAR_REPEAT (repeats last pixel value)
-		uchar * firstLine = pdst + dst.step;
-		int step = dst.step;
-		for (int y=0; y < dstheight; y++, pdst+= dstoffset, r+= roffset){
-			float * pinner = (float *) inner.data;
-			float * pouter = (float *) outer.data;
-			for (int x=0; x < dstwidth; x++, pinner++, pouter++){
-				float a = *pinner + r * (*pouter - *pinner);
-				pinner++; pouter++;
-				float b =  *pinner + r * (*pouter - *pinner);
-				int coordX = cvFloor(a);
-				int coordY = cvFloor(b);
-				if (coordX >= 0){
-					if (coordY >= 0){
-						if (coordX < srcwidth-1){
-							if (coordY < srcheight-1){
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(*psrc)) + dx*(float)(psrc[nChannels]))+ dy*((1-dx)*((float)(psrc[srcstep])) + dx*(float)(psrc[nChannels+srcstep])));
-								}
-							}
-							else if (coordY == srcheight-1){ // bottom out
-								float dx = a-coordX;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>(((1-dx)*((float)(*psrc)) + dx*(float)(psrc[nChannels])));
-								}
-							}
-							else if (pdst >= firstLine){
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = *(pdst - step); // one row above
-								}
-							}
-							else {
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = fill;
-								}
-							}
-						}
-						else if (coordX == srcwidth-1){
-							if (coordY < srcheight-1){// right out
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>(((1-dy)*((float)(*psrc))+ dy*((float)(psrc[srcstep]))));
-								}
-							}
-							else if (coordY == srcheight-1){ // bottom right out
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = *psrc;
-								}
-							}
-							else if (pdst >= firstLine){
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = *(pdst - step); // one row above
-								}
-							}
-							else {
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = fill;
-								}
-							}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = *(pdst - step); // one row above
-							}
-						}
-					}
-					else if (coordY == -1){
-						if (coordX < srcwidth-1){// top out
-								float dx = a-coordX;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>(((1-dx)*((float)(psrc[srcstep])) + dx*(float)(psrc[nChannels+srcstep])));
-								}
-						}
-						else if (coordX == srcwidth-1){// top right out
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = psrc[srcstep];
-								}
-						}
-						else if (pdst >= firstLine){
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = *(pdst - step); // one row above
-							}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = fill;
-							}
-						}
-					}
-					else if (pdst >= firstLine){
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = *(pdst - step); // one row above
-						}
-					}
-					else {
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = fill;
-						}
-					}
-				}
-				else if (coordX == -1){
-					if (coordY >= 0){
-						if (coordY < srcheight-1){// left out
-							float dy = b-coordY;
-							uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-							for (int i=0; i< nChannels; i++,pdst++,psrc++){
-								*pdst = saturate_cast<uchar>(((1-dy)*(float)(psrc[nChannels]) + dy*(float)(psrc[nChannels+srcstep])));
-							}
-						}
-						else if (coordY == srcheight-1){ // bottom left out
-							uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-							for (int i=0; i< nChannels; i++,pdst++,psrc++){
-								*pdst = psrc[nChannels];
-							}
-						}
-						else if (pdst >= firstLine){
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = *(pdst - step); // one row above
-							}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = fill;
-							}
-						}
-					}
-					else if (coordY == -1){ // top left out
-						uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-						for (int i=0; i< nChannels; i++,pdst++,psrc++){
-							*pdst = psrc[nChannels+srcstep];
-						}
-					}
-					else if (pdst >= firstLine){
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = *(pdst - step); // one row above
-						}
-					}
-					else {
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = fill;
-						}
-					}
-				}
-				else if (pdst >= firstLine){
-					for (int i=0; i< nChannels; i++,pdst++){
-						*pdst = *(pdst - step); // one row above
-					}
-				}
-				else {
-					for (int i=0; i< nChannels; i++,pdst++){
-						*pdst = fill;
-					}
-				}
-			}
-		}
-	}
+	RubbersheetMap sheet;
+	rubbersheetMap(inner, outer, dst.size(), src.size(), sheet);
+	rubbersheetRemap(src, dst, sheet, interpolation, fill);
 }
 
 /**
@@ -2287,6 +2008,20 @@ void setOffCenterRadi(Mat& dest, const float r, const float t){ //translate2
     }
 }
 
+/** ------------------------------- Segmentation workspace ------------------------------- **/
+
+/*
+ * Images and tables of one segmentation which are kept from one input file to the next, one
+ * workspace per worker thread. Mat::create only reallocates if size or type change, so a batch of
+ * equally sized images reuses the same memory and threads do not compete for the allocator.
+ */
+struct Workspace {
+	Mat img, orig, temp, accum, mag, orient, mask, bw, out, maskout;
+	CannyBuffers canny;
+	vector<HoughCircle> circles, irisCircles;
+	RubbersheetMap sheet;
+};
+
 /** ------------------------------- commandline functions ------------------------------- **/
 
 /**
@@ -2699,7 +2434,7 @@ int main(int argc, char *argv[])
     	else mode = MODE_MAIN;
     	if (mode == MODE_MAIN){
 			// validate command line
-			cmdCheckOpts(cmd,"-i|-o|-m|-s|-e|-q|-t|-po|-bm|-sr|-lt|-so|-si|-tr|-tc|-l|-tu|-noscale");
+			cmdCheckOpts(cmd,"-i|-o|-m|-s|-e|-q|-t|-po|-bm|-sr|-lt|-so|-si|-tr|-tc|-l|-tu|-noscale|-dv|-pyr|-j|-prof");
 			cmdCheckOptExists(cmd,"-i");
 			cmdCheckOptSize(cmd,"-i",1);
 			string inFiles = cmdGetPar(cmd,"-i");
@@ -2769,6 +2504,18 @@ int main(int argc, char *argv[])
 				cmdCheckOptSize(cmd,"-noscale",0);
 				downscale = false;
 			}
+			double voteWindow = 0;
+			if (cmdGetOpt(cmd,"-dv") != 0){
+				cmdCheckOptSize(cmd,"-dv",1);
+				voteWindow = cmdGetParFloat(cmd,"-dv") * M_PI / 180;
+				CV_Assert(voteWindow > 0);
+			}
+			int pyramidLevels = 0;
+			if (cmdGetOpt(cmd,"-pyr") != 0){
+				cmdCheckOptSize(cmd,"-pyr",1);
+				pyramidLevels = cmdGetParInt(cmd,"-pyr");
+				CV_Assert(pyramidLevels >= 0 && pyramidLevels <= 2);
+			}
 			int lt = 1;
 			if (cmdGetOpt(cmd,"-lt") != 0){
 				cmdCheckOptSize(cmd,"-lt",1);
@@ -2802,6 +2549,19 @@ int main(int argc, char *argv[])
                 cmdCheckOptSize(cmd, "-tr", 1);
                 translate = cmdGetParFloat(cmd, "-tr", 0);
             }
+			int jobs = 1;
+			if (cmdGetOpt(cmd,"-j") != 0){
+				cmdCheckOptSize(cmd,"-j",1);
+				jobs = cmdGetParInt(cmd,"-j");
+				CV_Assert(jobs >= 1);
+			}
+			// canny and the Hough transform run single-threaded when several files are processed at once
+			int stageThreads = (jobs > 1) ? 1 : 0;
+			Profile profile;
+			if (cmdGetOpt(cmd,"-prof") != 0){
+				cmdCheckOptSize(cmd,"-prof",1);
+				profile.open(cmdGetPar(cmd,"-prof"));
+			}
 			ofstream logFile;
 			if (cmdGetOpt(cmd,"-l") != 0){
 				cmdCheckOptSize(cmd,"-l",1);
@@ -2828,13 +2588,17 @@ int main(int argc, char *argv[])
 			patternToFiles(inFiles,files);
 			CV_Assert(files.size() > 0);
 			timing.total = files.size();
-			for (vector<string>::iterator inFile = files.begin(); inFile != files.end(); ++inFile, timing.progress++){
-				if (!quiet) printf("Loading image '%s' ...\n", (*inFile).c_str());;
+			vector<Workspace> workspaces(jobs);
+			auto processFile = [&](const string& inFile, int worker, ostream& logLines){
+				Workspace& ws = workspaces[worker];
+				ProfileTimer timer(profile, inFile);
+				timer.stage("load");
+				if (!quiet) printf("Loading image '%s' ...\n", inFile.c_str());;
 				// MODIFICATION TB, June 3rd, 2014
 				// additional conversion step to enable direct JP2K processing (Bug in CV)
 				// Loading of JP2k in color is supported, loading as grayscale, however, not
-				Mat imgCol = imread(*inFile, CV_LOAD_IMAGE_COLOR);
-				Mat img;
+				Mat imgCol = imread(inFile, CV_LOAD_IMAGE_COLOR);
+				Mat& img = ws.img;
 				cvtColor(imgCol,img,CV_BGR2GRAY);
 				CV_Assert(img.data != 0);
                 if( downscale){
@@ -2854,7 +2618,7 @@ int main(int argc, char *argv[])
                     else printf(" seems fine.\n");
                 }
 				double minArea = 0.02, maxArea = 0.04;
-				Mat orig;
+				Mat& orig = ws.orig;
 				if (!segresFiles.empty()) img.copyTo(orig);
 				double pixpdiam = 200;
 				double pixpdiam_stdev = 0;
@@ -2875,20 +2639,24 @@ int main(int argc, char *argv[])
 				int px = 0, py = 0, pr = 0;
 				if (!quiet) printf("Finding pupil ...\n");
 				int PUPIL_HOUGH_THRESHOLD = 200;
-				Mat temp(height,width,CV_8UC1);
+				Mat& temp = ws.temp;
 				img.copyTo(temp);
+				timer.stage("pupil luminance");
 				adjust_luminance(temp, width * height * minArea, width * height * maxArea);
 
-				Mat accum(height,width,CV_8UC1);
-				cumulate(temp, accum, 3, 3);
-				invert(accum);
-				cumulate(accum, temp, 3, 3);
-				invert(temp);
+				timer.stage("pupil cumulate");
+				Mat& accum = ws.accum;
+				accum.create(height,width,CV_8UC1);
+				cumulate(temp, accum, 3, 3, true);
+				cumulate(accum, temp, 3, 3, true);
 				int hrun = longest_horizontal_run(temp, width * 0.25, 127);
 				int vrun = longest_vertical_run(temp, height * 0.25, 127);
-				Mat mag(height,width,CV_32FC1);
-				Mat orient(height,width,CV_32FC1);
-				canny(temp, mag, orient, accum, 3, 15, 1, 1);
+				timer.stage("pupil canny");
+				Mat& mag = ws.mag;
+				mag.create(height,width,CV_32FC1);
+				Mat& orient = ws.orient;
+				orient.create(height,width,CV_32FC1);
+				canny(temp, mag, orient, accum, 3, 15, 1, 1, ws.canny, stageThreads);
 				remove_streaks(accum, 6, 1, 1, 5, 5, 10, 10, 3, 3);
 				int ax, ay, bx, by;
 				bounds_bigger_than_threshold(accum, 0, &ax, &ay, &bx, &by);
@@ -2918,11 +2686,14 @@ int main(int argc, char *argv[])
 				{
 					by = height - 1 - border;
 				}
-				vector<HoughCircle> circles;
-				hough_circle(accum, circles,min_r, max_r, ax, bx, ay, by, PUPIL_HOUGH_THRESHOLD, 0, 0, 0);
+				timer.stage("pupil hough");
+				vector<HoughCircle>& circles = ws.circles;
+				circles.clear();
+				hough_circle_pyramid(accum, circles,min_r, max_r, ax, bx, ay, by, PUPIL_HOUGH_THRESHOLD, 0, 0, 0, orient, voteWindow, pyramidLevels, stageThreads);
 				find_best_circle(circles, &px, &py, &pr, 1, width / 2, height / 2, height / 2,0, pixpdiam, pixpdiam_stdev);
 				if (!quiet) printf("Pupil circle: (x,y,r) = (%i,%i,%i)\n", px, py,pr);
 				if (!quiet) printf("Finding iris ...\n");
+				timer.stage("iris luminance");
 				int ix = 0, iy = 0, ir = 0;
 				img.copyTo(temp);
 				/* Blackout the pupil first */
@@ -2936,7 +2707,8 @@ int main(int argc, char *argv[])
 				threshold_above(temp, 128, 128);
 				hrun = longest_horizontal_run(temp, width * 0.1, 191);
 				vrun = longest_vertical_run(temp, height * 0.1, 191);
-				canny(temp, mag, orient, accum, 3, 15, 1, 0);
+				timer.stage("iris canny");
+				canny(temp, mag, orient, accum, 3, 15, 1, 0, ws.canny, stageThreads);
 				threshold_below(accum, 6, 0);
 				threshold_above(accum, 7, 255);
 				remove_streaks(accum, 6, 6, 6, 10, 10, 10, 10, 2, 10);
@@ -2987,8 +2759,10 @@ int main(int argc, char *argv[])
 					/* the center. */
 					/* 240 at double radius */
 					dim_above_horizon(accum, py, 240.0 / pr / pr / 4);
-					vector<HoughCircle> irisCircles;
-					hough_circle(accum, irisCircles,min_ir, max_ir, ax, bx, ay, by, IRIS_HOUGH_THRESHOLD, pr * 1.3, px, py);
+					timer.stage("iris hough");
+					vector<HoughCircle>& irisCircles = ws.irisCircles;
+					irisCircles.clear();
+					hough_circle_pyramid(accum, irisCircles,min_ir, max_ir, ax, bx, ay, by, IRIS_HOUGH_THRESHOLD, pr * 1.3, px, py, orient, voteWindow, pyramidLevels, stageThreads);
 					find_best_circle(irisCircles, &ix, &iy, &ir, 1, px, py, pr, 10, pixidiam, pixidiam_stdev);
 				}
 				if (!quiet) printf("Iris circle: (x,y,r) = (%i,%i,%i)\n", ix, iy,ir);
@@ -3002,17 +2776,19 @@ int main(int argc, char *argv[])
 				if (!quiet) printf("Scaled Iris circle: (x,y,r) = (%i,%i,%i)\n", ix, iy,ir);
 				if (!quiet) printf("Scaled Pupil circle: (x,y,r) = (%i,%i,%i)\n", px, py,pr);
                 if( logFile.is_open()){ 
-                    logFile << inFile->c_str() << ", " 
+                    logLines << inFile.c_str() << ", " 
                             << ix << ", " << iy << ", " << ir << ", " 
                             << px << ", " << py << ", " << pr << endl;
                 }
                 //scale off
-				Mat mask;
+				timer.stage("mask lids");
+				Mat& mask = ws.mask;
 				if (!maskFiles.empty()){
 					mask.create(height,width,CV_8UC1);
-					mask_lids(img, mask, px, py, pr, ix, iy, ir);
+					mask_lids(img, mask, px, py, pr, ix, iy, ir, stageThreads);
 					threshold(mask,mask,1,255,CV_THRESH_BINARY_INV);
 				}
+				timer.stage("boundaries");
 				Mat pupilCart (1,outWidth,CV_32FC2);
 				Mat irisCart (1,outWidth,CV_32FC2);
 				Mat cont(1,outWidth,CV_32FC1);
@@ -3028,6 +2804,7 @@ int main(int argc, char *argv[])
 					ix = (int)(ix * (pixelsacrossiris / 200.));
 					iy = (int)(iy * (pixelsacrossiris / 200.));
 				}
+				timer.stage("visualization");
 				if (!segresFiles.empty()){
 					Mat visual;
 					cvtColor(orig,visual,CV_GRAY2BGR);
@@ -3042,12 +2819,14 @@ int main(int argc, char *argv[])
                     circle(visual, Point2f(ix+tc,iy),lt*7/2,Scalar(0,0,255,0),lt);
                     circle(visual, Point2f(ix+tc,iy),max(1,lt/2),Scalar(0,0,255,0),lt);
 					string vsegmentfile;
-					patternFileRename(inFiles,segresFiles,*inFile,vsegmentfile);
+					patternFileRename(inFiles,segresFiles,inFile,vsegmentfile);
 					if (!quiet) printf("Storing segmentation image '%s' ...\n", vsegmentfile.c_str());
 					if (!imwrite(vsegmentfile,visual)) CV_Error(CV_StsError,"Could not save image '" + vsegmentfile + "'");
 				}
 				if (!binmaskFiles.empty()){
-                    Mat bw(height,width,CV_8UC1,Scalar(0));
+                    Mat& bw = ws.bw;
+                    bw.create(height,width,CV_8UC1);
+                    bw.setTo(0);
                     Point iris_points[1][outWidth];
                     float * it = (float *) irisCart.data;
                     for (int i=0; i < outWidth; i++){
@@ -3068,32 +2847,46 @@ int main(int argc, char *argv[])
                         maskAnd(bw,mask,bw);
                     }
                     string binmaskFile;
-                    patternFileRename(inFiles,binmaskFiles,*inFile,binmaskFile);
+                    patternFileRename(inFiles,binmaskFiles,inFile,binmaskFile);
                     if (!quiet) printf("Storing binary mask '%s' ...\n", binmaskFile.c_str());
                     if (!imwrite(binmaskFile,bw)) CV_Error(CV_StsError,"Could not save image '" + binmaskFile + "'");
 				}
+				timer.stage("rubbersheet");
 				if (!quiet) printf("Creating final texture ...\n");
-				Mat out (outHeight,outWidth,CV_8UC1);
-				rubbersheet(img, out, pupilCart, irisCart, INTER_LINEAR);
+				Mat& out = ws.out;
+				out.create(outHeight,outWidth,CV_8UC1);
+				RubbersheetMap& sheet = ws.sheet;
+				rubbersheetMap(pupilCart, irisCart, out.size(), img.size(), sheet);
+				Mat& maskout = ws.maskout;
+				if (!maskFiles.empty()){
+					maskout.create(outHeight,outWidth,CV_8UC1);
+					rubbersheetRemap(img, out, mask, maskout, sheet);
+				}
+				else rubbersheetRemap(img, out, sheet, INTER_LINEAR);
+				timer.stage("clahe");
 				if (enhance){
 					if (!quiet) printf("Enhancing texture ...\n");
 					clahe(out,out,width/8,height/2);
 				}
+				timer.stage("write");
 				if (!maskFiles.empty()){
-					Mat maskout (outHeight,outWidth,CV_8UC1);
-					rubbersheet(mask, maskout, pupilCart, irisCart, INTER_NEAREST);
 					string maskfile;
-					patternFileRename(inFiles,maskFiles,*inFile,maskfile);
+					patternFileRename(inFiles,maskFiles,inFile,maskfile);
 					if (!quiet) printf("Storing mask image '%s' ...\n", maskfile.c_str());
 					if (!imwrite(maskfile,maskout)) CV_Error(CV_StsError,"Could not save image '" + maskfile + "'");
 				}
 				string outfile;
-				patternFileRename(inFiles,outFiles,*inFile,outfile);
+				patternFileRename(inFiles,outFiles,inFile,outfile);
 				if (!quiet) printf("Storing image '%s' ...\n", outfile.c_str());
 				if (!imwrite(outfile,out)) CV_Error(CV_StsError,"Could not save image '" + outfile + "'");
+			};
+			batchProcess(files, jobs, processFile, [&](const string& logLines){
+				if (logFile.is_open()) logFile << logLines;
 				if (time && timing.update()) timing.print();
-			}
+				timing.progress++;
+			});
 			if (time && quiet) timing.clear();
+			profile.summary(quiet);
     	}
     	else if (mode == MODE_HELP){
 			// validate command line
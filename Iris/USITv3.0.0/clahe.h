@@ -0,0 +1,171 @@
+/*
+ * clahe.h
+ *
+ * Contrast-limited adaptive histogram equalization shared by the segmentation
+ * and feature extraction tools (caht, cahtvis, wahet, manuseg, cr)
+ *
+ */
+#ifndef USIT_CLAHE_H
+#define USIT_CLAHE_H
+
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <opencv2/core/core.hpp>
+#include "batch.h"
+
+/*
+ * Inplace histogram clipping according to Zuiderveld (counts excess and redistributes excess by adding the average increment)
+ *
+ * hist: CV_32SC1 1 x 256 histogram matrix
+ * clipFactor: between 0 (maximum slope M/N, where M #pixel in window, N #bins) and 1 (maximum slope M)
+ * pixelCount: number of pixels in window
+ */
+void clipHistogram(cv::Mat& hist, const float clipFactor, const int pixelCount) {
+	double minSlope = ((double) pixelCount) / 256;
+	int clipLimit = std::min(pixelCount, std::max(1, cvCeil(minSlope + clipFactor * (pixelCount - minSlope))));
+	int distributeCount = 0;
+	cv::MatIterator_<int> p = hist.begin<int>();
+	cv::MatIterator_<int> e = hist.end<int>();
+	for (; p!=e; p++){
+		int binsExcess = *p - clipLimit;
+		if (binsExcess > 0) {
+			distributeCount += binsExcess;
+			*p = clipLimit;
+		}
+	}
+	int avgInc = distributeCount / 256;
+	int maxBins = clipLimit - avgInc;
+	for (p = hist.begin<int>(); p!=e; p++){
+		if (*p <= maxBins) {
+			distributeCount -= avgInc;
+			*p += avgInc;
+		}
+		else if (*p < clipLimit) {
+			distributeCount -= (clipLimit - *p);
+			*p = clipLimit;
+		}
+	}
+	while (distributeCount > 0) {
+		for (p = hist.begin<int>(); p!=e && distributeCount > 0; p++){
+			if (*p < clipLimit) {
+				(*p)++;
+				distributeCount--;
+			}
+		}
+	}
+}
+
+/** fractional bits of the bilinear weights of clahe **/
+static const int CLAHE_BITS = 11;
+
+/*
+ * Computes for each position along one image axis the pair of clahe cells interpolated at this position
+ * and the weight of the second one. Positions follow the original painting order of the cells: half a
+ * cell with the first cell only, one band between each pair of neighbouring cell centers (shortened at
+ * the image border) and the rest of the last cell (only if necessary). Positions not covered by any of
+ * these regions are left unpainted.
+ *
+ * size: length of the image axis
+ * cellSize: cell size along this axis
+ * gridSize: number of cells along this axis
+ * first: index of the first cell (multiplied by step)
+ * second: index of the second cell (multiplied by step)
+ * weight: weight of the second cell in CLAHE_BITS fixed-point precision
+ * step: factor for cell indices
+ * returns: number of painted positions (always starting at 0)
+ */
+int claheAxis(const int size, const int cellSize, const int gridSize, std::vector<int>& first, std::vector<int>& second, std::vector<int>& weight, const int step = 1){
+	first.assign(size, (gridSize - 1) * step);
+	second.assign(size, (gridSize - 1) * step);
+	weight.assign(size, 0);
+	int painted = std::min(cellSize / 2, std::min(cellSize, size));
+	for (int i = 0; i < painted; i++){
+		first[i] = 0;
+		second[i] = 0;
+	}
+	for (int k = 1; k < gridSize; k++){
+		int start = (k - 1) * cellSize + cellSize / 2;
+		int band = std::min(cellSize, size - k * cellSize + cellSize / 2);
+		for (int a = 0; a < band; a++){
+			first[start + a] = (k - 1) * step;
+			second[start + a] = k * step;
+			weight[start + a] = (a * (1 << CLAHE_BITS) + band / 2) / band;
+		}
+		painted = start + band;
+	}
+	if (size % cellSize > cellSize / 2 || size % cellSize == 0) painted = size;
+	return painted;
+}
+
+/*
+ * Contrast-limited adaptive histogram equalization (supports in-place)
+ * Computes the equalization lookup tables of all cells first (one row of cells per task), then maps each
+ * pixel by bilinear interpolation of the tables of its surrounding cells (one image row per task).
+ *
+ * src: CV_8UC1 image
+ * dst: CV_8UC1 image (in-place operation is possible)
+ * _cellWidth: patch size in x direction (greater or equal to 2)
+ * _cellHeight: patch size in y direction (greater or equal to 2)
+ * clipFactor: histogram clip factor between 0 and 1
+ * threads: number of worker threads (0 = choose by image size)
+ */
+void clahe(const cv::Mat& src, cv::Mat& dst, const int _cellWidth = 10, const int _cellHeight = 10, const float clipFactor = 1., int threads = 0){
+    if( src.rows <=0 || src.cols<=0) return;
+    int cellWidth = std::max(2,_cellWidth);
+    int cellHeight = std::max(2,_cellHeight);
+	int height = src.rows;
+	int width = src.cols;
+	int gridWidth = width / cellWidth + (width % cellWidth == 0 ? 0 : 1);
+	int gridHeight = height / cellHeight + (height % cellHeight == 0 ? 0 : 1);
+	if (threads <= 0) threads = std::min(std::max(1, (int)std::thread::hardware_concurrency()), std::max(1, width * height / (1 << 18)));
+	// equalization lookup tables of all cells, row by row
+	std::vector<uchar> luts(gridWidth * gridHeight * 256);
+	parallelFor(gridHeight, threads, [&](int y){
+		int cY = y * cellHeight;
+		int cHeight = std::min(cellHeight, height - cY);
+		std::vector<int> hists(gridWidth * 256, 0);
+		for (int b = cY; b < cY + cHeight; b++){
+			const uchar * sp = src.ptr<uchar>(b);
+			int * hist = &hists[0];
+			for (int cX = 0; cX < width; cX += cellWidth, hist += 256){
+				int cWidth = std::min(cellWidth, width - cX);
+				for (int a = cX; a < cX + cWidth; a++) hist[sp[a]]++;
+			}
+		}
+		for (int x = 0; x < gridWidth; x++){
+			int pixelCount = std::min(cellWidth, width - x * cellWidth) * cHeight;
+			cv::Mat hist(1, 256, CV_32SC1, &hists[x * 256]);
+			if (clipFactor < 1) clipHistogram(hist, clipFactor, pixelCount);
+			uchar * lut = &luts[(y * gridWidth + x) * 256];
+			double sum = 0;
+			for (int i = 0; i < 256; i++){
+				sum += hists[x * 256 + i];
+				lut[i] = cv::saturate_cast<uchar>(sum * 255 / pixelCount);
+			}
+		}
+	});
+	// interpolation of the lookup tables of the surrounding cells
+	std::vector<int> colFirst, colSecond, colWeight, rowFirst, rowSecond, rowWeight;
+	int paintedWidth = claheAxis(width, cellWidth, gridWidth, colFirst, colSecond, colWeight, 256);
+	int paintedHeight = claheAxis(height, cellHeight, gridHeight, rowFirst, rowSecond, rowWeight, gridWidth * 256);
+	const int one = 1 << CLAHE_BITS;
+	const int half = 1 << (2 * CLAHE_BITS - 1);
+	parallelFor(paintedHeight, threads, [&](int y){
+		const uchar * sp = src.ptr<uchar>(y);
+		uchar * dp = dst.ptr<uchar>(y);
+		const uchar * upper = &luts[rowFirst[y]];
+		const uchar * lower = &luts[rowSecond[y]];
+		int wy = rowWeight[y], wy0 = one - wy;
+		for (int x = 0; x < paintedWidth; x++){
+			int v = sp[x];
+			int c0 = colFirst[x] + v, c1 = colSecond[x] + v;
+			int wx = colWeight[x], wx0 = one - wx;
+			int top = wx0 * upper[c0] + wx * upper[c1];
+			int bottom = wx0 * lower[c0] + wx * lower[c1];
+			dp[x] = (uchar)((wy0 * top + wy * bottom + half) >> (2 * CLAHE_BITS));
+		}
+	});
+}
+
+#endif //USIT_CLAHE_H
@@ -7,6 +7,7 @@
  *
  */
 #include "version.h"
+#include "clahe.h"
 #include <cstdio>
 #include <map>
 #include <vector>
@@ -14,6 +15,7 @@
 #include <cstring>
 #include <ctime>
 #include <fstream>
+#include <thread>
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -304,341 +306,6 @@ void hist2u(const Mat &src, Mat &histogram) {
   }
 }
 
-/** ------------------------------- Clahe ------------------------------- **/
-
-/*
- * Retrieves the (bilinear) interpolated byte from 4 bytes
- *
- * x: distance to left byte
- * y: distance to right byte
- * r: distance to upper byte
- * s: distance to lower byte
- * b1: upper left byte
- * b2: upper right byte
- * b3: lower left byte
- * b4: lower right byte
- */
-uchar interp(const double x, const double y, const double r, const double s,
-             const uchar b1, const uchar b2, const uchar b3, const uchar b4) {
-  double w1 = (x + y);
-  double w2 = x / w1;
-  w1 = y / w1;
-  double w3 = (r + s);
-  double w4 = r / w3;
-  w3 = s / w3;
-  return saturate_cast<uchar>(w3 * (w1 * b1 + w2 * b2) +
-                              w4 * (w1 * b3 + w2 * b4));
-}
-
-/*
- * Retrieves the bilinear interpolated byte from 2 bytes
- *
- * x:  distance to left byte
- * y:  distance to right byte
- * b1: left byte
- * b2: right byte
- */
-uchar interp(const double x, const double y, const uchar b1, const uchar b2) {
-  double w1 = (x + y);
-  double w2 = x / w1;
-  w1 = y / w1;
-  return saturate_cast<uchar>(w1 * b1 + w2 * b2);
-}
-
-/*
- * Inplace histogram clipping according to Zuiderveld (counts excess and
- *redistributes excess by adding the average increment)
- *
- * hist: CV_32SC1 1 x 256 histogram matrix
- * clipFactor: between 0 (maximum slope M/N, where M #pixel in window, N #bins)
- *and 1 (maximum slope M)
- * pixelCount: number of pixels in window
- */
-void clipHistogram(Mat &hist, const float clipFactor, const int pixelCount) {
-  double minSlope = ((double)pixelCount) / 256;
-  int clipLimit = std::min(
-      pixelCount,
-      std::max(1, cvCeil(minSlope + clipFactor * (pixelCount - minSlope))));
-  int distributeCount = 0;
-  MatIterator_<int> p = hist.begin<int>();
-  MatIterator_<int> e = hist.end<int>();
-  for (; p != e; p++) {
-    int binsExcess = *p - clipLimit;
-    if (binsExcess > 0) {
-      distributeCount += binsExcess;
-      *p = clipLimit;
-    }
-  }
-  int avgInc = distributeCount / 256;
-  int maxBins = clipLimit - avgInc;
-  for (p = hist.begin<int>(); p != e; p++) {
-    if (*p <= maxBins) {
-      distributeCount -= avgInc;
-      *p += avgInc;
-    } else if (*p < clipLimit) {
-      distributeCount -= (clipLimit - *p);
-      *p = clipLimit;
-    }
-  }
-  while (distributeCount > 0) {
-    for (p = hist.begin<int>(); p != e && distributeCount > 0; p++) {
-      if (*p < clipLimit) {
-        (*p)++;
-        distributeCount--;
-      }
-    }
-  }
-}
-
-/*
- * Contrast-limited adaptive histogram equalization (supports in-place)
- *
- * src: CV_8UC1 image
- * dst: CV_8UC1 image (in-place operation is possible)
- * cellWidth: patch size in x direction (greater or equal to 2)
- * cellHeight: patch size in y direction (greater or equal to 2)
- * clipFactor: histogram clip factor between 0 and 1
- */
-
-void clahe(const Mat &src, Mat &dst, const int cellWidth = 10,
-           const int cellHeight = 10, const float clipFactor = 1.) {
-  Mat hist(1, 256, CV_32SC1);
-  Mat roi;
-  uchar *sp, *dp;
-  int height = src.rows;
-  int width = src.cols;
-  int gridWidth = width / cellWidth + (width % cellWidth == 0 ? 0 : 1);
-  int gridHeight = height / cellHeight + (height % cellHeight == 0 ? 0 : 1);
-  int bufSize = (gridWidth + 2) * 256;
-  int bufOffsetLeft = bufSize - 256;
-  int bufOffsetTop = bufSize - gridWidth * 256;
-  int bufOffsetTopLeft = bufSize - (gridWidth + 1) * 256;
-  Mat buf(1, bufSize, CV_8UC1);
-  MatIterator_<uchar> pbuf = buf.begin<uchar>(), ebuf = buf.end<uchar>();
-  MatIterator_<int> phist, ehist = hist.end<int>();
-  uchar *curr, *topleft, *top, *left;
-  int pixelCount, cX, cY, cWidth, cHeight, cellOrigin, cellOffset;
-  double sum;
-  // process first row, first cell
-  cX = 0;
-  cY = 0;
-  cWidth = min(cellWidth, width);
-  cHeight = min(cellHeight, height);
-  pixelCount = cWidth * cHeight;
-  sum = 0;
-  roi = Mat(src, Rect(cX, cY, cWidth, cHeight));
-  hist2u(roi, hist);
-  if (clipFactor < 1) clipHistogram(hist, clipFactor, pixelCount);
-  // equalization
-  for (phist = hist.begin<int>(); phist != ehist; phist++, pbuf++) {
-    sum += *phist;
-    *pbuf = saturate_cast<uchar>(sum * 255 / pixelCount);
-  }
-  // paint first corner cell
-  cWidth = min(cellWidth / 2, cWidth);
-  cHeight = min(cellHeight / 2, cHeight);
-  cellOrigin = src.step * cY + cX;
-  cellOffset = src.step - cWidth;
-  sp = (uchar *)(src.data + cellOrigin);
-  dp = (uchar *)(dst.data + cellOrigin);
-  curr = buf.data;
-  for (int b = 0; b < cHeight; b++, sp += cellOffset, dp += cellOffset) {
-    for (int a = 0; a < cWidth; a++, sp++, dp++) {
-      *dp = curr[*sp];
-    }
-  }
-  // process first row, other cells
-  for (int x = 1; x < gridWidth; x++) {
-    cX = x * cellWidth;
-    cWidth = min(cellWidth, width - x * cellWidth);
-    cHeight = min(cellHeight, height);
-    pixelCount = cWidth * cHeight;
-    sum = 0;
-    roi.release();
-    roi = Mat(src, Rect(cX, cY, cWidth, cHeight));
-    hist2u(roi, hist);
-    if (clipFactor < 1) clipHistogram(hist, clipFactor, pixelCount);
-    // equalization
-    for (phist = hist.begin<int>(); phist != ehist; phist++, pbuf++) {
-      sum += *phist;
-      *pbuf = saturate_cast<uchar>(sum * 255 / pixelCount);
-    }
-    // paint first row, other cells
-    cX += cellWidth / 2 - cellWidth;
-    cWidth = min(cellWidth, width - x * cellWidth + cellWidth / 2);
-    cHeight = min(cellHeight / 2, height);
-    cellOrigin = src.step * cY + cX;
-    cellOffset = src.step - cWidth;
-    sp = (uchar *)(src.data + cellOrigin);
-    dp = (uchar *)(dst.data + cellOrigin);
-    curr = buf.data + (curr - buf.data + 256) % bufSize;
-    left = buf.data + (curr - buf.data + bufOffsetLeft) % bufSize;
-    for (int b = 0; b < cHeight; b++, sp += cellOffset, dp += cellOffset) {
-      for (int a = 0; a < cWidth; a++, sp++, dp++) {
-        *dp = interp(a, cWidth - a, left[*sp], curr[*sp]);
-      }
-    }
-  }
-  // process (i.e. paint) first row, last cell (only if necessary)
-  if (width % cellWidth > cellWidth / 2 || width % cellWidth == 0) {
-    cWidth = (width - cellWidth / 2) % cellWidth;
-    cHeight = min(cellHeight / 2, height);
-    cX = width - cWidth;
-    cellOrigin = src.step * cY + cX;
-    cellOffset = src.step - cWidth;
-    sp = (uchar *)(src.data + cellOrigin);
-    dp = (uchar *)(dst.data + cellOrigin);
-    for (int b = 0; b < cHeight; b++, sp += cellOffset, dp += cellOffset) {
-      for (int a = 0; a < cWidth; a++, sp++, dp++) {
-        *dp = curr[*sp];
-      }
-    }
-  }
-  // process rest of rows
-  for (int y = 1; y < gridHeight; y++) {
-    // process other rows, first cell
-    cX = 0;
-    cY = y * cellHeight;
-    cWidth = min(cellWidth, width);
-    cHeight = min(cellHeight, height - y * cellHeight);
-    pixelCount = cWidth * cHeight;
-    sum = 0;
-    roi.release();
-    roi = Mat(src, Rect(cX, cY, cWidth, cHeight));
-    hist2u(roi, hist);
-    if (clipFactor < 1) clipHistogram(hist, clipFactor, pixelCount);
-    // equalization
-    if (pbuf == ebuf) pbuf = buf.begin<uchar>();
-    for (phist = hist.begin<int>(); phist != ehist; phist++, pbuf++) {
-      sum += *phist;
-      *pbuf = saturate_cast<uchar>(sum * 255 / pixelCount);
-    }
-    // paint other rows, first cell
-    cY += cellHeight / 2 - cellHeight;
-    cWidth = min(cellWidth / 2, width);
-    cHeight = min(cellHeight, height - y * cellHeight + cellHeight / 2);
-    cellOrigin = src.step * cY + cX;
-    cellOffset = src.step - cWidth;
-    sp = (uchar *)(src.data + cellOrigin);
-    dp = (uchar *)(dst.data + cellOrigin);
-    curr = buf.data + (curr - buf.data + 256) % bufSize;
-    top = buf.data + (curr - buf.data + bufOffsetTop) % bufSize;
-    for (int b = 0; b < cHeight; b++, sp += cellOffset, dp += cellOffset) {
-      for (int a = 0; a < cWidth; a++, sp++, dp++) {
-        *dp = interp(b, cHeight - b, top[*sp], curr[*sp]);
-      }
-    }
-    // process other rows, rest of cells
-    for (int x = 1; x < gridWidth; x++) {
-      cX = x * cellWidth;
-      cY = y * cellHeight;
-      cWidth = min(cellWidth, width - x * cellWidth);
-      cHeight = min(cellHeight, height - y * cellHeight);
-      pixelCount = cWidth * cHeight;
-      sum = 0;
-      roi.release();
-      roi = Mat(src, Rect(cX, cY, cWidth, cHeight));
-      hist2u(roi, hist);
-      if (clipFactor < 1) clipHistogram(hist, clipFactor, pixelCount);
-      // equalization
-      if (pbuf == ebuf) pbuf = buf.begin<uchar>();
-      for (phist = hist.begin<int>(); phist != ehist; phist++, pbuf++) {
-        sum += *phist;
-        *pbuf = saturate_cast<uchar>(sum * 255 / pixelCount);
-      }
-      // paint other rows, rest of cells
-      cX += cellWidth / 2 - cellWidth;
-      cY += cellHeight / 2 - cellHeight;
-      cWidth = min(cellWidth, width - x * cellWidth + cellWidth / 2);
-      cHeight = min(cellHeight, height - y * cellHeight + cellHeight / 2);
-      cellOrigin = src.step * cY + cX;
-      cellOffset = src.step - cWidth;
-      sp = (uchar *)(src.data + cellOrigin);
-      dp = (uchar *)(dst.data + cellOrigin);
-      curr = buf.data + (curr - buf.data + 256) % bufSize;
-      top = buf.data + (curr - buf.data + bufOffsetTop) % bufSize;
-      topleft = buf.data + (curr - buf.data + bufOffsetTopLeft) % bufSize;
-      left = buf.data + (curr - buf.data + bufOffsetLeft) % bufSize;
-      for (int b = 0; b < cHeight; b++, sp += cellOffset, dp += cellOffset) {
-        for (int a = 0; a < cWidth; a++, sp++, dp++) {
-          *dp = interp(a, cWidth - a, b, cHeight - b, topleft[*sp], top[*sp],
-                       left[*sp], curr[*sp]);
-        }
-      }
-    }
-    // process (i.e. paint) other rows, last cell (only if necessary)
-    if (width % cellWidth > cellWidth / 2 || width % cellWidth == 0) {
-      cWidth = (width - cellWidth / 2) % cellWidth;
-      cHeight = min(cellHeight, height - y * cellHeight + cellHeight / 2);
-      cX = width - cWidth;
-      cellOrigin = src.step * cY + cX;
-      cellOffset = src.step - cWidth;
-      sp = (uchar *)(src.data + cellOrigin);
-      dp = (uchar *)(dst.data + cellOrigin);
-      top = buf.data + (curr - buf.data + bufOffsetTop) % bufSize;
-      for (int b = 0; b < cHeight; b++, sp += cellOffset, dp += cellOffset) {
-        for (int a = 0; a < cWidth; a++, sp++, dp++) {
-          *dp = interp(b, cHeight - b, top[*sp], curr[*sp]);
-        }
-      }
-    }
-  }
-  // process (i.e. paint) last row (only if necessary)
-  if (height % cellHeight > cellHeight / 2 || height % cellHeight == 0) {
-    // paint last row, first cell
-    cWidth = min(cellWidth / 2, width);
-    cHeight = (height - cellHeight / 2) % cellHeight;
-    cX = 0;
-    cY = height - cHeight;
-    cellOrigin = src.step * cY + cX;
-    cellOffset = src.step - cWidth;
-    sp = (uchar *)(src.data + cellOrigin);
-    dp = (uchar *)(dst.data + cellOrigin);
-    curr = buf.data + (curr - buf.data + bufOffsetTop + 256) % bufSize;
-    for (int b = 0; b < cHeight; b++, sp += cellOffset, dp += cellOffset) {
-      for (int a = 0; a < cWidth; a++, sp++, dp++) {
-        *dp = curr[*sp];
-      }
-    }
-    // paint last row, other cells
-    for (int x = 1; x < gridWidth; x++) {
-      cX = (x - 1) * cellWidth + cellWidth / 2;
-      cWidth = min(cellWidth, width - x * cellWidth + cellWidth / 2);
-      cHeight = (height - cellHeight / 2) % cellHeight;
-      cellOrigin = src.step * cY + cX;
-      cellOffset = src.step - cWidth;
-      sp = (uchar *)(src.data + cellOrigin);
-      dp = (uchar *)(dst.data + cellOrigin);
-      left = curr;
-      curr = buf.data + (curr - buf.data + 256) % bufSize;
-      for (int b = 0; b < cHeight; b++, sp += cellOffset, dp += cellOffset) {
-        for (int a = 0; a < cWidth; a++, sp++, dp++) {
-          *dp = interp(a, cWidth - a, left[*sp], curr[*sp]);
-        }
-      }
-    }
-    // paint last row, last cell (only if necessary)
-    if (width % cellWidth > cellWidth / 2 || width % cellWidth == 0) {
-      cWidth = (width - cellWidth / 2) % cellWidth;
-      cHeight = (height - cellHeight / 2) % cellHeight;
-      cX = width - cWidth;
-      cellOrigin = src.step * cY + cX;
-      cellOffset = src.step - cWidth;
-      sp = (uchar *)(src.data + cellOrigin);
-      dp = (uchar *)(dst.data + cellOrigin);
-      for (int b = 0; b < cHeight; b++, sp += cellOffset, dp += cellOffset) {
-        for (int a = 0; a < cWidth; a++, sp++, dp++) {
-          *dp = curr[*sp];
-        }
-      }
-    }
-  }
-}
-  
-
-
-
-
 /** ------------------------------- commandline functions ------------------------------- **/
 
 /**
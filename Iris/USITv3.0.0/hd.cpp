@@ -15,12 +15,16 @@
 #include <algorithm>
 #include <fstream>
 #include <tuple>
+#include <cstddef>
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <boost/regex.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
 
 using namespace std;
 using namespace cv;
@@ -69,6 +73,11 @@ void printUsage() {
 	printf("| -n   | from to    | 1 | Y | starting (0) and ending bit (MAX)               |\n");
 	printf("| -o   | outfile    | 1 | Y | target text                                     |\n");
 	printf("| -owp |            | 1 | Y | write full paths in outfile instead of file only|\n");
+	printf("|-scorecache db     | 1 | Y | persistent score cache keyed by the contents of |\n");
+	printf("|      |            |   |   | both codes/masks and the comparison parameters, |\n");
+	printf("|      |            |   |   | cached pairs are not recomputed, new ones added |\n");
+	printf("|-profile file      | 1 | Y | binary file with the HD at every shift of each  |\n");
+	printf("|      |            |   |   | comparison (see readme), -a does not matter     |\n");
 	printf("| -q   |            | 1 | Y | quiet mode on (off)                             |\n");
 	printf("| -t   |            | 1 | Y | time progress on (off)                          |\n");
 	printf("| -#   |            | 1 | N | use memoization if memory is not a concern.     |\n");
@@ -80,6 +89,16 @@ void printUsage() {
 	printf("| -sf  |            | 1 | N | Skip failures during comparison with masks, that|\n");
 	printf("|      |            |   |   | is comparisons where no bits are unmasked.      |\n");
 	printf("| -sfl | filename   | 1 | N | Log failures (with -sf) to filename.            |\n");
+	printf("|-shard| k/K        | 1 | Y | only execute the k-th of K (1 <= k <= K) equally|\n");
+	printf("|      |            |   |   | sized blocks of comparisons (1/1), outfiles of  |\n");
+	printf("|      |            |   |   | all shards concatenated yield the full outfile  |\n");
+	printf("| -sym |            | 1 | N | symmetric mode: infile1 and infile2 refer to the|\n");
+	printf("|      |            |   |   | same codes, only a < b is computed and mirrored |\n");
+	printf("|      |            |   |   | (no self-comparisons, requires min = -max), the |\n");
+	printf("|      |            |   |   | mirrored line b a directly follows a b, so lines|\n");
+	printf("|      |            |   |   | are not in the order of a run without -sym      |\n");
+	printf("|-symbin file       | 1 | Y | with -sym: binary file with the scores of the   |\n");
+	printf("|      |            |   |   | pairs a < b only, not mirrored (see readme)     |\n");
 	printf("| -h   |            | 2 | N | prints usage                                    |\n");
 	printf("+------+------------+---+---+-------------------------------------------------+\n");
 	printf("|                                                                             |\n");
@@ -88,6 +107,9 @@ void printUsage() {
     printf("| -i s1.png s2.png -m s1_mask.png s2_mask.png -o compare.txt                  |\n");
     printf("| -i *.png *.png -s -7 7 -o compare.txt -q -t                                 |\n");
     printf("| -i *.png *.png -a ssf -s ?1_shifted_*.png -7 7 -o compare.txt -q -t         |\n");
+    printf("| -i *.png *.png -s -7 7 -shard 2/4 -o compare2.txt -q                        |\n");
+    printf("| -i *.png *.png -s -7 7 -sym -o compare.txt -q                               |\n");
+    printf("| -i *.png *.png -s -7 7 -sym -symbin compare.bin -q                          |\n");
     printf("|                                                                             |\n");
 	printf("| AUTHOR                                                                      |\n");
 	printf("|                                                                             |\n");
@@ -100,421 +122,562 @@ void printUsage() {
 }
 
 /**
- * Fast hamming distance estimation
+ * Masked hamming distance of a shifted iris code. Shifting of code and mask, intersection
+ * of the masks and counting of differing and unmasked bits are fused into one pass.
  * a: sample iris code
  * b: reference iris code
- * start8: starting 8-bit block
- * stop8: ending 8-bit block
+ * start8: starting 8-bit block (inclusive)
+ * stop8: ending 8-bit block (exclusive)
+ * shifts: shift count of the sample (positive values indicate left shifts)
+ * aMask: mask for sample iris code (may be empty)
+ * bMask: mask for reference iris code (may be empty)
+ * bits: receives the number of unmasked bits
+ * returns: number of differing unmasked bits
  */
-unsigned int hd(const Mat a, const Mat b, const unsigned int start8, const unsigned int stop8, const Mat mask = Mat()){
+unsigned int shiftedHD(const Mat& a, const Mat& b, const unsigned int start8, const unsigned int stop8, const int shifts, const Mat& aMask, const Mat& bMask, unsigned int& bits){
+	CV_Assert(a.isContinuous() && b.isContinuous());
+	unsigned int size = a.rows * a.cols; // size in bytes
+	unsigned int offset, lshift, rshift;
+	if (shifts >= 0){ // left shift
+		offset = (shifts / 8) % size;
+		lshift = shifts % 8;
+		rshift = 8 - lshift;
+	}
+	else { // right shift
+		offset = (size - ((-shifts) / 8) % size - 1) % size;
+		rshift = (-shifts) % 8;
+		lshift = 8 - rshift;
+	}
+	const uchar * pa = a.data;
+	const uchar * pb = b.data;
+	unsigned int j = (offset + start8) % size;
 	unsigned int dist = 0;
-	MatConstIterator_<uchar> pa = a.begin<uchar>();
-	MatConstIterator_<uchar> pb = b.begin<uchar>();
-	MatConstIterator_<uchar> enda = pa + stop8;
-	pa += start8;
-	pb += start8;
-	if (!mask.empty()){
-		MatConstIterator_<uchar> pm = mask.begin<uchar>();
-		//unsigned int * pm = (unsigned int*) mask.data;
-		pm += start8;
-		for (;pa<enda; pa++, pb++, pm++){
-			dist += htlut[(*pa ^*pb) & *pm];
-
-			/*unsigned int val = (*pa ^*pb) & *pm;
-			while(val)
-			{
-				++dist;
-				val &= val - 1;
-			}*/
+	if (!aMask.empty() && !bMask.empty()){
+		CV_Assert(aMask.isContinuous() && bMask.isContinuous());
+		const uchar * paMask = aMask.data;
+		const uchar * pbMask = bMask.data;
+		bits = 0;
+		for (unsigned int i=start8; i<stop8; i++){
+			unsigned int k = (j + 1 == size) ? 0 : j + 1;
+			uchar mask = ((uchar)((paMask[j] << lshift) | (paMask[k] >> rshift))) & pbMask[i];
+			uchar code = (uchar)((pa[j] << lshift) | (pa[k] >> rshift));
+			dist += htlut[(code ^ pb[i]) & mask];
+			bits += htlut[mask];
+			j = k;
 		}
 	}
 	else {
-		for (;pa<enda; pa++, pb++){
-			//unsigned int val = *pa ^*pb;
-			dist += htlut[*pa ^*pb];
-			/*
-			while(val)
-			{
-				++dist;
-				val &= val - 1;
-			}*/
+		for (unsigned int i=start8; i<stop8; i++){
+			unsigned int k = (j + 1 == size) ? 0 : j + 1;
+			uchar code = (uchar)((pa[j] << lshift) | (pa[k] >> rshift));
+			dist += htlut[code ^ pb[i]];
+			j = k;
 		}
+		bits = 8*(stop8-start8);
 	}
 	return dist;
-
 }
 
 /**
- * Shifts source by a given shift count
- * src: source iris code
- * dst: destination (shifted) iris code
- * shifts: shift count (positive values indicate left shifts)
+ * Fractional hamming distances of a comparison at all shifts
  */
-void shift(const Mat src, Mat dst, const int shifts){
-	int size = src.cols*src.rows; // size in bytes
-	MatConstIterator_<uchar> psrc = src.begin<uchar>();
-	MatConstIterator_<uchar> endsrc = src.end<uchar>();
-	MatIterator_<uchar> pdst = dst.begin<uchar>();
-	MatIterator_<uchar> enddst = dst.end<uchar>();
-
-	if (shifts >= 0){ // left shift
-		unsigned int offset = shifts / 8;
-		psrc += offset;
-		unsigned int shiftCount = shifts % 8;
-		unsigned int ishiftCount = 8 - shiftCount;
-		for (;pdst<enddst; pdst++){
-			*pdst = (*psrc << shiftCount);
-			psrc++;
-			if (psrc == endsrc) psrc = src.begin<uchar>();
-			*pdst |= (*psrc >> (ishiftCount));
-		}
-	}
-	else { // right shift
-		unsigned int offset = (-shifts) / 8;
-		offset = (size-offset-1) % size;
-		psrc += offset;
-		unsigned int shiftCount = (-shifts) % 8;
-		unsigned int ishiftCount = 8 - shiftCount;
-		for (;pdst<enddst; pdst++){
-			*pdst = (*psrc << ishiftCount);
-			psrc++;
-			if (psrc == endsrc) psrc = src.begin<uchar>();
-			*pdst |= (*psrc >> (shiftCount));
-		}
-	}
-}
+struct ShiftProfile {
+	vector<double> hds; // fractional HD at each shift (0 if no bits are unmasked)
+	int firstShift; // shift of the first HD, consecutive HDs refer to consecutive shifts
+	bool valid; // at least one shift had unmasked bits
+	double minHD; // minimum HD (1 if no HD is below 1)
+	int minShift; // first shift with minimum HD (only if hasMin)
+	int lastMinShift; // last shift with minimum HD (only if hasMin)
+	bool hasMin;
+	double maxHD; // maximum HD (0 if no HD is above 0)
+	int maxShift; // first shift with maximum HD (only if hasMax)
+	int lastMaxShift; // last shift with maximum HD (only if hasMax)
+	bool hasMax;
+};
 
 /**
- * Shifts matrix a by a given shift count and intersects result with b
- * a: sample source iris mask
- * b: reference source iris mask
- * dst: destination (shifted) iris mask
- * shifts: shift count (positive values indicate left shifts)
+ * Determines minimum and maximum of a shift profile
+ * profile: shift profile with HDs
  */
-void intersectShifted(const Mat a, const Mat b, Mat dst, const int shifts){
-	uchar * pb = b.data;
-	uchar * pa = a.data;
-	uchar * pdst = dst.data;
-	unsigned int size = dst.cols;
-	unsigned int offset;
-	if (shifts >= 0){ // left shift
-		offset = shifts / 8;
-		uchar * enddst = pdst + dst.cols;
-		unsigned int shiftCount = shifts % 8;
-		unsigned int ishiftCount = 8 - shiftCount;
-		offset = (size + offset) % size;
-		for (;pdst<enddst; pdst++, pb++){
-			*pdst = (pa[offset] << shiftCount);
-			offset = ((offset+1)%size);
-			*pdst |= (pa[offset] >> (ishiftCount));
-			*pdst &= *pb;
+void summarizeProfile(ShiftProfile& profile){
+	profile.minHD = 1;
+	profile.maxHD = 0;
+	profile.hasMin = false;
+	profile.hasMax = false;
+	for (unsigned int i=0; i<profile.hds.size(); i++){
+		double hamdist = profile.hds[i];
+		int ss = profile.firstShift + i;
+		if (hamdist < profile.minHD){
+			profile.minHD = hamdist;
+			profile.minShift = ss;
+			profile.hasMin = true;
 		}
-	}
-	else { // right shift
-		offset = (-shifts) / 8;
-		uchar * enddst = pdst + dst.cols;
-		unsigned int shiftCount = (-shifts) % 8;
-		unsigned int ishiftCount = 8 - shiftCount;
-		offset = (size-offset-1) % size;
-		for (;pdst<enddst; pdst++, pb++){
-			*pdst = (pa[offset] << ishiftCount);
-			offset = ((offset+1)%size);
-			*pdst |= (pa[offset] >> (shiftCount));
-			*pdst &= *pb;
+		if (profile.hasMin && hamdist == profile.minHD) profile.lastMinShift = ss;
+		if (hamdist > profile.maxHD){
+			profile.maxHD = hamdist;
+			profile.maxShift = ss;
+			profile.hasMax = true;
 		}
+		if (profile.hasMax && hamdist == profile.maxHD) profile.lastMaxShift = ss;
 	}
 }
 
 /**
- * determines the best fractional Hamming Distance of two iris codes
+ * determines the fractional Hamming Distances of two iris codes at all shifts
  * a: first iris code
  * b: second iris code
  * start8: starting 8-bit block (inclusive)
  * stop8: ending 8-bit block (exclusive)
- * shifts: number of shifts
+ * minShifts: minimum number of shifts
+ * maxShifts: maximum number of shifts
+ * shiftStep: number of bits per shift
  * aMask: mask for first iris code
  * bMask: mask for second iris code
+ * profile: receives the HDs and their summary
  */
-std::tuple<double, int, bool> minHD(const Mat& a, const Mat& b, const unsigned int start8, const unsigned int stop8, const int minShifts, const int maxShifts,const int shiftStep, const Mat aMask, const Mat bMask = Mat()){
-    std::tuple<double, int, bool> result = std::make_tuple(1,0,false);
-	if (!aMask.empty() && !bMask.empty()){
-		Mat mask(b.rows,b.cols,CV_8UC1);
-		Mat zero(b.rows,b.cols,CV_8UC1);
-		zero.setTo(Scalar(0));
-		double hamdist = 1;
-		Mat imgSmplShifted(a.rows,a.cols,CV_8UC1);
-		for (int ss=minShifts; ss<=maxShifts; ss++){
-            int s = ss*shiftStep;
-			shift(a,imgSmplShifted,s);
-			intersectShifted(aMask,bMask,mask,s);
-			int codeLengthBits = hd(mask, zero, start8, stop8);
-            if( codeLengthBits > 0) std::get<2>(result) = true;
-			double shiftedHamdist = (codeLengthBits == 0) ? 0 : ((double)hd(imgSmplShifted,b,start8,stop8,mask)) / codeLengthBits;
-			if (shiftedHamdist < hamdist){
-                hamdist = shiftedHamdist;
-                std::get<1>(result) = ss;
-            }
-		}
-		std::get<0>(result) = hamdist;
+void profileHD(const Mat& a, const Mat& b, const unsigned int start8, const unsigned int stop8, const int minShifts, const int maxShifts, const int shiftStep, const Mat aMask, const Mat bMask, ShiftProfile& profile){
+	profile.hds.resize(maxShifts - minShifts + 1);
+	profile.firstShift = minShifts;
+	profile.valid = false;
+	for (int ss=minShifts; ss<=maxShifts; ss++){
+		unsigned int codeLengthBits = 0;
+		unsigned int hamdist = shiftedHD(a,b,start8,stop8,ss*shiftStep,aMask,bMask,codeLengthBits);
+		if (codeLengthBits > 0) profile.valid = true;
+		profile.hds[ss - minShifts] = (codeLengthBits == 0) ? 0 : ((double)hamdist) / codeLengthBits;
 	}
-	else {
-		int codeLengthBits = 8*(stop8-start8);
-		unsigned int hamdist = codeLengthBits;
-		Mat imgSmplShifted(a.rows,a.cols,CV_8UC1);
-		for (int ss=minShifts; ss<=maxShifts; ss++){
-            int s = ss*shiftStep;
-			shift(a,imgSmplShifted,s);
-			unsigned int shiftedHamdist = hd(imgSmplShifted,b,start8,stop8);
-			if (shiftedHamdist < hamdist){
-                hamdist = shiftedHamdist;
-                std::get<1>(result) = ss;
-            }
-		}
-		std::get<0>(result) = (((double)hamdist) / (codeLengthBits));
-	}
-	return result;
+	summarizeProfile(profile);
 }
 
 /**
- * determines the best fractional Hamming Distance of an iris code with a list of shifted versions of this code
+ * determines the fractional Hamming Distances of an iris code with a list of shifted versions of this code
  * a: shifted versions of first iris code
  * b: second iris code
  * start8: starting 8-bit block (inclusive)
  * stop8: ending 8-bit block (exclusive)
  * aMask: masks for corresponding shifted versions of first iris code
  * bMask: mask for second iris code
+ * profile: receives the HDs (indexed by shifted version) and their summary
  */
-std::tuple<double, int, bool> minHD(const vector<Mat>& a, const Mat& b, const unsigned int start8, const unsigned int stop8, const vector<Mat>& aMask, const Mat bMask = Mat()){
-    std::tuple<double, int, bool> result = std::make_tuple(1,0,false);
-	if (!aMask.empty() && !bMask.empty()){
-		CV_Assert(aMask.size() == a.size());
-		Mat mask(b.rows,b.cols,CV_8UC1);
-		Mat zero(b.rows,b.cols,CV_8UC1);
-		zero.setTo(Scalar(0));
-		double hamdist = 1;
-		for (unsigned int i=0; i<a.size();i++){
-			intersectShifted(aMask[i],bMask,mask,0);
-			int codeLengthBits = hd(mask, zero, start8, stop8);
-            if( codeLengthBits > 0) std::get<2>(result) = true;
-			double shiftedHamdist = (codeLengthBits == 0) ? 0 : ((double)hd(a[i],b,start8,stop8,mask)) / codeLengthBits;
-			if (shiftedHamdist < hamdist){
-                hamdist = shiftedHamdist;
-                std::get<1>(result) = i;
-            }
-		}
-		std::get<0>(result) = hamdist;
-	} else {
-		int codeLengthBits = 8*(stop8-start8);
-		unsigned int hamdist = codeLengthBits;
-		for (unsigned int i=0; i<a.size();i++){
-			unsigned int shiftedHamdist = hd(a[i],b,start8,stop8);
-			if (shiftedHamdist < hamdist){
-                hamdist = shiftedHamdist;
-                std::get<1>(result) = i;
-            }
-		}
-		std::get<0>(result) = (((double)hamdist) / (codeLengthBits));
+void profileHD(const vector<Mat>& a, const Mat& b, const unsigned int start8, const unsigned int stop8, const vector<Mat>& aMask, const Mat bMask, ShiftProfile& profile){
+	bool masked = (!aMask.empty() && !bMask.empty());
+	if (masked) CV_Assert(aMask.size() == a.size());
+	profile.hds.resize(a.size());
+	profile.firstShift = 0;
+	profile.valid = false;
+	for (unsigned int i=0; i<a.size();i++){
+		unsigned int codeLengthBits = 0;
+		unsigned int hamdist = shiftedHD(a[i],b,start8,stop8,0,(masked) ? aMask[i] : Mat(),bMask,codeLengthBits);
+		if (codeLengthBits > 0) profile.valid = true;
+		profile.hds[i] = (codeLengthBits == 0) ? 0 : ((double)hamdist) / codeLengthBits;
 	}
-	return result;
+	summarizeProfile(profile);
 }
 
 /**
- * determines the worst fractional Hamming Distance of two iris codes
- * a: first iris code
- * b: second iris code
- * start8: starting 8-bit block (inclusive)
- * stop8: ending 8-bit block (exclusive)
- * shifts: number of shifts
- * aMask: mask for first iris code
- * bMask: mask for second iris code
+ * Derives the score of an HD-based algorithm from a shift profile
+ * profile: shift profile of the comparison
+ * alg: HD-based algorithm (minhd: minimum HD, maxhd: 1-maximum HD, ssf: shift score fusion)
+ * noShift: shift reported if no HD is below 1 (maxhd: above 0)
+ * reverseShift: if set, receives the shift reported when comparing b with a (requires a symmetric shift range)
+ * returns: score, shift of the score and whether any bits were unmasked
  */
-std::tuple<double, int, bool> maxHD(const Mat& a, const Mat& b, const unsigned int start8, const unsigned int stop8, const int minShifts, const int maxShifts, const int shiftStep, const Mat aMask, const Mat bMask = Mat()){
-    std::tuple<double, int, bool> result = std::make_tuple(0,0,false);
-	if (!aMask.empty() && !bMask.empty()){
-		Mat mask(b.rows,b.cols,CV_8UC1);
-		Mat zero(b.rows,b.cols,CV_8UC1);
-		zero.setTo(Scalar(0));
-		double hamdist = 0;
-		Mat imgSmplShifted(a.rows,a.cols,CV_8UC1);
-		for (int ss=minShifts; ss<=maxShifts; ss++){
-            int s = ss*shiftStep;
-			shift(a,imgSmplShifted,s);
-			intersectShifted(aMask,bMask,mask,s);
-			int codeLengthBits = hd(mask, zero, start8, stop8);
-            if( codeLengthBits > 0) std::get<2>(result) = true;
-			double shiftedHamdist = (codeLengthBits == 0) ? 0 : ((double)hd(imgSmplShifted,b,start8,stop8,mask)) / codeLengthBits;
-			if (shiftedHamdist > hamdist){
-                hamdist = shiftedHamdist;
-                std::get<1>(result) = ss;
-            }
-		}
-		std::get<0>(result) = 1 - hamdist;
+std::tuple<double, int, bool> profileScore(const ShiftProfile& profile, const int alg, const int noShift, int * reverseShift = 0){
+	if (alg == ALG_MAXHD){
+		if (reverseShift != 0) *reverseShift = (profile.hasMax) ? -profile.lastMaxShift : noShift;
+		return std::make_tuple(1 - profile.maxHD, (profile.hasMax) ? profile.maxShift : noShift, profile.valid);
 	}
-	else {
+	if (reverseShift != 0) *reverseShift = (profile.hasMin) ? -profile.lastMinShift : noShift;
+	double score = (alg == ALG_SSF) ? ((1-profile.maxHD) + profile.minHD)/2 : profile.minHD;
+	return std::make_tuple(score, (profile.hasMin) ? profile.minShift : noShift, profile.valid);
+}
 
-		int codeLengthBits = 8*(stop8-start8);
-		unsigned int hamdist = 0;
-		Mat imgSmplShifted(a.rows,a.cols,CV_8UC1);
-		for (int ss=minShifts; ss<=maxShifts; ss++){
-            int s = ss*shiftStep;
-			shift(a,imgSmplShifted,s);
-			unsigned int shiftedHamdist = hd(imgSmplShifted,b,start8,stop8);
-			if (shiftedHamdist > hamdist){
-                hamdist = shiftedHamdist;
-                std::get<1>(result) = ss;
-            }
-		}
-		std::get<0>(result) = 1-(((double)hamdist) / (codeLengthBits));
+/**
+ * Appends the shift profile of a comparison to a binary profile file
+ * pfile: profile file
+ * name1: name of first iris code
+ * name2: name of second iris code
+ * profile: shift profile of the comparison
+ * mirrored: write the profile of the mirrored comparison (name1 and name2 already swapped)
+ */
+void writeProfile(ofstream& pfile, const string& name1, const string& name2, const ShiftProfile& profile, const bool mirrored){
+	int count = profile.hds.size();
+	int firstShift = (mirrored) ? -(profile.firstShift + count - 1) : profile.firstShift;
+	int len1 = name1.size(), len2 = name2.size();
+	pfile.write((const char *)&len1,sizeof(int));
+	pfile.write(name1.c_str(),len1);
+	pfile.write((const char *)&len2,sizeof(int));
+	pfile.write(name2.c_str(),len2);
+	pfile.write((const char *)&firstShift,sizeof(int));
+	pfile.write((const char *)&count,sizeof(int));
+	for (int i=0; i<count; i++){
+		double hamdist = profile.hds[(mirrored) ? count - 1 - i : i];
+		pfile.write((const char *)&hamdist,sizeof(double));
 	}
-	return result;
 }
 
 /**
- * determines the worst fractional Hamming Distance of an iris code with a list of shifted versions of this code
- * a: shifted versions of first iris code
- * b: second iris code
- * start8: starting 8-bit block (inclusive)
- * stop8: ending 8-bit block (exclusive)
- * aMask: masks for corresponding shifted versions of first iris code
- * bMask: mask for second iris code
+ * Writes the header of a triangle score file (-symbin)
+ * bfile: triangle score file
+ * names: names of all codes in comparison order
+ * first: index of the first pair (i,j) with i < j written to the file (row by row)
+ * count: number of pairs written to the file
  */
-std::tuple<double, int, bool> maxHD(const vector<Mat>& a, const Mat& b, const unsigned int start8, const unsigned int stop8, const vector<Mat>& aMask, const Mat bMask = Mat()){
-	std::tuple<double, int, bool> result = std::make_tuple(1,0,false);
-	if (!aMask.empty() && !bMask.empty()){
-		CV_Assert(aMask.size() == a.size());
-		Mat mask(b.rows,b.cols,CV_8UC1);
-		Mat zero(b.rows,b.cols,CV_8UC1);
-		zero.setTo(Scalar(0));
-		double hamdist = 0;
-		for (unsigned int i=0; i<a.size();i++){
-			intersectShifted(aMask[i],bMask,mask,0);
-			int codeLengthBits = hd(mask, zero, start8, stop8);
-            if( codeLengthBits > 0) std::get<2>(result) = true;
-			double shiftedHamdist = (codeLengthBits == 0) ? 0 : ((double)hd(a[i],b,start8,stop8,mask)) / codeLengthBits;
-			if (shiftedHamdist > hamdist){
-                hamdist = shiftedHamdist;
-                std::get<1>(result) = i;
-            }
-		}
-		std::get<0>(result) = 1 - hamdist;
+void writeTriangleHeader(ofstream& bfile, const vector<string>& names, const long long first, const long long count){
+	int version = 1, size = names.size();
+	bfile.write("HDSYMTRI",8);
+	bfile.write((const char *)&version,sizeof(int));
+	bfile.write((const char *)&size,sizeof(int));
+	for (vector<string>::const_iterator it = names.begin(); it != names.end(); it++){
+		int len = it->size();
+		bfile.write((const char *)&len,sizeof(int));
+		bfile.write(it->c_str(),len);
 	}
-	else {
-		int codeLengthBits = 8*(stop8-start8);
-		unsigned int hamdist = 0;
-		for (unsigned int i=0; i<a.size();i++){
-			unsigned int shiftedHamdist = hd(a[i],b,start8,stop8);
-			if (shiftedHamdist > hamdist){
-                hamdist = shiftedHamdist;
-                std::get<1>(result) = i;
-            }
-		}
-		std::get<0>(result) = 1- (((double)hamdist) / (codeLengthBits));
+	bfile.write((const char *)&first,sizeof(long long));
+	bfile.write((const char *)&count,sizeof(long long));
+}
+
+/**
+ * Appends the score of a pair to a triangle score file (-symbin)
+ * bfile: triangle score file
+ * score: score, shift and validity of the comparison
+ * reverseShift: shift of the mirrored comparison
+ */
+void writeTriangleScore(ofstream& bfile, const std::tuple<double, int, bool>& score, const int reverseShift){
+	double value = std::get<0>(score);
+	int shift = std::get<1>(score), valid = std::get<2>(score) ? 1 : 0;
+	bfile.write((const char *)&value,sizeof(double));
+	bfile.write((const char *)&shift,sizeof(int));
+	bfile.write((const char *)&reverseShift,sizeof(int));
+	bfile.write((const char *)&valid,sizeof(int));
+}
+
+/**
+ * Parses a shard specification of the form k/K
+ * spec: shard specification
+ * shard: index of the shard (1 <= shard <= shards)
+ * shards: total number of shards
+ */
+void parseShard(const string& spec, int& shard, int& shards){
+	if (sscanf(spec.c_str(),"%d/%d",&shard,&shards) != 2 || shards < 1 || shard < 1 || shard > shards){
+		CV_Error(CV_StsBadArg,"Invalid shard '" + spec + "', expected k/K with 1 <= k <= K");
 	}
-	return result;
 }
 
 /**
- * determines Shifting Score Fusion of two iris codes
- * a: first iris code
- * b: second iris code
- * start8: starting 8-bit block (inclusive)
- * stop8: ending 8-bit block (exclusive)
- * shifts: number of shifts
- * aMask: mask for first iris code
- * bMask: mask for second iris code
+ * Determines the block of comparisons executed by a shard. Comparisons are numbered
+ * in the order they are executed, the K blocks differ in size by at most one.
+ * shard: index of the shard (1 <= shard <= shards)
+ * shards: total number of shards
+ * total: total number of comparisons
+ * begin: index of the first comparison of the shard (inclusive)
+ * end: index of the last comparison of the shard (exclusive)
  */
-std::tuple<double, int, bool>  ssf(const Mat& a, const Mat& b, const unsigned int start8, const unsigned int stop8, const int minShifts, const int maxShifts, const int shiftStep, const Mat aMask, const Mat bMask = Mat()){
-	std::tuple<double, int, bool>  result = std::make_tuple(0,666,false);
-	if (!aMask.empty() && !bMask.empty()){
-		Mat mask(b.rows,b.cols,CV_8UC1);
-		Mat zero(b.rows,b.cols,CV_8UC1);
-		zero.setTo(Scalar(0));
-		intersectShifted(aMask,bMask,mask,0);
-		double hamdist = 1;
-		double maxhamdist = 0;
-		Mat imgSmplShifted(a.rows,a.cols,CV_8UC1);
-		for (int ss=minShifts; ss<=maxShifts; ss++){
-            int s = ss*shiftStep;
-			shift(a,imgSmplShifted,s);
-			intersectShifted(aMask,bMask,mask,s);
-			int codeLengthBits = hd(mask, zero, start8, stop8);
-            if( codeLengthBits > 0) std::get<2>(result) = true;
-			double shiftedHamdist = (codeLengthBits == 0) ? 0 : ((double)hd(imgSmplShifted,b,start8,stop8,mask)) / codeLengthBits;
-			if (shiftedHamdist < hamdist){
-                hamdist = shiftedHamdist;
-                std::get<1>(result) = ss;
-            }
-			if (shiftedHamdist > maxhamdist) maxhamdist = shiftedHamdist;
-		}
-		std::get<0>(result) = ((1-maxhamdist) +  hamdist)/2;
+void shardRange(const int shard, const int shards, const long long total, long long& begin, long long& end){
+	begin = (total * (shard - 1)) / shards;
+	end = (total * shard) / shards;
+}
+
+/** ------------------------------- score cache functions ------------------------------- **/
+
+/**
+ * Slot of the score cache hash table, a slot with hashSmpl = 0 is empty
+ */
+struct CacheRecord {
+	unsigned long long hashSmpl; // content hash of sample code and mask
+	unsigned long long hashRef; // content hash of reference code and mask
+	unsigned long long hashParams; // hash of algorithm, shift parameters and bit window
+	double score;
+	int shift;
+	int reverseShift; // shift when comparing reference with sample (symmetric shift ranges only)
+	int valid; // any bits were unmasked
+	unsigned int check; // checksum of the preceding fields
+};
+static_assert(sizeof(CacheRecord) == 48, "unexpected score cache record size");
+
+/**
+ * Header of the score cache file, followed by capacity slots
+ */
+struct CacheHeader {
+	unsigned long long magic; // CACHE_MAGIC
+	unsigned long long version; // CACHE_VERSION
+	unsigned long long capacity; // number of slots of the hash table (a power of 2)
+	unsigned long long count; // number of occupied slots
+	unsigned long long reserved[2];
+};
+static_assert(sizeof(CacheHeader) == sizeof(CacheRecord), "unexpected score cache header size");
+static const unsigned long long CACHE_MAGIC = 0x4548434153444831ULL, CACHE_VERSION = 2;
+
+/**
+ * Persistent score cache: an open-addressing hash table (linear probing) which is
+ * memory-mapped and probed directly in the file. While a cache is used, filename.lock is
+ * locked sharable, so several hd processes may share one cache file: slots are claimed
+ * with an atomic compare-and-swap and the checksum of a slot is written last. The table
+ * is only grown when a process opens the cache while no other process uses it.
+ */
+struct ScoreCache {
+	boost::interprocess::file_lock lock; // sharable lock on the lock file of the cache
+	boost::interprocess::mapped_region region; // mapped cache file
+	CacheHeader * header; // header of the mapped file (0 if no cache is used)
+	CacheRecord * slots; // slots of the hash table
+	map<string, unsigned long long> refHashes; // content hashes of reference templates by file
+	long long hits;
+	long long dropped; // scores not stored because the table was full
+};
+
+/**
+ * Updates an FNV-1a hash with a block of bytes
+ * hash: hash value to update
+ * data: bytes
+ * size: number of bytes
+ */
+void hashBytes(unsigned long long& hash, const void * data, const size_t size){
+	const uchar * p = (const uchar *) data;
+	for (size_t i=0; i<size; i++){
+		hash = (hash ^ p[i]) * 1099511628211ULL;
 	}
-	else {
-		int codeLengthBits = 8*(stop8-start8);
-		unsigned int hamdist = codeLengthBits;
-		unsigned int maxhamdist = 0;
-		Mat imgSmplShifted(a.rows,a.cols,CV_8UC1);
-		for (int ss=minShifts; ss<=maxShifts; ss++){
-            int s = ss*shiftStep;
-			shift(a,imgSmplShifted,s);
-			unsigned int shiftedHamdist = hd(imgSmplShifted,b,start8,stop8);
-			if (shiftedHamdist < hamdist){
-                hamdist = shiftedHamdist;
-                std::get<1>(result) = ss;
-            }
-			if (shiftedHamdist > maxhamdist) maxhamdist = shiftedHamdist;
+}
+
+/**
+ * Computes the content hash of a template (all codes and masks)
+ * imgs: iris codes (or shifted versions)
+ * masks: corresponding masks (may be empty)
+ */
+unsigned long long hashTemplate(const vector<Mat>& imgs, const vector<Mat>& masks){
+	unsigned long long hash = 14695981039346656037ULL;
+	for (unsigned int m=0; m<2; m++){
+		const vector<Mat>& list = (m == 0) ? imgs : masks;
+		hashBytes(hash,&m,sizeof(m));
+		for (vector<Mat>::const_iterator it = list.begin(); it != list.end(); it++){
+			int dims[2] = {it->rows, it->cols};
+			hashBytes(hash,dims,sizeof(dims));
+			for (int y=0; y<it->rows; y++) hashBytes(hash,it->ptr<uchar>(y),it->cols);
 		}
-		std::get<0>(result) = ((1-(((double)maxhamdist) / (codeLengthBits))) + (((double)hamdist) / (codeLengthBits)))/2;
 	}
-	return result;
+	return (hash != 0) ? hash : 1; // 0 marks empty cache slots
 }
 
 /**
- * determines Shifting Score Fusion of an iris code with a list of shifted versions of this code
- * a: shifted versions of first iris code
- * b: second iris code
- * start8: starting 8-bit block (inclusive)
- * stop8: ending 8-bit block (exclusive)
- * aMask: masks for corresponding shifted versions of first iris code
- * bMask: mask for second iris code
+ * Checksum of a cache record
+ * record: cache record
  */
-std::tuple<double, int, bool> ssf(const vector<Mat>& a, const Mat& b, const unsigned int start8, const unsigned int stop8, const vector<Mat>& aMask, const Mat bMask = Mat()){
-	std::tuple<double, int, bool> result = std::make_tuple(0,0,false);
-	if (!aMask.empty() && !bMask.empty()){
-		CV_Assert(aMask.size() == a.size());
-		Mat mask(b.rows,b.cols,CV_8UC1);
-		Mat zero(b.rows,b.cols,CV_8UC1);
-		zero.setTo(Scalar(0));
-		int codeLengthBits = 0;
-		double hamdist = 1;
-		double maxhamdist = 0;
-		for (unsigned int i=0; i<a.size();i++){
-			intersectShifted(aMask[i],bMask,mask,0);
-			codeLengthBits = hd(mask, zero, start8, stop8);
-            if( codeLengthBits > 0) std::get<2>(result) = true;
-			double shiftedHamdist = (codeLengthBits == 0) ? 0 : ((double)hd(a[i],b,start8,stop8,mask)) / codeLengthBits;
-			if (shiftedHamdist < hamdist){
-                hamdist = shiftedHamdist;
-                std::get<1>(result) = i;
-            }
-			if (shiftedHamdist > maxhamdist) maxhamdist = shiftedHamdist;
+unsigned int cacheCheck(const CacheRecord& record){
+	unsigned long long hash = 14695981039346656037ULL;
+	hashBytes(hash,&record,offsetof(CacheRecord,check));
+	return (unsigned int)(hash ^ (hash >> 32));
+}
+
+/**
+ * Combined key of a cache record
+ */
+unsigned long long cacheKey(const unsigned long long hashSmpl, const unsigned long long hashRef, const unsigned long long hashParams){
+	unsigned long long hash = 14695981039346656037ULL;
+	hashBytes(hash,&hashSmpl,sizeof(hashSmpl));
+	hashBytes(hash,&hashRef,sizeof(hashRef));
+	hashBytes(hash,&hashParams,sizeof(hashParams));
+	return hash;
+}
+
+/**
+ * Finds the slot of a key in the hash table of the cache
+ * slots: slots of the hash table
+ * capacity: number of slots (a power of 2)
+ * hashSmpl: content hash of the sample
+ * hashRef: content hash of the reference
+ * hashParams: hash of the comparison parameters
+ * returns: slot holding the key, the first empty slot if the key is not contained, 0 if the table is full
+ */
+CacheRecord * cacheFind(CacheRecord * slots, const unsigned long long capacity, const unsigned long long hashSmpl, const unsigned long long hashRef, const unsigned long long hashParams){
+	unsigned long long slot = cacheKey(hashSmpl,hashRef,hashParams) & (capacity - 1);
+	for (unsigned long long i=0; i<capacity; i++){
+		CacheRecord record;
+		memcpy(&record,slots + slot,sizeof(record));
+		if (record.hashSmpl == 0) return slots + slot;
+		// slots being written by other processes or damaged slots fail the checksum
+		if (record.hashSmpl == hashSmpl && record.hashRef == hashRef && record.hashParams == hashParams && record.check == cacheCheck(record)) return slots + slot;
+		slot = (slot + 1) & (capacity - 1);
+	}
+	return 0;
+}
+
+/**
+ * Stores a record in an empty slot of the hash table. The slot is claimed by an atomic
+ * compare-and-swap of its sample hash, the checksum is written after all other fields.
+ * header: header of the cache file
+ * slots: slots of the hash table
+ * record: record to store (with checksum)
+ * returns: whether the record is contained in the table afterwards
+ */
+bool cacheInsert(CacheHeader * header, CacheRecord * slots, const CacheRecord& record){
+	for (;;){
+		CacheRecord * slot = cacheFind(slots,header->capacity,record.hashSmpl,record.hashRef,record.hashParams);
+		if (slot == 0) return false;
+		if (slot->hashSmpl != 0) return true; // stored meanwhile by another process
+		if (!__sync_bool_compare_and_swap(&slot->hashSmpl,0ULL,record.hashSmpl)) continue; // claimed by another process
+		slot->hashRef = record.hashRef;
+		slot->hashParams = record.hashParams;
+		slot->score = record.score;
+		slot->shift = record.shift;
+		slot->reverseShift = record.reverseShift;
+		slot->valid = record.valid;
+		__sync_synchronize();
+		slot->check = record.check;
+		__sync_fetch_and_add(&header->count,1ULL);
+		return true;
+	}
+}
+
+/**
+ * Checks the header of a mapped cache file
+ * filename: path of the cache file
+ * region: mapped cache file
+ * returns: header of the cache file
+ */
+CacheHeader * cacheHeader(const string& filename, boost::interprocess::mapped_region& region){
+	CacheHeader * header = (CacheHeader *) region.get_address();
+	if (region.get_size() < sizeof(CacheHeader) || header->magic != CACHE_MAGIC || header->version != CACHE_VERSION || header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0
+		|| region.get_size() != (header->capacity + 1) * sizeof(CacheRecord)) CV_Error(CV_StsError,"Invalid score cache '" + filename + "'");
+	return header;
+}
+
+/**
+ * Creates the hash table of a cache file or grows it, such that it holds the stored scores and
+ * the expected number of new scores at a load of at most one half. Requires exclusive access.
+ * filename: path of the cache file
+ * expected: number of scores this run may add
+ * quiet: suppress messages
+ */
+void prepareCache(const string& filename, const long long expected, const bool quiet){
+	vector<CacheRecord> records;
+	uintmax_t size = boost::filesystem::file_size(filename);
+	// an empty file or a header of zeros (interrupted resize) is initialized
+	bool initialize = (size < sizeof(CacheHeader));
+	if (!initialize){
+		boost::interprocess::file_mapping mapping(filename.c_str(),boost::interprocess::read_only);
+		boost::interprocess::mapped_region region(mapping,boost::interprocess::read_only);
+		const CacheHeader * header = (const CacheHeader *) region.get_address();
+		initialize = (header->magic == 0 && header->version == 0);
+		if (!initialize){
+			header = cacheHeader(filename,region);
+			if ((header->count + expected) * 2 <= header->capacity) return;
+			const CacheRecord * slots = (const CacheRecord *)(header + 1);
+			for (unsigned long long i=0; i<header->capacity; i++){
+				if (slots[i].hashSmpl != 0 && slots[i].check == cacheCheck(slots[i])) records.push_back(slots[i]);
+			}
 		}
-		std::get<0>(result) = ((1-maxhamdist) +  hamdist)/2;
 	}
-	else {
-		int codeLengthBits = 8*(stop8-start8);
-		unsigned int hamdist = codeLengthBits;
-		unsigned int maxhamdist = 0;
-		for (unsigned int i=0; i<a.size();i++){
-			unsigned int shiftedHamdist = hd(a[i],b,start8,stop8);
-			if (shiftedHamdist < hamdist){
-                hamdist = shiftedHamdist;
-                std::get<1>(result) = i;
-            }
-			if (shiftedHamdist > maxhamdist) maxhamdist = shiftedHamdist;
+	unsigned long long capacity = 1024;
+	while (capacity < 2 * (records.size() + expected)) capacity *= 2;
+	if (!quiet && !records.empty()) printf("Growing score cache '%s' to %llu slots ...\n",filename.c_str(),capacity);
+	// truncating and extending the file yields a table of empty slots
+	boost::filesystem::resize_file(filename,0);
+	boost::filesystem::resize_file(filename,(capacity + 1) * sizeof(CacheRecord));
+	boost::interprocess::file_mapping mapping(filename.c_str(),boost::interprocess::read_write);
+	boost::interprocess::mapped_region region(mapping,boost::interprocess::read_write);
+	CacheHeader * header = (CacheHeader *) region.get_address();
+	CacheRecord * slots = (CacheRecord *)(header + 1);
+	header->capacity = capacity;
+	for (vector<CacheRecord>::const_iterator it = records.begin(); it != records.end(); it++) cacheInsert(header,slots,*it);
+	header->version = CACHE_VERSION;
+	header->magic = CACHE_MAGIC;
+	region.flush();
+}
+
+/**
+ * Opens a score cache file (creating it if it does not exist) and maps its hash table
+ * filename: path of the cache file
+ * cache: score cache
+ * expected: number of scores this run may add
+ * quiet: suppress messages
+ */
+void openCache(const string& filename, ScoreCache& cache, const long long expected, const bool quiet){
+	cache.hits = 0;
+	cache.dropped = 0;
+	{
+		ofstream touch(filename.c_str(),ios::out | ios::app | ios::binary);
+		if (!touch.is_open()) CV_Error(CV_StsError,"Could not open score cache '" + filename + "'");
+	}
+	// locks are held on a separate file, closing any handle of a file releases its locks on POSIX
+	string lockfile = filename + ".lock";
+	{ ofstream touch(lockfile.c_str(),ios::out | ios::app); }
+	boost::interprocess::file_lock lock(lockfile.c_str());
+	if (lock.try_lock()){ // no other process uses the cache
+		try {
+			prepareCache(filename,expected,quiet);
 		}
-		std::get<0>(result) = ((1-(((double)maxhamdist) / (codeLengthBits))) + (((double)hamdist) / (codeLengthBits)))/2;
+		catch (...){
+			lock.unlock();
+			throw;
+		}
+		lock.unlock();
 	}
-	return result;
+	lock.lock_sharable();
+	cache.lock.swap(lock);
+	boost::interprocess::file_mapping mapping(filename.c_str(),boost::interprocess::read_write);
+	boost::interprocess::mapped_region region(mapping,boost::interprocess::read_write);
+	cache.region.swap(region);
+	cache.header = cacheHeader(filename,cache.region);
+	cache.slots = (CacheRecord *)(cache.header + 1);
+	if (!quiet) printf("Opened score cache '%s' (%llu scores, %llu slots) ...\n",filename.c_str(),cache.header->count,cache.header->capacity);
+}
+
+/**
+ * Unmaps and unlocks a score cache
+ * cache: score cache
+ */
+void closeCache(ScoreCache& cache){
+	boost::interprocess::mapped_region().swap(cache.region);
+	cache.header = 0;
+	cache.slots = 0;
+	cache.lock.unlock_sharable();
+}
+
+/**
+ * Looks up a score in the cache
+ * cache: score cache
+ * hashSmpl: content hash of the sample
+ * hashRef: content hash of the reference
+ * hashParams: hash of the comparison parameters
+ * score: receives score, shift and validity
+ * reverseShift: receives the shift of the mirrored comparison
+ * returns: whether the score was cached
+ */
+bool cacheLookup(ScoreCache& cache, const unsigned long long hashSmpl, const unsigned long long hashRef, const unsigned long long hashParams, std::tuple<double, int, bool>& score, int& reverseShift){
+	CacheRecord * slot = cacheFind(cache.slots,cache.header->capacity,hashSmpl,hashRef,hashParams);
+	if (slot == 0) return false;
+	CacheRecord record;
+	memcpy(&record,slot,sizeof(record));
+	if (record.hashSmpl == 0 || record.check != cacheCheck(record)) return false;
+	score = std::make_tuple(record.score,record.shift,record.valid != 0);
+	reverseShift = record.reverseShift;
+	cache.hits++;
+	return true;
+}
+
+/**
+ * Adds a score to the cache, scores are dropped once three quarters of the slots are occupied
+ * cache: score cache
+ * hashSmpl: content hash of the sample
+ * hashRef: content hash of the reference
+ * hashParams: hash of the comparison parameters
+ * score: score, shift and validity
+ * reverseShift: shift of the mirrored comparison
+ */
+void cacheAppend(ScoreCache& cache, const unsigned long long hashSmpl, const unsigned long long hashRef, const unsigned long long hashParams, const std::tuple<double, int, bool>& score, const int reverseShift){
+	if (cache.header->count * 4 >= cache.header->capacity * 3){
+		cache.dropped++;
+		return;
+	}
+	CacheRecord record;
+	memset(&record,0,sizeof(record));
+	record.hashSmpl = hashSmpl;
+	record.hashRef = hashRef;
+	record.hashParams = hashParams;
+	record.score = std::get<0>(score);
+	record.shift = std::get<1>(score);
+	record.reverseShift = reverseShift;
+	record.valid = std::get<2>(score) ? 1 : 0;
+	record.check = cacheCheck(record);
+	if (!cacheInsert(cache.header,cache.slots,record)) cache.dropped++;
 }
 
 /** ------------------------------- commandline functions ------------------------------- **/
@@ -952,7 +1115,7 @@ int main(int argc, char *argv[])
 		else mode = MODE_MAIN;
 		if (mode == MODE_MAIN){
 			// validate command line
-			cmdCheckOpts(cmd,"-i|-m|-s|-ss|-a|-n|-o|-owp|-q|-t|-#|-#off|-b|-boff|-sf|-sfl");
+			cmdCheckOpts(cmd,"-i|-m|-s|-ss|-a|-n|-o|-owp|-profile|-scorecache|-q|-t|-#|-#off|-b|-boff|-sf|-sfl|-shard|-sym|-symbin");
 			cmdCheckOptExists(cmd,"-i");
 			cmdCheckOptSize(cmd,"-i",2);
 			string infilesSmpl = cmdGetPar(cmd,"-i",0);
@@ -1012,6 +1175,16 @@ int main(int argc, char *argv[])
                     outfile_with_path = true;
                 }
 			}
+			string profilefile;
+			if (cmdGetOpt(cmd,"-profile") != 0){
+				cmdCheckOptSize(cmd,"-profile",1);
+				profilefile = cmdGetPar(cmd,"-profile");
+			}
+			string cachefile;
+			if (cmdGetOpt(cmd,"-scorecache") != 0){
+				cmdCheckOptSize(cmd,"-scorecache",1);
+				cachefile = cmdGetPar(cmd,"-scorecache");
+			}
 			bool quiet = false;
 			if (cmdGetOpt(cmd,"-q") != 0){
 				cmdCheckOptSize(cmd,"-q",0);
@@ -1053,6 +1226,24 @@ int main(int argc, char *argv[])
                     printf( "Skip masks (-sf) specified but there are no masks (-m) given, ignoring\n");
                 }
             }
+			int shard = 1, shards = 1;
+			if (cmdGetOpt(cmd,"-shard") != 0){
+				cmdCheckOptSize(cmd,"-shard",1);
+				parseShard(cmdGetPar(cmd,"-shard"),shard,shards);
+			}
+			bool sym = false;
+			if (cmdGetOpt(cmd,"-sym") != 0){
+				cmdCheckOptSize(cmd,"-sym",0);
+				if (shiftedfiles) CV_Error(CV_StsBadArg,"Symmetric mode (-sym) does not support shifted files");
+				if (minShifts != -maxShifts) CV_Error(CV_StsBadArg,"Symmetric mode (-sym) requires a symmetric shift range (min = -max)");
+				sym = true;
+			}
+			string symbinfile;
+			if (cmdGetOpt(cmd,"-symbin") != 0){
+				cmdCheckOptSize(cmd,"-symbin",1);
+				if (!sym) CV_Error(CV_StsBadArg,"Triangle score file (-symbin) requires symmetric mode (-sym)");
+				symbinfile = cmdGetPar(cmd,"-symbin");
+			}
 			// starting routine
 			Timing timing(1,quiet);
 			vector<string> filesSmpl;
@@ -1064,7 +1255,24 @@ int main(int argc, char *argv[])
                 CV_Assert(filesSmpl.size() > 0);
             }
 			CV_Assert(filesRef.size() > 0);
-			timing.total = filesSmpl.size() * filesRef.size();
+			if (sym){
+				if (filesSmpl != filesRef) CV_Error(CV_StsBadArg,"Symmetric mode (-sym) requires both -i patterns to refer to the same files");
+				if (masks){
+					for (vector<string>::iterator f = filesSmpl.begin(); f != filesSmpl.end(); ++f){
+						string maskSmplFile, maskRefFile;
+						patternFileRename(infilesSmpl,masksSmpl,*f,maskSmplFile);
+						patternFileRename(infilesRef,masksRef,*f,maskRefFile);
+						if (maskSmplFile != maskRefFile) CV_Error(CV_StsBadArg,"Symmetric mode (-sym) requires both -m patterns to refer to the same masks");
+					}
+				}
+			}
+			// comparisons [shardBegin,shardEnd) in execution order are executed by this shard
+			long long shardBegin = 0, shardEnd = 0;
+			// in symmetric mode only pairs (i,j) with i < j are compared
+			long long comparisonsCount = (sym) ? ((long long)filesSmpl.size()) * (filesSmpl.size() - 1) / 2 : ((long long)filesSmpl.size()) * filesRef.size();
+			shardRange(shard,shards,comparisonsCount,shardBegin,shardEnd);
+			long long comparison = 0;
+			timing.total = shardEnd - shardBegin;
 			ofstream cfile;
 			if (!outfile.empty()){
 				if (!quiet) printf("Opening result file '%s' ...\n", outfile.c_str());;
@@ -1073,6 +1281,34 @@ int main(int argc, char *argv[])
 					CV_Error(CV_StsError,"Could not open result file '" + outfile + "'");
 				}
 			}
+			ofstream pfile;
+			if (!profilefile.empty()){
+				if (!quiet) printf("Opening profile file '%s' ...\n", profilefile.c_str());
+				pfile.open(profilefile.c_str(),ios::out | ios::trunc | ios::binary);
+				if (!(pfile.is_open())) {
+					CV_Error(CV_StsError,"Could not open profile file '" + profilefile + "'");
+				}
+				// header: magic, version and number of bits per shift (0 for shifted files)
+				int version = 1, bitsPerShift = (shiftedfiles) ? 0 : shiftStep;
+				pfile.write("HDPROFIL",8);
+				pfile.write((const char *)&version,sizeof(int));
+				pfile.write((const char *)&bitsPerShift,sizeof(int));
+			}
+			ofstream bfile;
+			if (!symbinfile.empty()){
+				if (!quiet) printf("Opening triangle score file '%s' ...\n", symbinfile.c_str());
+				bfile.open(symbinfile.c_str(),ios::out | ios::trunc | ios::binary);
+				if (!(bfile.is_open())) {
+					CV_Error(CV_StsError,"Could not open triangle score file '" + symbinfile + "'");
+				}
+				vector<string> names;
+				for (vector<string>::iterator f = filesSmpl.begin(); f != filesSmpl.end(); ++f) names.push_back((outfile_with_path) ? *f : skipPath(*f));
+				writeTriangleHeader(bfile,names,shardBegin,shardEnd - shardBegin);
+			}
+			ScoreCache cache;
+			cache.header = 0;
+			// the table is sized for the comparisons of all shards, which may share the cache
+			if (!cachefile.empty()) openCache(cachefile,cache,comparisonsCount,quiet);
             ofstream sflfile;
 			if (!skip_failure_log.empty()){
 				if (!quiet) printf("Opening failure log file '%s' ...\n", skip_failure_log.c_str());;
@@ -1082,6 +1318,13 @@ int main(int argc, char *argv[])
 				}
 			}
 			for (vector<string>::iterator infileSmpl = filesSmpl.begin(); infileSmpl != filesSmpl.end(); ++infileSmpl){
+				// skip samples without comparisons in this shard
+				vector<string>::iterator refBegin = (sym) ? filesRef.begin() + (infileSmpl - filesSmpl.begin()) + 1 : filesRef.begin();
+				long long rowCount = filesRef.end() - refBegin;
+				if (comparison + rowCount <= shardBegin || comparison >= shardEnd){
+					comparison += rowCount;
+					continue;
+				}
 				vector<Mat> imgSmpl;
 				vector<Mat> maskSmpl;
 				if (shiftedfiles){
@@ -1126,8 +1369,17 @@ int main(int argc, char *argv[])
 				Size codeSize = imgSmpl[0].size();
 				unsigned int codeLength = codeSize.height * codeSize.width;
 				unsigned int bitStop = min(to,codeLength);
+				if (sym && (from != 0 || bitStop != codeLength)) CV_Error(CV_StsBadArg,"Symmetric mode (-sym) requires the full bit range (-n)");
+				unsigned long long hashSmpl = 0, hashParams = 0;
+				if (cache.header != 0){
+					hashSmpl = hashTemplate(imgSmpl,maskSmpl);
+					string params = to_string(alg) + " " + ((shiftedfiles) ? "files" : to_string(minShifts) + " " + to_string(maxShifts) + " " + to_string(shiftStep)) + " " + to_string(from) + " " + to_string(bitStop);
+					hashParams = 14695981039346656037ULL;
+					hashBytes(hashParams,params.c_str(),params.size());
+				}
 				//CV_Assert(codeLength % sizeof(int) == 0);
-				for (vector<string>::iterator infileRef = filesRef.begin(); infileRef != filesRef.end(); ++infileRef, timing.progress++){
+				for (vector<string>::iterator infileRef = refBegin; infileRef != filesRef.end(); ++infileRef, comparison++){
+					if (comparison < shardBegin || comparison >= shardEnd) continue;
 					Mat imgRef = imread_mem(*infileRef, CV_LOAD_IMAGE_UNCHANGED);
 					CV_Assert(imgRef.data != 0);
 					CV_Assert(imgRef.type() == CV_8UC1);
@@ -1144,41 +1396,70 @@ int main(int argc, char *argv[])
 					else {
 						maskRef = Mat();
 					}
-                    std::tuple<double, int, bool> score = (alg == ALG_MINHD) ? (shiftedfiles) ? minHD(imgSmpl,imgRef,from,bitStop, maskSmpl, maskRef) : minHD(imgSmpl[0],imgRef,from,bitStop,minShifts, maxShifts, shiftStep, (maskSmpl.size() > 0) ? maskSmpl[0] : Mat(), maskRef) :
-								(alg == ALG_MAXHD) ? (shiftedfiles) ? maxHD(imgSmpl,imgRef,from,bitStop, maskSmpl, maskRef) : maxHD(imgSmpl[0],imgRef,from,bitStop,minShifts, maxShifts, shiftStep, (maskSmpl.size() > 0) ? maskSmpl[0] : Mat(), maskRef) :
-								(shiftedfiles) ? ssf(imgSmpl,imgRef,from,bitStop,maskSmpl, maskRef) : ssf(imgSmpl[0],imgRef,from,bitStop,minShifts, maxShifts, shiftStep, (maskSmpl.size() > 0) ? maskSmpl[0] : Mat(), maskRef);
-                    if( std::get<2>(score) or !skip_failure ){
-                        if (!quiet){
-                            if (writebitshift)
-                                printf("hd(%s,%s) = %f at %d bits\n",(*infileSmpl).c_str(), (*infileRef).c_str(), std::get<0>(score), std::get<1>(score));
-                            else
-                                printf("hd(%s,%s) = %f\n",(*infileSmpl).c_str(), (*infileRef).c_str(), std::get<0>(score));
-                        }
+                    ShiftProfile profile;
+                    std::tuple<double, int, bool> score;
+                    int reverseShift = 0;
+                    unsigned long long hashRef = 0;
+                    if (cache.header != 0){
+                        map<string, unsigned long long>::iterator hit = cache.refHashes.find(*infileRef);
+                        if (hit == cache.refHashes.end()) hit = cache.refHashes.insert(make_pair(*infileRef,hashTemplate(vector<Mat>(1,imgRef),(masks) ? vector<Mat>(1,maskRef) : vector<Mat>()))).first;
+                        hashRef = hit->second;
+                    }
+                    // profiles are not cached
+                    if (cache.header == 0 || !profilefile.empty() || !cacheLookup(cache,hashSmpl,hashRef,hashParams,score,reverseShift)){
+                        // all algorithms are derived from the HDs at every shift
+                        if (shiftedfiles) profileHD(imgSmpl,imgRef,from,bitStop,maskSmpl,maskRef,profile);
+                        else profileHD(imgSmpl[0],imgRef,from,bitStop,minShifts,maxShifts,shiftStep,(maskSmpl.size() > 0) ? maskSmpl[0] : Mat(),maskRef,profile);
+                        score = profileScore(profile,alg,(alg == ALG_SSF && !shiftedfiles) ? 666 : 0,&reverseShift);
+                        if (cache.header != 0) cacheAppend(cache,hashSmpl,hashRef,hashParams,score,reverseShift);
+                    }
+                    if (!symbinfile.empty() && bfile.is_open()) writeTriangleScore(bfile,score,reverseShift);
+                    // in symmetric mode the result is also reported for the mirrored pair
+                    for (int mirrored = 0; mirrored < ((sym) ? 2 : 1); mirrored++){
+                        const string& name1 = (mirrored) ? *infileRef : *infileSmpl;
+                        const string& name2 = (mirrored) ? *infileSmpl : *infileRef;
+                        int bitshift = (mirrored) ? reverseShift : std::get<1>(score);
+                        if( std::get<2>(score) or !skip_failure ){
+                            if (!quiet){
+                                if (writebitshift)
+                                    printf("hd(%s,%s) = %f at %d bits\n",name1.c_str(), name2.c_str(), std::get<0>(score), bitshift);
+                                else
+                                    printf("hd(%s,%s) = %f\n",name1.c_str(), name2.c_str(), std::get<0>(score));
+                            }
 
-                        if (!outfile.empty() && cfile.is_open()){
-                            if( outfile_with_path){
-                                cfile << *infileSmpl << " " << *infileRef;
-                            } else {
-                                cfile << skipPath(*infileSmpl) << " " << skipPath(*infileRef);
+                            if (!outfile.empty() && cfile.is_open()){
+                                if( outfile_with_path){
+                                    cfile << name1 << " " << name2;
+                                } else {
+                                    cfile << skipPath(name1) << " " << skipPath(name2);
+                                }
+                                cfile  << " " << std::get<0>(score);
+                                if( writebitshift) cfile << " " << bitshift;
+                                cfile << endl;
                             }
-                            cfile  << " " << std::get<0>(score);
-                            if( writebitshift) cfile << " " << std::get<1>(score);
-                            cfile << endl;
-                        }
-                    } else {
-                        if (!quiet){
-                            printf("hd(%s,%s) no non mask bits",(*infileSmpl).c_str(), (*infileRef).c_str());
-                        }
-                        if (!skip_failure_log.empty() && sflfile.is_open()){
-                            if( outfile_with_path){
-                                sflfile << *infileSmpl << " " << *infileRef;
-                            } else {
-                                sflfile << skipPath(*infileSmpl) << " " << skipPath(*infileRef);
+                            if (!profilefile.empty() && pfile.is_open()){
+                                if( outfile_with_path){
+                                    writeProfile(pfile,name1,name2,profile,mirrored != 0);
+                                } else {
+                                    writeProfile(pfile,skipPath(name1),skipPath(name2),profile,mirrored != 0);
+                                }
+                            }
+                        } else {
+                            if (!quiet){
+                                printf("hd(%s,%s) no non mask bits",name1.c_str(), name2.c_str());
+                            }
+                            if (!skip_failure_log.empty() && sflfile.is_open()){
+                                if( outfile_with_path){
+                                    sflfile << name1 << " " << name2;
+                                } else {
+                                    sflfile << skipPath(name1) << " " << skipPath(name2);
+                                }
+                                sflfile << endl;
                             }
-                            sflfile << endl;
                         }
                     }
 					if (time && timing.update()) timing.print();
+					timing.progress++;
 				}
 			}
 			if (time && quiet) timing.clear();
@@ -1188,6 +1469,17 @@ int main(int argc, char *argv[])
 			if (!skip_failure_log.empty() && sflfile.is_open()){
 				sflfile.close();
 			}
+			if (!profilefile.empty() && pfile.is_open()){
+				pfile.close();
+			}
+			if (!symbinfile.empty() && bfile.is_open()){
+				bfile.close();
+			}
+			if (cache.header != 0){
+				if (!quiet) printf("Score cache: %lld of %lld comparisons cached\n",cache.hits,shardEnd - shardBegin);
+				if (!quiet && cache.dropped > 0) printf("Score cache full: %lld scores not stored (the cache grows when it is opened by a single process)\n",cache.dropped);
+				closeCache(cache);
+			}
     	}
     	else if (mode == MODE_HELP){
 			// validate command line
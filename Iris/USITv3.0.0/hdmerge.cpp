@@ -0,0 +1,616 @@
+/*
+ * hdmerge.cpp
+ *
+ * Merges histograms of sharded hdverify evaluations
+ *
+ */
+#include "version.h"
+#include <cstdio>
+#include <map>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <opencv2/core/core.hpp>
+#include <boost/regex.hpp>
+#include <boost/filesystem.hpp>
+
+using namespace std;
+using namespace cv;
+
+/** no globbing in win32 mode **/
+int _CRT_glob = 0;
+
+/** Program modes **/
+static const int MODE_MAIN = 1, MODE_HELP = 2;
+
+/*
+ * Print command line usage for this program
+ */
+void printUsage() {
+    printVersion();
+	printf("+-----------------------------------------------------------------------------+\n");
+    printf("| hdmerge - merges histograms of sharded hdverify runs                        |\n");
+    printf("|                                                                             |\n");
+    printf("| MODES                                                                       |\n");
+    printf("|                                                                             |\n");
+    printf("| (# 1) merges histogram files of all shards (hdverify -shard k/K -hist ...)  |\n");
+    printf("| (# 2) usage                                                                 |\n");
+    printf("|                                                                             |\n");
+    printf("| ARGUMENTS                                                                   |\n");
+    printf("|                                                                             |\n");
+    printf("+------+------------+---+---+-------------------------------------------------+\n");
+    printf("| Name | Parameters | # | ? | Description                                     |\n");
+    printf("+------+------------+---+---+-------------------------------------------------+\n");
+    printf("| -i   | histfile+  | 1 | N | histogram files of the shards (* = any)         |\n");
+    printf("| -r   | rocfile    | 1 | Y | target roc-file path (FMR/FNMR pairs)           |\n");
+    printf("| -d   | distfile   | 1 | Y | target distributions-file path  (Gen/Imp pairs) |\n");
+    printf("| -hist| histfile   | 1 | Y | target histogram-file path (merged histogram)   |\n");
+    printf("| -q   |            | 1 | Y | quiet mode on (off)                             |\n");
+    printf("| -h   |            | 2 | N | prints usage                                    |\n");
+    printf("+------+------------+---+---+-------------------------------------------------+\n");
+    printf("|                                                                             |\n");
+	printf("| EXAMPLE USAGE                                                               |\n");
+    printf("|                                                                             |\n");
+    printf("| -i shard*.hist -d dist.txt -r roc.txt                                       |\n");
+    printf("| -i s1.hist s2.hist s3.hist -hist all.hist -q                                |\n");
+    printf("|                                                                             |\n");
+    printf("| Score files (-o) of the shards are merged by concatenating them in shard    |\n");
+    printf("| order, which yields the score files of a single hdverify run.               |\n");
+    printf("|                                                                             |\n");
+    printf("| COPYRIGHT                                                                   |\n");
+    printf("|                                                                             |\n");
+    printf("| (C) 2020 University of Salzburg. See license.txt for the terms of use.      |\n");
+    printf("+-----------------------------------------------------------------------------+\n");
+}
+
+/** ------------------------------- evaluation functions ------------------------------- **/
+
+/**
+ * Histogram of a (sharded) hdverify evaluation
+ */
+struct Histogram {
+	/** description of the comparison parameters **/
+	string params;
+	/** index of the shard (1 <= shard <= shards) **/
+	int shard;
+	/** total number of shards **/
+	int shards;
+	/** genuine score histogram **/
+	vector<long long> genuines;
+	/** imposter score histogram **/
+	vector<long long> imposters;
+};
+
+/**
+ * Loads a histogram file as stored by hdverify -hist
+ * filename: path of the histogram file
+ * hist: loaded histogram
+ */
+void loadHistogram(const string& filename, Histogram& hist){
+	ifstream file(filename.c_str(),ios::in);
+	if (!file.is_open()) CV_Error(CV_StsError,"Could not open histogram file '" + filename + "'");
+	string magic, key;
+	int version = 0, bins = 0;
+	long long genuinesCount = 0, impostersCount = 0;
+	file >> magic >> version;
+	if (magic != "hdverify-histogram" || version != 1) CV_Error(CV_StsError,"Invalid histogram file '" + filename + "'");
+	file >> key;
+	if (key != "params") CV_Error(CV_StsError,"Invalid histogram file '" + filename + "'");
+	file >> ws;
+	getline(file,hist.params);
+	file >> key >> hist.shard >> hist.shards;
+	if (key != "shard" || hist.shards < 1 || hist.shard < 1 || hist.shard > hist.shards) CV_Error(CV_StsError,"Invalid histogram file '" + filename + "'");
+	file >> key >> bins;
+	if (key != "bins" || bins <= 0) CV_Error(CV_StsError,"Invalid histogram file '" + filename + "'");
+	file >> key >> genuinesCount >> impostersCount;
+	if (key != "counts") CV_Error(CV_StsError,"Invalid histogram file '" + filename + "'");
+	hist.genuines.assign(bins,0);
+	hist.imposters.assign(bins,0);
+	for (int i=0; i<bins; i++){
+		file >> hist.genuines[i] >> hist.imposters[i];
+		genuinesCount -= hist.genuines[i];
+		impostersCount -= hist.imposters[i];
+	}
+	if (file.fail() || genuinesCount != 0 || impostersCount != 0) CV_Error(CV_StsError,"Corrupt histogram file '" + filename + "'");
+}
+
+/**
+ * Stores a merged histogram file (a single shard 1/1)
+ * filename: path of the histogram file
+ * hist: merged histogram
+ */
+void saveHistogram(const string& filename, const Histogram& hist){
+	ofstream cfile;
+	cfile.open(filename.c_str(),ios::out | ios::trunc);
+	if (cfile.is_open()) {
+		long long genuinesCount = 0, impostersCount = 0;
+		int bins = hist.genuines.size();
+		for (int i=0; i<bins; i++){
+			genuinesCount += hist.genuines[i];
+			impostersCount += hist.imposters[i];
+		}
+		cfile << "hdverify-histogram 1" << endl;
+		cfile << "params " << hist.params << endl;
+		cfile << "shard 1 1" << endl;
+		cfile << "bins " << bins << endl;
+		cfile << "counts " << genuinesCount << " " << impostersCount << endl;
+		for (int i=0; i<bins; i++){
+			cfile << hist.genuines[i] << " " << hist.imposters[i] << endl;
+		}
+		cfile.close();
+	}
+	else {
+		CV_Error(CV_StsError,"Could not save histogram file '" + filename + "'");
+	}
+}
+
+/**
+ * Stores the genuine and imposter score distributions
+ * filename: path of the distribution file
+ * genuines: genuine score histogram
+ * imposters: imposter score histogram
+ * genuinesCount: total number of genuine comparisons
+ * impostersCount: total number of imposter comparisons
+ */
+void saveDistribution(const string& filename, const vector<long long>& genuines, const vector<long long>& imposters, const long long genuinesCount, const long long impostersCount){
+	ofstream cfile;
+	cfile.open(filename.c_str(),ios::out | ios::trunc);
+	if (cfile.is_open()) {
+		int bins = genuines.size();
+		double intervalSize = 1. / bins;
+		for (int i=0; i<bins; i++){
+			cfile << ((i + 0.5) * intervalSize) << " " << genuines[i] << " " << imposters[i] << " " << (100*((double)genuines[i]) / genuinesCount) << " " << (100*((double)imposters[i]) / impostersCount) << endl;
+		}
+		cfile.close();
+	}
+	else {
+		CV_Error(CV_StsError,"Could not save distribution file '" + filename + "'");
+	}
+}
+
+/**
+ * Stores the receiver operating characteristic (FMR/FNMR pairs)
+ * filename: path of the roc file
+ * genuines: genuine score histogram
+ * imposters: imposter score histogram
+ * genuinesCount: total number of genuine comparisons
+ * impostersCount: total number of imposter comparisons
+ */
+void saveRoc(const string& filename, const vector<long long>& genuines, const vector<long long>& imposters, const long long genuinesCount, const long long impostersCount){
+	ofstream cfile;
+	cfile.open(filename.c_str(),ios::out | ios::trunc);
+	if (cfile.is_open()) {
+		int bins = genuines.size();
+		cfile << "0 100 0" << endl;
+		long long falseaccepts = 0;
+		long long falserejects = genuinesCount;
+		long long lastfalseaccepts = falseaccepts, lastfalserejects = falserejects;
+		for (int i=0; i< bins; i++){
+			falseaccepts += imposters[i];
+			falserejects -= genuines[i];
+			if (lastfalseaccepts != falseaccepts || lastfalserejects != falserejects) {
+				double fmr = (100*((double)falseaccepts) / impostersCount), fnmr = (100*((double)falserejects) / genuinesCount);
+				cfile << fmr << " " << fnmr << " " << (100-fnmr) << endl;
+				lastfalserejects = falserejects;
+				lastfalseaccepts = falseaccepts;
+			}
+		}
+		cfile.close();
+	}
+	else {
+		CV_Error(CV_StsError,"Could not save roc file '" + filename + "'");
+	}
+}
+
+/**
+ * Prints the equal error rate to STDOUT
+ * genuines: genuine score histogram
+ * imposters: imposter score histogram
+ * genuinesCount: total number of genuine comparisons
+ * impostersCount: total number of imposter comparisons
+ */
+void printEER(const vector<long long>& genuines, const vector<long long>& imposters, const long long genuinesCount, const long long impostersCount){
+	int bins = genuines.size();
+	long long falseaccepts = 0;
+	long long falserejects = genuinesCount;
+	long long lastfalseaccepts = falseaccepts, lastfalserejects = falserejects;
+	for (int i=0; i< bins; i++){
+		falseaccepts += imposters[i];
+		falserejects -= genuines[i];
+		if (lastfalseaccepts != falseaccepts || lastfalserejects != falserejects) {
+			double fmr = (((double)falseaccepts) / impostersCount), fnmr = (((double)falserejects) / genuinesCount);
+			if (fmr == fnmr){
+				printf("EER = %f%% at threshold t = %f\n",fmr,((i+1.)/bins));
+				break;
+			}
+			else if (fmr > fnmr){ // interpolate
+				double lastfmr = (((double)lastfalseaccepts) / impostersCount);
+				double lastfnmr = (((double)lastfalserejects) / genuinesCount);
+				printf("EER = %f%% at threshold t = %f \n", (100*(-lastfmr * fnmr + lastfnmr * fmr) / (lastfnmr - lastfmr - fnmr + fmr)), ((i+1.)/bins));
+				break;
+			}
+			lastfalserejects = falserejects;
+			lastfalseaccepts = falseaccepts;
+		}
+	}
+}
+
+/** ------------------------------- commandline functions ------------------------------- **/
+
+/**
+ * Parses a command line
+ * This routine should be called for parsing command lines for executables.
+ * Note, that all options require '-' as prefix and may contain an arbitrary
+ * number of optional arguments.
+ *
+ * cmd: commandline representation
+ * argc: number of parameters
+ * argv: string array of argument values
+ */
+void cmdRead(map<string ,vector<string> >& cmd, int argc, char *argv[]){
+	for (int i=1; i< argc; i++){
+		char * argument = argv[i];
+		if (strlen(argument) > 1 && argument[0] == '-' && (argument[1] < '0' || argument[1] > '9')){
+			cmd[argument]; // insert
+			char * argument2;
+			while (i + 1 < argc && (strlen(argument2 = argv[i+1]) <= 1 || argument2[0] != '-'  || (argument2[1] >= '0' && argument2[1] <= '9'))){
+				cmd[argument].push_back(argument2);
+				i++;
+			}
+		}
+		else {
+			CV_Error(CV_StsBadArg,"Invalid command line format");
+		}
+	}
+}
+
+/**
+ * Checks, if each command line option is valid, i.e. exists in the options array
+ *
+ * cmd: commandline representation
+ * validOptions: list of valid options separated by pipe (i.e. |) character
+ */
+void cmdCheckOpts(map<string ,vector<string> >& cmd, const string validOptions){
+	vector<string> tokens;
+	const string delimiters = "|";
+	string::size_type lastPos = validOptions.find_first_not_of(delimiters,0); // skip delimiters at beginning
+	string::size_type pos = validOptions.find_first_of(delimiters, lastPos); // find first non-delimiter
+	while (string::npos != pos || string::npos != lastPos){
+		tokens.push_back(validOptions.substr(lastPos,pos - lastPos)); // add found token to vector
+		lastPos = validOptions.find_first_not_of(delimiters,pos); // skip delimiters
+		pos = validOptions.find_first_of(delimiters,lastPos); // find next non-delimiter
+	}
+	sort(tokens.begin(), tokens.end());
+	for (map<string, vector<string> >::iterator it = cmd.begin(); it != cmd.end(); it++){
+		if (!binary_search(tokens.begin(),tokens.end(),it->first)){
+			CV_Error(CV_StsBadArg,"Command line parameter '" + it->first + "' not allowed.");
+			tokens.clear();
+			return;
+		}
+	}
+	tokens.clear();
+}
+
+/*
+ * Checks, if a specific required option exists in the command line
+ *
+ * cmd: commandline representation
+ * option: option name
+ */
+void cmdCheckOptExists(map<string ,vector<string> >& cmd, const string option){
+	map<string, vector<string> >::iterator it = cmd.find(option);
+	if (it == cmd.end()) CV_Error(CV_StsBadArg,"Command line parameter '" + option + "' is required, but does not exist.");
+}
+
+/*
+ * Checks, if a specific option has the appropriate number of parameters
+ *
+ * cmd: commandline representation
+ * option: option name
+ * size: appropriate number of parameters for the option
+ */
+void cmdCheckOptSize(map<string ,vector<string> >& cmd, const string option, const unsigned int size = 1){
+	map<string, vector<string> >::iterator it = cmd.find(option);
+	if (it->second.size() != size) CV_Error(CV_StsBadArg,"Command line parameter '" + option + "' has unexpected size.");
+}
+
+/*
+ * Checks, if a specific option has the appropriate number of parameters
+ *
+ * cmd: commandline representation
+ * option: option name
+ * min: minimum appropriate number of parameters for the option
+ * max: maximum appropriate number of parameters for the option
+ */
+void cmdCheckOptRange(map<string ,vector<string> >& cmd, string option, unsigned int min = 0, unsigned int max = 1){
+	map<string, vector<string> >::iterator it = cmd.find(option);
+	unsigned int size = it->second.size();
+	if (size < min || size > max) CV_Error(CV_StsBadArg,"Command line parameter '" + option + "' is out of range.");
+}
+
+/*
+ * Returns the list of parameters for a given option
+ *
+ * cmd: commandline representation
+ * option: name of the option
+ */
+vector<string> * cmdGetOpt(map<string ,vector<string> >& cmd, const string option){
+	map<string, vector<string> >::iterator it = cmd.find(option);
+	return (it != cmd.end()) ? &(it->second) : 0;
+}
+
+/*
+ * Returns number of parameters in an option
+ *
+ * cmd: commandline representation
+ * option: name of the option
+ */
+unsigned int cmdSizePars(map<string ,vector<string> >& cmd, const string option){
+	map<string, vector<string> >::iterator it = cmd.find(option);
+	return (it != cmd.end()) ? it->second.size() : 0;
+}
+
+/*
+ * Returns a specific parameter type (int) given an option and parameter index
+ *
+ * cmd: commandline representation
+ * option: name of option
+ * param: name of parameter
+ */
+int cmdGetParInt(map<string ,vector<string> >& cmd, string option, unsigned int param = 0){
+	map<string, vector<string> >::iterator it = cmd.find(option);
+	if (it != cmd.end()) {
+		if (param < it->second.size()) {
+			return atoi(it->second[param].c_str());
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns a specific parameter type (float) given an option and parameter index
+ *
+ * cmd: commandline representation
+ * option: name of option
+ * param: name of parameter
+ */
+float cmdGetParFloat(map<string ,vector<string> >& cmd, const string option, const unsigned int param = 0){
+	map<string, vector<string> >::iterator it = cmd.find(option);
+	if (it != cmd.end()) {
+		if (param < it->second.size()) {
+			return atof(it->second[param].c_str());
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns a specific parameter type (string) given an option and parameter index
+ *
+ * cmd: commandline representation
+ * option: name of option
+ * param: name of parameter
+ */
+string cmdGetPar(map<string ,vector<string> >& cmd, const string option, const unsigned int param = 0){
+	map<string, vector<string> >::iterator it = cmd.find(option);
+	if (it != cmd.end()) {
+		if (param < it->second.size()) {
+			return it->second[param];
+		}
+	}
+	return 0;
+}
+
+/** ------------------------------- file pattern matching functions ------------------------------- **/
+
+
+/*
+ * Formats a given string, such that it can be used as a regular expression
+ * I.e. escapes special characters and uses * and ? as wildcards
+ *
+ * pattern: regular expression path pattern
+ * pos: substring starting index
+ * n: substring size
+ *
+ * returning: escaped substring
+ */
+string patternSubstrRegex(string& pattern, size_t pos, size_t n){
+	string result;
+	for (size_t i=pos, e=pos+n; i < e; i++ ) {
+		char c = pattern[i];
+		if ( c == '\\' || c == '.' || c == '+' || c == '[' || c == '{' || c == '|' || c == '(' || c == ')' || c == '^' || c == '$' || c == '}' || c == ']') {
+			result.append(1,'\\');
+			result.append(1,c);
+		}
+		else if (c == '*'){
+			result.append("([^/\\\\]*)");
+		}
+		else if (c == '?'){
+			result.append("([^/\\\\])");
+		}
+		else {
+			result.append(1,c);
+		}
+	}
+	return result;
+}
+
+/*
+ * Converts a regular expression path pattern into a list of files matching with this pattern by replacing wildcards
+ * starting in position pos assuming that all prior wildcards have been resolved yielding intermediate directory path.
+ * I.e. this function appends the files in the specified path according to yet unresolved pattern by recursive calling.
+ *
+ * pattern: regular expression path pattern
+ * files: the list to which new files can be applied
+ * pos: an index such that positions 0...pos-1 of pattern are already considered/matched yielding path
+ * path: the current directory (or empty)
+ */
+void patternToFiles(string& pattern, vector<string>& files, const size_t& pos, const string& path){
+	size_t first_unknown = pattern.find_first_of("*?",pos); // find unknown * in pattern
+	if (first_unknown != string::npos){
+		size_t last_dirpath = pattern.find_last_of("/\\",first_unknown);
+		size_t next_dirpath = pattern.find_first_of("/\\",first_unknown);
+		if (next_dirpath != string::npos){
+			boost::regex expr((last_dirpath != string::npos && last_dirpath > pos) ? patternSubstrRegex(pattern,last_dirpath+1,next_dirpath-last_dirpath-1) : patternSubstrRegex(pattern,pos,next_dirpath-pos));
+			boost::filesystem::directory_iterator end_itr; // default construction yields past-the-end
+			try {
+				for ( boost::filesystem::directory_iterator itr( ((path.length() > 0) ? path + pattern[pos-1] : (last_dirpath != string::npos && last_dirpath > pos) ? "" : "./") + ((last_dirpath != string::npos && last_dirpath > pos) ? pattern.substr(pos,last_dirpath-pos) : "")); itr != end_itr; ++itr )
+				{
+					if (boost::filesystem::is_directory(itr->path())){
+						boost::filesystem::path p = itr->path().filename();
+						string s =  p.string();
+						if (boost::regex_match(s.c_str(), expr)){
+							patternToFiles(pattern,files,(int)(next_dirpath+1),((path.length() > 0) ? path + pattern[pos-1] : "") + ((last_dirpath != string::npos && last_dirpath > pos) ? pattern.substr(pos,last_dirpath-pos) + pattern[last_dirpath] : "") + s);
+						}
+					}
+				}
+			}
+			catch (boost::filesystem::filesystem_error &e){}
+		}
+		else {
+			boost::regex expr((last_dirpath != string::npos && last_dirpath > pos) ? patternSubstrRegex(pattern,last_dirpath+1,pattern.length()-last_dirpath-1) : patternSubstrRegex(pattern,pos,pattern.length()-pos));
+			boost::filesystem::directory_iterator end_itr; // default construction yields past-the-end
+			try {
+				for ( boost::filesystem::directory_iterator itr(((path.length() > 0) ? path +  pattern[pos-1] : (last_dirpath != string::npos && last_dirpath > pos) ? "" : "./") + ((last_dirpath != string::npos && last_dirpath > pos) ? pattern.substr(pos,last_dirpath-pos) : "")); itr != end_itr; ++itr )
+				{
+					boost::filesystem::path p = itr->path().filename();
+					string s =  p.string();
+					if (boost::regex_match(s.c_str(), expr)){
+						files.push_back(((path.length() > 0) ? path + pattern[pos-1] : "") + ((last_dirpath != string::npos && last_dirpath > pos) ? pattern.substr(pos,last_dirpath-pos) + pattern[last_dirpath] : "") + s);
+					}
+				}
+			}
+			catch (boost::filesystem::filesystem_error &e){}
+		}
+	}
+	else { // no unknown symbols
+		boost::filesystem::path file(((path.length() > 0) ? path + "/" : "") + pattern.substr(pos,pattern.length()-pos));
+		if (boost::filesystem::exists(file)){
+			files.push_back(file.string());
+		}
+	}
+}
+
+/**
+ * Converts a regular expression path pattern into a list of files matching with this pattern
+ *
+ * pattern: regular expression path pattern
+ * files: the list to which new files can be applied
+ */
+void patternToFiles(string& pattern, vector<string>& files){
+	patternToFiles(pattern,files,0,"");
+}
+
+/** ------------------------------- Program ------------------------------- **/
+
+/*
+ * Main program
+ */
+int main(int argc, char *argv[])
+{
+	int mode = MODE_HELP;
+	map<string,vector<string> > cmd;
+	try {
+		cmdRead(cmd,argc,argv);
+		if (cmd.size() == 0 || cmdGetOpt(cmd,"-h") != 0) mode = MODE_HELP;
+		else mode = MODE_MAIN;
+		if (mode == MODE_MAIN){
+			// validate command line
+			cmdCheckOpts(cmd,"-i|-r|-d|-hist|-q");
+			cmdCheckOptExists(cmd,"-i");
+			cmdCheckOptRange(cmd,"-i",1,INT_MAX);
+			string roc;
+			if (cmdGetOpt(cmd,"-r") != 0){
+				cmdCheckOptSize(cmd,"-r",1);
+				roc = cmdGetPar(cmd,"-r");
+			}
+			string dist;
+			if (cmdGetOpt(cmd,"-d") != 0){
+				cmdCheckOptSize(cmd,"-d",1);
+				dist = cmdGetPar(cmd,"-d");
+			}
+			string hist;
+			if (cmdGetOpt(cmd,"-hist") != 0){
+				cmdCheckOptSize(cmd,"-hist",1);
+				hist = cmdGetPar(cmd,"-hist");
+			}
+			bool quiet = false;
+			if (cmdGetOpt(cmd,"-q") != 0){
+				cmdCheckOptSize(cmd,"-q",0);
+				quiet = true;
+			}
+			// starting routine
+			vector<string> files;
+			for (unsigned int i=0, e=cmdSizePars(cmd,"-i"); i<e; i++){
+				string infiles = cmdGetPar(cmd,"-i",i);
+				patternToFiles(infiles,files);
+			}
+			CV_Assert(files.size() > 0);
+			Histogram merged;
+			vector<string> shardFiles;
+			for (vector<string>::iterator infile = files.begin(); infile != files.end(); ++infile){
+				if (!quiet) printf("Loading histogram file '%s' ...\n",(*infile).c_str());
+				Histogram shardHist;
+				loadHistogram(*infile,shardHist);
+				if (shardFiles.empty()){
+					merged = shardHist;
+					merged.genuines.assign(shardHist.genuines.size(),0);
+					merged.imposters.assign(shardHist.imposters.size(),0);
+					shardFiles.resize(shardHist.shards);
+				}
+				if (shardHist.params != merged.params || shardHist.shards != merged.shards || shardHist.genuines.size() != merged.genuines.size()){
+					CV_Error(CV_StsBadArg,"Histogram file '" + *infile + "' does not match the parameters, shard count or bins of '" + files[0] + "'");
+				}
+				if (!shardFiles[shardHist.shard-1].empty()){
+					CV_Error(CV_StsBadArg,"Histogram files '" + shardFiles[shardHist.shard-1] + "' and '" + *infile + "' contain the same shard");
+				}
+				shardFiles[shardHist.shard-1] = *infile;
+				for (unsigned int i=0; i<merged.genuines.size(); i++){
+					merged.genuines[i] += shardHist.genuines[i];
+					merged.imposters[i] += shardHist.imposters[i];
+				}
+			}
+			for (int i=0; i<merged.shards; i++){
+				if (shardFiles[i].empty()){
+					CV_Error(CV_StsBadArg,"Shard " + to_string(i+1) + "/" + to_string(merged.shards) + " is missing");
+				}
+			}
+			long long genuinesCount = 0, impostersCount = 0;
+			for (unsigned int i=0; i<merged.genuines.size(); i++){
+				genuinesCount += merged.genuines[i];
+				impostersCount += merged.imposters[i];
+			}
+			if (!quiet) cout << "Merged " << merged.shards << " shards (" << genuinesCount << " genuines, " << impostersCount << " imposters)" << endl;
+			if (!hist.empty()){
+				if (!quiet) printf("Storing histogram file '%s' ...\n",hist.c_str());
+				saveHistogram(hist,merged);
+			}
+			if (!dist.empty()){
+				if (!quiet) printf("Storing distribution file '%s' ...\n",dist.c_str());
+				saveDistribution(dist,merged.genuines,merged.imposters,genuinesCount,impostersCount);
+			}
+			if (!roc.empty()){
+				if (!quiet) printf("Storing roc file '%s' ...\n",roc.c_str());
+				saveRoc(roc,merged.genuines,merged.imposters,genuinesCount,impostersCount);
+			}
+			// calculate EER
+			if (!quiet){
+				printEER(merged.genuines,merged.imposters,genuinesCount,impostersCount);
+			}
+    	}
+    	else if (mode == MODE_HELP){
+    		// validate command line
+			cmdCheckOpts(cmd,"-h");
+			if (cmdGetOpt(cmd,"-h") != 0) cmdCheckOptSize(cmd,"-h",0);
+			// starting routine
+			printUsage();
+    	}
+    }
+	catch (...){
+		printf("Exit with errors.\n");
+		exit(EXIT_FAILURE);
+	}
+    return EXIT_SUCCESS;
+}
@@ -12,6 +12,7 @@
 #include <vector>
 #include <string>
 #include <cstring>
+#include <cfloat>
 #include <algorithm>
 #include <fstream>
 #include <opencv2/core/core.hpp>
@@ -20,6 +21,8 @@
 #include <boost/regex.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
 
 using namespace std;
 using namespace cv;
@@ -74,11 +77,30 @@ void printUsage() {
     printf("| -ss  | shiftstep  |   | Y | Number of grouped bits to shift for one step of |\n");
     printf("|      |            |   |   | -s shift.                                       |\n");
     printf("| -n   | from to    | 1 | Y | starting (0) and ending bit (MAX)               |\n");
+    printf("| -sws | max+       | 1 | Y | sweep: evaluate all shift ranges -max..max at   |\n");
+    printf("|      |            |   |   | once (default is -s), requires min/max shifts   |\n");
+    printf("| -swn | from to+   | 1 | Y | sweep: evaluate all bit windows from..to (to may|\n");
+    printf("|      |            |   |   | be MAX) at once (default is -n), each shift     |\n");
+    printf("|      |            |   |   | range/bit window pair is one configuration. Its |\n");
+    printf("|      |            |   |   | -r, -d, -hist files get the suffix _s<min>_<max>|\n");
+    printf("|      |            |   |   | _n<from>_<to> before the extension, -o is not   |\n");
+    printf("|      |            |   |   | supported                                       |\n");
     printf("| -b   | bins       | 1 | Y | number of histogram bins (1000)                 |\n");
     printf("| -o   | genuinefile| 1 | Y | target match file paths (HD matching scores of  |\n");
     printf("|      | impostfile | 1 | Y | genuines and imposters, file-sorted)            |\n");
     printf("| -r   | rocfile    | 1 | Y | target roc-file path (FMR/FNMR pairs)           |\n");
     printf("| -d   | distfile   | 1 | Y | target distributions-file path  (Gen/Imp pairs) |\n");
+    printf("| -hist| histfile   | 1 | Y | target histogram-file path (for hdmerge)        |\n");
+    printf("| -cmc | cmcfile    | 1 | Y | target cmc-file path (rank/identification rate):|\n");
+    printf("|      | maxrank    |   | Y | each template is a probe against all others, up |\n");
+    printf("|      |            |   |   | to maxrank (20) ranks, requires all comparisons |\n");
+    printf("|      |            |   |   | and symmetric shifts (-s -n n, no -ss or -s img)|\n");
+    printf("|-state| statefile  | 1 | Y | evaluation state: scores of pairs whose template|\n");
+    printf("|      |            |   |   | contents are unchanged are reused, the state is |\n");
+    printf("|      |            |   |   | replaced by all pairs of this run (shards add   |\n");
+    printf("|      |            |   |   | their pairs to the pairs already in the file)   |\n");
+    printf("|-shard| k/K        | 1 | Y | only execute the k-th of K (1 <= k <= K) equally|\n");
+    printf("|      |            |   |   | sized blocks of comparisons (1/1)               |\n");
     printf("| -q   |            | 1 | Y | quiet mode on (off)                             |\n");
     printf("| -t   |            | 1 | Y | time progress on (off)                          |\n");
     printf("| -h   |            | 2 | N | prints usage                                    |\n");
@@ -88,6 +110,10 @@ void printUsage() {
     printf("|                                                                             |\n");
     printf("| -i files/class*/*.tiff ?1 -t -s -7 7                                        |\n");
     printf("| -i */*.tiff ?1 -m ?1/?2_mask.png -s -7 7 -o gen.txt imp.txt -q -t           |\n");
+    printf("| -i */*.tiff ?1 -s -7 7 -shard 2/4 -hist s2.hist -o gen2.txt imp2.txt -q     |\n");
+    printf("| -i */*.tiff ?1 -s -7 7 -state eval.state -r roc.txt -q                      |\n");
+    printf("| -i */*.tiff ?1 -s -7 7 -cmc cmc.txt 50 -r roc.txt                           |\n");
+    printf("| -i */*.tiff ?1 -sws 4 8 16 24 -swn 0 MAX 0 8192 -r roc.txt -t               |\n");
     printf("|                                                                             |\n");
     printf("| AUTHOR                                                                      |\n");
     printf("|                                                                             |\n");
@@ -186,42 +212,19 @@ void shift(const Mat src, Mat dst, const int shifts){
 
 /**
  * Shifts matrix a by a given shift count and intersects result with b
+ * The mask is shifted over all rows like the iris code in shift().
  * a: sample source iris mask
  * b: reference source iris mask
  * dst: destination (shifted) iris mask
  * shifts: shift count (positive values indicate left shifts)
  */
 void intersectShifted(const Mat a, const Mat b, Mat dst, const int shifts){
-	uchar * pb = b.data;
-	uchar * pa = a.data;
-	uchar * pdst = dst.data;
-	unsigned int size = dst.cols;
-	unsigned int offset;
-	if (shifts >= 0){ // left shift
-		offset = shifts / 8;
-		uchar * enddst = pdst + dst.cols;
-		unsigned int shiftCount = shifts % 8;
-		unsigned int ishiftCount = 8 - shiftCount;
-		offset = (size + offset) % size;
-		for (;pdst<enddst; pdst++, pb++){
-			*pdst = (pa[offset] << shiftCount);
-			offset = ((offset+1)%size);
-			*pdst |= (pa[offset] >> (ishiftCount));
-			*pdst &= *pb;
-		}
-	}
-	else { // right shift
-		offset = (-shifts) / 8;
-		uchar * enddst = pdst + dst.cols;
-		unsigned int shiftCount = (-shifts) % 8;
-		unsigned int ishiftCount = 8 - shiftCount;
-		offset = (size-offset-1) % size;
-		for (;pdst<enddst; pdst++, pb++){
-			*pdst = (pa[offset] << ishiftCount);
-			offset = ((offset+1)%size);
-			*pdst |= (pa[offset] >> (shiftCount));
-			*pdst &= *pb;
-		}
+	shift(a,dst,shifts);
+	MatConstIterator_<uchar> pb = b.begin<uchar>();
+	MatIterator_<uchar> pdst = dst.begin<uchar>();
+	MatIterator_<uchar> enddst = dst.end<uchar>();
+	for (;pdst<enddst; pdst++, pb++){
+		*pdst &= *pb;
 	}
 }
 
@@ -494,6 +497,369 @@ double compare(const vector<Mat>& imgSmpl, const Mat& imgRef, const unsigned int
 	else if (shiftedfiles) return ssf(imgSmpl,imgRef,from,bitStop,maskSmpl, maskRef); else return ssf(imgSmpl[0],imgRef,from,bitStop,minShifts, maxShifts, shiftStep, (maskSmpl.size() > 0) ? maskSmpl[0] : Mat(), maskRef);
 }
 
+/**
+ * Comparison configuration (shift range and bit window) evaluated by hdverify
+ */
+struct Config {
+	int minShifts; // minimum number of shifts
+	int maxShifts; // maximum number of shifts
+	unsigned int from; // starting 8-bit block (inclusive)
+	unsigned int to; // ending 8-bit block (exclusive), INT_MAX for the whole code
+	string suffix; // suffix of output files (empty if only a single configuration is evaluated)
+};
+
+/**
+ * Compares two iris codes for several shift ranges and bit windows at once. The per-shift
+ * hamming distances are computed only once for the union of all shift ranges, prefix sums
+ * over 8-bit blocks yield the distance of any bit window. Scores are identical to compare().
+ * a: first iris code
+ * b: second iris code
+ * shiftStep: number of bits per shift step
+ * alg: HD-based algorithm
+ * configs: evaluated configurations
+ * scores: score for each configuration
+ * aMask: mask for first iris code
+ * bMask: mask for second iris code
+ */
+void sweep(const Mat& a, const Mat& b, const int shiftStep, const int alg, const vector<Config>& configs, vector<double>& scores, const Mat aMask, const Mat bMask = Mat()){
+	int minShifts = configs[0].minShifts, maxShifts = configs[0].maxShifts;
+	for (vector<Config>::const_iterator it = configs.begin(); it != configs.end(); it++){
+		minShifts = min(minShifts,it->minShifts);
+		maxShifts = max(maxShifts,it->maxShifts);
+	}
+	bool masked = (!aMask.empty() && !bMask.empty());
+	unsigned int codeLength = b.rows * b.cols;
+	unsigned int blocks = codeLength + 1;
+	// prefix sums of differing and (if masked) unmasked bits for each shift
+	vector<unsigned int> diffs((maxShifts - minShifts + 1) * blocks);
+	vector<unsigned int> bits((masked) ? diffs.size() : 0);
+	Mat mask(b.rows,b.cols,CV_8UC1);
+	Mat imgSmplShifted(a.rows,a.cols,CV_8UC1);
+	for (int ss=minShifts; ss<=maxShifts; ss++){
+		int s = shiftStep*ss;
+		shift(a,imgSmplShifted,s);
+		unsigned int * pdiff = &diffs[(ss - minShifts) * blocks];
+		MatConstIterator_<uchar> pa = imgSmplShifted.begin<uchar>();
+		MatConstIterator_<uchar> pb = b.begin<uchar>();
+		pdiff[0] = 0;
+		if (masked){
+			intersectShifted(aMask,bMask,mask,s);
+			unsigned int * pbits = &bits[(ss - minShifts) * blocks];
+			MatConstIterator_<uchar> pm = mask.begin<uchar>();
+			pbits[0] = 0;
+			for (unsigned int i=0; i<codeLength; i++, pa++, pb++, pm++){
+				pdiff[i+1] = pdiff[i] + htlut[(*pa ^*pb) & *pm];
+				pbits[i+1] = pbits[i] + htlut[*pm];
+			}
+		}
+		else {
+			for (unsigned int i=0; i<codeLength; i++, pa++, pb++){
+				pdiff[i+1] = pdiff[i] + htlut[*pa ^*pb];
+			}
+		}
+	}
+	scores.resize(configs.size());
+	for (unsigned int c=0; c<configs.size(); c++){
+		const Config& config = configs[c];
+		unsigned int start8 = config.from, stop8 = min(config.to,codeLength);
+		CV_Assert(start8 <= stop8);
+		if (masked){
+			double minhamdist = 1, maxhamdist = 0;
+			for (int ss=config.minShifts; ss<=config.maxShifts; ss++){
+				unsigned int offset = (ss - minShifts) * blocks;
+				int codeLengthBits = bits[offset + stop8] - bits[offset + start8];
+				double shiftedHamdist = (codeLengthBits == 0) ? 0 : ((double)(diffs[offset + stop8] - diffs[offset + start8])) / codeLengthBits;
+				if (shiftedHamdist < minhamdist) minhamdist = shiftedHamdist;
+				if (shiftedHamdist > maxhamdist) maxhamdist = shiftedHamdist;
+			}
+			scores[c] = (alg == ALG_MINHD) ? minhamdist : (alg == ALG_MAXHD) ? 1 - maxhamdist : ((1-maxhamdist) +  minhamdist)/2;
+		}
+		else {
+			int codeLengthBits = 8*(stop8-start8);
+			unsigned int minhamdist = codeLengthBits, maxhamdist = 0;
+			for (int ss=config.minShifts; ss<=config.maxShifts; ss++){
+				unsigned int offset = (ss - minShifts) * blocks;
+				unsigned int shiftedHamdist = diffs[offset + stop8] - diffs[offset + start8];
+				if (shiftedHamdist < minhamdist) minhamdist = shiftedHamdist;
+				if (shiftedHamdist > maxhamdist) maxhamdist = shiftedHamdist;
+			}
+			scores[c] = (alg == ALG_MINHD) ? (((double)minhamdist) / (codeLengthBits)) : (alg == ALG_MAXHD) ? 1-(((double)maxhamdist) / (codeLengthBits)) : ((1-(((double)maxhamdist) / (codeLengthBits))) + (((double)minhamdist) / (codeLengthBits)))/2;
+		}
+	}
+}
+
+/**
+ * Compares two iris codes for all configurations
+ * imgSmpl: first iris code (or its shifted versions)
+ * imgRef: second iris code
+ * shiftStep: number of bits per shift step
+ * alg: HD-based algorithm
+ * configs: evaluated configurations (a single one if shiftedfiles is set)
+ * scores: score for each configuration
+ * maskSmpl: masks for first iris code
+ * maskRef: mask for second iris code
+ * shiftedfiles: imgSmpl contains shifted versions of the first iris code
+ */
+void compareAll(const vector<Mat>& imgSmpl, const Mat& imgRef, const int shiftStep, const int alg, const vector<Config>& configs, vector<double>& scores, const vector<Mat>& maskSmpl, const Mat& maskRef, bool shiftedfiles){
+	if (configs.size() == 1){
+		unsigned int bitStop = min(configs[0].to,(unsigned int)(imgRef.rows * imgRef.cols));
+		scores.resize(1);
+		scores[0] = compare(imgSmpl,imgRef,configs[0].from,bitStop,configs[0].minShifts,configs[0].maxShifts,shiftStep,alg,maskSmpl,maskRef,shiftedfiles);
+	}
+	else {
+		sweep(imgSmpl[0],imgRef,shiftStep,alg,configs,scores,(maskSmpl.size() > 0) ? maskSmpl[0] : Mat(),maskRef);
+	}
+}
+
+/** ------------------------------- evaluation functions ------------------------------- **/
+
+/**
+ * Parses a shard specification of the form k/K
+ * spec: shard specification
+ * shard: index of the shard (1 <= shard <= shards)
+ * shards: total number of shards
+ */
+void parseShard(const string& spec, int& shard, int& shards){
+	if (sscanf(spec.c_str(),"%d/%d",&shard,&shards) != 2 || shards < 1 || shard < 1 || shard > shards){
+		CV_Error(CV_StsBadArg,"Invalid shard '" + spec + "', expected k/K with 1 <= k <= K");
+	}
+}
+
+/**
+ * Determines the block of comparisons executed by a shard. Comparisons are numbered
+ * in the order they are executed, the K blocks differ in size by at most one.
+ * shard: index of the shard (1 <= shard <= shards)
+ * shards: total number of shards
+ * total: total number of comparisons
+ * begin: index of the first comparison of the shard (inclusive)
+ * end: index of the last comparison of the shard (exclusive)
+ */
+void shardRange(const int shard, const int shards, const long long total, long long& begin, long long& end){
+	begin = (total * (shard - 1)) / shards;
+	end = (total * shard) / shards;
+}
+
+/**
+ * Inserts the suffix of a configuration into a file name (before the extension)
+ * filename: path of the file
+ * suffix: suffix of the configuration
+ */
+string configFilename(const string& filename, const string& suffix){
+	size_t dot = filename.find_last_of('.');
+	size_t sep = filename.find_last_of("/\\");
+	if (dot == string::npos || (sep != string::npos && dot < sep)) return filename + suffix;
+	return filename.substr(0,dot) + suffix + filename.substr(dot);
+}
+/**
+ * Stores a histogram file which can be merged with other shards by hdmerge
+ * filename: path of the histogram file
+ * params: description of the comparison parameters (shards are only merged if identical)
+ * shard: index of the shard (1 <= shard <= shards)
+ * shards: total number of shards
+ * genuines: genuine score histogram
+ * imposters: imposter score histogram
+ * bins: number of histogram bins
+ */
+void saveHistogram(const string& filename, const string& params, const int shard, const int shards, const int * genuines, const int * imposters, const int bins){
+	ofstream cfile;
+	cfile.open(filename.c_str(),ios::out | ios::trunc);
+	if (cfile.is_open()) {
+		long long genuinesCount = 0, impostersCount = 0;
+		for (int i=0; i<bins; i++){
+			genuinesCount += genuines[i];
+			impostersCount += imposters[i];
+		}
+		cfile << "hdverify-histogram 1" << endl;
+		cfile << "params " << params << endl;
+		cfile << "shard " << shard << " " << shards << endl;
+		cfile << "bins " << bins << endl;
+		cfile << "counts " << genuinesCount << " " << impostersCount << endl;
+		for (int i=0; i<bins; i++){
+			cfile << genuines[i] << " " << imposters[i] << endl;
+		}
+		cfile.close();
+	}
+	else {
+		CV_Error(CV_StsError,"Could not save histogram file '" + filename + "'");
+	}
+}
+
+/**
+ * Stores the genuine and imposter score distributions
+ * filename: path of the distribution file
+ * genuines: genuine score histogram
+ * imposters: imposter score histogram
+ * bins: number of histogram bins
+ * genuinesCount: total number of genuine comparisons
+ * impostersCount: total number of imposter comparisons
+ */
+void saveDistribution(const string& filename, const int * genuines, const int * imposters, const int bins, const int genuinesCount, const int impostersCount){
+	ofstream cfile;
+	cfile.open(filename.c_str(),ios::out | ios::trunc);
+	if (cfile.is_open()) {
+		double intervalSize = 1. / bins;
+		for (int i=0; i<bins; i++){
+			cfile << ((i + 0.5) * intervalSize) << " " << genuines[i] << " " << imposters[i] << " " << (100*((double)genuines[i]) / genuinesCount) << " " << (100*((double)imposters[i]) / impostersCount) << endl;
+		}
+		cfile.close();
+	}
+	else {
+		CV_Error(CV_StsError,"Could not save distribution file '" + filename + "'");
+	}
+}
+
+/**
+ * Stores the receiver operating characteristic (FMR/FNMR pairs)
+ * filename: path of the roc file
+ * genuines: genuine score histogram
+ * imposters: imposter score histogram
+ * bins: number of histogram bins
+ * genuinesCount: total number of genuine comparisons
+ * impostersCount: total number of imposter comparisons
+ */
+void saveRoc(const string& filename, const int * genuines, const int * imposters, const int bins, const int genuinesCount, const int impostersCount){
+	ofstream cfile;
+	cfile.open(filename.c_str(),ios::out | ios::trunc);
+	if (cfile.is_open()) {
+		cfile << "0 100 0" << endl;
+		int falseaccepts = 0;
+		int falserejects = genuinesCount;
+		int lastfalseaccepts = falseaccepts, lastfalserejects = falserejects;
+		for (int i=0; i< bins; i++){
+			falseaccepts += imposters[i];
+			falserejects -= genuines[i];
+			if (lastfalseaccepts != falseaccepts || lastfalserejects != falserejects) {
+				double fmr = (100*((double)falseaccepts) / impostersCount), fnmr = (100*((double)falserejects) / genuinesCount);
+				cfile << fmr << " " << fnmr << " " << (100-fnmr) << endl;
+				lastfalserejects = falserejects;
+				lastfalseaccepts = falseaccepts;
+			}
+		}
+		cfile.close();
+	}
+	else {
+		CV_Error(CV_StsError,"Could not save roc file '" + filename + "'");
+	}
+}
+
+/**
+ * Prints the equal error rate to STDOUT
+ * genuines: genuine score histogram
+ * imposters: imposter score histogram
+ * bins: number of histogram bins
+ * genuinesCount: total number of genuine comparisons
+ * impostersCount: total number of imposter comparisons
+ */
+void printEER(const int * genuines, const int * imposters, const int bins, const int genuinesCount, const int impostersCount){
+	int falseaccepts = 0;
+	int falserejects = genuinesCount;
+	int lastfalseaccepts = falseaccepts, lastfalserejects = falserejects;
+	for (int i=0; i< bins; i++){
+		falseaccepts += imposters[i];
+		falserejects -= genuines[i];
+		if (lastfalseaccepts != falseaccepts || lastfalserejects != falserejects) {
+			double fmr = (((double)falseaccepts) / impostersCount), fnmr = (((double)falserejects) / genuinesCount);
+			if (fmr == fnmr){
+				printf("EER = %f%% at threshold t = %f\n",fmr,((i+1.)/bins));
+				break;
+			}
+			else if (fmr > fnmr){ // interpolate
+				double lastfmr = (((double)lastfalseaccepts) / impostersCount);
+				double lastfnmr = (((double)lastfalserejects) / genuinesCount);
+				printf("EER = %f%% at threshold t = %f \n", (100*(-lastfmr * fnmr + lastfnmr * fmr) / (lastfnmr - lastfmr - fnmr + fmr)), ((i+1.)/bins));
+				break;
+			}
+			lastfalserejects = falserejects;
+			lastfalseaccepts = falseaccepts;
+		}
+	}
+}
+
+/**
+ * Identification candidates of a probe template: the best genuine score and the
+ * best scores of the (at most maxRank) closest other classes sorted ascending
+ */
+struct RankList {
+	double genuine; // best genuine score (DBL_MAX if no genuine comparison)
+	vector<pair<double,int> > imposters; // (best score, class) of the closest other classes
+	RankList() : genuine(DBL_MAX) {}
+};
+
+/**
+ * Registers the score of a probe against a gallery template. Only the best score
+ * of each class is kept, classes ranked behind maxRank can never affect the curve.
+ * list: candidates of the probe
+ * probeClass: class of the probe
+ * refClass: class of the gallery template
+ * score: comparison score (lower is better)
+ * maxRank: highest rank of the curve
+ */
+void rankUpdate(RankList& list, const int probeClass, const int refClass, const double score, const unsigned int maxRank){
+	if (probeClass == refClass){
+		if (score < list.genuine) list.genuine = score;
+		return;
+	}
+	vector<pair<double,int> >& cand = list.imposters;
+	size_t pos = 0;
+	while (pos < cand.size() && cand[pos].second != refClass) pos++;
+	if (pos < cand.size()){
+		if (score >= cand[pos].first) return;
+	}
+	else if (cand.size() < maxRank){
+		cand.push_back(make_pair(score,refClass));
+	}
+	else if (score < cand.back().first){
+		pos = cand.size() - 1;
+	}
+	else return;
+	// move the improved class to its sorted position
+	cand[pos] = make_pair(score,refClass);
+	for (; pos > 0 && cand[pos].first < cand[pos-1].first; pos--) swap(cand[pos],cand[pos-1]);
+}
+
+/**
+ * Computes the cumulative match characteristic, a probe is identified at rank k if
+ * its genuine class scores strictly better than the k-th closest other class
+ * (probes without genuine comparison are not counted)
+ * lists: candidates of all probes
+ * maxRank: highest rank of the curve
+ * cmc: identified probes for ranks 1..maxRank
+ * returns: number of counted probes
+ */
+int computeCmc(const vector<RankList>& lists, const unsigned int maxRank, vector<int>& cmc){
+	cmc.assign(maxRank,0);
+	int probes = 0;
+	for (vector<RankList>::const_iterator it = lists.begin(); it != lists.end(); it++){
+		if (it->genuine == DBL_MAX) continue;
+		probes++;
+		unsigned int rank = 0; // classes not behind the genuine class
+		while (rank < it->imposters.size() && it->imposters[rank].first <= it->genuine) rank++;
+		if (rank < maxRank) cmc[rank]++;
+	}
+	for (unsigned int k=1; k<maxRank; k++) cmc[k] += cmc[k-1];
+	return probes;
+}
+
+/**
+ * Stores the cumulative match characteristic (rank/identification rate pairs)
+ * filename: path of the cmc file
+ * cmc: identified probes for ranks 1..maxRank
+ * probes: number of counted probes
+ */
+void saveCmc(const string& filename, const vector<int>& cmc, const int probes){
+	ofstream cfile;
+	cfile.open(filename.c_str(),ios::out | ios::trunc);
+	if (cfile.is_open()) {
+		for (unsigned int k=0; k<cmc.size(); k++){
+			cfile << (k+1) << " " << ((probes > 0) ? (100*((double)cmc[k]) / probes) : 0) << endl;
+		}
+		cfile.close();
+	}
+	else {
+		CV_Error(CV_StsError,"Could not save cmc file '" + filename + "'");
+	}
+}
+
 /** ------------------------------- commandline functions ------------------------------- **/
 
 /**
@@ -891,6 +1257,287 @@ void patternFileRename(string& pattern, const string& renamePattern, const strin
 	}
 }
 
+/** ------------------------------- evaluation state functions ------------------------------- **/
+
+/**
+ * Persistent evaluation state: scores of all compared pairs keyed by the content hashes of
+ * sample and reference template, valid for one set of comparison parameters. Pairs are kept
+ * as fixed-size records in flat arrays sorted by key and looked up by binary search.
+ */
+struct EvalState {
+	bool enabled; // state file given
+	string params; // comparison parameters of all configurations
+	unsigned int configs; // number of scores per pair
+	vector<pair<unsigned long long, unsigned long long> > keys; // sorted (sample,reference) hashes of the loaded pairs
+	vector<double> scores; // scores of the loaded pairs, configs per pair in key order
+	vector<bool> used; // loaded pairs compared in this run
+	vector<pair<unsigned long long, unsigned long long> > newKeys; // pairs computed in this run (unsorted)
+	vector<double> newScores; // scores of the computed pairs, configs per pair
+	map<string, unsigned long long> refHashes; // content hashes of reference templates (file and mask path)
+	long long reused; // number of scores taken from the state
+};
+
+/**
+ * Updates an FNV-1a hash with the dimensions and content of a template image
+ * hash: hash value to update
+ * img: template image (code or mask)
+ */
+void hashImage(unsigned long long& hash, const Mat& img){
+	int dims[2] = {img.rows, img.cols};
+	const uchar * pdims = (const uchar *) dims;
+	for (unsigned int i=0; i<sizeof(dims); i++){
+		hash = (hash ^ pdims[i]) * 1099511628211ULL;
+	}
+	for (int y=0; y<img.rows; y++){
+		const uchar * p = img.ptr<uchar>(y);
+		for (int x=0; x<img.cols; x++){
+			hash = (hash ^ p[x]) * 1099511628211ULL;
+		}
+	}
+}
+
+/**
+ * Computes the content hash of a template (all codes and masks)
+ * imgs: iris codes (or shifted versions)
+ * masks: corresponding masks (may be empty)
+ */
+unsigned long long hashTemplate(const vector<Mat>& imgs, const vector<Mat>& masks){
+	unsigned long long hash = 14695981039346656037ULL;
+	for (vector<Mat>::const_iterator it = imgs.begin(); it != imgs.end(); it++) hashImage(hash,*it);
+	hash = (hash ^ 'm') * 1099511628211ULL;
+	for (vector<Mat>::const_iterator it = masks.begin(); it != masks.end(); it++) hashImage(hash,*it);
+	return hash;
+}
+
+/**
+ * Loads a reference iris code and its mask
+ * reffile: path of the reference iris code
+ * infiles: input file pattern
+ * maskfiles: mask file pattern (?n = n-th * in infiles)
+ * masks: whether masks are used
+ * codeSize: expected size of the code
+ * imgRef: receives the reference iris code
+ * maskRef: receives the reference mask (empty without masks)
+ */
+void loadReference(const string& reffile, const string& infiles, const string& maskfiles, const bool masks, const Size& codeSize, Mat& imgRef, Mat& maskRef){
+	imgRef = imread(reffile, CV_LOAD_IMAGE_UNCHANGED);
+	CV_Assert(imgRef.data != 0);
+	CV_Assert(imgRef.type() == CV_8UC1);
+	CV_Assert(imgRef.size() == codeSize);
+	if (masks){
+		string pattern = infiles, maskRefFile;
+		patternFileRename(pattern,maskfiles,reffile,maskRefFile);
+		maskRef = imread(maskRefFile, CV_LOAD_IMAGE_UNCHANGED);
+		CV_Assert(maskRef.data != 0);
+		CV_Assert(maskRef.type() == CV_8UC1);
+		CV_Assert(maskRef.size() == codeSize);
+	}
+	else {
+		maskRef = Mat();
+	}
+}
+
+/**
+ * Compares a sample with a reference template for all configurations. If an evaluation
+ * state is used, scores of pairs with unchanged content are taken from the state and
+ * references are only loaded when their content hash is not yet known.
+ * imgSmpl: sample iris code (or its shifted versions)
+ * maskSmpl: masks of the sample
+ * hashSmpl: content hash of the sample (only with state)
+ * reffile: path of the reference iris code
+ * infiles: input file pattern
+ * maskfiles: mask file pattern of the reference
+ * masks: whether masks are used
+ * codeSize: size of the codes
+ * shiftStep: number of bits per shift step
+ * alg: HD-based algorithm
+ * configs: evaluated configurations
+ * shiftedfiles: imgSmpl contains shifted versions of the sample
+ * state: evaluation state
+ * scores: receives the score for each configuration
+ */
+void compareReference(const vector<Mat>& imgSmpl, const vector<Mat>& maskSmpl, const unsigned long long hashSmpl, const string& reffile, const string& infiles, const string& maskfiles, const bool masks, const Size& codeSize, const int shiftStep, const int alg, const vector<Config>& configs, const bool shiftedfiles, EvalState& state, vector<double>& scores){
+	Mat imgRef, maskRef;
+	if (!state.enabled){
+		loadReference(reffile,infiles,maskfiles,masks,codeSize,imgRef,maskRef);
+		compareAll(imgSmpl,imgRef,shiftStep,alg,configs,scores,maskSmpl,maskRef,shiftedfiles);
+		return;
+	}
+	string refkey = reffile + "|" + ((masks) ? maskfiles : "");
+	map<string, unsigned long long>::iterator hit = state.refHashes.find(refkey);
+	if (hit == state.refHashes.end()){
+		loadReference(reffile,infiles,maskfiles,masks,codeSize,imgRef,maskRef);
+		hit = state.refHashes.insert(make_pair(refkey,hashTemplate(vector<Mat>(1,imgRef),(masks) ? vector<Mat>(1,maskRef) : vector<Mat>()))).first;
+	}
+	pair<unsigned long long, unsigned long long> key = make_pair(hashSmpl,hit->second);
+	vector<pair<unsigned long long, unsigned long long> >::const_iterator kit = lower_bound(state.keys.begin(),state.keys.end(),key);
+	if (kit != state.keys.end() && *kit == key){
+		size_t idx = kit - state.keys.begin();
+		scores.assign(state.scores.begin() + idx * state.configs,state.scores.begin() + (idx + 1) * state.configs);
+		state.used[idx] = true;
+		state.reused++;
+	}
+	else {
+		if (imgRef.empty()) loadReference(reffile,infiles,maskfiles,masks,codeSize,imgRef,maskRef);
+		compareAll(imgSmpl,imgRef,shiftStep,alg,configs,scores,maskSmpl,maskRef,shiftedfiles);
+		state.newKeys.push_back(key);
+		state.newScores.insert(state.newScores.end(),scores.begin(),scores.end());
+	}
+}
+
+/**
+ * Reads the pairs of an evaluation state file
+ * filename: path of the state file
+ * params: comparison parameters of all configurations
+ * configs: number of configurations
+ * keys: receives the sorted (sample,reference) hashes of all pairs
+ * scores: receives the scores of all pairs, configs per pair in key order
+ * returns: 1 if the pairs were read, 0 if there is no state file, -1 if it was computed with other parameters
+ */
+int readState(const string& filename, const string& params, const unsigned int configs, vector<pair<unsigned long long, unsigned long long> >& keys, vector<double>& scores){
+	keys.clear();
+	scores.clear();
+	ifstream sfile(filename.c_str(),ios::in | ios::binary);
+	if (!sfile.is_open()) return 0;
+	char magic[8];
+	int version = 0, paramsLength = 0, configsCount = 0;
+	long long count = 0;
+	sfile.read(magic,8);
+	sfile.read((char *)&version,sizeof(int));
+	if (!sfile || memcmp(magic,"HDVSTATE",8) != 0 || version != 1) CV_Error(CV_StsError,"Invalid evaluation state file '" + filename + "'");
+	sfile.read((char *)&paramsLength,sizeof(int));
+	if (!sfile || paramsLength < 0) CV_Error(CV_StsError,"Invalid evaluation state file '" + filename + "'");
+	string fileParams(paramsLength,' ');
+	if (paramsLength > 0) sfile.read(&fileParams[0],paramsLength);
+	sfile.read((char *)&configsCount,sizeof(int));
+	sfile.read((char *)&count,sizeof(long long));
+	if (!sfile || count < 0) CV_Error(CV_StsError,"Invalid evaluation state file '" + filename + "'");
+	if (fileParams != params || configsCount != (int)configs) return -1;
+	uintmax_t recordSize = 2 * sizeof(unsigned long long) + configs * sizeof(double);
+	if ((uintmax_t)count > boost::filesystem::file_size(filename) / recordSize) CV_Error(CV_StsError,"Truncated evaluation state file '" + filename + "'");
+	keys.resize(count);
+	scores.resize(count * configs);
+	for (long long i=0; i<count; i++){
+		sfile.read((char *)&keys[i].first,sizeof(unsigned long long));
+		sfile.read((char *)&keys[i].second,sizeof(unsigned long long));
+		sfile.read((char *)&scores[i * configs],configs * sizeof(double));
+		if (!sfile) CV_Error(CV_StsError,"Truncated evaluation state file '" + filename + "'");
+		if (i > 0 && !(keys[i-1] < keys[i])) CV_Error(CV_StsError,"Invalid evaluation state file '" + filename + "' (pairs not sorted)");
+	}
+	return 1;
+}
+
+/**
+ * Loads the evaluation state, a missing file or a file with other comparison parameters yields an empty state
+ * filename: path of the state file
+ * state: evaluation state (params and configs must be set)
+ * quiet: suppress messages
+ */
+void loadState(const string& filename, EvalState& state, const bool quiet){
+	int result = readState(filename,state.params,state.configs,state.keys,state.scores);
+	state.used.assign(state.keys.size(),false);
+	if (quiet) return;
+	if (result == 0) printf("No evaluation state '%s', computing all comparisons ...\n",filename.c_str());
+	else if (result < 0) printf("Evaluation state '%s' was computed with other parameters, computing all comparisons ...\n",filename.c_str());
+	else printf("Loaded evaluation state '%s' (%u pairs) ...\n",filename.c_str(),(unsigned int)state.keys.size());
+}
+
+/**
+ * Merges two lists of pairs sorted by key, a pair contained in both lists is taken from the first one
+ * keysA, scoresA: first list (keys and configs scores per pair)
+ * keysB, scoresB: second list
+ * configs: number of scores per pair
+ * keys, scores: receive the merged list
+ */
+void mergeState(const vector<pair<unsigned long long, unsigned long long> >& keysA, const vector<double>& scoresA, const vector<pair<unsigned long long, unsigned long long> >& keysB, const vector<double>& scoresB, const unsigned int configs, vector<pair<unsigned long long, unsigned long long> >& keys, vector<double>& scores){
+	keys.clear();
+	scores.clear();
+	keys.reserve(keysA.size() + keysB.size());
+	scores.reserve(scoresA.size() + scoresB.size());
+	size_t a = 0, b = 0;
+	while (a < keysA.size() || b < keysB.size()){
+		bool takeA = (b == keysB.size() || (a < keysA.size() && !(keysB[b] < keysA[a])));
+		const pair<unsigned long long, unsigned long long>& key = (takeA) ? keysA[a] : keysB[b];
+		const double * pscores = (takeA) ? &scoresA[a * configs] : &scoresB[b * configs];
+		if (takeA) a++; else b++;
+		if (!keys.empty() && keys.back() == key) continue; // already taken from the first list
+		keys.push_back(key);
+		scores.insert(scores.end(),pscores,pscores + configs);
+	}
+}
+
+/**
+ * Stores the scores of all pairs compared in this run as evaluation state. The file is
+ * written under a temporary name and renamed while holding a lock on filename.lock, so an
+ * interrupted run keeps the old state. Shards of one evaluation (merge) add their pairs to
+ * the pairs already in the state file instead of replacing them.
+ * filename: path of the state file
+ * state: evaluation state (the loaded pairs are reduced to those used in this run)
+ * merge: keep the pairs of the state file which were not compared in this run
+ */
+void saveState(const string& filename, EvalState& state, const bool merge){
+	unsigned int configs = state.configs;
+	// pairs computed in this run sorted by key (stable, the first score of a pair computed twice is kept)
+	vector<size_t> order(state.newKeys.size());
+	for (size_t i=0; i<order.size(); i++) order[i] = i;
+	stable_sort(order.begin(),order.end(),[&state](size_t a, size_t b){ return state.newKeys[a] < state.newKeys[b]; });
+	vector<pair<unsigned long long, unsigned long long> > newKeys(order.size());
+	vector<double> newScores(order.size() * configs);
+	for (size_t i=0; i<order.size(); i++){
+		newKeys[i] = state.newKeys[order[i]];
+		copy(state.newScores.begin() + order[i] * configs,state.newScores.begin() + (order[i] + 1) * configs,newScores.begin() + i * configs);
+	}
+	vector<size_t>().swap(order);
+	vector<pair<unsigned long long, unsigned long long> >().swap(state.newKeys);
+	vector<double>().swap(state.newScores);
+	// loaded pairs compared in this run (in place, remains sorted)
+	size_t count = 0;
+	for (size_t i=0; i<state.keys.size(); i++){
+		if (!state.used[i]) continue;
+		state.keys[count] = state.keys[i];
+		copy(state.scores.begin() + i * configs,state.scores.begin() + (i + 1) * configs,state.scores.begin() + count * configs);
+		count++;
+	}
+	state.keys.resize(count);
+	state.scores.resize(count * configs);
+	state.used.assign(count,true);
+	vector<pair<unsigned long long, unsigned long long> > keys;
+	vector<double> scores;
+	mergeState(newKeys,newScores,state.keys,state.scores,configs,keys,scores);
+	string lockfile = filename + ".lock";
+	{ ofstream touch(lockfile.c_str(),ios::out | ios::app); }
+	boost::interprocess::file_lock lock(lockfile.c_str());
+	boost::interprocess::scoped_lock<boost::interprocess::file_lock> guard(lock);
+	if (merge){ // state file as written by the shards finished so far
+		vector<pair<unsigned long long, unsigned long long> > fileKeys;
+		vector<double> fileScores;
+		if (readState(filename,state.params,configs,fileKeys,fileScores) > 0){
+			newKeys.swap(keys);
+			newScores.swap(scores);
+			mergeState(newKeys,newScores,fileKeys,fileScores,configs,keys,scores);
+		}
+	}
+	string tmpfile = filename + ".tmp";
+	ofstream sfile(tmpfile.c_str(),ios::out | ios::trunc | ios::binary);
+	if (!sfile.is_open()) CV_Error(CV_StsError,"Could not save evaluation state '" + filename + "'");
+	int version = 1, paramsLength = state.params.size(), configsCount = configs;
+	long long pairs = keys.size();
+	sfile.write("HDVSTATE",8);
+	sfile.write((const char *)&version,sizeof(int));
+	sfile.write((const char *)&paramsLength,sizeof(int));
+	sfile.write(state.params.c_str(),paramsLength);
+	sfile.write((const char *)&configsCount,sizeof(int));
+	sfile.write((const char *)&pairs,sizeof(long long));
+	for (size_t i=0; i<keys.size(); i++){
+		sfile.write((const char *)&keys[i].first,sizeof(unsigned long long));
+		sfile.write((const char *)&keys[i].second,sizeof(unsigned long long));
+		sfile.write((const char *)&scores[i * configs],configs * sizeof(double));
+	}
+	sfile.close();
+	if (!sfile) CV_Error(CV_StsError,"Could not save evaluation state '" + filename + "'");
+	boost::filesystem::rename(tmpfile,filename);
+}
+
 /** ------------------------------- Program ------------------------------- **/
 
 /*
@@ -906,7 +1553,7 @@ int main(int argc, char *argv[])
 		else mode = MODE_MAIN;
 		if (mode == MODE_MAIN){
 			// validate command line
-			cmdCheckOpts(cmd,"-i|-s|-ss|-m|-c|-a|-n|-b|-o|-r|-d|-q|-t");
+			cmdCheckOpts(cmd,"-i|-s|-ss|-m|-c|-a|-n|-sws|-swn|-b|-o|-r|-d|-hist|-cmc|-state|-shard|-q|-t");
 			cmdCheckOptExists(cmd,"-i");
 			cmdCheckOptSize(cmd,"-i",2);
 			string infiles = cmdGetPar(cmd,"-i",0);
@@ -947,6 +1594,53 @@ int main(int argc, char *argv[])
 				CV_Assert(to % 8 == 0);
 				to /= 8;
 			}
+			// each pair of shift range and bit window is evaluated as one configuration
+			vector<pair<int,int> > sweepShifts(1,make_pair(minShifts,maxShifts));
+			if (cmdGetOpt(cmd,"-sws") != 0){
+				if (shiftedfiles) CV_Error(CV_StsBadArg,"Sweeping shift ranges (-sws) requires min/max shifts (-s min max)");
+				cmdCheckOptRange(cmd,"-sws",1,INT_MAX);
+				sweepShifts.clear();
+				for (unsigned int i=0; i<cmdSizePars(cmd,"-sws"); i++){
+					int shifts = cmdGetParInt(cmd,"-sws",i);
+					CV_Assert(shifts >= 0);
+					sweepShifts.push_back(make_pair(-shifts,shifts));
+				}
+			}
+			vector<pair<unsigned int,unsigned int> > sweepWindows(1,make_pair(from,to));
+			if (cmdGetOpt(cmd,"-swn") != 0){
+				cmdCheckOptRange(cmd,"-swn",2,INT_MAX);
+				if (cmdSizePars(cmd,"-swn") % 2 != 0) CV_Error(CV_StsBadArg,"Bit windows (-swn) have to be pairs of starting and ending bit");
+				sweepWindows.clear();
+				for (unsigned int i=0; i<cmdSizePars(cmd,"-swn"); i+=2){
+					unsigned int windowFrom = cmdGetParInt(cmd,"-swn",i);
+					CV_Assert(windowFrom % 8 == 0);
+					unsigned int windowTo = INT_MAX;
+					if (cmdGetPar(cmd,"-swn",i+1) != "MAX"){
+						windowTo = cmdGetParInt(cmd,"-swn",i+1);
+						CV_Assert(windowTo % 8 == 0);
+						windowTo /= 8;
+					}
+					sweepWindows.push_back(make_pair(windowFrom / 8,windowTo));
+				}
+			}
+			vector<Config> configs;
+			for (vector<pair<int,int> >::iterator sit = sweepShifts.begin(); sit != sweepShifts.end(); sit++){
+				for (vector<pair<unsigned int,unsigned int> >::iterator wit = sweepWindows.begin(); wit != sweepWindows.end(); wit++){
+					Config config;
+					config.minShifts = sit->first;
+					config.maxShifts = sit->second;
+					config.from = wit->first;
+					config.to = wit->second;
+					configs.push_back(config);
+				}
+			}
+			if (configs.size() > 1){
+				if (shiftedfiles) CV_Error(CV_StsBadArg,"Sweeping bit windows (-swn) requires min/max shifts (-s min max)");
+				if (cmdGetOpt(cmd,"-o") != 0) CV_Error(CV_StsBadArg,"Score files (-o) are not supported when sweeping several configurations");
+				for (vector<Config>::iterator it = configs.begin(); it != configs.end(); it++){
+					it->suffix = "_s" + to_string(it->minShifts) + "_" + to_string(it->maxShifts) + "_n" + to_string(it->from * 8) + "_" + ((it->to == INT_MAX) ? "MAX" : to_string(it->to * 8));
+				}
+			}
 			bool masks = (cmdGetOpt(cmd,"-m") != 0);
 			if (masks && shiftedfiles) cmdCheckOptSize(cmd,"-m",2); else if (masks) cmdCheckOptSize(cmd,"-m",1);
 			string maskfiles = ((masks) ? cmdGetPar(cmd,"-m",0) : "");
@@ -981,6 +1675,32 @@ int main(int argc, char *argv[])
 				cmdCheckOptSize(cmd,"-d",1);
 				dist = cmdGetPar(cmd,"-d");
 			}
+			string hist;
+			if (cmdGetOpt(cmd,"-hist") != 0){
+				cmdCheckOptSize(cmd,"-hist",1);
+				hist = cmdGetPar(cmd,"-hist");
+			}
+			string cmcfile;
+			unsigned int maxRank = 20;
+			if (cmdGetOpt(cmd,"-cmc") != 0){
+				cmdCheckOptRange(cmd,"-cmc",1,2);
+				cmcfile = cmdGetPar(cmd,"-cmc",0);
+				if (cmdSizePars(cmd,"-cmc") > 1){
+					int rank = cmdGetParInt(cmd,"-cmc",1);
+					CV_Assert(rank > 0);
+					maxRank = rank;
+				}
+			}
+			string statefile;
+			if (cmdGetOpt(cmd,"-state") != 0){
+				cmdCheckOptSize(cmd,"-state",1);
+				statefile = cmdGetPar(cmd,"-state");
+			}
+			int shard = 1, shards = 1;
+			if (cmdGetOpt(cmd,"-shard") != 0){
+				cmdCheckOptSize(cmd,"-shard",1);
+				parseShard(cmdGetPar(cmd,"-shard"),shard,shards);
+			}
 			bool quiet = false;
 			if (cmdGetOpt(cmd,"-q") != 0){
 				cmdCheckOptSize(cmd,"-q",0);
@@ -991,6 +1711,11 @@ int main(int argc, char *argv[])
 				cmdCheckOptSize(cmd,"-t",0);
 				time = true;
 			}
+			if (!cmcfile.empty() && (mod != EVAL_ALL || shards > 1)) CV_Error(CV_StsBadArg,"Identification (-cmc) requires all comparisons (-c all) of a single shard");
+			// the score of a pair is used for both templates as probe, which requires score(a,b) = score(b,a)
+			bool symmetric = !shiftedfiles && cmdGetOpt(cmd,"-ss") == 0;
+			for (vector<Config>::iterator it = configs.begin(); it != configs.end(); it++) if (it->minShifts != -it->maxShifts) symmetric = false;
+			if (!cmcfile.empty() && !symmetric) CV_Error(CV_StsBadArg,"Identification (-cmc) requires symmetric shifts (-s -n n) without -ss or shifted files");
 			// starting routine
 			Timing timing(1,quiet);
 			vector<string> files;
@@ -1004,6 +1729,7 @@ int main(int argc, char *argv[])
 				userTemplates[user].push_back(*infile);
 			}
 			int genuinesCount = 0, impostersCount = 0;
+			long long comparisonsCount = 0;
 			// counting comparisons
 			if (mod == EVAL_BALANCED){
 				for (map<string, vector<string> >::iterator it = userTemplates.begin(); it != userTemplates.end(); it++){
@@ -1011,6 +1737,7 @@ int main(int argc, char *argv[])
 					genuinesCount += (templSize * (templSize-1))/2;
 					impostersCount ++;
 				}
+				comparisonsCount = genuinesCount + (((long long)impostersCount) * (impostersCount - 1))/2;
 				impostersCount = (impostersCount * (impostersCount - 1))/2;
 			}
 			else {// mod == EVAL_ALL
@@ -1019,9 +1746,32 @@ int main(int argc, char *argv[])
 					genuinesCount += (templSize * (templSize-1))/2;
 					impostersCount += templSize;
 				}
+				comparisonsCount = (((long long)impostersCount) * (impostersCount - 1))/2;
 				impostersCount = (impostersCount * (impostersCount - 1))/2;
 				impostersCount -= genuinesCount;
 			}
+			// comparisons [shardBegin,shardEnd) in execution order are executed by this shard
+			long long shardBegin = 0, shardEnd = comparisonsCount;
+			shardRange(shard,shards,comparisonsCount,shardBegin,shardEnd);
+			long long comparison = 0;
+			// shards are only merged if they used identical parameters on the same set of templates
+			vector<string> params;
+			// scores in the evaluation state do not depend on the set of templates
+			EvalState state;
+			state.enabled = !statefile.empty();
+			state.configs = configs.size();
+			state.reused = 0;
+			for (vector<Config>::iterator it = configs.begin(); it != configs.end(); it++){
+				string comparisonParams = string((alg == ALG_MAXHD) ? "maxhd" : (alg == ALG_SSF) ? "ssf" : "minhd")
+					+ " " + ((shiftedfiles) ? "files" : to_string(it->minShifts) + " " + to_string(it->maxShifts) + " " + to_string(shiftStep))
+					+ " " + to_string(it->from * 8) + " " + ((it->to == INT_MAX) ? "MAX" : to_string(it->to * 8))
+					+ " " + ((masks) ? "masks" : "nomasks");
+				params.push_back(comparisonParams
+					+ " " + ((mod == EVAL_BALANCED) ? "balanced" : "all")
+					+ " " + to_string(comparisonsCount));
+				state.params += comparisonParams + ";";
+			}
+			if (state.enabled) loadState(statefile,state,quiet);
 			if (!quiet) cout << "done" << endl;
 			ofstream gfile, ifile;
 			if (!gsfile.empty()){
@@ -1037,14 +1787,27 @@ int main(int argc, char *argv[])
 				if (!quiet) cout << "done" << endl;
 			}
 			if (!quiet) cout << "Executing matches (" << genuinesCount << " genuines, " << impostersCount << " imposters) ..."<< endl;
-			int * genuines = new int[bins];
-			int * imposters = new int[bins];
-			memset(genuines, 0,bins*sizeof(int));
-			memset(imposters, 0,bins*sizeof(int));
-			timing.total = genuinesCount + impostersCount;
+			if (!quiet && shards > 1) cout << "Executing shard " << shard << "/" << shards << " (comparisons " << shardBegin << " to " << (shardEnd - 1) << ") ..." << endl;
+			if (!quiet && configs.size() > 1) cout << "Sweeping " << configs.size() << " configurations ..." << endl;
+			// one genuine and imposter histogram per configuration
+			vector<vector<int> > genuines(configs.size(),vector<int>(bins,0));
+			vector<vector<int> > imposters(configs.size(),vector<int>(bins,0));
+			vector<double> scores;
+			// identification candidates per configuration and probe, templates and classes are numbered in execution order
+			bool identification = !cmcfile.empty();
+			vector<vector<RankList> > ranks(configs.size(),vector<RankList>((identification) ? files.size() : 0));
+			timing.total = shardEnd - shardBegin;
 			if (mod == EVAL_ALL){
-				for (map<string, vector<string> >::iterator it = userTemplates.begin(); it != userTemplates.end(); it++){
-					for (vector<string>::iterator itSample = it->second.begin(), itEnd = it->second.end(); itSample != itEnd; itSample++){
+				long long remaining = files.size(); // templates not yet used as sample
+				int sampleIndex = 0, sampleClass = 0;
+				for (map<string, vector<string> >::iterator it = userTemplates.begin(); it != userTemplates.end(); it++, sampleClass++){
+					for (vector<string>::iterator itSample = it->second.begin(), itEnd = it->second.end(); itSample != itEnd; itSample++, sampleIndex++){
+						// skip samples without comparisons in this shard
+						remaining--;
+						if (comparison + remaining <= shardBegin || comparison >= shardEnd){
+							comparison += remaining;
+							continue;
+						}
 						vector<Mat> imgSmpl;
 						vector<Mat> maskSmpl;
 						if (shiftedfiles){
@@ -1089,66 +1852,51 @@ int main(int argc, char *argv[])
 							}
 						}
 						Size codeSize = imgSmpl[0].size();
-						unsigned int codeLength = codeSize.height * codeSize.width;
-						unsigned int bitStop = min(to,codeLength);
+						unsigned long long hashSmpl = (state.enabled) ? hashTemplate(imgSmpl,maskSmpl) : 0;
 						//CV_Assert(codeLength % sizeof(int) == 0);
 						// genuine matches
 						vector<string>::iterator itRef = itSample;
-						for (itRef++; itRef != itEnd; itRef++, timing.progress++){
-							Mat imgRef = imread(*itRef, CV_LOAD_IMAGE_UNCHANGED);
-							CV_Assert(imgRef.data != 0);
-							CV_Assert(imgRef.type() == CV_8UC1);
-							CV_Assert(imgRef.size() == codeSize);
-							Mat maskRef;
-							if (masks){
-								string maskRefFile;
-								patternFileRename(infiles,refmaskfiles,*itRef,maskRefFile);
-								maskRef = imread(maskRefFile, CV_LOAD_IMAGE_UNCHANGED);
-								CV_Assert(maskRef.data != 0);
-								CV_Assert(maskRef.type() == CV_8UC1);
-								CV_Assert(maskRef.size() == codeSize);
-							}
-							else {
-								maskRef = Mat();
-							}
-
-							double score = compare(imgSmpl,imgRef,from,bitStop,minShifts,maxShifts,shiftStep,alg,maskSmpl,maskRef,shiftedfiles);
-							int idx = cvFloor(score*bins);
-							if (idx == bins) idx--;
+						int refIndex = sampleIndex + 1;
+						for (itRef++; itRef != itEnd; itRef++, refIndex++, comparison++){
+							if (comparison < shardBegin || comparison >= shardEnd) continue;
+							compareReference(imgSmpl,maskSmpl,hashSmpl,*itRef,infiles,refmaskfiles,masks,codeSize,shiftStep,alg,configs,shiftedfiles,state,scores);
 							if (!gsfile.empty()){
-								gfile << score << endl;
+								gfile << scores[0] << endl;
+							}
+							for (unsigned int c=0; c<configs.size(); c++){
+								int idx = cvFloor(scores[c]*bins);
+								if (idx == bins) idx--;
+								genuines[c][idx]++;
+								if (identification){
+									rankUpdate(ranks[c][sampleIndex],sampleClass,sampleClass,scores[c],maxRank);
+									rankUpdate(ranks[c][refIndex],sampleClass,sampleClass,scores[c],maxRank);
+								}
 							}
-							genuines[idx]++;
 							if (time && timing.update()) timing.print();
+							timing.progress++;
 						}
 						// imposter matches
 						map<string, vector<string> >::iterator it2 = it;
-						for (it2++; it2 != userTemplates.end(); it2++){
-							for (vector<string>::iterator itRef = it2->second.begin(), itEnd2 = it2->second.end(); itRef != itEnd2; itRef++, timing.progress++){
-								Mat imgRef = imread(*itRef, CV_LOAD_IMAGE_UNCHANGED);
-								CV_Assert(imgRef.data != 0);
-								CV_Assert(imgRef.type() == CV_8UC1);
-								CV_Assert(imgRef.size() == codeSize);
-								Mat maskRef;
-								if (masks){
-									string maskRefFile;
-									patternFileRename(infiles,maskfiles,*itRef,maskRefFile);
-									maskRef = imread(maskRefFile, CV_LOAD_IMAGE_UNCHANGED);
-									CV_Assert(maskRef.data != 0);
-									CV_Assert(maskRef.type() == CV_8UC1);
-									CV_Assert(maskRef.size() == codeSize);
-								}
-								else {
-									maskRef = Mat();
-								}
-								double score = compare(imgSmpl,imgRef,from,bitStop,minShifts,maxShifts,shiftStep,alg,maskSmpl,maskRef,shiftedfiles);
-								int idx = cvFloor(score*bins);
-								if (idx == bins) idx--;
+						refIndex = sampleIndex + (itEnd - itSample);
+						int refClass = sampleClass + 1;
+						for (it2++; it2 != userTemplates.end(); it2++, refClass++){
+							for (vector<string>::iterator itRef = it2->second.begin(), itEnd2 = it2->second.end(); itRef != itEnd2; itRef++, refIndex++, comparison++){
+								if (comparison < shardBegin || comparison >= shardEnd) continue;
+								compareReference(imgSmpl,maskSmpl,hashSmpl,*itRef,infiles,maskfiles,masks,codeSize,shiftStep,alg,configs,shiftedfiles,state,scores);
 								if (!isfile.empty()){
-									ifile << score << endl;
+									ifile << scores[0] << endl;
+								}
+								for (unsigned int c=0; c<configs.size(); c++){
+									int idx = cvFloor(scores[c]*bins);
+									if (idx == bins) idx--;
+									imposters[c][idx]++;
+									if (identification){
+										rankUpdate(ranks[c][sampleIndex],sampleClass,refClass,scores[c],maxRank);
+										rankUpdate(ranks[c][refIndex],refClass,sampleClass,scores[c],maxRank);
+									}
 								}
-								imposters[idx]++;
 								if (time && timing.update()) timing.print();
+								timing.progress++;
 							}
 						}
 					}
@@ -1202,67 +1950,49 @@ int main(int argc, char *argv[])
 					}
 					Size codeSize = imgSmpl[0].size();
 					unsigned int codeLength = codeSize.height * codeSize.width;
-					unsigned int bitStop = min(to,codeLength);
 					CV_Assert(codeLength % sizeof(int) == 0);
+					unsigned long long hashSmpl = (state.enabled) ? hashTemplate(imgSmpl,maskSmpl) : 0;
 					// genuine matches
 					vector<string>::iterator itRef = itSample;
-					for (itRef++; itRef != itEnd; itRef++, timing.progress++){
-						Mat imgRef = imread(*itRef, CV_LOAD_IMAGE_UNCHANGED);
-						CV_Assert(imgRef.data != 0);
-						CV_Assert(imgRef.type() == CV_8UC1);
-						CV_Assert(imgRef.size() == codeSize);
-						Mat maskRef;
-						if (masks){
-							string maskRefFile;
-							patternFileRename(infiles,refmaskfiles,*itRef,maskRefFile);
-							maskRef = imread(maskRefFile, CV_LOAD_IMAGE_UNCHANGED);
-							CV_Assert(maskRef.data != 0);
-							CV_Assert(maskRef.type() == CV_8UC1);
-							CV_Assert(maskRef.size() == codeSize);
-						}
-						else {
-							maskRef = Mat();
-						}
-						double score = compare(imgSmpl,imgRef,from,bitStop,minShifts,maxShifts,shiftStep,alg,maskSmpl,maskRef,shiftedfiles);
-						int idx = cvFloor(score*bins);
-						if (idx == bins) idx--;
+					for (itRef++; itRef != itEnd; itRef++, comparison++){
+						if (comparison < shardBegin || comparison >= shardEnd) continue;
+						compareReference(imgSmpl,maskSmpl,hashSmpl,*itRef,infiles,refmaskfiles,masks,codeSize,shiftStep,alg,configs,shiftedfiles,state,scores);
 						if (!gsfile.empty()){
-							gfile << *itSample << ";" << *itRef << ";" << score << endl;
+							gfile << *itSample << ";" << *itRef << ";" << scores[0] << endl;
+						}
+						for (unsigned int c=0; c<configs.size(); c++){
+							int idx = cvFloor(scores[c]*bins);
+							if (idx == bins) idx--;
+							genuines[c][idx]++;
 						}
-						genuines[idx]++;
 						if (time && timing.update()) timing.print();
+						timing.progress++;
 					}
 					// imposter matches
 					map<string, vector<string> >::iterator it2 = it;
-					for (it2++; it2 != userTemplates.end(); it2++, timing.progress++){
+					for (it2++; it2 != userTemplates.end(); it2++, comparison++){
+						if (comparison < shardBegin || comparison >= shardEnd) continue;
 						itRef = it2->second.begin();
-						Mat imgRef = imread(*itRef, CV_LOAD_IMAGE_UNCHANGED);
-						CV_Assert(imgRef.data != 0);
-						CV_Assert(imgRef.type() == CV_8UC1);
-						CV_Assert(imgRef.size() == codeSize);
-						Mat maskRef;
-						if (masks){
-							string maskRefFile;
-							patternFileRename(infiles,refmaskfiles,*itRef,maskRefFile);
-							maskRef = imread(maskRefFile, CV_LOAD_IMAGE_UNCHANGED);
-							CV_Assert(maskRef.data != 0);
-							CV_Assert(maskRef.type() == CV_8UC1);
-							CV_Assert(maskRef.size() == codeSize);
-						}
-						else {
-							maskRef = Mat();
-						}
-						double score = compare(imgSmpl,imgRef,from,bitStop,minShifts,maxShifts,shiftStep,alg,maskSmpl,maskRef, shiftedfiles);
-						int idx = cvFloor(score*bins);
-						if (idx == bins) idx--;
+						compareReference(imgSmpl,maskSmpl,hashSmpl,*itRef,infiles,refmaskfiles,masks,codeSize,shiftStep,alg,configs,shiftedfiles,state,scores);
 						if (!isfile.empty()){
-							ifile << *itSample << ";" << *itRef << ";" << score << endl;
+							ifile << *itSample << ";" << *itRef << ";" << scores[0] << endl;
+						}
+						for (unsigned int c=0; c<configs.size(); c++){
+							int idx = cvFloor(scores[c]*bins);
+							if (idx == bins) idx--;
+							imposters[c][idx]++;
 						}
-						imposters[idx]++;
 						if (time && timing.update()) timing.print();
+						timing.progress++;
 					}
 					// all other samples
 					for (itSample++; itSample != itEnd; itSample++){
+						// skip samples without comparisons in this shard
+						long long remaining = itEnd - itSample - 1;
+						if (comparison + remaining <= shardBegin || comparison >= shardEnd){
+							comparison += remaining;
+							continue;
+						}
 						imgSmpl.clear();
 						maskSmpl.clear();
 						if (shiftedfiles){
@@ -1305,33 +2035,22 @@ int main(int argc, char *argv[])
 								maskSmpl.push_back(msk);
 							}
 						}
+						hashSmpl = (state.enabled) ? hashTemplate(imgSmpl,maskSmpl) : 0;
 						// genuine matches
 						itRef = itSample;
-						for (itRef++; itRef != itEnd; itRef++, timing.progress++){
-							Mat imgRef = imread(*itRef, CV_LOAD_IMAGE_UNCHANGED);
-							CV_Assert(imgRef.data != 0);
-							CV_Assert(imgRef.type() == CV_8UC1);
-							CV_Assert(imgRef.size() == codeSize);
-							Mat maskRef;
-							if (masks){
-								string maskRefFile;
-								patternFileRename(infiles,refmaskfiles,*itRef,maskRefFile);
-								maskRef = imread(maskRefFile, CV_LOAD_IMAGE_UNCHANGED);
-								CV_Assert(maskRef.data != 0);
-								CV_Assert(maskRef.type() == CV_8UC1);
-								CV_Assert(maskRef.size() == codeSize);
-							}
-							else {
-								maskRef = Mat();
-							}
-							double score = compare(imgSmpl,imgRef,from,bitStop,minShifts,maxShifts,shiftStep,alg,maskSmpl,maskRef, shiftedfiles);
-							int idx = cvFloor(score*bins);
-							if (idx == bins) idx--;
+						for (itRef++; itRef != itEnd; itRef++, comparison++){
+							if (comparison < shardBegin || comparison >= shardEnd) continue;
+							compareReference(imgSmpl,maskSmpl,hashSmpl,*itRef,infiles,refmaskfiles,masks,codeSize,shiftStep,alg,configs,shiftedfiles,state,scores);
 							if (!gsfile.empty()){
-								gfile << *itSample << ";" << *itRef << ";" << score << endl;
+								gfile << *itSample << ";" << *itRef << ";" << scores[0] << endl;
+							}
+							for (unsigned int c=0; c<configs.size(); c++){
+								int idx = cvFloor(scores[c]*bins);
+								if (idx == bins) idx--;
+								genuines[c][idx]++;
 							}
-							genuines[idx]++;
 							if (time && timing.update()) timing.print();
+							timing.progress++;
 						}
 					}
 				}
@@ -1341,73 +2060,54 @@ int main(int argc, char *argv[])
 				gfile.close();
 				ifile.close();
 			}
-			if (!dist.empty()){
-				ofstream cfile;
-				if (!quiet) printf("Storing distribution file '%s' ...\n",dist.c_str());
-				cfile.open(dist.c_str(),ios::out | ios::trunc);
-				if (cfile.is_open()) {
-					double intervalSize = 1. / bins;
+			if (state.enabled){
+				if (!quiet) printf("Storing evaluation state '%s' (%lld of %lld comparisons reused) ...\n",statefile.c_str(),state.reused,shardEnd - shardBegin);
+				saveState(statefile,state,shards > 1);
+			}
+			for (unsigned int c=0; c<configs.size(); c++){
+				if (shards > 1){ // statistics of this shard only
+					genuinesCount = 0;
+					impostersCount = 0;
 					for (int i=0; i<bins; i++){
-						cfile << ((i + 0.5) * intervalSize) << " " << genuines[i] << " " << imposters[i] << " " << (100*((double)genuines[i]) / genuinesCount) << " " << (100*((double)imposters[i]) / impostersCount) << endl;
+						genuinesCount += genuines[c][i];
+						impostersCount += imposters[c][i];
 					}
-					cfile.close();
 				}
-				else {
-					CV_Error(CV_StsError,"Could not save distribution file '" + dist + "'");
+				if (!hist.empty()){
+					string histfile = configFilename(hist,configs[c].suffix);
+					if (!quiet) printf("Storing histogram file '%s' ...\n",histfile.c_str());
+					saveHistogram(histfile,params[c],shard,shards,&genuines[c][0],&imposters[c][0],bins);
 				}
-			}
-			if (!roc.empty()){
-				ofstream cfile;
-				if (!quiet) printf("Storing roc file '%s' ...\n",roc.c_str());
-				cfile.open(roc.c_str(),ios::out | ios::trunc);
-				if (cfile.is_open()) {
-					cfile << "0 100 0" << endl;
-					int falseaccepts = 0;
-					int falserejects = genuinesCount;
-					int lastfalseaccepts = falseaccepts, lastfalserejects = falserejects;
-					for (int i=0; i< bins; i++){
-						falseaccepts += imposters[i];
-						falserejects -= genuines[i];
-						if (lastfalseaccepts != falseaccepts || lastfalserejects != falserejects) {
-							double fmr = (100*((double)falseaccepts) / impostersCount), fnmr = (100*((double)falserejects) / genuinesCount);
-							cfile << fmr << " " << fnmr << " " << (100-fnmr) << endl;
-							lastfalserejects = falserejects;
-							lastfalseaccepts = falseaccepts;
-						}
-					}
-					cfile.close();
+				if (!dist.empty()){
+					string distfile = configFilename(dist,configs[c].suffix);
+					if (!quiet) printf("Storing distribution file '%s' ...\n",distfile.c_str());
+					saveDistribution(distfile,&genuines[c][0],&imposters[c][0],bins,genuinesCount,impostersCount);
 				}
-				else {
-					CV_Error(CV_StsError,"Could not save roc file '" + roc + "'");
+				if (!roc.empty()){
+					string rocfile = configFilename(roc,configs[c].suffix);
+					if (!quiet) printf("Storing roc file '%s' ...\n",rocfile.c_str());
+					saveRoc(rocfile,&genuines[c][0],&imposters[c][0],bins,genuinesCount,impostersCount);
 				}
-			}
-			// calculate EER
-			if (!quiet){
-				int falseaccepts = 0;
-				int falserejects = genuinesCount;
-				int lastfalseaccepts = falseaccepts, lastfalserejects = falserejects;
-				for (int i=0; i< bins; i++){
-					falseaccepts += imposters[i];
-					falserejects -= genuines[i];
-					if (lastfalseaccepts != falseaccepts || lastfalserejects != falserejects) {
-						double fmr = (((double)falseaccepts) / impostersCount), fnmr = (((double)falserejects) / genuinesCount);
-						if (fmr == fnmr){
-							printf("EER = %f%% at threshold t = %f\n",fmr,((i+1.)/bins));
-							break;
-						}
-						else if (fmr > fnmr){ // interpolate
-							double lastfmr = (((double)lastfalseaccepts) / impostersCount);
-							double lastfnmr = (((double)lastfalserejects) / genuinesCount);
-							printf("EER = %f%% at threshold t = %f \n", (100*(-lastfmr * fnmr + lastfnmr * fmr) / (lastfnmr - lastfmr - fnmr + fmr)), ((i+1.)/bins));
-							break;
-						}
-						lastfalserejects = falserejects;
-						lastfalseaccepts = falseaccepts;
+				// calculate EER
+				if (!quiet){
+					if (configs.size() > 1) printf("%s: ",params[c].c_str());
+					printEER(&genuines[c][0],&imposters[c][0],bins,genuinesCount,impostersCount);
+				}
+				if (identification){
+					vector<int> cmc;
+					int probes = computeCmc(ranks[c],maxRank,cmc);
+					string cmcfilename = configFilename(cmcfile,configs[c].suffix);
+					if (!quiet) printf("Storing cmc file '%s' ...\n",cmcfilename.c_str());
+					saveCmc(cmcfilename,cmc,probes);
+					if (!quiet){
+						if (configs.size() > 1) printf("%s: ",params[c].c_str());
+						printf("Identification of %i probes: rank-1 = %f%%",probes,(probes > 0) ? (100.*cmc[0]) / probes : 0.);
+						if (maxRank >= 5) printf(", rank-5 = %f%%",(probes > 0) ? (100.*cmc[4]) / probes : 0.);
+						if (maxRank >= 10) printf(", rank-10 = %f%%",(probes > 0) ? (100.*cmc[9]) / probes : 0.);
+						printf("\n");
 					}
 				}
 			}
-			delete [] genuines;
-			delete [] imposters;
     	}
     	else if (mode == MODE_HELP){
     		// validate command line
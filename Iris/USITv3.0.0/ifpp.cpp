@@ -10,6 +10,7 @@
  */
 
 #include "version.h"
+#include "batch.h"
 #include <map>
 #include <list>
 #include <cmath>
@@ -17,6 +18,10 @@
 #include <string>
 #include <cstring>
 #include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 #include <sstream>
 #include <fstream>
 #include <algorithm>
@@ -71,6 +76,10 @@ void printUsage() {
     cout << "| -bm  | binarymask | 1 | Y | iris mask image (?n = n-th * in infile, off)    |" << endl;
     cout << "| -q   |            | 1 | Y | quiet mode on (off)                             |" << endl;
     cout << "| -t   |            | 1 | Y | time progress on (off)                          |" << endl;
+    cout << "| -j   | jobs       | 1 | Y | number of files processed in parallel (1)       |" << endl;
+    cout << "|      |            |   |   | (console messages interleave, use with -q)      |" << endl;
+    cout << "| -prof | proffile  | 1 | Y | write the wall time of each stage and image as  |" << endl;
+    cout << "|      |            |   |   | JSON lines, print p50/p95/p99 per stage (off)   |" << endl;
     cout << "| -h   |            | 2 | N | prints usage                                    |" << endl;
     cout << "+------+------------+---+---+-------------------------------------------------+" << endl;
     cout << "|                                                                             |" << endl;
@@ -423,194 +432,173 @@ void vec2polar(const Mat& srcX, const Mat& srcY, Mat& mag, Mat& orient, float& s
 }
 
 /**
- * Generates destination regions map from source image
+ * Finds the root of a provisional region label (with path halving)
  *
- * src: 		single channel 8-bit input image
- * dst: 		single channel 32-bit regions map image
- * count: 		outputs number of regions
+ * parent: parent of each provisional label
+ * label: provisional label
+ *
+ * returning: root label of the region
+ */
+static inline int regionRoot(vector<int>& parent, int label){
+	while (parent[label] != label){
+		parent[label] = parent[parent[label]];
+		label = parent[label];
+	}
+	return label;
+}
+
+/**
+ * Merges the regions of two provisional labels, the smaller root becomes the root of both
+ *
+ * parent: parent of each provisional label
+ * label1: first provisional label
+ * label2: second provisional label
+ *
+ * returning: root label of the merged region
  */
-void regionsmap(const Mat& src, Mat& dst, int& count){
+static inline int regionUnion(vector<int>& parent, int label1, int label2){
+	label1 = regionRoot(parent,label1);
+	label2 = regionRoot(parent,label2);
+	if (label1 < label2){
+		parent[label2] = label1;
+		return label1;
+	}
+	parent[label1] = label2;
+	return label2;
+}
+
+/**
+ * Generates destination regions map of 8-connected non-zero pixels from source image
+ * Horizontal strips of the image are labelled in parallel with provisional labels from disjoint ranges
+ * (at most one new label per 2x2 block), which are merged with union-find along the strip borders.
+ * Regions are numbered in raster order of their first pixel.
+ *
+ * src: CV_8UC1 image
+ * dst: CV_32SC1 regions map image (same size as src)
+ * count: outputs number of regions
+ * sizes: outputs number of pixels of each region (count+1 entries, sizes[0] = 0)
+ * threads: number of threads (0 for one per 256K pixels up to the number of cores)
+ */
+void regionsmap(const Mat& src, Mat& dst, int& count, vector<int>& sizes, int threads = 0){
 	CV_Assert(src.type() == CV_8UC1);
 	CV_Assert(dst.type() == CV_32SC1);
 	int width = src.cols;
 	int height = src.rows;
-	int labelsCount = 0;
-	int maxRegions = ((width / 2) + 1) * ((height/2)+1)+1;
-	int * map = new int[maxRegions];
-	for (int i=0; i< maxRegions; i++) map[i] = i; // identity mapping
-	uchar * psrc = src.data;
-	int * pdst = (int *)(dst.data);
-	int srcoffset = src.step - src.cols;
-	int srcline = src.step;
-	int dstoffset = dst.step / sizeof(int) - dst.cols;
-	int dstline = dst.step / sizeof(int);
-	dst.setTo(0);
-	// 1) processing first row
-	if (*psrc != 0) *pdst = ++labelsCount;
-	if (width > 1) {
-		psrc++; pdst++;
-	}
-	for (int x=1; x < width; x++, psrc++, pdst++){
-		if (*psrc != 0) {// if pixel is a region pixel, check left neightbor
-			if (psrc[-1] != 0){ // label like left neighbor
-				*pdst = pdst[-1];
-			}
-			else { // label new region
-				 *pdst = ++labelsCount;
-			}
-		}
-	}
-	if (height > 1){
-		psrc += srcoffset;
-		pdst += dstoffset;
-	}
-	// 2) for all other rows
-	for (int y=1; y < height; y++, psrc+= srcoffset, pdst += dstoffset){
-		// first pixel in row only checks upper and upper-right pixels
-		if (*psrc != 0){
-			if (psrc[-srcline] != 0){ // check upper pixel
-				*pdst = pdst[-dstline];
-			}
-			else if (1 < width && psrc[1-srcline] != 0){ // check upper right
-				*pdst = pdst[1-dstline];
-			}
-			else {
-				*pdst = ++labelsCount;
-			}
-		}
-		if (width > 1){
-			psrc++;
-			pdst++;
-		}
-		// all other pixels in the row check for left and three upper pixels
-		for (int x=1; x < width-1; x++, psrc++, pdst++){
-			if (*psrc != 0){
-				if (psrc[-1] != 0){// check left neighbor
-					*pdst = pdst[-1];
+	if (threads <= 0) threads = min(max(1, (int)thread::hardware_concurrency()), max(1, width * height / (1 << 18)));
+	int strips = max(1, min(threads, height));
+	vector<int> firstLabel(strips+1);
+	firstLabel[0] = 1;
+	for (int s=0; s < strips; s++){
+		int rows = height * (s+1) / strips - height * s / strips;
+		firstLabel[s+1] = firstLabel[s] + ((width+1)/2) * ((rows+1)/2);
+	}
+	vector<int> parent(firstLabel[strips]);
+	vector<int> area(firstLabel[strips]);
+	vector<int> lastLabel(strips);
+	// 1) label each strip, the first row of a strip only looks at its left neighbor
+	parallelFor(strips, threads, [&](int s){
+		int labels = firstLabel[s];
+		for (int y = height * s / strips; y < height * (s+1) / strips; y++){
+			const uchar * psrc = src.ptr<uchar>(y);
+			const uchar * pup = (y > height * s / strips) ? src.ptr<uchar>(y-1) : 0;
+			int * pdst = dst.ptr<int>(y);
+			const int * plup = (pup != 0) ? dst.ptr<int>(y-1) : 0;
+			for (int x=0; x < width; x++){
+				if (psrc[x] == 0){
+					pdst[x] = 0;
+					continue;
 				}
-				else if (psrc[-1-srcline] != 0){// label like left upper
-					*pdst = pdst[-1-dstline];
+				int label;
+				bool left = (x > 0 && psrc[x-1] != 0);
+				bool upLeft = (pup != 0 && x > 0 && pup[x-1] != 0);
+				if (pup != 0 && pup[x] != 0){ // upper neighbor is connected to all other neighbors
+					label = plup[x];
 				}
-				else if (psrc[-srcline] != 0){// check upper
-					*pdst = pdst[-dstline];
+				else if (pup != 0 && x+1 < width && pup[x+1] != 0){ // upper right may join a second region
+					label = plup[x+1];
+					if (upLeft) label = regionUnion(parent,label,plup[x-1]);
+					else if (left) label = regionUnion(parent,label,pdst[x-1]);
 				}
-				if (psrc[1-srcline] != 0){
-					if (*pdst == 0){ // label pixel as the above right
-						*pdst = pdst[1-dstline];
-					}
-					else {
-						int label1 = *pdst;
-						int label2 = pdst[1-dstline];
-						if ((label1 != label2) && (map[label1] != map[label2])){
-							if (map[label1] == label1){ // map unmapped to already mapped
-								map[label1] = map[label2];
-							}
-							else if (map[label2] == label2){ // map unmapped to already mapped
-								map[label2] = map[label1];
-							}
-							else { // both values are already mapped
-								map[map[label1]] = map[label2];
-								map[label1] = map[label2];
-							}
-							// reindexing
-							for (int i=1; i <= labelsCount; i++){
-								if (map[i] != i){
-									int j = map[i];
-									while (j != map[j]){
-										j = map[j];
-									}
-									map[i] = j;
-								}
-							}
-						}
-					}
+				else if (upLeft){
+					label = plup[x-1];
+				}
+				else if (left){
+					label = pdst[x-1];
 				}
-				if (*pdst == 0)
-				{
-					*pdst = ++labelsCount;
+				else { // new region
+					label = labels++;
+					parent[label] = label;
+					area[label] = 0;
 				}
+				pdst[x] = label;
+				area[label]++;
 			}
 		}
-		if (*psrc != 0){
-			if (psrc[-1] != 0){// check left neighbor
-				*pdst = pdst[-1];
-			}
-			else if (psrc[-1-srcline] != 0){// label like left upper
-				*pdst = pdst[-1-dstline];
-			}
-			else if (psrc[-srcline] != 0){// check upper
-				*pdst = pdst[-dstline];
-			}
-			else
-			{
-				*pdst = ++labelsCount;
+		lastLabel[s] = labels;
+	});
+	// 2) merge regions along the strip borders
+	for (int s=1; s < strips; s++){
+		int y = height * s / strips;
+		const uchar * psrc = src.ptr<uchar>(y);
+		const uchar * pup = src.ptr<uchar>(y-1);
+		const int * pdst = dst.ptr<int>(y);
+		const int * plup = dst.ptr<int>(y-1);
+		for (int x=0; x < width; x++){
+			if (psrc[x] == 0) continue;
+			for (int i = max(x-1,0); i <= min(x+1,width-1); i++){
+				if (pup[i] != 0) regionUnion(parent,pdst[x],plup[i]);
 			}
 		}
-		psrc++;
-		pdst++;
 	}
-	int * remap = new int[maxRegions];
+	// 3) number the regions (roots are the smallest label of their region) and sum up their sizes
+	vector<int> remap(firstLabel[strips]);
+	remap[0] = 0;
 	count = 0;
-	for (int i=1; i <= labelsCount; i++){
-		if (map[i] == i) {
-			remap[i] = ++count;
+	sizes.assign(1,0);
+	for (int s=0; s < strips; s++){
+		for (int i = firstLabel[s]; i < lastLabel[s]; i++){
+			int root = regionRoot(parent,i);
+			if (root == i){
+				remap[i] = ++count;
+				sizes.push_back(0);
+			}
+			else remap[i] = remap[root];
+			sizes[remap[i]] += area[i];
 		}
 	}
-	remap[0] = 0;
-	// complete remapping
-	for (int i=1; i <= labelsCount; i++){
-		if (map[i] != i) remap[i] = remap[map[i]];
-	}
-	pdst = (int *) (dst.data);
-	for (int y=0; y < height; y++, pdst += dstoffset){
-		for (int x=0; x < width; x++, pdst++){
-			*pdst = remap[*pdst];
+	// 4) relabel
+	parallelFor(strips, threads, [&](int s){
+		for (int y = height * s / strips; y < height * (s+1) / strips; y++){
+			int * pdst = dst.ptr<int>(y);
+			for (int x=0; x < width; x++) pdst[x] = remap[pdst[x]];
 		}
-	}
-	delete[] remap;
-	delete[] map;
+	});
 }
 
 /**
- * The regsize operator filters out too large or too small binary large objects (regions) in a region map
+ * Filters out too large or too small binary large objects (regions) in a region map
  *
- * regmap:  regions map (to calculate this, simply compute bm::regionsmap(mask,regmap,count), where count returns # of regions)
- * mask:    output mask with filtered regions
- * count:   number of connected components in regmap
+ * regmap:  CV_32SC1 regions map (use regionsmap() to calculate this object)
+ * mask:    CV_8UC1 output mask with filtered regions (same size as regmap)
+ * sizes:   number of pixels of each region in regmap (as computed by regionsmap())
  * minSize: only regions larger or equal than minSize are kept
  * maxSize: only regions smaller or equal than maxSize are kept
  */
-void maskRegsize(const Mat& regmap, Mat& mask, const int count, const int minSize = INT_MIN, const int maxSize = INT_MAX){
+void maskRegsize(const Mat& regmap, Mat& mask, const vector<int>& sizes, const int minSize = INT_MIN, const int maxSize = INT_MAX){
 	CV_Assert(regmap.type() == CV_32SC1);
 	CV_Assert(mask.type() == CV_8UC1);
 	CV_Assert(mask.size() == regmap.size());
-	int * map = new int[count+1];
-	// resetting map to now count region size
-	for (int i=0; i<count+1; i++) map[i] = 0;
+	vector<uchar> value(sizes.size(), 0);
+	for (size_t i=1; i < sizes.size(); i++){
+		value[i] = (sizes[i] < minSize || sizes[i] > maxSize) ? 0 : 255;
+	}
 	int width = regmap.cols;
 	int height = regmap.rows;
-	int * pmap = (int *) (regmap.data);
-	int mapoffset = regmap.step / sizeof(int) - regmap.cols;
-	for (int y=0; y < height; y++, pmap += mapoffset){
-		for (int x=0; x < width; x++, pmap++){
-			if (*pmap > 0){
-				map[*pmap]++;
-			}
-		}
+	for (int y=0; y < height; y++){
+		const int * pmap = regmap.ptr<int>(y);
+		uchar * pmask = mask.ptr<uchar>(y);
+		for (int x=0; x < width; x++) pmask[x] = value[pmap[x]];
 	}
-	// delete too large and too small regions
-	pmap = (int *) (regmap.data);
-	uchar * pmask = mask.data;
-	int maskoffset = mask.step - mask.cols;
-	for (int y=0; y < height; y++, pmap += mapoffset, pmask += maskoffset){
-		for (int x=0; x < width; x++, pmap++, pmask++){
-			if (*pmap > 0){
-				int size = map[*pmap];
-				if (size < minSize || size > maxSize) *pmask = 0; else *pmask = 255;
-			} else *pmask = 0;
-		}
-	}
-	delete[] map;
 }
 
 /**
@@ -622,8 +610,9 @@ void maskRegsize(const Mat& regmap, Mat& mask, const int count, const int minSiz
  * maxSize:    maximum size of reflection region
  * dilateSize: size of circular structuring element for dilate operation
  * dilateIterations: iterations of dilate operation
+ * threads:    number of threads labelling the regions (0 chooses by image size)
  */
-void maskReflections(const Mat& src, Mat& mask, const float roiPercent = 20, const int dilateSize = 5, const int dilateIterations = 2, const int maxSize = 1000){
+void maskReflections(const Mat& src, Mat& mask, const float roiPercent = 20, const int dilateSize = 5, const int dilateIterations = 2, const int maxSize = 1000, const int threads = 0){
 	CV_Assert(src.type() == CV_8UC1);
 	CV_Assert(mask.type() == CV_8UC1);
 	CV_Assert(mask.size() == src.size());
@@ -641,8 +630,9 @@ void maskReflections(const Mat& src, Mat& mask, const float roiPercent = 20, con
 	}
 	Mat regions(mask.rows,mask.cols,CV_32SC1);
 	int count = 0;
-	regionsmap(mask,regions,count);
-	maskRegsize(regions,mask,count,0,maxSize);
+	vector<int> sizes;
+	regionsmap(mask,regions,count,sizes,threads);
+	maskRegsize(regions,mask,sizes,0,maxSize);
 }
 
 /**
@@ -750,23 +740,53 @@ void maskEye(const Mat& src, Mat& mask, Mat& reflect){
 /** ------------------------------- Center detection ------------------------------- **/
 
 /**
- * Type for a bi-directional ray ith originating point and direction
- * x: x-coordinate of origin
- * y: y-coordinate of origin
- * alpha: direction in degrees
+ * Type for a set of bi-directional rays with originating points and directions,
+ * stored as one array per component
+ * x:   x-coordinates of origins
+ * y:   y-coordinates of origins
+ * fx:  x-directions
+ * fy:  y-directions
+ * mag: ray weights (magnitudes)
  */
-struct BidRay{
-	float x;
-	float y;
-	float fx;
-	float fy;
-	float mag;
-	BidRay(float _x, float _y, float _fx, float _fy, float _mag){
-		x = _x;
-		y = _y;
-		fx = _fx;
-		fy = _fy;
-		mag = _mag;
+struct BidRays{
+	vector<float> x;
+	vector<float> y;
+	vector<float> fx;
+	vector<float> fy;
+	vector<float> mag;
+	size_t size() const{
+		return x.size();
+	}
+	void push_back(float _x, float _y, float _fx, float _fy, float _mag){
+		x.push_back(_x);
+		y.push_back(_y);
+		fx.push_back(_fx);
+		fy.push_back(_fy);
+		mag.push_back(_mag);
+	}
+	void resize(size_t count){
+		x.resize(count);
+		y.resize(count);
+		fx.resize(count);
+		fy.resize(count);
+		mag.resize(count);
+	}
+	/*
+	 * Removes all rays i with keep[i] == 0 preserving the order of the remaining rays
+	 */
+	void compact(const vector<uchar>& keep){
+		size_t count = 0;
+		for (size_t i = 0; i < keep.size(); i++){
+			if (keep[i]){
+				x[count] = x[i];
+				y[count] = y[i];
+				fx[count] = fx[i];
+				fy[count] = fy[i];
+				mag[count] = mag[i];
+				count++;
+			}
+		}
+		resize(count);
 	}
 };
 
@@ -1011,24 +1031,27 @@ int intersectRect(const float &x, const float &y, const float &fx, const float &
 /**
  * Draws a line onto accumulator matrix using Bresenham's algorithm
  * Increases a rectangular accumulator by adding a given value to all points on a line
- * line:    line to be drawn
+ * x:       x-coordinate of the line's origin
+ * y:       y-coordinate of the line's origin
+ * fx:      x-direction of the line
+ * fy:      y-direction of the line
+ * mag:     line weight, mag / 1000 is added to accu on points on the line
  * accu:    floating point canvas (accumulator)
  * border:  outer accu boundary rectangle in user space coordinates
- * value:   value to add to accu on points on the line
  *
  * returns true, if values are added to the accu
  */
-bool drawLine(const BidRay& line, Mat_<float>& accu, const Rect_<float>& border){
+bool drawLine(const float x, const float y, const float fx, const float fy, const float mag, Mat_<float>& accu, const Rect_<float>& border){
 	// intersect line with border
 	float cellWidth = border.width/accu.cols;
 	float cellHeight = border.height/accu.rows;
 	float rx = border.x+cellWidth/2, ry = border.y+cellHeight/2;
 	float rwidth = border.x+border.width-cellWidth, rheight = border.y+border.height-cellHeight;
 	float px, py, qx, qy;
-	float incValue = line.mag / 1000;
+	float incValue = mag / 1000;
 	int accuLine = (accu.step/sizeof(float));
 
-	int res = intersectRect(line.x,line.y,line.fx,line.fy,rx,ry,rwidth,rheight,px,py,qx,qy);
+	int res = intersectRect(x,y,fx,fy,rx,ry,rwidth,rheight,px,py,qx,qy);
 	if (res != 0){
 	  int x1 = min(max(cvRound((px-rx)/cellWidth+0.5),0),accu.cols-1);
 	  int y1 = min(max(cvRound((py-ry)/cellHeight+0.5),0),accu.rows-1);
@@ -1085,6 +1108,38 @@ bool drawLine(const BidRay& line, Mat_<float>& accu, const Rect_<float>& border)
 	return false;
 }
 
+/*
+ * Draws a set of rays onto accumulator matrix and removes the rays missing it
+ * The rays are split into contiguous blocks drawn by separate threads onto their own accumulators,
+ * which are summed up in block order afterwards.
+ * rays:    rays to be drawn (rays not hitting the accu are removed, the order of the others is kept)
+ * accu:    floating point canvas (accumulator), cleared before drawing
+ * partial: accumulators of all but the first block (allocated as needed)
+ * hit:     buffer for the per-ray intersection flags
+ * border:  outer accu boundary rectangle in user space coordinates
+ * threads: maximum number of threads
+ */
+void drawRays(BidRays& rays, Mat_<float>& accu, vector<Mat_<float> >& partial, vector<uchar>& hit, const Rect_<float>& border, int threads){
+	const int count = rays.size();
+	threads = max(1, min(threads, count / 4096));
+	if ((int) partial.size() < threads - 1) partial.resize(threads - 1);
+	hit.resize(count);
+	accu.setTo(Scalar(0));
+	parallelFor(threads, threads, [&](int t){
+		Mat_<float>& canvas = (t == 0) ? accu : partial[t-1];
+		if (t > 0){
+			canvas.create(accu.rows, accu.cols);
+			canvas.setTo(Scalar(0));
+		}
+		int end = (int)(((long long) count * (t + 1)) / threads);
+		for (int i = (int)(((long long) count * t) / threads); i < end; i++){
+			hit[i] = drawLine(rays.x[i],rays.y[i],rays.fx[i],rays.fy[i],rays.mag[i],canvas,border);
+		}
+	});
+	for (int t = 1; t < threads; t++) add(accu,partial[t-1],accu);
+	rays.compact(hit);
+}
+
 /*
  * Calculates circle center in source image.
  *
@@ -1094,8 +1149,9 @@ bool drawLine(const BidRay& line, Mat_<float>& accu, const Rect_<float>& border)
  * center:		    center point of main circle in source image
  * accuPrecision:   stop condition for accuracy of center
  * accuSize:	    size of the accumulator array
+ * threads:         number of threads drawing the rays (0 for one per core)
  */
-void eyeCenter(const Mat& gradX, const Mat& gradY, const Mat& mask, Point& center, const float accuPrecision = .5, const int accuSize = 10){
+void eyeCenter(const Mat& gradX, const Mat& gradY, const Mat& mask, Point& center, const float accuPrecision = .5, const int accuSize = 10, int threads = 0){
 	// initial assertions
 	CV_Assert(gradX.type() == CV_32FC1);
 	CV_Assert(gradY.type() == CV_32FC1);
@@ -1109,8 +1165,11 @@ void eyeCenter(const Mat& gradX, const Mat& gradY, const Mat& mask, Point& cente
 	Rect_<float> accuRect(0,0,width,height);
 	Mat_<float> accu(accuSize,accuSize);
 	Mat_<float> accuScaled(accuScaledSize,accuScaledSize);
+	vector<Mat_<float> > partial;
+	vector<uchar> hit;
+	if (threads <= 0) threads = max(1, (int)thread::hardware_concurrency());
 	// create candidates list
-	std::list<BidRay> candidates;
+	BidRays candidates;
 	float * px = (float *)(gradX.data);
 	float * py = (float *)(gradY.data);
 	uchar * pmask = (uchar *)(mask.data);
@@ -1122,18 +1181,12 @@ void eyeCenter(const Mat& gradX, const Mat& gradY, const Mat& mask, Point& cente
 		for (int x=0; x < width; x++, px++, py++, pmask++){
 			if (*pmask > 0){
 				float fx = *px, fy = *py;
-				candidates.push_back(BidRay(x,y,fx,fy,sqrt(fx*fx+fy*fy)));
+				candidates.push_back(x,y,fx,fy,sqrt(fx*fx+fy*fy));
 			}
 		}
 	}
 	while (accuRect.width > accuPrecision || accuRect.height > accuPrecision){
-		accu.setTo(Scalar(0));
-		bool isIn = true;
-		if (candidates.size() > 0){
-			for (std::list<BidRay>::iterator it = candidates.begin(); it != candidates.end();(isIn) ? ++it : it = candidates.erase(it)){
-				isIn = drawLine(*it,accu,accuRect);
-			}
-		}
+		drawRays(candidates,accu,partial,hit,accuRect,threads);
 		pyrDown(accu,accuScaled);
 		float * p = (float *) (accuScaled.data);
 		float maxCellValue = 0;
@@ -1161,6 +1214,129 @@ void eyeCenter(const Mat& gradX, const Mat& gradY, const Mat& mask, Point& cente
 /** ------------------------------- Rubbersheet transform ------------------------------- **/
 
 
+/** fractional bits of the bilinear weights of a rubbersheet map **/
+static const int RUBBERSHEET_BITS = 11;
+
+/*
+ * Sampling positions of a rubbersheet transform, computed once per segmentation and
+ * shared by all images sampled with it. Positions are pixel indices into the source
+ * image padded by one pixel on each side (with row length srcwidth + 2), so samples
+ * overlapping the border need no special treatment. Positions out of the image are -1.
+ */
+struct RubbersheetMap {
+	int width, height; // size of the polar image
+	int srcwidth, srcheight; // size of the source image
+	vector<int> linear; // upper-left pixel of the bilinear neighbourhood
+	vector<short> wx, wy; // horizontal and vertical weights of the right and lower pixels
+	vector<int> nearest; // nearest pixel
+};
+
+/*
+ * Computes the sampling positions of a rubbersheet transform (coordinates are shifted by half a pixel).
+ *
+ * inner: CV_32FC2 inner cartesian coordinates
+ * outer: CV_32FC2 outer cartesian coordinates
+ * dstSize: size of the polar image
+ * srcSize: size of the cartesian source image
+ * sheet: sampling positions
+ */
+void rubbersheetMap(const Mat& inner, const Mat& outer, const Size& dstSize, const Size& srcSize, RubbersheetMap& sheet) {
+	int dstheight = dstSize.height;
+	int dstwidth = dstSize.width;
+	int srcheight = srcSize.height;
+	int srcwidth = srcSize.width;
+	int pwidth = srcwidth + 2;
+	const float scale = 1 << RUBBERSHEET_BITS;
+	sheet.width = dstwidth;
+	sheet.height = dstheight;
+	sheet.srcwidth = srcwidth;
+	sheet.srcheight = srcheight;
+	sheet.linear.resize(dstwidth * dstheight);
+	sheet.wx.resize(dstwidth * dstheight);
+	sheet.wy.resize(dstwidth * dstheight);
+	sheet.nearest.resize(dstwidth * dstheight);
+	float roffset = 1.f / dstheight;
+	float r = 0;
+	for (int y=0, idx=0; y < dstheight; y++, r+= roffset){
+		float * pinner = (float *) inner.data;
+		float * pouter = (float *) outer.data;
+		for (int x=0; x < dstwidth; x++, idx++, pinner++, pouter++){
+			float a = 0.5f + *pinner + r * (*pouter - *pinner);
+			pinner++; pouter++;
+			float b =  0.5f + *pinner + r * (*pouter - *pinner);
+			// clamp far away positions to keep the integer conversions in range
+			a = std::min(std::max(a,-2.f),srcwidth + 1.f);
+			b = std::min(std::max(b,-2.f),srcheight + 1.f);
+			int coordX = cvRound(a);
+			int coordY = cvRound(b);
+			sheet.nearest[idx] = (coordX < 0 || coordY < 0 || coordX >= srcwidth || coordY >= srcheight) ? -1 : (coordY + 1) * pwidth + coordX + 1;
+			coordX = cvFloor(a);
+			coordY = cvFloor(b);
+			if (coordX < -1 || coordY < -1 || coordX >= srcwidth || coordY >= srcheight){
+				sheet.linear[idx] = -1;
+				sheet.wx[idx] = 0;
+				sheet.wy[idx] = 0;
+			}
+			else {
+				sheet.linear[idx] = (coordY + 1) * pwidth + coordX + 1;
+				sheet.wx[idx] = (short) cvRound((a - coordX) * scale);
+				sheet.wy[idx] = (short) cvRound((b - coordY) * scale);
+			}
+		}
+	}
+}
+
+/*
+ * Samples a (polar) image from a rubbersheet sheet. The source is padded by one pixel of
+ * fill (INTER_NEAREST, INTER_LINEAR) or of its border pixels (INTER_LINEAR_REPEAT, where
+ * positions out of the image repeat the pixel of the row above).
+ *
+ * src: CV_8U (cartesian) source image (possibly multi-channel)
+ * dst: CV_8U (polar) destination image of the size of the map
+ * sheet: sampling positions
+ * interpolation: interpolation mode (INTER_NEAREST, INTER_LINEAR or INTER_LINEAR_REPEAT)
+ * fill: fill value for pixels out of the image
+ */
+void rubbersheetRemap(const Mat& src, Mat& dst, const RubbersheetMap& sheet, const int interpolation = INTER_LINEAR, const uchar fill = 0) {
+	CV_Assert(src.depth() == CV_8U && src.type() == dst.type());
+	CV_Assert(src.cols == sheet.srcwidth && src.rows == sheet.srcheight && dst.cols == sheet.width && dst.rows == sheet.height);
+	int nChannels = src.channels();
+	bool repeat = (interpolation != INTER_NEAREST && interpolation != INTER_LINEAR);
+	Mat padded;
+	copyMakeBorder(src,padded,1,1,1,1,(repeat) ? BORDER_REPLICATE : BORDER_CONSTANT,Scalar::all(fill));
+	const uchar * psrc = padded.data;
+	int pstep = padded.step;
+	const int half = 1 << (2 * RUBBERSHEET_BITS - 1);
+	const int one = 1 << RUBBERSHEET_BITS;
+	for (int y=0, idx=0; y < sheet.height; y++){
+		uchar * pdst = dst.ptr<uchar>(y);
+		if (interpolation == INTER_NEAREST){
+			for (int x=0; x < sheet.width; x++, idx++){
+				int pos = sheet.nearest[idx];
+				for (int i=0; i< nChannels; i++,pdst++){
+					*pdst = (pos < 0) ? fill : psrc[pos * nChannels + i];
+				}
+			}
+			continue;
+		}
+		for (int x=0; x < sheet.width; x++, idx++){
+			int pos = sheet.linear[idx];
+			if (pos < 0){
+				for (int i=0; i< nChannels; i++,pdst++){
+					*pdst = (repeat && y > 0) ? *(pdst - dst.step) : fill; // one row above
+				}
+				continue;
+			}
+			int dx = sheet.wx[idx], dy = sheet.wy[idx];
+			int w00 = (one - dx) * (one - dy), w01 = dx * (one - dy), w10 = (one - dx) * dy, w11 = dx * dy;
+			const uchar * p = psrc + pos * nChannels;
+			for (int i=0; i< nChannels; i++,pdst++,p++){
+				*pdst = (uchar)((w00 * p[0] + w01 * p[nChannels] + w10 * p[pstep] + w11 * p[pstep + nChannels] + half) >> (2 * RUBBERSHEET_BITS));
+			}
+		}
+	}
+}
+
 /*
  * Calculates the mapped (polar) image of source using transformation center (polar origin) and radius.
  *
@@ -1178,180 +1354,9 @@ void rubbersheet(const Mat& src, Mat& dst, const Mat& inner, const Mat& outer, c
 	CV_Assert(2 * dst.cols == inner.cols);
 	CV_Assert(outer.cols == inner.cols);
 	CV_Assert(interpolation == INTER_NEAREST || interpolation == INTER_LINEAR);
-	int nChannels = src.channels();
-	// image processing helpers
-	int dstheight = dst.rows;
-	int dstwidth = dst.cols;
-	int srcheight = src.rows;
-	int srcwidth = src.cols;
-	uchar * pdst = dst.data;
-	int dstoffset = dst.step - dstwidth * nChannels;
-	int srcstep = src.step;
-	float roffset = 1.f / dstheight;
-	float r = 0;
-	if (interpolation == INTER_NEAREST){
-		for (int y=0; y < dstheight; y++, pdst+= dstoffset, r+=roffset){
-			float * pinner = (float *) inner.data;
-			float * pouter = (float *) outer.data;
-			for (int x=0; x < dstwidth; x++, pinner++, pouter++){
-				float a = 0.5f + *pinner + r * (*pouter - *pinner);
-				pinner++; pouter++;
-				float b =  0.5f + *pinner + r * (*pouter - *pinner);
-				int coordX = cvRound(a);
-				int coordY = cvRound(b);
-				if (coordX < 0 || coordY < 0 || coordX >= srcwidth || coordY >= srcheight){
-					for (int i=0; i< nChannels; i++,pdst++){
-						*pdst = 0;
-					}
-				}
-				else {
-					uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-					for (int i=0; i< nChannels; i++,pdst++,psrc++){
-						*pdst = *psrc;
-					}
-				}
-			}
-		}
-	}
-	else {
-		for (int y=0; y < dstheight; y++, pdst+= dstoffset, r+= roffset){
-			float * pinner = (float *) inner.data;
-			float * pouter = (float *) outer.data;
-			for (int x=0; x < dstwidth; x++, pinner++, pouter++){
-				float a = 0.5f + *pinner + r * (*pouter - *pinner);
-				pinner++; pouter++;
-				float b =  0.5f + *pinner + r * (*pouter - *pinner);
-				int coordX = cvFloor(a);
-				int coordY = cvFloor(b);
-				if (coordX >= 0){
-					if (coordY >= 0){
-						if (coordX < srcwidth-1){
-							if (coordY < srcheight-1){
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(*psrc)) + dx*(float)(psrc[nChannels]))+ dy*((1-dx)*((float)(psrc[srcstep])) + dx*(float)(psrc[nChannels+srcstep])));
-								}
-							}
-							else if (coordY == srcheight-1){ // unten raus
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(*psrc)) + dx*(float)(psrc[nChannels])));
-								}
-							}
-							else {
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = 0;
-								}
-							}
-						}
-						else if (coordX == srcwidth-1){
-							if (coordY < srcheight-1){// rechts raus
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dx)*((1-dy)*((float)(*psrc))+ dy*((float)(psrc[srcstep]))));
-								}
-							}
-							else if (coordY == srcheight-1){ // unten rechts raus
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dy)*(1-dx)*((float)(*psrc)));
-								}
-							}
-							else {
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = 0;
-								}
-							}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = 0;
-							}
-						}
-					}
-					else if (coordY == -1){
-						if (coordX < srcwidth-1){// oben raus
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((dy)*((1-dx)*((float)(psrc[srcstep])) + dx*(float)(psrc[nChannels+srcstep])));
-								}
-						}
-						else if (coordX == srcwidth-1){// oben rechts raus
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((dy)*(1-dx)*((float)(psrc[srcstep])));
-								}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = 0;
-							}
-						}
-					}
-					else {
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = 0;
-						}
-					}
-				}
-				else if (coordX == -1){
-					if (coordY >= 0){
-						if (coordY < srcheight-1){// links raus
-							float dx = a-coordX;
-							float dy = b-coordY;
-							uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-							for (int i=0; i< nChannels; i++,pdst++,psrc++){
-								*pdst = saturate_cast<uchar>(dx*((1-dy)*(float)(psrc[nChannels]) + dy*(float)(psrc[nChannels+srcstep])));
-							}
-						}
-						else if (coordY == srcheight-1){ // links unten raus
-							float dx = a-coordX;
-							float dy = b-coordY;
-							uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-							for (int i=0; i< nChannels; i++,pdst++,psrc++){
-								*pdst = saturate_cast<uchar>((1-dy)*(dx)*((float)(psrc[nChannels])));
-							}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = 0;
-							}
-						}
-					}
-					else if (coordY == -1){ // links oben raus
-						float dx = a-coordX;
-						float dy = b-coordY;
-						uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-						for (int i=0; i< nChannels; i++,pdst++,psrc++){
-							*pdst = saturate_cast<uchar>((dy)*(dx)*((float)(psrc[nChannels+srcstep])));
-						}
-					}
-					else {
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = 0;
-						}
-					}
-				}
-				else {
-					for (int i=0; i< nChannels; i++,pdst++){
-						*pdst = 0;
-					}
-				}
-			}
-		}
-	}
+	RubbersheetMap sheet;
+	rubbersheetMap(inner, outer, dst.size(), src.size(), sheet);
+	rubbersheetRemap(src, dst, sheet, interpolation);
 }
 
 /** ------------------------------- Boundary detection ------------------------------- **/
@@ -1620,52 +1625,90 @@ void extendBorder(const Mat& src, Mat& dst, const int offsetX, const int offsetY
 }
 
 /**
- * Normalizes a function based on DFT by keeping the first numberCoeffs fourier coefficients only
- * Tip: f should be normalized (i.e. its average ideally should be zero)!
+ * Cosine and sine of the angles 2 * PI * m / size (m = 0 .. size-1) of a contour of given size
+ */
+struct FourierTable {
+	vector<double> cosine, sine;
+};
+
+/**
+ * Returns the Fourier table of contours of given size from a process-wide cache. Tables are
+ * computed on first use and never released, so the returned reference stays valid and can be
+ * shared by all threads.
+ */
+static const FourierTable& fourierTable(const int size){
+	static mutex lock;
+	static map<int, FourierTable> tables;
+	lock_guard<mutex> guard(lock);
+	map<int, FourierTable>::iterator it = tables.find(size);
+	if (it != tables.end()) return it->second;
+	FourierTable& table = tables[size];
+	table.cosine.resize(size);
+	table.sine.resize(size);
+	for (int m=0; m < size; m++){
+		table.cosine[m] = cos(2 * M_PI * m / size);
+		table.sine[m] = sin(2 * M_PI * m / size);
+	}
+	return table;
+}
+
+/**
+ * Normalizes a function by keeping the first numberCoeffs fourier coefficients only. The coefficients
+ * are computed directly in O(size * numberCoeffs) and equal those of the DFT (supports in-place).
  * f:            original signal, should be Mat (1, size, CV_32FC1);
  * norm:         normalized signal, should be Mat (1, size, CV_32FC1);
- * numberCoeffs: number of fourrier coefficients to keep
+ * energy:       sum of the squared magnitudes of the first numberCoeffs Fourier coefficients (DC excluded,
+ *               of all coefficients if all are kept)
+ * numberCoeffs: number of fourrier coefficients to keep (all if negative)
  */
 void fourierNormalize(const Mat& f, Mat& norm, float& energy, const int numberCoeffs = -1){
+	CV_Assert(f.size() == norm.size());
+	CV_Assert(f.type() == CV_32FC1 && norm.type() == CV_32FC1);
 	int size = f.cols;
-	int dftSize = getOptimalDFTSize(f.cols);
-	if (dftSize != size){
-		Mat g = Mat(1,dftSize,f.type());
-		float * src = (float *) f.data;
-		float * dst = (float *) g.data;
-		for (int i=0; i<size; i++)
-			dst[i] = src[i];
-		for (int i=size; i<dftSize; i++)
-			dst[i] = src[0];
-		Mat gFourier = Mat(1,dftSize,f.type());
-		dft(g,gFourier,CV_DXT_FORWARD);
-		if (numberCoeffs >= 0){
-			float * data = (float *) gFourier.data;
-			for (int i = 1 + numberCoeffs*2; i < dftSize; i++){
-				data[i] = 0;
-			}
-		}
-		dft(gFourier,g,CV_DXT_INV_SCALE);
-		src = (float *) g.data;
-		dst = (float *) norm.data;
-		for (int i=0; i<size; i++)
-			dst[i] = src[i];
-	}
-	else {
-		Mat fFourier = Mat(1,dftSize,f.type());
-		dft(f,fFourier,CV_DXT_FORWARD);
-		if (numberCoeffs >= 0){
-			float * data = (float *) fFourier.data;
-			energy = 0;
-			int datastop = 1 + numberCoeffs*2;
-			for (int i = 1; i < datastop; i++){
-				energy += data[i] * data[i];
-			}
-			for (int i = datastop; i < size; i++){
-				data[i] = 0;
-			}
-		}
-		dft(fFourier,norm,CV_DXT_INV_SCALE);
+	const float * src = (const float *) f.data;
+	double mean = 0;
+	for (int x=0; x < size; x++) mean += src[x];
+	mean /= size;
+	if (numberCoeffs < 0 || 1 + 2*numberCoeffs >= size){ // all coefficients are kept
+		// energy by Parseval (coefficients j and size-j have equal magnitudes, size/2 is real)
+		double sum = 0, nyquist = 0;
+		for (int x=0; x < size; x++){
+			double v = src[x] - mean;
+			sum += v * v;
+			nyquist += (x % 2 == 0) ? v : -v;
+		}
+		sum *= size;
+		if (size % 2 == 0) sum += nyquist * nyquist;
+		energy = (float) (sum / 2);
+		if (norm.data != f.data) f.copyTo(norm);
+		return;
+	}
+	const FourierTable& table = fourierTable(size);
+	// project onto the kept coefficients (real and imaginary part as in the forward DFT)
+	vector<double> re(numberCoeffs+1, 0), im(numberCoeffs+1, 0);
+	double sum = 0;
+	for (int j=1; j <= numberCoeffs; j++){
+		double a = 0, b = 0;
+		for (int x=0, m=0; x < size; x++, m += j){
+			if (m >= size) m -= size;
+			double v = src[x] - mean;
+			a += v * table.cosine[m];
+			b -= v * table.sine[m];
+		}
+		re[j] = a;
+		im[j] = b;
+		sum += a*a + b*b;
+	}
+	energy = (float) sum;
+	// reconstruct from the kept coefficients (as the scaled inverse DFT)
+	float * dst = (float *) norm.data;
+	for (int x=0; x < size; x++){
+		double v = 0;
+		for (int j=1, m=x; j <= numberCoeffs; j++, m += x){
+			if (m >= size) m %= size;
+			v += re[j] * table.cosine[m] - im[j] * table.sine[m];
+		}
+		dst[x] = (float)(mean + 2 * v / size);
 	}
 }
 
@@ -3109,6 +3152,18 @@ public:
 	}
 };
 
+/** ------------------------------- Segmentation workspace ------------------------------- **/
+
+/*
+ * Images and tables of one segmentation which are kept from one input file to the next, one
+ * workspace per worker thread. Mat::create only reallocates if size or type change, so a batch of
+ * equally sized images reuses the same memory and threads do not compete for the allocator.
+ */
+struct Workspace {
+	Mat img, mask, img2, mask2, gradX, gradY, polar, bw, out;
+	RubbersheetMap sheet;
+};
+
 /** ------------------------------- Program ------------------------------- **/
 
 /*
@@ -3123,7 +3178,7 @@ int main(int argc, char *argv[])
     	else mode = MODE_MAIN;
     	if (mode == MODE_MAIN){
 			// validate command line
-			cmd.checkOpts("-i|-o|-s|-vm|-vc|-vp|-vb|-vs|-bm|-q|-t");
+			cmd.checkOpts("-i|-o|-s|-vm|-vc|-vp|-vb|-vs|-bm|-q|-t|-j|-prof");
 			cmd.checkOptExists("-i");
 			cmd.checkOptSize("-i",1);
 			FilePattern infiles(cmd.getPar("-i"));
@@ -3179,51 +3234,76 @@ int main(int argc, char *argv[])
 				cmd.checkOptSize("-t",0);
 				t = true;
 			}
+			int jobs = 1;
+			if (cmd.getOpt("-j") != 0){
+				cmd.checkOptSize("-j",1);
+				jobs = cmd.getParInt("-j");
+				CV_Assert(jobs >= 1);
+			}
+			// reflection masking and center detection run single-threaded when several files are processed at once
+			int stageThreads = (jobs > 1) ? 1 : 0;
+			Profile profile;
+			if (cmd.getOpt("-prof") != 0){
+				cmd.checkOptSize("-prof",1);
+				profile.open(cmd.getPar("-prof"));
+			}
 			// starting routine
 			Timing timing(1,q);
 			std::list<std::string> files;
 			infiles.getFiles(files);
 			CV_Assert(files.size() > 0);
 			timing.total = files.size();
-			for (std::list<std::string>::iterator infile = files.begin(); infile != files.end(); ++infile, timing.progress++){
-				if (!q) cout << "Loading image '" << *infile << "' ..."<< endl;
+			vector<Workspace> workspaces(jobs);
+			auto processFile = [&](const string& infile, int worker, ostream& logLines){
+				Workspace& ws = workspaces[worker];
+				ProfileTimer timer(profile, infile);
+				timer.stage("load");
+				if (!q) cout << "Loading image '" << infile << "' ..."<< endl;
 				// MODIFICATION TB, June 3rd, 2014
 				// additional conversion step to enable direct JP2K processing (Bug in CV)
 				// Loading of JP2k in color is supported, loading as grayscale, however, not
-				Mat imgCol = imread(*infile, CV_LOAD_IMAGE_COLOR);			
-				Mat img;			
+				Mat imgCol = imread(infile, CV_LOAD_IMAGE_COLOR);			
+				Mat& img = ws.img;
 				cvtColor(imgCol,img,CV_BGR2GRAY);
 				CV_Assert(img.data != 0);
 				CV_Assert(img.depth() == CV_8U);
 				int width = img.cols;
 				int height = img.rows;
+				timer.stage("reflections");
 				if (!q) cout << "done" << endl << "Removing reflections ..."<< endl;
-				Mat mask(height,width,CV_8UC1);
-				Mat img2(height,width,CV_8UC1);
+				Mat& mask = ws.mask;
+				mask.create(height,width,CV_8UC1);
+				Mat& img2 = ws.img2;
+				img2.create(height,width,CV_8UC1);
 				const float roiReflections = 15;//10
 				const int maxReflectSize = 2000;//1000
 				const int dilateSize = 10;//7
 				const int dilateIterations = 4;//3
-				maskReflections(img, mask, roiReflections, dilateSize, dilateIterations, maxReflectSize);
+				maskReflections(img, mask, roiReflections, dilateSize, dilateIterations, maxReflectSize, stageThreads);
 				inpaint(img,mask,img2,10,INPAINT_NS);
+				timer.stage("mask");
 				if (!q) cout << "done" << endl << "Generating mask ..."<< endl;
-				Mat mask2(height,width,CV_8UC1);
+				Mat& mask2 = ws.mask2;
+				mask2.create(height,width,CV_8UC1);
 				maskEye(img2,mask2,mask);
 				if (!q) cout << "done" << endl;
 				if (!vmaskfiles.empty()){
 					string vmaskfile;
-					infiles.renameFile(*infile,vmaskfile,vmaskfiles);
+					infiles.renameFile(infile,vmaskfile,vmaskfiles);
 					if (!q) cout << "Storing visual mask '" << vmaskfile << "' ..."<< endl;
 					if (!imwrite(vmaskfile,mask)) CV_Error(CV_StsError,"Could not save image '" + vmaskfile + "'");
 					if (!q) cout << "done" << endl;
 				}
+				timer.stage("eye center");
 				if (!q) cout << "Finding circle center ..."<< endl;
 				Point center;
-				Mat gradX(height,width,CV_32FC1);
-				Mat gradY(height,width,CV_32FC1);
+				Mat& gradX = ws.gradX;
+				gradX.create(height,width,CV_32FC1);
+				Mat& gradY = ws.gradY;
+				gradY.create(height,width,CV_32FC1);
 				Sobel(img2,gradX,gradX.depth(),1,0,apertureSize);
 				Sobel(img2,gradY,gradY.depth(),0,1,apertureSize);
-				eyeCenter(gradX,gradY,mask2,center,accuPrecision,accuSize);
+				eyeCenter(gradX,gradY,mask2,center,accuPrecision,accuSize,stageThreads);
 				cout << "Center before: (x=" << center.x << ";y=" << center.y << ")" << endl;
 				refineEyeCenter(img2,center);
 				cout << "Center after: (x=" << center.x << ";y=" << center.y << ")" << endl;
@@ -3244,12 +3324,13 @@ int main(int argc, char *argv[])
 						line(visual,Point(center.x,0),Point(center.x,img.rows),Scalar(255,255,255,0));
 						line(visual,Point(0,center.y),Point(img.cols,center.y),Scalar(255,255,255,0));
 						string vcenterfile;
-						infiles.renameFile(*infile,vcenterfile,vcenterfiles);
+						infiles.renameFile(infile,vcenterfile,vcenterfiles);
 						if (!q) cout << "Storing visual center '" << vcenterfile << "' ..."<< endl;
 						if (!imwrite(vcenterfile,visual)) CV_Error(CV_StsError,"Could not save image '" + vcenterfile + "'");
 						if (!q) cout << "done" << endl;
 					}
 				}
+				timer.stage("polar");
 				if (!q) cout << "Applying Cartesian to Polar Transformation ..."<< endl;
 				int polarwidth = (outwidth < 0) ? width : outwidth;
 				int polarheight = (outwidth < 0) ? height : cvRound(outwidth * height / ((float)(width)));
@@ -3259,21 +3340,24 @@ int main(int argc, char *argv[])
 				if (outheight < 0){
 					outheight = height;
 				}
-				Mat polar (polarheight,polarwidth,CV_8UC1);
+				Mat& polar = ws.polar;
+				polar.create(polarheight,polarwidth,CV_8UC1);
 				cart2polar(img2,polar,center.x,center.y,-1,INTER_LINEAR);
 				if (!q) cout << "done" << endl;
 				if (!vpolarfiles.empty()){
 					string vpolarfile;
-					infiles.renameFile(*infile,vpolarfile,vpolarfiles);
+					infiles.renameFile(infile,vpolarfile,vpolarfiles);
 					if (!q) cout << "Storing visual polar image '" << vpolarfile << "' ..."<< endl;
 					if (!imwrite(vpolarfile,polar)) CV_Error(CV_StsError,"Could not save image '" + vpolarfile + "'");
 					if (!q) cout << "done" << endl;
 				}
+				timer.stage("boundaries");
 				if (!q) cout << "Finding eye boundaries ..."<< endl;
 				Mat inner (1,polarwidth,CV_32FC1);
 				Mat outer (1,polarwidth,CV_32FC1);
 				eyeborderPolar(polar, inner, outer);
 				if (!q) cout << "done" << endl;
+				timer.stage("contours");
 				if (!vborderfiles.empty()){
 					Mat visual;
 					polar.copyTo(visual);
@@ -3294,14 +3378,15 @@ int main(int argc, char *argv[])
 						line(visual,Point2f(i, *c),Point2f(i+1, c[1]),Scalar(255,255,255,0));
 					}
 					string vborderfile;
-					infiles.renameFile(*infile,vborderfile,vborderfiles);
+					infiles.renameFile(infile,vborderfile,vborderfiles);
 					if (!q) cout << "Storing image '" << vborderfile << "' ..."<< endl;
 					if (!imwrite(vborderfile,visual)) CV_Error(CV_StsError,"Could not save image '" + vborderfile + "'");
 					if (!q) cout << "done" << endl;
 				}
 				Mat innerCart (1,2*polarwidth,CV_32FC1);
 				Mat outerCart (1,2*polarwidth,CV_32FC1);
-				Mat out (outheight,outwidth,CV_8UC1);
+				Mat& out = ws.out;
+				out.create(outheight,outwidth,CV_8UC1);
 				float resX = 2.f * M_PI / polarwidth;
 				float resY = getResY(width, height, polarheight, center.x, center.y);
 				mappolar2cart(inner, innerCart, center.x,center.y, resY, resX);
@@ -3324,13 +3409,15 @@ int main(int argc, char *argv[])
 						line(visual,Point2f(c[2*i], c[2*i+1]),Point2f(c[2*i+2], c[2*i+3]),Scalar(255,255,255,0));
 					}
 					string vsegmentfile;
-					infiles.renameFile(*infile,vsegmentfile,vsegmentfiles);
+					infiles.renameFile(infile,vsegmentfile,vsegmentfiles);
 					if (!q) cout << "Storing image '" << vsegmentfile << "' ..."<< endl;
 					if (!imwrite(vsegmentfile,visual)) CV_Error(CV_StsError,"Could not save image '" + vsegmentfile + "'");
 					if (!q) cout << "done" << endl;
 				}
                 if( !binmaskfiles.empty()){
-					Mat bw(height,width, CV_8UC1, Scalar(0));
+					Mat& bw = ws.bw;
+					bw.create(height,width,CV_8UC1);
+					bw.setTo(0);
                     Point iris_points[1][polarwidth];
 					float * it = (float *) outerCart.data;
 					for (int i=0; i < polarwidth; i++){
@@ -3351,21 +3438,29 @@ int main(int argc, char *argv[])
 					fillPoly(bw,pupilpoints,&polarwidth,1,Scalar(0,0,0));
 
 					string binmaskfile;
-					infiles.renameFile(*infile,binmaskfile,binmaskfiles);
+					infiles.renameFile(infile,binmaskfile,binmaskfiles);
 					if (!q) cout << "Storing binary mask image '" << binmaskfile << "' ..."<< endl;
 					if (!imwrite(binmaskfile,bw)) CV_Error(CV_StsError,"Could not save image '" + binmaskfile + "'");
 					if (!q) cout << "done" << endl;
                 }
+				timer.stage("rubbersheet");
 				if (!q) cout << "Applying Rubbersheet transform ..."<< endl;
-				rubbersheet(img2, out, innerCart, outerCart, INTER_LINEAR);
+				CV_Assert(2 * out.cols == innerCart.cols);
+				rubbersheetMap(innerCart, outerCart, out.size(), img2.size(), ws.sheet);
+				rubbersheetRemap(img2, out, ws.sheet, INTER_LINEAR);
+				timer.stage("write");
 				string outfile;
-				infiles.renameFile(*infile,outfile,outfiles);
+				infiles.renameFile(infile,outfile,outfiles);
 				if (!q) cout << "done" << endl << "Storing image '" << outfile << "' ..."<< endl;
 				if (!imwrite(outfile,out)) CV_Error(CV_StsError,"Could not save image '" + outfile + "'");
 				if (!q) cout << "done" << endl;
+			};
+			batchProcess(vector<string>(files.begin(), files.end()), jobs, processFile, [&](const string& logLines){
 				if (t && timing.update()) timing.print();
-			}
+				timing.progress++;
+			});
 			if (t && q) timing.clear();
+			profile.summary(q);
     	}
     	else if (mode == MODE_HELP){
 			// validate command line
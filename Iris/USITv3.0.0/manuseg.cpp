@@ -6,6 +6,7 @@
  */
 
 #include "version.h"
+#include "clahe.h"
 #include <map>
 #include <list>
 #include <cmath>
@@ -16,6 +17,7 @@
 #include <sstream>
 #include <fstream>
 #include <algorithm>
+#include <thread>
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -110,328 +112,6 @@ void hist2u(const Mat& src, Mat& histogram){
 	}
 }
 
-/*
- * Retrieves the (bilinear) interpolated byte from 4 bytes
- *
- * x: distance to left byte
- * y: distance to right byte
- * r: distance to upper byte
- * s: distance to lower byte
- * b1: upper left byte
- * b2: upper right byte
- * b3: lower left byte
- * b4: lower right byte
- */
-uchar interp(const double x, const double y, const double r, const double s, const uchar b1, const uchar b2, const uchar b3, const uchar b4) {
-  double w1 = (x + y);
-  double w2 = x / w1;
-  w1 = y / w1;
-  double w3 = (r + s);
-  double w4 = r / w3;
-  w3 = s / w3;
-  return saturate_cast<uchar>(w3 * (w1 * b1 + w2 * b2) + w4 * (w1 * b3 + w2 * b4));
-}
-
-/*
- * Retrieves the bilinear interpolated byte from 2 bytes
- *
- * x:  distance to left byte
- * y:  distance to right byte
- * b1: left byte
- * b2: right byte
- */
-uchar interp(const double x, const double y, const uchar b1, const uchar b2) {
-  double w1 = (x + y);
-  double w2 = x / w1;
-  w1 = y / w1;
-  return saturate_cast<uchar>(w1 * b1 + w2 * b2);
-}
-
-/*
- * Inplace histogram clipping according to Zuiderveld (counts excess and redistributes excess by adding the average increment)
- *
- * hist: CV_32SC1 1 x 256 histogram matrix
- * clipFactor: between 0 (maximum slope M/N, where M #pixel in window, N #bins) and 1 (maximum slope M)
- * pixelCount: number of pixels in window
- */
-void clipHistogram(Mat& hist, const float clipFactor, const int pixelCount) {
-	double minSlope = ((double) pixelCount) / 256;
-	int clipLimit = std::min(pixelCount, std::max(1, cvCeil(minSlope + clipFactor * (pixelCount - minSlope))));
-	int distributeCount = 0;
-	MatIterator_<int> p = hist.begin<int>();
-	MatIterator_<int> e = hist.end<int>();
-	for (; p!=e; p++){
-		int binsExcess = *p - clipLimit;
-		if (binsExcess > 0) {
-			distributeCount += binsExcess;
-			*p = clipLimit;
-		}
-	}
-	int avgInc = distributeCount / 256;
-	int maxBins = clipLimit - avgInc;
-	for (p = hist.begin<int>(); p!=e; p++){
-		if (*p <= maxBins) {
-			distributeCount -= avgInc;
-			*p += avgInc;
-		}
-		else if (*p < clipLimit) {
-			distributeCount -= (clipLimit - *p);
-			*p = clipLimit;
-		}
-	}
-	while (distributeCount > 0) {
-		for (p = hist.begin<int>(); p!=e && distributeCount > 0; p++){
-			if (*p < clipLimit) {
-				(*p)++;
-				distributeCount--;
-			}
-		}
-	}
-}
-
-/*
- * Contrast-limited adaptive histogram equalization (supports in-place)
- *
- * src: CV_8UC1 image
- * dst: CV_8UC1 image (in-place operation is possible)
- * cellWidth: patch size in x direction (greater or equal to 2)
- * cellHeight: patch size in y direction (greater or equal to 2)
- * clipFactor: histogram clip factor between 0 and 1
- */
-void clahe(const Mat& src, Mat& dst, const int cellWidth = 10, const int cellHeight = 10, const float clipFactor = 1.){
-	Mat hist(1,256,CV_32SC1);
-	Mat roi;
-	uchar * sp, * dp;
-	int height = src.rows;
-	int width = src.cols;
-	int gridWidth = width / cellWidth + (width % cellWidth == 0 ? 0 : 1);
-	int gridHeight = height / cellHeight + (height % cellHeight == 0 ? 0 : 1);
-	int bufSize = (gridWidth + 2)*256;
-	int bufOffsetLeft = bufSize - 256;
-	int bufOffsetTop = bufSize - gridWidth * 256;
-	int bufOffsetTopLeft = bufSize - (gridWidth + 1) * 256;
-	Mat buf(1, bufSize, CV_8UC1);
-	MatIterator_<uchar> pbuf = buf.begin<uchar>(), ebuf = buf.end<uchar>();
-	MatIterator_<int> phist, ehist = hist.end<int>();
-	uchar * curr, * topleft, * top, * left;
-	int pixelCount, cX, cY, cWidth, cHeight, cellOrigin, cellOffset;
-	double sum;
-	// process first row, first cell
-	cX = 0;
-	cY = 0;
-	cWidth = min(cellWidth, width);
-	cHeight = min(cellHeight, height);
-	pixelCount = cWidth*cHeight;
-	sum = 0;
-	roi = Mat(src,Rect(cX,cY,cWidth,cHeight));
-	hist2u(roi,hist);
-	if (clipFactor < 1) clipHistogram(hist,clipFactor,pixelCount);
-	// equalization
-	for(phist = hist.begin<int>(); phist!=ehist; phist++, pbuf++){
-		sum += *phist;
-		*pbuf = saturate_cast<uchar>(sum * 255 / pixelCount);
-	}
-	// paint first corner cell
-	cWidth = min(cellWidth / 2, cWidth);
-	cHeight = min(cellHeight / 2, cHeight);
-	cellOrigin = src.step * cY + cX;
-	cellOffset = src.step - cWidth;
-	sp = (uchar *)(src.data + cellOrigin);
-	dp = (uchar *)(dst.data + cellOrigin);
-	curr = buf.data;
-	for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-	  for (int a=0; a < cWidth; a++, sp++, dp++){
-		*dp = curr[*sp];
-	  }
-	}
-	// process first row, other cells
-	for (int x = 1; x < gridWidth; x++) {
-		cX = x*cellWidth;
-		cWidth = min(cellWidth, width - x*cellWidth);
-		cHeight = min(cellHeight, height);
-		pixelCount = cWidth*cHeight;
-		sum = 0;
-		roi.release();
-		roi = Mat(src,Rect(cX,cY,cWidth,cHeight));
-		hist2u(roi,hist);
-		if (clipFactor < 1) clipHistogram(hist,clipFactor,pixelCount);
-		// equalization
-		for(phist = hist.begin<int>(); phist!=ehist; phist++, pbuf++){
-			sum += *phist;
-			*pbuf = saturate_cast<uchar>(sum * 255 / pixelCount);
-		}
-		// paint first row, other cells
-		cX += cellWidth/2 - cellWidth;
-		cWidth = min(cellWidth, width - x*cellWidth + cellWidth/2);
-		cHeight = min(cellHeight / 2, height);
-		cellOrigin = src.step * cY + cX;
-		cellOffset = src.step - cWidth;
-		sp = (uchar *)(src.data + cellOrigin);
-		dp = (uchar *)(dst.data + cellOrigin);
-		curr = buf.data + (curr - buf.data + 256) % bufSize;
-		left = buf.data + (curr - buf.data + bufOffsetLeft) % bufSize;
-		for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-		  for (int a=0; a < cWidth; a++, sp++, dp++){
-			  *dp = interp(a,cWidth-a,left[*sp], curr[*sp]);
-		  }
-		}
-	}
-	// process (i.e. paint) first row, last cell (only if necessary)
-	if (width % cellWidth > cellWidth / 2 || width % cellWidth == 0) {
-		cWidth = (width - cellWidth / 2) % cellWidth;
-		cHeight = min(cellHeight / 2, height);
-		cX = width-cWidth;
-		cellOrigin = src.step * cY + cX;
-		cellOffset = src.step - cWidth;
-		sp = (uchar *)(src.data + cellOrigin);
-		dp = (uchar *)(dst.data + cellOrigin);
-		for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-		  for (int a=0; a < cWidth; a++, sp++, dp++){
-			*dp = curr[*sp];
-		  }
-		}
-	}
-	// process rest of rows
-	for (int y = 1; y < gridHeight; y++) {
-		// process other rows, first cell
-		cX = 0;
-		cY = y*cellHeight;
-		cWidth = min(cellWidth, width);
-		cHeight = min(cellHeight, height - y*cellHeight);
-		pixelCount = cWidth*cHeight;
-		sum = 0;
-		roi.release();
-		roi = Mat(src,Rect(cX,cY,cWidth,cHeight));
-		hist2u(roi,hist);
-		if (clipFactor < 1) clipHistogram(hist,clipFactor,pixelCount);
-		// equalization
-		if (pbuf == ebuf) pbuf = buf.begin<uchar>();
-		for(phist = hist.begin<int>(); phist!=ehist; phist++, pbuf++){
-			sum += *phist;
-			*pbuf = saturate_cast<uchar>(sum * 255 / pixelCount);
-		}
-		// paint other rows, first cell
-		cY += cellHeight/2 - cellHeight;
-		cWidth = min(cellWidth / 2, width);
-		cHeight = min(cellHeight, height - y*cellHeight + cellHeight/2);
-		cellOrigin = src.step * cY + cX;
-		cellOffset = src.step - cWidth;
-		sp = (uchar *)(src.data + cellOrigin);
-		dp = (uchar *)(dst.data + cellOrigin);
-		curr = buf.data + (curr - buf.data + 256) % bufSize;
-		top = buf.data + (curr - buf.data + bufOffsetTop) % bufSize;
-		for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-		  for (int a=0; a < cWidth; a++, sp++, dp++){
-			  *dp = interp(b,cHeight-b,top[*sp], curr[*sp]);
-		  }
-		}
-		// process other rows, rest of cells
-		for (int x = 1; x < gridWidth; x++) {
-			cX = x*cellWidth;
-			cY = y*cellHeight;
-			cWidth = min(cellWidth, width - x*cellWidth);
-			cHeight = min(cellHeight, height - y*cellHeight);
-			pixelCount = cWidth*cHeight;
-			sum = 0;
-			roi.release();
-			roi = Mat(src,Rect(cX,cY,cWidth,cHeight));
-			hist2u(roi,hist);
-			if (clipFactor < 1) clipHistogram(hist,clipFactor,pixelCount);
-			// equalization
-			if (pbuf == ebuf) pbuf = buf.begin<uchar>();
-			for(phist = hist.begin<int>(); phist!=ehist; phist++, pbuf++){
-				sum += *phist;
-				*pbuf = saturate_cast<uchar>(sum * 255 / pixelCount);
-			}
-			// paint other rows, rest of cells
-			cX += cellWidth/2 - cellWidth;
-			cY += cellHeight/2 - cellHeight;
-			cWidth = min(cellWidth, width - x*cellWidth + cellWidth/2);
-			cHeight = min(cellHeight, height - y*cellHeight + cellHeight/2);
-			cellOrigin = src.step * cY + cX;
-			cellOffset = src.step - cWidth;
-			sp = (uchar *)(src.data + cellOrigin);
-			dp = (uchar *)(dst.data + cellOrigin);
-			curr = buf.data + (curr - buf.data + 256) % bufSize;
-			top = buf.data + (curr - buf.data + bufOffsetTop) % bufSize;
-			topleft = buf.data + (curr - buf.data + bufOffsetTopLeft) % bufSize;
-			left = buf.data + (curr - buf.data + bufOffsetLeft) % bufSize;
-			for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-			  for (int a=0; a < cWidth; a++, sp++, dp++){
-				  *dp = interp(a, cWidth-a,b,cHeight-b,topleft[*sp],top[*sp],left[*sp],curr[*sp]);
-			  }
-			}
-		}
-		// process (i.e. paint) other rows, last cell (only if necessary)
-		if (width % cellWidth > cellWidth / 2 || width % cellWidth == 0) {
-			cWidth = (width - cellWidth / 2) % cellWidth;
-			cHeight = min(cellHeight, height - y*cellHeight + cellHeight/2);
-			cX = width-cWidth;
-			cellOrigin = src.step * cY + cX;
-			cellOffset = src.step - cWidth;
-			sp = (uchar *)(src.data + cellOrigin);
-			dp = (uchar *)(dst.data + cellOrigin);
-			top = buf.data + (curr - buf.data + bufOffsetTop) % bufSize;
-			for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-			  for (int a=0; a < cWidth; a++, sp++, dp++){
-				  *dp = interp(b,cHeight-b,top[*sp], curr[*sp]);
-			  }
-			}
-		}
-	}
-	// process (i.e. paint) last row (only if necessary)
-	if (height % cellHeight > cellHeight / 2 || height % cellHeight == 0) {
-		// paint last row, first cell
-		cWidth =  min(cellWidth / 2, width);
-		cHeight = (height - cellHeight / 2) % cellHeight;
-		cX = 0;
-		cY = height-cHeight;
-		cellOrigin = src.step * cY + cX;
-		cellOffset = src.step - cWidth;
-		sp = (uchar *)(src.data + cellOrigin);
-		dp = (uchar *)(dst.data + cellOrigin);
-		curr = buf.data + (curr - buf.data + bufOffsetTop + 256) % bufSize;
-		for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-		  for (int a=0; a < cWidth; a++, sp++, dp++){
-			*dp = curr[*sp];
-		  }
-		}
-		// paint last row, other cells
-		for (int x = 1; x < gridWidth; x++) {
-			cX = (x-1)*cellWidth + cellWidth/2;
-			cWidth = min(cellWidth, width - x*cellWidth + cellWidth/2);
-			cHeight = (height - cellHeight / 2) % cellHeight;
-			cellOrigin = src.step * cY + cX;
-			cellOffset = src.step - cWidth;
-			sp = (uchar *)(src.data + cellOrigin);
-			dp = (uchar *)(dst.data + cellOrigin);
-			left = curr;
-			curr = buf.data + (curr - buf.data + 256) % bufSize;
-			for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-			  for (int a=0; a < cWidth; a++, sp++, dp++){
-				  *dp = interp(a,cWidth-a,left[*sp], curr[*sp]);
-			  }
-			}
-		}
-		// paint last row, last cell (only if necessary)
-		if (width % cellWidth > cellWidth / 2 || width % cellWidth == 0) {
-			cWidth = (width - cellWidth / 2) % cellWidth;
-			cHeight = (height - cellHeight / 2) % cellHeight;
-			cX = width-cWidth;
-			cellOrigin = src.step * cY + cX;
-			cellOffset = src.step - cWidth;
-			sp = (uchar *)(src.data + cellOrigin);
-			dp = (uchar *)(dst.data + cellOrigin);
-			for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-			  for (int a=0; a < cWidth; a++, sp++, dp++){
-				  *dp = curr[*sp];
-			  }
-			}
-		}
-	}
-}
-
-
 /** ------------------------------- commandline functions ------------------------------- **/
 
 /**
@@ -1028,356 +708,185 @@ void ellipse2Cart(Mat& cart, const RotatedRect& ellipse, const float offset_x =
  */
 static const int INTER_LINEAR_REPEAT = 82;
 
+/** fractional bits of the bilinear weights of a rubbersheet map **/
+static const int RUBBERSHEET_BITS = 11;
+
 /*
- * Calculates the mapped (polar) image of source using two transformation contours.
+ * Sampling positions of a rubbersheet transform, computed once per segmentation and
+ * shared by all images sampled with it. Positions are pixel indices into the source
+ * image padded by one pixel on each side (with row length srcwidth + 2), so samples
+ * overlapping the border need no special treatment. Positions out of the image are -1.
+ */
+struct RubbersheetMap {
+	int width, height; // size of the polar image
+	int srcwidth, srcheight; // size of the source image
+	vector<int> linear; // upper-left pixel of the bilinear neighbourhood
+	vector<short> wx, wy; // horizontal and vertical weights of the right and lower pixels
+	vector<int> nearest; // nearest pixel
+};
+
+/*
+ * Computes the sampling positions of a rubbersheet transform.
  *
- * src: CV_8U (cartesian) source image (possibly multi-channel)
- * dst:	CV_8U (polar) destination image (possibly multi-channel, 2 times the col size of inner)
  * inner: CV_32FC2 inner cartesian coordinates
  * outer: CV_32FC2 outer cartesian coordinates
- * interpolation: interpolation mode (INTER_NEAREST, INTER_LINEAR or INTER_LINEAR_REPEAT)
- * fill: fill value for pixels out of the image
+ * dstSize: size of the polar image
+ * srcSize: size of the cartesian source image
+ * sheet: sampling positions
  */
-void rubbersheet(const Mat& src, Mat& dst, const Mat& inner, const Mat& outer, const int interpolation = INTER_LINEAR, const uchar fill = 0) {
-	int nChannels = src.channels();
-	int dstheight = dst.rows;
-	int dstwidth = dst.cols;
-	int srcheight = src.rows;
-	int srcwidth = src.cols;
-	uchar * pdst = dst.data;
-	int dstoffset = dst.step - dstwidth * nChannels;
-	int srcstep = src.step;
+void rubbersheetMap(const Mat& inner, const Mat& outer, const Size& dstSize, const Size& srcSize, RubbersheetMap& sheet) {
+	int dstheight = dstSize.height;
+	int dstwidth = dstSize.width;
+	int srcheight = srcSize.height;
+	int srcwidth = srcSize.width;
+	int pwidth = srcwidth + 2;
+	const float scale = 1 << RUBBERSHEET_BITS;
+	sheet.width = dstwidth;
+	sheet.height = dstheight;
+	sheet.srcwidth = srcwidth;
+	sheet.srcheight = srcheight;
+	sheet.linear.resize(dstwidth * dstheight);
+	sheet.wx.resize(dstwidth * dstheight);
+	sheet.wy.resize(dstwidth * dstheight);
+	sheet.nearest.resize(dstwidth * dstheight);
 	float roffset = 1.f / dstheight;
 	float r = 0;
-	if (interpolation == INTER_NEAREST){
-		for (int y=0; y < dstheight; y++, pdst+= dstoffset, r+=roffset){
-			float * pinner = (float *) inner.data;
-			float * pouter = (float *) outer.data;
-			for (int x=0; x < dstwidth; x++, pinner++, pouter++){
-				float a = *pinner + r * (*pouter - *pinner);
-				pinner++; pouter++;
-				float b =  *pinner + r * (*pouter - *pinner);
-				int coordX = cvRound(a);
-				int coordY = cvRound(b);
-				if (coordX < 0 || coordY < 0 || coordX >= srcwidth || coordY >= srcheight){
-					for (int i=0; i< nChannels; i++,pdst++){
-						*pdst = fill;
-					}
-				}
-				else {
-					uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-					for (int i=0; i< nChannels; i++,pdst++,psrc++){
-						*pdst = *psrc;
-					}
-				}
+	for (int y=0, idx=0; y < dstheight; y++, r+= roffset){
+		float * pinner = (float *) inner.data;
+		float * pouter = (float *) outer.data;
+		for (int x=0; x < dstwidth; x++, idx++, pinner++, pouter++){
+			float a = *pinner + r * (*pouter - *pinner);
+			pinner++; pouter++;
+			float b =  *pinner + r * (*pouter - *pinner);
+			// clamp far away positions to keep the integer conversions in range
+			a = std::min(std::max(a,-2.f),srcwidth + 1.f);
+			b = std::min(std::max(b,-2.f),srcheight + 1.f);
+			int coordX = cvRound(a);
+			int coordY = cvRound(b);
+			sheet.nearest[idx] = (coordX < 0 || coordY < 0 || coordX >= srcwidth || coordY >= srcheight) ? -1 : (coordY + 1) * pwidth + coordX + 1;
+			coordX = cvFloor(a);
+			coordY = cvFloor(b);
+			if (coordX < -1 || coordY < -1 || coordX >= srcwidth || coordY >= srcheight){
+				sheet.linear[idx] = -1;
+				sheet.wx[idx] = 0;
+				sheet.wy[idx] = 0;
+			}
+			else {
+				sheet.linear[idx] = (coordY + 1) * pwidth + coordX + 1;
+				sheet.wx[idx] = (short) cvRound((a - coordX) * scale);
+				sheet.wy[idx] = (short) cvRound((b - coordY) * scale);
 			}
 		}
 	}
-	else if (interpolation == INTER_LINEAR){
-		for (int y=0; y < dstheight; y++, pdst+= dstoffset, r+= roffset){
-			float * pinner = (float *) inner.data;
-			float * pouter = (float *) outer.data;
-			for (int x=0; x < dstwidth; x++, pinner++, pouter++){
-				float a = *pinner + r * (*pouter - *pinner);
-				pinner++; pouter++;
-				float b =  *pinner + r * (*pouter - *pinner);
-				int coordX = cvFloor(a);
-				int coordY = cvFloor(b);
-				if (coordX >= 0){
-					if (coordY >= 0){
-						if (coordX < srcwidth-1){
-							if (coordY < srcheight-1){
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(*psrc)) + dx*(float)(psrc[nChannels]))+ dy*((1-dx)*((float)(psrc[srcstep])) + dx*(float)(psrc[nChannels+srcstep])));
-								}
-							}
-							else if (coordY == srcheight-1){ // bottom out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(*psrc)) + dx*(float)(psrc[nChannels])) + dy * ((float) fill));
-								}
-							}
-							else {
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = fill;
-								}
-							}
-						}
-						else if (coordX == srcwidth-1){
-							if (coordY < srcheight-1){// right out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dx)*((1-dy)*((float)(*psrc))+ dy*((float)(psrc[srcstep]))) + dx * ((float) fill));
-								}
-							}
-							else if (coordY == srcheight-1){ // bottom right out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(*psrc)) + dx * ((float)fill)) + dy * ((float) fill));
-								}
-							}
-							else {
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = fill;
-								}
-							}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = fill;
-							}
-						}
-					}
-					else if (coordY == -1){
-						if (coordX < srcwidth-1){// top out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((dy)*((1-dx)*((float)(psrc[srcstep])) + dx*(float)(psrc[nChannels+srcstep])) + (1-dy) * ((float) fill));
-								}
-						}
-						else if (coordX == srcwidth-1){// top right out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((dy)*((1-dx)*((float)(psrc[srcstep])) + dx * ((float)fill)) + (1-dy) * ((float) fill));
-								}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = fill;
-							}
-						}
-					}
-					else {
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = fill;
-						}
-					}
-				}
-				else if (coordX == -1){
-					if (coordY >= 0){
-						if (coordY < srcheight-1){// left out
-							float dx = a-coordX;
-							float dy = b-coordY;
-							uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-							for (int i=0; i< nChannels; i++,pdst++,psrc++){
-								*pdst = saturate_cast<uchar>(dx*((1-dy)*(float)(psrc[nChannels]) + dy*(float)(psrc[nChannels+srcstep])) + (1-dx) * ((float) fill));
-							}
-						}
-						else if (coordY == srcheight-1){ // left bottom out
-							float dx = a-coordX;
-							float dy = b-coordY;
-							uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-							for (int i=0; i< nChannels; i++,pdst++,psrc++){
-								*pdst = saturate_cast<uchar>((1-dy)*((dx)*((float)(psrc[nChannels])) + (1-dx) * ((float) fill)) + dy * ((float) fill));
-							}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = fill;
-							}
-						}
-					}
-					else if (coordY == -1){ // left top out
-						float dx = a-coordX;
-						float dy = b-coordY;
-						uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-						for (int i=0; i< nChannels; i++,pdst++,psrc++){
-							*pdst = saturate_cast<uchar>((dy)*((dx)*((float)(psrc[nChannels+srcstep])) + (1-dx) * ((float) fill)) + (1-dy) * ((float) fill));
-						}
-					}
-					else {
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = fill;
-						}
-					}
+}
+
+/*
+ * Samples a (polar) image from a rubbersheet sheet. The source is padded by one pixel of
+ * fill (INTER_NEAREST, INTER_LINEAR) or of its border pixels (INTER_LINEAR_REPEAT, where
+ * positions out of the image repeat the pixel of the row above).
+ *
+ * src: CV_8U (cartesian) source image (possibly multi-channel)
+ * dst: CV_8U (polar) destination image of the size of the map
+ * sheet: sampling positions
+ * interpolation: interpolation mode (INTER_NEAREST, INTER_LINEAR or INTER_LINEAR_REPEAT)
+ * fill: fill value for pixels out of the image
+ */
+void rubbersheetRemap(const Mat& src, Mat& dst, const RubbersheetMap& sheet, const int interpolation = INTER_LINEAR, const uchar fill = 0) {
+	CV_Assert(src.depth() == CV_8U && src.type() == dst.type());
+	CV_Assert(src.cols == sheet.srcwidth && src.rows == sheet.srcheight && dst.cols == sheet.width && dst.rows == sheet.height);
+	int nChannels = src.channels();
+	bool repeat = (interpolation != INTER_NEAREST && interpolation != INTER_LINEAR);
+	Mat padded;
+	copyMakeBorder(src,padded,1,1,1,1,(repeat) ? BORDER_REPLICATE : BORDER_CONSTANT,Scalar::all(fill));
+	const uchar * psrc = padded.data;
+	int pstep = padded.step;
+	const int half = 1 << (2 * RUBBERSHEET_BITS - 1);
+	const int one = 1 << RUBBERSHEET_BITS;
+	for (int y=0, idx=0; y < sheet.height; y++){
+		uchar * pdst = dst.ptr<uchar>(y);
+		if (interpolation == INTER_NEAREST){
+			for (int x=0; x < sheet.width; x++, idx++){
+				int pos = sheet.nearest[idx];
+				for (int i=0; i< nChannels; i++,pdst++){
+					*pdst = (pos < 0) ? fill : psrc[pos * nChannels + i];
 				}
-				else {
-					for (int i=0; i< nChannels; i++,pdst++){
-						*pdst = fill;
-					}
+			}
+			continue;
+		}
+		for (int x=0; x < sheet.width; x++, idx++){
+			int pos = sheet.linear[idx];
+			if (pos < 0){
+				for (int i=0; i< nChannels; i++,pdst++){
+					*pdst = (repeat && y > 0) ? *(pdst - dst.step) : fill; // one row above
 				}
+				continue;
+			}
+			int dx = sheet.wx[idx], dy = sheet.wy[idx];
+			int w00 = (one - dx) * (one - dy), w01 = dx * (one - dy), w10 = (one - dx) * dy, w11 = dx * dy;
+			const uchar * p = psrc + pos * nChannels;
+			for (int i=0; i< nChannels; i++,pdst++,p++){
+				*pdst = (uchar)((w00 * p[0] + w01 * p[nChannels] + w10 * p[pstep] + w11 * p[pstep + nChannels] + half) >> (2 * RUBBERSHEET_BITS));
 			}
 		}
 	}
-	else { // INTER_LINEAR_REPEAT (repeats last pixel value)
-		uchar * firstLine = pdst + dst.step;
-		int step = dst.step;
-		for (int y=0; y < dstheight; y++, pdst+= dstoffset, r+= roffset){
-			float * pinner = (float *) inner.data;
-			float * pouter = (float *) outer.data;
-			for (int x=0; x < dstwidth; x++, pinner++, pouter++){
-				float a = *pinner + r * (*pouter - *pinner);
-				pinner++; pouter++;
-				float b =  *pinner + r * (*pouter - *pinner);
-				int coordX = cvFloor(a);
-				int coordY = cvFloor(b);
-				if (coordX >= 0){
-					if (coordY >= 0){
-						if (coordX < srcwidth-1){
-							if (coordY < srcheight-1){
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(*psrc)) + dx*(float)(psrc[nChannels]))+ dy*((1-dx)*((float)(psrc[srcstep])) + dx*(float)(psrc[nChannels+srcstep])));
-								}
-							}
-							else if (coordY == srcheight-1){ // bottom out
-								float dx = a-coordX;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>(((1-dx)*((float)(*psrc)) + dx*(float)(psrc[nChannels])));
-								}
-							}
-							else if (pdst >= firstLine){
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = *(pdst - step); // one row above
-								}
-							}
-							else {
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = fill;
-								}
-							}
-						}
-						else if (coordX == srcwidth-1){
-							if (coordY < srcheight-1){// right out
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>(((1-dy)*((float)(*psrc))+ dy*((float)(psrc[srcstep]))));
-								}
-							}
-							else if (coordY == srcheight-1){ // bottom right out
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = *psrc;
-								}
-							}
-							else if (pdst >= firstLine){
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = *(pdst - step); // one row above
-								}
-							}
-							else {
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = fill;
-								}
-							}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = *(pdst - step); // one row above
-							}
-						}
-					}
-					else if (coordY == -1){
-						if (coordX < srcwidth-1){// top out
-								float dx = a-coordX;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>(((1-dx)*((float)(psrc[srcstep])) + dx*(float)(psrc[nChannels+srcstep])));
-								}
-						}
-						else if (coordX == srcwidth-1){// top right out
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = psrc[srcstep];
-								}
-						}
-						else if (pdst >= firstLine){
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = *(pdst - step); // one row above
-							}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = fill;
-							}
-						}
-					}
-					else if (pdst >= firstLine){
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = *(pdst - step); // one row above
-						}
-					}
-					else {
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = fill;
-						}
-					}
-				}
-				else if (coordX == -1){
-					if (coordY >= 0){
-						if (coordY < srcheight-1){// left out
-							float dy = b-coordY;
-							uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-							for (int i=0; i< nChannels; i++,pdst++,psrc++){
-								*pdst = saturate_cast<uchar>(((1-dy)*(float)(psrc[nChannels]) + dy*(float)(psrc[nChannels+srcstep])));
-							}
-						}
-						else if (coordY == srcheight-1){ // bottom left out
-							uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-							for (int i=0; i< nChannels; i++,pdst++,psrc++){
-								*pdst = psrc[nChannels];
-							}
-						}
-						else if (pdst >= firstLine){
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = *(pdst - step); // one row above
-							}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = fill;
-							}
-						}
-					}
-					else if (coordY == -1){ // top left out
-						uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-						for (int i=0; i< nChannels; i++,pdst++,psrc++){
-							*pdst = psrc[nChannels+srcstep];
-						}
-					}
-					else if (pdst >= firstLine){
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = *(pdst - step); // one row above
-						}
-					}
-					else {
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = fill;
-						}
-					}
-				}
-				else if (pdst >= firstLine){
-					for (int i=0; i< nChannels; i++,pdst++){
-						*pdst = *(pdst - step); // one row above
-					}
-				}
-				else {
-					for (int i=0; i< nChannels; i++,pdst++){
-						*pdst = fill;
-					}
-				}
+}
+
+/*
+ * Samples the texture (INTER_LINEAR) and the noise mask (INTER_NEAREST) of a segmentation
+ * from a rubbersheet map in one pass, pixels out of the image are 0.
+ *
+ * src: CV_8UC1 (cartesian) source image
+ * dst: CV_8UC1 (polar) texture of the size of the map
+ * mask: CV_8UC1 (cartesian) noise mask of the size of src
+ * maskDst: CV_8UC1 (polar) noise mask of the size of the map
+ * sheet: sampling positions
+ */
+void rubbersheetRemap(const Mat& src, Mat& dst, const Mat& mask, Mat& maskDst, const RubbersheetMap& sheet) {
+	CV_Assert(src.type() == CV_8UC1 && dst.type() == CV_8UC1 && mask.type() == CV_8UC1 && maskDst.type() == CV_8UC1);
+	CV_Assert(src.size() == mask.size() && dst.size() == maskDst.size());
+	CV_Assert(src.cols == sheet.srcwidth && src.rows == sheet.srcheight && dst.cols == sheet.width && dst.rows == sheet.height);
+	Mat padded, paddedMask;
+	copyMakeBorder(src,padded,1,1,1,1,BORDER_CONSTANT,Scalar::all(0));
+	copyMakeBorder(mask,paddedMask,1,1,1,1,BORDER_CONSTANT,Scalar::all(0));
+	const uchar * psrc = padded.data;
+	const uchar * pmask = paddedMask.data;
+	int pstep = padded.step;
+	const int half = 1 << (2 * RUBBERSHEET_BITS - 1);
+	const int one = 1 << RUBBERSHEET_BITS;
+	for (int y=0, idx=0; y < sheet.height; y++){
+		uchar * pdst = dst.ptr<uchar>(y);
+		uchar * pmaskdst = maskDst.ptr<uchar>(y);
+		for (int x=0; x < sheet.width; x++, idx++){
+			int npos = sheet.nearest[idx];
+			pmaskdst[x] = (npos < 0) ? 0 : pmask[npos];
+			int pos = sheet.linear[idx];
+			if (pos < 0){
+				pdst[x] = 0;
+				continue;
 			}
+			int dx = sheet.wx[idx], dy = sheet.wy[idx];
+			const uchar * p = psrc + pos;
+			pdst[x] = (uchar)(((one - dx) * (one - dy) * p[0] + dx * (one - dy) * p[1] + (one - dx) * dy * p[pstep] + dx * dy * p[pstep + 1] + half) >> (2 * RUBBERSHEET_BITS));
 		}
 	}
 }
 
+/*
+ * Calculates the mapped (polar) image of source using two transformation contours.
+ *
+ * src: CV_8U (cartesian) source image (possibly multi-channel)
+ * dst:	CV_8U (polar) destination image (possibly multi-channel, 2 times the col size of inner)
+ * inner: CV_32FC2 inner cartesian coordinates
+ * outer: CV_32FC2 outer cartesian coordinates
+ * interpolation: interpolation mode (INTER_NEAREST, INTER_LINEAR or INTER_LINEAR_REPEAT)
+ * fill: fill value for pixels out of the image
+ */
+void rubbersheet(const Mat& src, Mat& dst, const Mat& inner, const Mat& outer, const int interpolation = INTER_LINEAR, const uchar fill = 0) {
+	RubbersheetMap sheet;
+	rubbersheetMap(inner, outer, dst.size(), src.size(), sheet);
+	rubbersheetRemap(src, dst, sheet, interpolation, fill);
+}
+
 
 void reverse(vector<Point2f>& curve,vector<Point2f>& reversed){
 	for (vector<Point2f>::iterator it = curve.end(); it != curve.begin(); --it){
@@ -1613,7 +1122,9 @@ int main(int argc, char *argv[])
                 if (!q) cout << "Eyelid offset: " << eyelid_offset << endl;
 
 				Mat out (outHeight,outWidth,CV_8UC1);
-				rubbersheet(img, out, innerBoundary, outerBoundary, INTER_LINEAR);
+				RubbersheetMap sheet;
+				rubbersheetMap(innerBoundary, outerBoundary, out.size(), img.size(), sheet);
+				rubbersheetRemap(img, out, sheet, INTER_LINEAR);
 				if (enhance){
 					int width = img.cols;
 					int height = img.rows;
@@ -1656,7 +1167,7 @@ int main(int argc, char *argv[])
 
 					if (!maskfiles.empty()){
 						Mat outNoise (outHeight,outWidth,CV_8UC1);
-						rubbersheet(bw, outNoise, innerBoundary, outerBoundary, INTER_NEAREST);
+						rubbersheetRemap(bw, outNoise, sheet, INTER_NEAREST);
 						string maskfile;
 						patternFileRename(infiles,maskfiles,*infile,maskfile);
 						if (!q) cout << "Storing image '" << maskfile << "' ..."<< endl;
@@ -0,0 +1,27 @@
+/*
+ * caht_test.cpp
+ *
+ * Regression tests of caht, run with "make -f Makefile_linux.mak test".
+ *
+ */
+#define main caht_main
+#include "../caht.cpp"
+#undef main
+#include "gaussian_smooth.h"
+
+/*
+ * caht keeps the buffer of the row-wise pass between images, so one buffer is
+ * reused for all cases here.
+ */
+static void smooth(Mat& image, Mat& res, double sigma, int size)
+{
+    static Mat temp;
+    gaussian_smooth(image, res, sigma, size, temp);
+}
+
+int main()
+{
+    int failed = 0;
+    failed += testGaussianSmooth("caht", smooth);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
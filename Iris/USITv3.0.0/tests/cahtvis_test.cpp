@@ -0,0 +1,17 @@
+/*
+ * cahtvis_test.cpp
+ *
+ * Regression tests of cahtvis, run with "make -f Makefile_linux.mak test".
+ *
+ */
+#define main cahtvis_main
+#include "../cahtvis.cpp"
+#undef main
+#include "gaussian_smooth.h"
+
+int main()
+{
+    int failed = 0;
+    failed += testGaussianSmooth("cahtvis", gaussian_smooth);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,115 @@
+/*
+ * fourier_normalize.h
+ *
+ * Regression test of the fourierNormalize of wahet and ifpp (projection onto
+ * the kept Fourier coefficients) against the DFT path it replaced: forward
+ * DFT, zeroing of all but the first coefficients and scaled inverse DFT.
+ *
+ */
+#ifndef TESTS_FOURIER_NORMALIZE_H
+#define TESTS_FOURIER_NORMALIZE_H
+
+#include <cstdio>
+#include <cmath>
+#include <random>
+#include <opencv2/core/core.hpp>
+
+namespace oracle {
+
+/*
+ * Normalizes a function based on DFT by keeping the first numberCoeffs fourier
+ * coefficients only (the former path of fourierNormalize, which the tools only
+ * took for optimal DFT sizes, is applied to contours of any size here)
+ * f:            original signal, Mat (1, size, CV_32FC1)
+ * norm:         normalized signal, Mat (1, size, CV_32FC1)
+ * energy:       sum of the squared magnitudes of the first numberCoeffs Fourier
+ *               coefficients (DC excluded)
+ * numberCoeffs: number of fourrier coefficients to keep
+ */
+inline void fourierNormalize(const cv::Mat& f, cv::Mat& norm, double& energy, const int numberCoeffs){
+	int size = f.cols;
+	cv::Mat fFourier(1, size, CV_32FC1);
+	cv::dft(f, fFourier, CV_DXT_FORWARD);
+	float * data = (float *) fFourier.data;
+	int datastop = std::min(size, 1 + numberCoeffs*2);
+	energy = 0;
+	for (int i = 1; i < datastop; i++){
+		energy += (double) data[i] * data[i];
+	}
+	for (int i = datastop; i < size; i++){
+		data[i] = 0;
+	}
+	cv::dft(fFourier, norm, CV_DXT_INV_SCALE);
+}
+
+}
+
+/*
+ * Compares normalize (the fourierNormalize of a tool) to the DFT path on random
+ * contours (radii around 100 with noise) keeping 1 and 3 coefficients, for even
+ * and odd lengths, lengths which are not optimal DFT sizes and lengths where all
+ * coefficients are kept, out-of-place and in-place. Reconstruction and energy
+ * may differ by float rounding; in-place results must equal the out-of-place
+ * ones. If all coefficients are kept, the energy is that of all of them.
+ * tool: name printed in the messages
+ * energyIsNorm: the tool returns the norm of the coefficients (wahet) instead of
+ *               the sum of their squares (ifpp)
+ * returns the number of failed cases
+ */
+template <typename Normalize>
+int testFourierNormalize(const char *tool, Normalize normalize, const bool energyIsNorm)
+{
+	static const int sizes[] = { 5, 7, 8, 9, 16, 17, 31, 64, 97, 100, 127, 360, 361, 512, 513, 1021 };
+	static const int coeffs[] = { 1, 3 };
+	std::mt19937 rng(1);
+	std::normal_distribution<float> noise(0, 5);
+	int cases = 0, failed = 0, nonOptimal = 0;
+	for (int size : sizes)
+	{
+		if (cv::getOptimalDFTSize(size) != size) nonOptimal++;
+		cv::Mat cont(1, size, CV_32FC1);
+		float * c = (float *) cont.data;
+		float amplitude = 0;
+		for (int x = 0; x < size; x++)
+		{
+			c[x] = 100 + 10 * sin(2 * M_PI * x / size) + noise(rng);
+			amplitude = std::max(amplitude, std::fabs(c[x]));
+		}
+		for (int k : coeffs)
+		{
+			cv::Mat expected(1, size, CV_32FC1), actual(1, size, CV_32FC1), inplace = cont.clone();
+			double expectedEnergy;
+			float energy = -1, inplaceEnergy = -1;
+			oracle::fourierNormalize(cont, expected, expectedEnergy, k);
+			if (energyIsNorm) expectedEnergy = sqrt(expectedEnergy);
+			normalize(cont, actual, energy, k);
+			normalize(inplace, inplace, inplaceEnergy, k);
+			double err = 0, inplaceErr = 0;
+			const float * e = (const float *) expected.data;
+			const float * a = (const float *) actual.data;
+			const float * p = (const float *) inplace.data;
+			for (int x = 0; x < size; x++)
+			{
+				err = std::max(err, (double) std::fabs(e[x] - a[x]));
+				inplaceErr = std::max(inplaceErr, (double) std::fabs(p[x] - a[x]));
+			}
+			double energyErr = std::fabs(energy - expectedEnergy) / std::max(1., expectedEnergy);
+			cases++;
+			if (!(err <= 1e-4 * amplitude) || !(energyErr <= 1e-4) || inplaceErr != 0 || inplaceEnergy != energy)
+			{
+				failed++;
+				printf("FAIL %s fourierNormalize size %d (optimal DFT size %d) %d coefficients: max error %g, energy %g (expected %g), in-place error %g, in-place energy %g\n",
+					tool, size, cv::getOptimalDFTSize(size), k, err, energy, expectedEnergy, inplaceErr, inplaceEnergy);
+			}
+		}
+	}
+	printf("%s fourierNormalize: %d of %d cases passed\n", tool, cases - failed, cases);
+	if (nonOptimal == 0)
+	{
+		failed++;
+		printf("FAIL %s fourierNormalize: no size differs from its optimal DFT size\n", tool);
+	}
+	return failed;
+}
+
+#endif
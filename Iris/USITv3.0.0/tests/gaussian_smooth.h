@@ -0,0 +1,156 @@
+/*
+ * gaussian_smooth.h
+ *
+ * Regression test of the separable gaussian_smooth of caht, cahtvis and wahet
+ * against the original 2D convolution (the oracle below is the brute force
+ * implementation the tools used before).
+ *
+ */
+#ifndef TESTS_GAUSSIAN_SMOOTH_H
+#define TESTS_GAUSSIAN_SMOOTH_H
+
+#include <cstdio>
+#include <cmath>
+#include <random>
+#include <opencv2/core/core.hpp>
+
+namespace oracle {
+
+/*
+ * Returns the result of convoluting image with kernel.
+ * The border is handled by treating all outside pixels as the nearest picture
+ * pixel.
+ */
+inline void convolution_brute(const cv::Mat& image, cv::Mat& res, const cv::Mat& kernel)
+{
+    int w = image.cols;
+    int h = image.rows;
+    int step = image.step / sizeof (float);
+    int kw = kernel.cols;
+    int kh = kernel.rows;
+    int kstep = kernel.step / sizeof (float);
+    float *data = (float*)image.data;
+    float *kdata = (float*)kernel.data;
+    int ox = -kw / 2;
+    int oy = -kh / 2;
+    float *result = (float*)res.data;
+    int rstep = res.step / sizeof (float);
+    for (int y = oy; y < h + oy; y++)
+    {
+        for (int x = ox; x < w + ox; x++)
+        {
+            float sum = 0;
+            for (int j = 0; j < kh; j++)
+            {
+                int yj;
+                if (y + j >= 0 && y + j < h)
+                {
+                    yj = y + j;
+                }
+                else
+                {
+                    yj = y - oy;
+                }
+                for (int i = 0; i < kw; i++)
+                {
+                    int xi;
+                    if (x + i >= 0 && x + i < w)
+                    {
+                        xi = x + i;
+                    }
+                    else
+                    {
+                        xi = x - ox;
+                    }
+                    float v = data[step * yj + xi];
+                    float k = kdata[j * kstep + i];
+                    sum += v * k;
+                }
+            }
+            result[(y - oy) * rstep + x - ox] = sum;
+        }
+    }
+}
+
+/*
+ * Returns a new image of size w times h with the result of a gaussian
+ * smoothing operation with a size times size kernel.
+ */
+inline void gaussian_smooth(cv::Mat& image, cv::Mat& res, double sigma, int size)
+{
+    double sigma2 = sigma * sigma;
+    int kw = size;
+    int kh = size;
+    cv::Mat kernel(kh,kw,CV_32FC1);
+    float *pos = (float *) kernel.data;
+    int off = (kernel.step / sizeof(float)) - kernel.cols;
+    int o = -size / 2;
+    for (int j = o; j < kh + o; j++, pos+=off)
+    {
+        for (int i = o; i < kw + o; i++, pos++)
+        /* This is 2D (for 1D, sqrt the factor) */
+        {
+            *pos = exp(-(i * i + j * j) / (2 * sigma2)) / (2 * M_PI * sigma2);
+        }
+    }
+    convolution_brute(image, res, kernel);
+}
+
+}
+
+/*
+ * Compares smooth (the gaussian_smooth of a tool) to the oracle on random
+ * images of odd and even sizes (down to 1x1) with odd and even kernels, up to
+ * kernels larger than the image, so every pixel of the small images takes the
+ * border path. The results differ only in the rounding of the float sums, the
+ * tolerance is relative to the largest pixel value.
+ * tool: name printed in the messages
+ * returns the number of failed cases
+ */
+inline int testGaussianSmooth(const char *tool, void (*smooth)(cv::Mat&, cv::Mat&, double, int))
+{
+    static const int sizes[] = { 1, 2, 3, 4, 7, 8, 16, 33 };
+    static const int kernels[] = { 1, 2, 3, 5, 6, 9, 13, 40, 67 };
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> pixel(0, 255);
+    int cases = 0, failed = 0;
+    for (int h : sizes)
+    {
+        for (int w : sizes)
+        {
+            cv::Mat image(h, w, CV_32FC1);
+            for (int y = 0; y < h; y++)
+            {
+                float *p = image.ptr<float>(y);
+                for (int x = 0; x < w; x++) p[x] = pixel(rng);
+            }
+            for (int size : kernels)
+            {
+                double sigma = 0.5 + size / 3.;
+                cv::Mat expected(h, w, CV_32FC1), actual(h, w, CV_32FC1);
+                oracle::gaussian_smooth(image, expected, sigma, size);
+                smooth(image, actual, sigma, size);
+                double err = 0;
+                for (int y = 0; y < h; y++)
+                {
+                    const float *e = expected.ptr<float>(y);
+                    const float *a = actual.ptr<float>(y);
+                    for (int x = 0; x < w; x++)
+                    {
+                        err = std::max(err, (double)std::fabs(e[x] - a[x]));
+                    }
+                }
+                cases++;
+                if (!(err <= 255 * 1e-5))
+                {
+                    failed++;
+                    printf("FAIL %s gaussian_smooth %dx%d kernel %d: max error %g\n", tool, w, h, size, err);
+                }
+            }
+        }
+    }
+    printf("%s gaussian_smooth: %d of %d cases passed\n", tool, cases - failed, cases);
+    return failed;
+}
+
+#endif
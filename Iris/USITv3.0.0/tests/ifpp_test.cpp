@@ -0,0 +1,17 @@
+/*
+ * ifpp_test.cpp
+ *
+ * Regression tests of ifpp, run with "make -f Makefile_linux.mak test".
+ *
+ */
+#define main ifpp_main
+#include "../ifpp.cpp"
+#undef main
+#include "fourier_normalize.h"
+
+int main()
+{
+    int failed = 0;
+    failed += testFourierNormalize("ifpp", fourierNormalize, false);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
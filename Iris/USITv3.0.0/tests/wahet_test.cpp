@@ -0,0 +1,19 @@
+/*
+ * wahet_test.cpp
+ *
+ * Regression tests of wahet, run with "make -f Makefile_linux.mak test".
+ *
+ */
+#define main wahet_main
+#include "../wahet.cpp"
+#undef main
+#include "gaussian_smooth.h"
+#include "fourier_normalize.h"
+
+int main()
+{
+    int failed = 0;
+    failed += testGaussianSmooth("wahet", gaussian_smooth);
+    failed += testFourierNormalize("wahet", fourierNormalize, true);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -29,6 +29,8 @@
 #endif
 
 #include "version.h"
+#include "clahe.h"
+#include "batch.h"
 #include <cstdio>
 #include <map>
 #include <vector>
@@ -37,6 +39,12 @@
 #include <ctime>
 #include <fstream>
 #include <iostream>
+#include <algorithm>
+#include <thread>
+#include <sstream>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -84,6 +92,10 @@ void printUsage() {
     printf("| -e   |            | 1 | Y | enhance iris texture on (off)                   |\n");
     printf("| -q   |            | 1 | Y | quiet mode on (off)                             |\n");
     printf("| -t   |            | 1 | Y | time progress on (off)                          |\n");
+    printf("| -j   | jobs       | 1 | Y | number of files processed in parallel (1)       |\n");
+    printf("|      |            |   |   | (console messages interleave, use with -q)      |\n");
+    printf("| -prof | proffile  | 1 | Y | write the wall time of each stage and image as  |\n");
+    printf("|      |            |   |   | JSON lines, print p50/p95/p99 per stage (off)   |\n");
     printf("| -rm  | rmaskfile  | 1 | Y | write source reflection mask (off)              |\n");
     printf("| -rr  | rremovfile | 1 | Y | write image with removed reflections (off)      |\n");
     printf("| -em  | emaskfile  | 1 | Y | write image masking boundary edges (off)        |\n");
@@ -222,332 +234,6 @@ int histquant2u(const Mat& histogram, const int count, const float quantile){
 	return p;
 }
 
-/** ------------------------------- Clahe ------------------------------- **/
-
-/*
- * Retrieves the (bilinear) interpolated byte from 4 bytes
- *
- * x: distance to left byte
- * y: distance to right byte
- * r: distance to upper byte
- * s: distance to lower byte
- * b1: upper left byte
- * b2: upper right byte
- * b3: lower left byte
- * b4: lower right byte
- */
-uchar interp(const double x, const double y, const double r, const double s, const uchar b1, const uchar b2, const uchar b3, const uchar b4) {
-  double w1 = (x + y);
-  double w2 = x / w1;
-  w1 = y / w1;
-  double w3 = (r + s);
-  double w4 = r / w3;
-  w3 = s / w3;
-  return saturate_cast<uchar>(w3 * (w1 * b1 + w2 * b2) + w4 * (w1 * b3 + w2 * b4));
-}
-
-/*
- * Retrieves the bilinear interpolated byte from 2 bytes
- *
- * x:  distance to left byte
- * y:  distance to right byte
- * b1: left byte
- * b2: right byte
- */
-uchar interp(const double x, const double y, const uchar b1, const uchar b2) {
-  double w1 = (x + y);
-  double w2 = x / w1;
-  w1 = y / w1;
-  return saturate_cast<uchar>(w1 * b1 + w2 * b2);
-}
-
-/*
- * Inplace histogram clipping according to Zuiderveld (counts excess and redistributes excess by adding the average increment)
- *
- * hist: CV_32SC1 1 x 256 histogram matrix
- * clipFactor: between 0 (maximum slope M/N, where M #pixel in window, N #bins) and 1 (maximum slope M)
- * pixelCount: number of pixels in window
- */
-void clipHistogram(Mat& hist, const float clipFactor, const int pixelCount) {
-	double minSlope = ((double) pixelCount) / 256;
-	int clipLimit = std::min(pixelCount, std::max(1, cvCeil(minSlope + clipFactor * (pixelCount - minSlope))));
-	int distributeCount = 0;
-	MatIterator_<int> p = hist.begin<int>();
-	MatIterator_<int> e = hist.end<int>();
-	for (; p!=e; p++){
-		int binsExcess = *p - clipLimit;
-		if (binsExcess > 0) {
-			distributeCount += binsExcess;
-			*p = clipLimit;
-		}
-	}
-	int avgInc = distributeCount / 256;
-	int maxBins = clipLimit - avgInc;
-	for (p = hist.begin<int>(); p!=e; p++){
-		if (*p <= maxBins) {
-			distributeCount -= avgInc;
-			*p += avgInc;
-		}
-		else if (*p < clipLimit) {
-			distributeCount -= (clipLimit - *p);
-			*p = clipLimit;
-		}
-	}
-	while (distributeCount > 0) {
-		for (p = hist.begin<int>(); p!=e && distributeCount > 0; p++){
-			if (*p < clipLimit) {
-				(*p)++;
-				distributeCount--;
-			}
-		}
-	}
-}
-
-/*
- * Contrast-limited adaptive histogram equalization (supports in-place)
- *
- * src: CV_8UC1 image
- * dst: CV_8UC1 image (in-place operation is possible)
- * _cellWidth: patch size in x direction (greater or equal to 2)
- * _cellHeight: patch size in y direction (greater or equal to 2)
- * clipFactor: histogram clip factor between 0 and 1
- */
-void clahe(const Mat& src, Mat& dst, const int _cellWidth = 10, const int _cellHeight = 10, const float clipFactor = 1.){
-    if( src.rows <=0 || src.cols<=0) return;
-    int cellWidth = max(2,_cellWidth);
-    int cellHeight = max(2,_cellHeight);
-	Mat hist(1,256,CV_32SC1);
-	Mat roi;
-	uchar * sp, * dp;
-	int height = src.rows;
-	int width = src.cols;
-	int gridWidth = width / cellWidth + (width % cellWidth == 0 ? 0 : 1);
-	int gridHeight = height / cellHeight + (height % cellHeight == 0 ? 0 : 1);
-	int bufSize = (gridWidth + 2)*256;
-	int bufOffsetLeft = bufSize - 256;
-	int bufOffsetTop = bufSize - gridWidth * 256;
-	int bufOffsetTopLeft = bufSize - (gridWidth + 1) * 256;
-	Mat buf(1, bufSize, CV_8UC1);
-	MatIterator_<uchar> pbuf = buf.begin<uchar>(), ebuf = buf.end<uchar>();
-	MatIterator_<int> phist, ehist = hist.end<int>();
-	uchar * curr, * topleft, * top, * left;
-	int pixelCount, cX, cY, cWidth, cHeight, cellOrigin, cellOffset;
-	double sum;
-	// process first row, first cell
-	cX = 0;
-	cY = 0;
-	cWidth = min(cellWidth, width);
-	cHeight = min(cellHeight, height);
-	pixelCount = cWidth*cHeight;
-	sum = 0;
-	roi = Mat(src,Rect(cX,cY,cWidth,cHeight));
-	hist2u(roi,hist);
-	if (clipFactor < 1) clipHistogram(hist,clipFactor,pixelCount);
-	// equalization
-	for(phist = hist.begin<int>(); phist!=ehist; phist++, pbuf++){
-		sum += *phist;
-		*pbuf = saturate_cast<uchar>(sum * 255 / pixelCount);
-	}
-	// paint first corner cell
-	cWidth = min(cellWidth / 2, cWidth);
-	cHeight = min(cellHeight / 2, cHeight);
-	cellOrigin = src.step * cY + cX;
-	cellOffset = src.step - cWidth;
-	sp = (uchar *)(src.data + cellOrigin);
-	dp = (uchar *)(dst.data + cellOrigin);
-	curr = buf.data;
-	for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-	  for (int a=0; a < cWidth; a++, sp++, dp++){
-		*dp = curr[*sp];
-	  }
-	}
-	// process first row, other cells
-	for (int x = 1; x < gridWidth; x++) {
-		cX = x*cellWidth;
-		cWidth = min(cellWidth, width - x*cellWidth);
-		cHeight = min(cellHeight, height);
-		pixelCount = cWidth*cHeight;
-		sum = 0;
-		roi.release();
-		roi = Mat(src,Rect(cX,cY,cWidth,cHeight));
-		hist2u(roi,hist);
-		if (clipFactor < 1) clipHistogram(hist,clipFactor,pixelCount);
-		// equalization
-		for(phist = hist.begin<int>(); phist!=ehist; phist++, pbuf++){
-			sum += *phist;
-			*pbuf = saturate_cast<uchar>(sum * 255 / pixelCount);
-		}
-		// paint first row, other cells
-		cX += cellWidth/2 - cellWidth;
-		cWidth = min(cellWidth, width - x*cellWidth + cellWidth/2);
-		cHeight = min(cellHeight / 2, height);
-		cellOrigin = src.step * cY + cX;
-		cellOffset = src.step - cWidth;
-		sp = (uchar *)(src.data + cellOrigin);
-		dp = (uchar *)(dst.data + cellOrigin);
-		curr = buf.data + (curr - buf.data + 256) % bufSize;
-		left = buf.data + (curr - buf.data + bufOffsetLeft) % bufSize;
-		for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-		  for (int a=0; a < cWidth; a++, sp++, dp++){
-			  *dp = interp(a,cWidth-a,left[*sp], curr[*sp]);
-		  }
-		}
-	}
-	// process (i.e. paint) first row, last cell (only if necessary)
-	if (width % cellWidth > cellWidth / 2 || width % cellWidth == 0) {
-		cWidth = (width - cellWidth / 2) % cellWidth;
-		cHeight = min(cellHeight / 2, height);
-		cX = width-cWidth;
-		cellOrigin = src.step * cY + cX;
-		cellOffset = src.step - cWidth;
-		sp = (uchar *)(src.data + cellOrigin);
-		dp = (uchar *)(dst.data + cellOrigin);
-		for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-		  for (int a=0; a < cWidth; a++, sp++, dp++){
-			*dp = curr[*sp];
-		  }
-		}
-	}
-	// process rest of rows
-	for (int y = 1; y < gridHeight; y++) {
-		// process other rows, first cell
-		cX = 0;
-		cY = y*cellHeight;
-		cWidth = min(cellWidth, width);
-		cHeight = min(cellHeight, height - y*cellHeight);
-		pixelCount = cWidth*cHeight;
-		sum = 0;
-		roi.release();
-		roi = Mat(src,Rect(cX,cY,cWidth,cHeight));
-		hist2u(roi,hist);
-		if (clipFactor < 1) clipHistogram(hist,clipFactor,pixelCount);
-		// equalization
-		if (pbuf == ebuf) pbuf = buf.begin<uchar>();
-		for(phist = hist.begin<int>(); phist!=ehist; phist++, pbuf++){
-			sum += *phist;
-			*pbuf = saturate_cast<uchar>(sum * 255 / pixelCount);
-		}
-		// paint other rows, first cell
-		cY += cellHeight/2 - cellHeight;
-		cWidth = min(cellWidth / 2, width);
-		cHeight = min(cellHeight, height - y*cellHeight + cellHeight/2);
-		cellOrigin = src.step * cY + cX;
-		cellOffset = src.step - cWidth;
-		sp = (uchar *)(src.data + cellOrigin);
-		dp = (uchar *)(dst.data + cellOrigin);
-		curr = buf.data + (curr - buf.data + 256) % bufSize;
-		top = buf.data + (curr - buf.data + bufOffsetTop) % bufSize;
-		for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-		  for (int a=0; a < cWidth; a++, sp++, dp++){
-			  *dp = interp(b,cHeight-b,top[*sp], curr[*sp]);
-		  }
-		}
-		// process other rows, rest of cells
-		for (int x = 1; x < gridWidth; x++) {
-			cX = x*cellWidth;
-			cY = y*cellHeight;
-			cWidth = min(cellWidth, width - x*cellWidth);
-			cHeight = min(cellHeight, height - y*cellHeight);
-			pixelCount = cWidth*cHeight;
-			sum = 0;
-			roi.release();
-			roi = Mat(src,Rect(cX,cY,cWidth,cHeight));
-			hist2u(roi,hist);
-			if (clipFactor < 1) clipHistogram(hist,clipFactor,pixelCount);
-			// equalization
-			if (pbuf == ebuf) pbuf = buf.begin<uchar>();
-			for(phist = hist.begin<int>(); phist!=ehist; phist++, pbuf++){
-				sum += *phist;
-				*pbuf = saturate_cast<uchar>(sum * 255 / pixelCount);
-			}
-			// paint other rows, rest of cells
-			cX += cellWidth/2 - cellWidth;
-			cY += cellHeight/2 - cellHeight;
-			cWidth = min(cellWidth, width - x*cellWidth + cellWidth/2);
-			cHeight = min(cellHeight, height - y*cellHeight + cellHeight/2);
-			cellOrigin = src.step * cY + cX;
-			cellOffset = src.step - cWidth;
-			sp = (uchar *)(src.data + cellOrigin);
-			dp = (uchar *)(dst.data + cellOrigin);
-			curr = buf.data + (curr - buf.data + 256) % bufSize;
-			top = buf.data + (curr - buf.data + bufOffsetTop) % bufSize;
-			topleft = buf.data + (curr - buf.data + bufOffsetTopLeft) % bufSize;
-			left = buf.data + (curr - buf.data + bufOffsetLeft) % bufSize;
-			for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-			  for (int a=0; a < cWidth; a++, sp++, dp++){
-				  *dp = interp(a, cWidth-a,b,cHeight-b,topleft[*sp],top[*sp],left[*sp],curr[*sp]);
-			  }
-			}
-		}
-		// process (i.e. paint) other rows, last cell (only if necessary)
-		if (width % cellWidth > cellWidth / 2 || width % cellWidth == 0) {
-			cWidth = (width - cellWidth / 2) % cellWidth;
-			cHeight = min(cellHeight, height - y*cellHeight + cellHeight/2);
-			cX = width-cWidth;
-			cellOrigin = src.step * cY + cX;
-			cellOffset = src.step - cWidth;
-			sp = (uchar *)(src.data + cellOrigin);
-			dp = (uchar *)(dst.data + cellOrigin);
-			top = buf.data + (curr - buf.data + bufOffsetTop) % bufSize;
-			for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-			  for (int a=0; a < cWidth; a++, sp++, dp++){
-				  *dp = interp(b,cHeight-b,top[*sp], curr[*sp]);
-			  }
-			}
-		}
-	}
-	// process (i.e. paint) last row (only if necessary)
-	if (height % cellHeight > cellHeight / 2 || height % cellHeight == 0) {
-		// paint last row, first cell
-		cWidth =  min(cellWidth / 2, width);
-		cHeight = (height - cellHeight / 2) % cellHeight;
-		cX = 0;
-		cY = height-cHeight;
-		cellOrigin = src.step * cY + cX;
-		cellOffset = src.step - cWidth;
-		sp = (uchar *)(src.data + cellOrigin);
-		dp = (uchar *)(dst.data + cellOrigin);
-		curr = buf.data + (curr - buf.data + bufOffsetTop + 256) % bufSize;
-		for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-		  for (int a=0; a < cWidth; a++, sp++, dp++){
-			*dp = curr[*sp];
-		  }
-		}
-		// paint last row, other cells
-		for (int x = 1; x < gridWidth; x++) {
-			cX = (x-1)*cellWidth + cellWidth/2;
-			cWidth = min(cellWidth, width - x*cellWidth + cellWidth/2);
-			cHeight = (height - cellHeight / 2) % cellHeight;
-			cellOrigin = src.step * cY + cX;
-			cellOffset = src.step - cWidth;
-			sp = (uchar *)(src.data + cellOrigin);
-			dp = (uchar *)(dst.data + cellOrigin);
-			left = curr;
-			curr = buf.data + (curr - buf.data + 256) % bufSize;
-			for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-			  for (int a=0; a < cWidth; a++, sp++, dp++){
-				  *dp = interp(a,cWidth-a,left[*sp], curr[*sp]);
-			  }
-			}
-		}
-		// paint last row, last cell (only if necessary)
-		if (width % cellWidth > cellWidth / 2 || width % cellWidth == 0) {
-			cWidth = (width - cellWidth / 2) % cellWidth;
-			cHeight = (height - cellHeight / 2) % cellHeight;
-			cX = width-cWidth;
-			cellOrigin = src.step * cY + cX;
-			cellOffset = src.step - cWidth;
-			sp = (uchar *)(src.data + cellOrigin);
-			dp = (uchar *)(dst.data + cellOrigin);
-			for (int b=0; b < cHeight; b++, sp+= cellOffset, dp += cellOffset){
-			  for (int a=0; a < cWidth; a++, sp++, dp++){
-				  *dp = curr[*sp];
-			  }
-			}
-		}
-	}
-}
-
 /** ------------------------------- Mask generation ------------------------------- **/
 
 /*
@@ -570,150 +256,145 @@ void maskValue(const Mat& src, Mat& dst, const Mat& mask, const uchar onread = 0
 }
 
 /**
- * Generates destination regions map from source image
+ * Finds the root of a provisional region label (with path halving)
+ *
+ * parent: parent of each provisional label
+ * label: provisional label
+ *
+ * returning: root label of the region
+ */
+static inline int regionRoot(vector<int>& parent, int label){
+	while (parent[label] != label){
+		parent[label] = parent[parent[label]];
+		label = parent[label];
+	}
+	return label;
+}
+
+/**
+ * Merges the regions of two provisional labels, the smaller root becomes the root of both
+ *
+ * parent: parent of each provisional label
+ * label1: first provisional label
+ * label2: second provisional label
+ *
+ * returning: root label of the merged region
+ */
+static inline int regionUnion(vector<int>& parent, int label1, int label2){
+	label1 = regionRoot(parent,label1);
+	label2 = regionRoot(parent,label2);
+	if (label1 < label2){
+		parent[label2] = label1;
+		return label1;
+	}
+	parent[label1] = label2;
+	return label2;
+}
+
+/**
+ * Generates destination regions map of 8-connected non-zero pixels from source image
+ * Horizontal strips of the image are labelled in parallel with provisional labels from disjoint ranges
+ * (at most one new label per 2x2 block), which are merged with union-find along the strip borders.
+ * Regions are numbered in raster order of their first pixel.
  *
  * src: CV_8UC1 image
  * dst: CV_32SC1 regions map image (same size as src)
  * count: outputs number of regions
+ * sizes: outputs number of pixels of each region (count+1 entries, sizes[0] = 0)
+ * threads: number of threads (0 for one per 256K pixels up to the number of cores)
  */
-void regionsmap(const Mat& src, Mat& dst, int& count){
+void regionsmap(const Mat& src, Mat& dst, int& count, vector<int>& sizes, int threads = 0){
 	int width = src.cols;
 	int height = src.rows;
-	int labelsCount = 0;
-	int maxRegions = ((width / 2) + 1) * ((height/2)+1)+1;
-	Mat regsmap(1,maxRegions,CV_32SC1);
-	int * map = (int *)regsmap.data;
-	for (int i=0; i< maxRegions; i++) map[i] = i; // identity mapping
-	uchar * psrc = src.data;
-	int * pdst = (int *)(dst.data);
-	int srcoffset = src.step - src.cols;
-	int srcline = src.step;
-	int dstoffset = dst.step / sizeof(int) - dst.cols;
-	int dstline = dst.step / sizeof(int);
-	dst.setTo(0);
-	// 1) processing first row
-	if (*psrc != 0) *pdst = ++labelsCount;
-	if (width > 1) {
-		psrc++; pdst++;
-	}
-	for (int x=1; x < width; x++, psrc++, pdst++){
-		if (*psrc != 0) {// if pixel is a region pixel, check left neightbor
-			if (psrc[-1] != 0){ // label like left neighbor
-				*pdst = pdst[-1];
-			}
-			else { // label new region
-				 *pdst = ++labelsCount;
-			}
-		}
+	if (threads <= 0) threads = min(max(1, (int)thread::hardware_concurrency()), max(1, width * height / (1 << 18)));
+	int strips = max(1, min(threads, height));
+	vector<int> firstLabel(strips+1);
+	firstLabel[0] = 1;
+	for (int s=0; s < strips; s++){
+		int rows = height * (s+1) / strips - height * s / strips;
+		firstLabel[s+1] = firstLabel[s] + ((width+1)/2) * ((rows+1)/2);
 	}
-	if (height > 1){
-		psrc += srcoffset;
-		pdst += dstoffset;
-	}
-	// 2) for all other rows
-	for (int y=1; y < height; y++, psrc+= srcoffset, pdst += dstoffset){
-		// first pixel in row only checks upper and upper-right pixels
-		if (*psrc != 0){
-			if (psrc[-srcline] != 0){ // check upper pixel
-				*pdst = pdst[-dstline];
-			}
-			else if (1 < width && psrc[1-srcline] != 0){ // check upper right
-				*pdst = pdst[1-dstline];
-			}
-			else {
-				*pdst = ++labelsCount;
-			}
-		}
-		if (width > 1){
-			psrc++;
-			pdst++;
-		}
-		// all other pixels in the row check for left and three upper pixels
-		for (int x=1; x < width-1; x++, psrc++, pdst++){
-			if (*psrc != 0){
-				if (psrc[-1] != 0){// check left neighbor
-					*pdst = pdst[-1];
+	vector<int> parent(firstLabel[strips]);
+	vector<int> area(firstLabel[strips]);
+	vector<int> lastLabel(strips);
+	// 1) label each strip, the first row of a strip only looks at its left neighbor
+	parallelFor(strips, threads, [&](int s){
+		int labels = firstLabel[s];
+		for (int y = height * s / strips; y < height * (s+1) / strips; y++){
+			const uchar * psrc = src.ptr<uchar>(y);
+			const uchar * pup = (y > height * s / strips) ? src.ptr<uchar>(y-1) : 0;
+			int * pdst = dst.ptr<int>(y);
+			const int * plup = (pup != 0) ? dst.ptr<int>(y-1) : 0;
+			for (int x=0; x < width; x++){
+				if (psrc[x] == 0){
+					pdst[x] = 0;
+					continue;
 				}
-				else if (psrc[-1-srcline] != 0){// label like left upper
-					*pdst = pdst[-1-dstline];
+				int label;
+				bool left = (x > 0 && psrc[x-1] != 0);
+				bool upLeft = (pup != 0 && x > 0 && pup[x-1] != 0);
+				if (pup != 0 && pup[x] != 0){ // upper neighbor is connected to all other neighbors
+					label = plup[x];
 				}
-				else if (psrc[-srcline] != 0){// check upper
-					*pdst = pdst[-dstline];
+				else if (pup != 0 && x+1 < width && pup[x+1] != 0){ // upper right may join a second region
+					label = plup[x+1];
+					if (upLeft) label = regionUnion(parent,label,plup[x-1]);
+					else if (left) label = regionUnion(parent,label,pdst[x-1]);
 				}
-				if (psrc[1-srcline] != 0){
-					if (*pdst == 0){ // label pixel as the above right
-						*pdst = pdst[1-dstline];
-					}
-					else {
-						int label1 = *pdst;
-						int label2 = pdst[1-dstline];
-						if ((label1 != label2) && (map[label1] != map[label2])){
-							if (map[label1] == label1){ // map unmapped to already mapped
-								map[label1] = map[label2];
-							}
-							else if (map[label2] == label2){ // map unmapped to already mapped
-								map[label2] = map[label1];
-							}
-							else { // both values are already mapped
-								map[map[label1]] = map[label2];
-								map[label1] = map[label2];
-							}
-							// reindexing
-							for (int i=1; i <= labelsCount; i++){
-								if (map[i] != i){
-									int j = map[i];
-									while (j != map[j]){
-										j = map[j];
-									}
-									map[i] = j;
-								}
-							}
-						}
-					}
+				else if (upLeft){
+					label = plup[x-1];
 				}
-				if (*pdst == 0)
-				{
-					*pdst = ++labelsCount;
+				else if (left){
+					label = pdst[x-1];
 				}
+				else { // new region
+					label = labels++;
+					parent[label] = label;
+					area[label] = 0;
+				}
+				pdst[x] = label;
+				area[label]++;
 			}
 		}
-		if (*psrc != 0){
-			if (psrc[-1] != 0){// check left neighbor
-				*pdst = pdst[-1];
-			}
-			else if (psrc[-1-srcline] != 0){// label like left upper
-				*pdst = pdst[-1-dstline];
-			}
-			else if (psrc[-srcline] != 0){// check upper
-				*pdst = pdst[-dstline];
-			}
-			else
-			{
-				*pdst = ++labelsCount;
+		lastLabel[s] = labels;
+	});
+	// 2) merge regions along the strip borders
+	for (int s=1; s < strips; s++){
+		int y = height * s / strips;
+		const uchar * psrc = src.ptr<uchar>(y);
+		const uchar * pup = src.ptr<uchar>(y-1);
+		const int * pdst = dst.ptr<int>(y);
+		const int * plup = dst.ptr<int>(y-1);
+		for (int x=0; x < width; x++){
+			if (psrc[x] == 0) continue;
+			for (int i = max(x-1,0); i <= min(x+1,width-1); i++){
+				if (pup[i] != 0) regionUnion(parent,pdst[x],plup[i]);
 			}
 		}
-		psrc++;
-		pdst++;
 	}
-	Mat regsremap(1,maxRegions,CV_32SC1);
-	int * remap = (int *)regsremap.data;
+	// 3) number the regions (roots are the smallest label of their region) and sum up their sizes
+	vector<int> remap(firstLabel[strips]);
+	remap[0] = 0;
 	count = 0;
-	for (int i=1; i <= labelsCount; i++){
-		if (map[i] == i) {
-			remap[i] = ++count;
+	sizes.assign(1,0);
+	for (int s=0; s < strips; s++){
+		for (int i = firstLabel[s]; i < lastLabel[s]; i++){
+			int root = regionRoot(parent,i);
+			if (root == i){
+				remap[i] = ++count;
+				sizes.push_back(0);
+			}
+			else remap[i] = remap[root];
+			sizes[remap[i]] += area[i];
 		}
 	}
-	remap[0] = 0;
-	// complete remapping
-	for (int i=1; i <= labelsCount; i++){
-		if (map[i] != i) remap[i] = remap[map[i]];
-	}
-	pdst = (int *) (dst.data);
-	for (int y=0; y < height; y++, pdst += dstoffset){
-		for (int x=0; x < width; x++, pdst++){
-			*pdst = remap[*pdst];
+	// 4) relabel
+	parallelFor(strips, threads, [&](int s){
+		for (int y = height * s / strips; y < height * (s+1) / strips; y++){
+			int * pdst = dst.ptr<int>(y);
+			for (int x=0; x < width; x++) pdst[x] = remap[pdst[x]];
 		}
-	}
+	});
 }
 
 /**
@@ -721,37 +402,21 @@ void regionsmap(const Mat& src, Mat& dst, int& count){
  *
  * regmap:  CV_32SC1 regions map (use regionsmap() to calculate this object)
  * mask:    CV_8UC1 output mask with filtered regions (same size as regmap)
- * count:   number of connected components in regmap
+ * sizes:   number of pixels of each region in regmap (as computed by regionsmap())
  * minSize: only regions larger or equal than minSize are kept
  * maxSize: only regions smaller or equal than maxSize are kept
  */
-void maskRegsize(const Mat& regmap, Mat& mask, const int count, const int minSize = INT_MIN, const int maxSize = INT_MAX){
-	Mat regs(1,count+1,CV_32SC1);
-	int * map = (int *)regs.data;
-	// resetting map to now count region size
-	for (int i=0; i<count+1; i++) map[i] = 0;
+void maskRegsize(const Mat& regmap, Mat& mask, const vector<int>& sizes, const int minSize = INT_MIN, const int maxSize = INT_MAX){
+	vector<uchar> value(sizes.size(), 0);
+	for (size_t i=1; i < sizes.size(); i++){
+		value[i] = (sizes[i] < minSize || sizes[i] > maxSize) ? 0 : 255;
+	}
 	int width = regmap.cols;
 	int height = regmap.rows;
-	int * pmap = (int *) (regmap.data);
-	int mapoffset = regmap.step / sizeof(int) - regmap.cols;
-	for (int y=0; y < height; y++, pmap += mapoffset){
-		for (int x=0; x < width; x++, pmap++){
-			if (*pmap > 0){
-				map[*pmap]++;
-			}
-		}
-	}
-	// delete too large and too small regions
-	pmap = (int *) (regmap.data);
-	uchar * pmask = mask.data;
-	int maskoffset = mask.step - mask.cols;
-	for (int y=0; y < height; y++, pmap += mapoffset, pmask += maskoffset){
-		for (int x=0; x < width; x++, pmap++, pmask++){
-			if (*pmap > 0){
-				int size = map[*pmap];
-				if (size < minSize || size > maxSize) *pmask = 0; else *pmask = 255;
-			} else *pmask = 0;
-		}
+	for (int y=0; y < height; y++){
+		const int * pmap = regmap.ptr<int>(y);
+		uchar * pmask = mask.ptr<uchar>(y);
+		for (int x=0; x < width; x++) pmask[x] = value[pmap[x]];
 	}
 }
 
@@ -764,8 +429,9 @@ void maskRegsize(const Mat& regmap, Mat& mask, const int count, const int minSiz
  * maxSize: maximum size of reflection region between 0 and 1
  * dilateSize: size of circular structuring element for dilate operation
  * dilateIterations: iterations of dilate operation
+ * threads: number of threads labelling the regions (0 chooses by image size)
  */
-void createReflectionMask(const Mat& src, Mat& mask, const float roiPercent = 20, const float maxSizePercent = 3, const int dilateSize = 11, const int dilateIterations = 1){
+void createReflectionMask(const Mat& src, Mat& mask, const float roiPercent = 20, const float maxSizePercent = 3, const int dilateSize = 11, const int dilateIterations = 1, const int threads = 0){
 	CV_Assert(src.type() == CV_8UC1);
 	CV_Assert(mask.type() == CV_8UC1);
 	CV_Assert(mask.size() == src.size());
@@ -774,14 +440,105 @@ void createReflectionMask(const Mat& src, Mat& mask, const float roiPercent = 20
 	//blur(src,src2,Size(3,3));
 	adaptiveThreshold(src,mask,255,ADAPTIVE_THRESH_MEAN_C,THRESH_BINARY,23,-60);
 	int count = 0;
-	regionsmap(mask,regions,count);
-	maskRegsize(regions,mask,count,10,1000);
+	vector<int> sizes;
+	regionsmap(mask,regions,count,sizes,threads);
+	maskRegsize(regions,mask,sizes,10,1000);
 	Mat kernel(dilateSize,dilateSize,CV_8UC1);
 	kernel.setTo(0);
 	circle(kernel,Point(dilateSize/2,dilateSize/2),dilateSize/2,Scalar(255),CV_FILLED);
 	dilate(mask,mask,kernel,Point(-1,-1),dilateIterations);
 }
 
+/**
+ * Index of a pixel mirrored at the image border without repeating the border pixel (as BORDER_REFLECT_101)
+ *
+ * p: pixel index (possibly out of the image)
+ * len: number of pixels
+ *
+ * returning: pixel index within [0, len)
+ */
+static inline int reflect101(int p, const int len){
+	if (len == 1) return 0;
+	while (p < 0 || p >= len) p = (p < 0) ? -p : 2 * len - 2 - p;
+	return p;
+}
+
+/**
+ * Computes the 7x7 Sobel gradients (as Sobel(src,grad,CV_32F,1,0,7) and Sobel(src,grad,CV_32F,0,1,7)) with
+ * reflection pixels set to 0, and their magnitude in one pass. Each row is filtered vertically into integer
+ * row buffers and then horizontally, rows are processed in parallel bands.
+ *
+ * src: CV_8UC1 image
+ * reflect: CV_8UC1 reflection mask (gradients of pixels with value 255 are set to 0)
+ * gradX: CV_32FC1 gradient image in x-direction (same size as src)
+ * gradY: CV_32FC1 gradient image in y-direction (same size as src)
+ * mag: CV_32FC1 gradient magnitude (same size as src)
+ * maxMag: outputs the maximum gradient magnitude
+ * threads: number of threads (0 for one per 64K pixels up to the number of cores)
+ */
+void gradientMagnitude(const Mat& src, const Mat& reflect, Mat& gradX, Mat& gradY, Mat& mag, float& maxMag, int threads = 0){
+	CV_Assert(src.type() == CV_8UC1 && reflect.type() == CV_8UC1 && reflect.size() == src.size());
+	static const int smooth[7] = {1, 6, 15, 20, 15, 6, 1};
+	static const int deriv[7] = {-1, -4, -5, 0, 5, 4, 1};
+	int width = src.cols;
+	int height = src.rows;
+	gradX.create(height,width,CV_32FC1);
+	gradY.create(height,width,CV_32FC1);
+	mag.create(height,width,CV_32FC1);
+	if (threads <= 0) threads = min(max(1, (int)thread::hardware_concurrency()), max(1, width * height / (1 << 16)));
+	int bands = max(1, min(threads, height));
+	vector<int> cols(width + 6);
+	for (int x=0; x < width + 6; x++) cols[x] = reflect101(x - 3, width);
+	vector<float> bandMax(bands, 0);
+	parallelFor(bands, threads, [&](int band){
+		vector<int> rowSmooth(width + 6), rowDeriv(width + 6);
+		float bmax = 0;
+		for (int y = height * band / bands; y < height * (band + 1) / bands; y++){
+			const uchar * rows[7];
+			for (int k=0; k < 7; k++) rows[k] = src.ptr<uchar>(reflect101(y + k - 3, height));
+			// vertical pass: smoothing for the x-gradient, derivative for the y-gradient
+			for (int x=0; x < width; x++){
+				int s = 0, d = 0;
+				for (int k=0; k < 7; k++){
+					s += smooth[k] * rows[k][x];
+					d += deriv[k] * rows[k][x];
+				}
+				rowSmooth[x + 3] = s;
+				rowDeriv[x + 3] = d;
+			}
+			for (int x=0; x < 3; x++){
+				rowSmooth[x] = rowSmooth[cols[x] + 3];
+				rowDeriv[x] = rowDeriv[cols[x] + 3];
+				rowSmooth[width + 3 + x] = rowSmooth[cols[width + 3 + x] + 3];
+				rowDeriv[width + 3 + x] = rowDeriv[cols[width + 3 + x] + 3];
+			}
+			// horizontal pass
+			const uchar * prefl = reflect.ptr<uchar>(y);
+			float * pgx = gradX.ptr<float>(y);
+			float * pgy = gradY.ptr<float>(y);
+			float * pmag = mag.ptr<float>(y);
+			for (int x=0; x < width; x++){
+				if (prefl[x] == 255){
+					pgx[x] = pgy[x] = pmag[x] = 0;
+					continue;
+				}
+				int gx = 0, gy = 0;
+				for (int k=0; k < 7; k++){
+					gx += deriv[k] * rowSmooth[x + k];
+					gy += smooth[k] * rowDeriv[x + k];
+				}
+				float fx = (float) gx, fy = (float) gy;
+				pgx[x] = fx;
+				pgy[x] = fy;
+				pmag[x] = std::sqrt(fx * fx + fy * fy);
+				if (pmag[x] > bmax) bmax = pmag[x];
+			}
+		}
+		bandMax[band] = bmax;
+	});
+	maxMag = *std::max_element(bandMax.begin(), bandMax.end());
+}
+
 /**
  * Main eye mask selecting pupillary and limbic boundary pixels
  *
@@ -790,8 +547,9 @@ void createReflectionMask(const Mat& src, Mat& mask, const float roiPercent = 20
  * gradX: CV_32FC1 gradient image in x-direction
  * gradY: CV_32FC1 gradient image in y-direction
  * mag: CV_32FC1 gradient magnitude
+ * maxMag: maximum of mag (computed if negative)
  */
-void createBoundaryMask(const Mat& src, Mat& mask, const Mat& gradX, const Mat& gradY, const Mat& mag){
+void createBoundaryMask(const Mat& src, Mat& mask, const Mat& gradX, const Mat& gradY, const Mat& mag, float maxMag = -1){
 	const float roiPercent = 20; // was 20
 	const int histbins = 1000;
 	int width = mask.cols;
@@ -804,9 +562,12 @@ void createBoundaryMask(const Mat& src, Mat& mask, const Mat& gradX, const Mat&
     if (cellHeight > 0) gridHeight = height / cellHeight + (height % cellHeight == 0 ? 0 : 1);
 	MatConstIterator_<float> pmag = mag.begin<float>();
 	MatConstIterator_<float> emag = mag.end<float>();
-	float max = 0;
-	for (; pmag!=emag; pmag++){
-		if (*pmag > max) max = *pmag;
+	float max = maxMag;
+	if (max < 0){
+		max = 0;
+		for (; pmag!=emag; pmag++){
+			if (*pmag > max) max = *pmag;
+		}
 	}
 	Mat hist(1,histbins,CV_32SC1);
 	float histmax = max + max/histbins;
@@ -863,26 +624,54 @@ void createBoundaryMask(const Mat& src, Mat& mask, const Mat& gradX, const Mat&
 /** ------------------------------- Center detection ------------------------------- **/
 
 /**
- * Type for a bi-directional ray with originating point and direction
+ * Type for a set of bi-directional rays with originating points and directions,
+ * stored as one array per component
  *
- * x: x-coordinate of origin
- * y: y-coordinate of origin
- * fx: x-direction
- * fy: y-direction
- * mag: ray weight (magnitude)
+ * x: x-coordinates of origins
+ * y: y-coordinates of origins
+ * fx: x-directions
+ * fy: y-directions
+ * mag: ray weights (magnitudes)
  */
-struct BidRay{
-	float x;
-	float y;
-	float fx;
-	float fy;
-	float mag;
-	BidRay(float _x, float _y, float _fx, float _fy, float _mag){
-		x = _x;
-		y = _y;
-		fx = _fx;
-		fy = _fy;
-		mag = _mag;
+struct BidRays{
+	vector<float> x;
+	vector<float> y;
+	vector<float> fx;
+	vector<float> fy;
+	vector<float> mag;
+	size_t size() const{
+		return x.size();
+	}
+	void push_back(float _x, float _y, float _fx, float _fy, float _mag){
+		x.push_back(_x);
+		y.push_back(_y);
+		fx.push_back(_fx);
+		fy.push_back(_fy);
+		mag.push_back(_mag);
+	}
+	void resize(size_t count){
+		x.resize(count);
+		y.resize(count);
+		fx.resize(count);
+		fy.resize(count);
+		mag.resize(count);
+	}
+	/*
+	 * Removes all rays i with keep[i] == 0 preserving the order of the remaining rays
+	 */
+	void compact(const vector<uchar>& keep){
+		size_t count = 0;
+		for (size_t i = 0; i < keep.size(); i++){
+			if (keep[i]){
+				x[count] = x[i];
+				y[count] = y[i];
+				fx[count] = fx[i];
+				fy[count] = fy[i];
+				mag[count] = mag[i];
+				count++;
+			}
+		}
+		resize(count);
 	}
 };
 
@@ -1138,23 +927,27 @@ int intersectRect(const float &x, const float &y, const float &fx, const float &
  * Draws a line onto accumulator matrix using Bresenham's algorithm:
  * Increases a rectangular accumulator by adding a given value to all points on a line
  *
- * line: line to be drawn
+ * x: x-coordinate of the line's origin
+ * y: y-coordinate of the line's origin
+ * fx: x-direction of the line
+ * fy: y-direction of the line
+ * mag: line weight (magnitude)
  * accu: floating point canvas (accumulator)
  * border: outer accu boundary rectangle in user space coordinates
  *
  * returning: true, if values are added to the accu
  */
-bool drawLine(const BidRay& line, Mat_<float>& accu, const float borderX, const float borderY, const float borderWidth, const float borderHeight){
+bool drawLine(const float x, const float y, const float fx, const float fy, const float mag, Mat_<float>& accu, const float borderX, const float borderY, const float borderWidth, const float borderHeight){
 	// intersect line with border
 	float cellWidth = borderWidth/accu.cols;
 	float cellHeight = borderHeight/accu.rows;
 	float lx = borderX, ly = borderY;
 	float rx = borderX+borderWidth, ry = borderY+borderHeight;
 	float px, py, qx, qy;
-	float incValue = line.mag / 1000;
+	float incValue = mag / 1000;
 	int accuLine = (accu.step/sizeof(float));
 
-	int res = intersectRect(line.x,line.y,line.fx,line.fy,lx,ly,rx,ry,px,py,qx,qy);
+	int res = intersectRect(x,y,fx,fy,lx,ly,rx,ry,px,py,qx,qy);
 	if (res != 0){
 	  int x1 = min(max(cvRound((px-lx)/cellWidth),0),accu.cols-1);
 	  int y1 = min(max(cvRound((py-ly)/cellHeight),0),accu.rows-1);
@@ -1211,6 +1004,39 @@ bool drawLine(const BidRay& line, Mat_<float>& accu, const float borderX, const
 	return false;
 }
 
+/*
+ * Draws a set of rays onto accumulator matrix and removes the rays missing it
+ * The rays are split into contiguous blocks drawn by separate threads onto their own accumulators,
+ * which are summed up in block order afterwards.
+ *
+ * rays: rays to be drawn (rays not hitting the accu are removed, the order of the others is kept)
+ * accu: floating point canvas (accumulator), cleared before drawing
+ * partial: accumulators of all but the first block (allocated as needed)
+ * hit: buffer for the per-ray intersection flags
+ * border: outer accu boundary rectangle in user space coordinates
+ * threads: maximum number of threads
+ */
+void drawRays(BidRays& rays, Mat_<float>& accu, vector<Mat_<float> >& partial, vector<uchar>& hit, const float borderX, const float borderY, const float borderWidth, const float borderHeight, int threads){
+	const int count = rays.size();
+	threads = max(1, min(threads, count / 4096));
+	if ((int) partial.size() < threads - 1) partial.resize(threads - 1);
+	hit.resize(count);
+	accu.setTo(0);
+	parallelFor(threads, threads, [&](int t){
+		Mat_<float>& canvas = (t == 0) ? accu : partial[t-1];
+		if (t > 0){
+			canvas.create(accu.rows, accu.cols);
+			canvas.setTo(0);
+		}
+		int end = (int)(((long long) count * (t + 1)) / threads);
+		for (int i = (int)(((long long) count * t) / threads); i < end; i++){
+			hit[i] = drawLine(rays.x[i],rays.y[i],rays.fx[i],rays.fy[i],rays.mag[i],canvas,borderX,borderY,borderWidth,borderHeight);
+		}
+	});
+	for (int t = 1; t < threads; t++) add(accu,partial[t-1],accu);
+	rays.compact(hit);
+}
+
 /**
  * Returns a gaussian 2D kernel
  * kernel: output CV_32FC1 image of specific size
@@ -1242,19 +1068,23 @@ void gaussianKernel(cv::Mat& kernel,float sigma = 1.4){
  * center: center point of main circle in source image
  * accuPrecision: stop condition for accuracy of center
  * accuSize: size of the accumulator array
+ * threads: number of threads drawing the rays (0 for one per core)
  */
-void detectEyeCenter(const Mat& gradX, const Mat& gradY, const Mat& mag, const Mat& mask, float& centerx, float& centery, const float accuPrecision = .5, const int accuSize = 10){
+void detectEyeCenter(const Mat& gradX, const Mat& gradY, const Mat& mag, const Mat& mask, float& centerx, float& centery, const float accuPrecision = .5, const int accuSize = 10, int threads = 0){
 	// initial declarations
 	int width = mask.cols;
 	int height = mask.rows;
 	int accuScaledSize = (accuSize+1)/2;
 	float rectX = -0.5, rectY = -0.5, rectWidth = width, rectHeight = height;
+	if (threads <= 0) threads = max(1, (int)thread::hardware_concurrency());
 	Mat gauss(accuScaledSize,accuScaledSize,CV_32FC1);
 	gaussianKernel(gauss,accuScaledSize/3);
 	Mat_<float> accu(accuSize,accuSize);
 	Mat_<float> accuScaled(accuScaledSize,accuScaledSize);
+	vector<Mat_<float> > partial;
+	vector<uchar> hit;
 	// create candidates list
-	list<BidRay> candidates;
+	BidRays candidates;
 	float * px = (float *)(gradX.data);
 	float * py = (float *)(gradY.data);
 	float * pmag = (float *)(mag.data);
@@ -1267,19 +1097,13 @@ void detectEyeCenter(const Mat& gradX, const Mat& gradY, const Mat& mag, const M
 	for (int y=0; y < height; y++, px += xoffset, py += yoffset,pmask += maskoffset,pmag += magoffset){
 		for (int x=0; x < width; x++, px++, py++, pmask++, pmag++){
 			if (*pmask > 0){
-				candidates.push_back(BidRay(x,y,*px,*py,*pmag));
+				candidates.push_back(x,y,*px,*py,*pmag);
 			}
 		}
 	}
 	//int tempi = 0;
 	while (rectWidth > accuPrecision || rectHeight > accuPrecision){
-		accu.setTo(0);
-		bool isIn = true;
-		if (candidates.size() > 0){
-			for (list<BidRay>::iterator it = candidates.begin(); it != candidates.end();(isIn) ? ++it : it = candidates.erase(it)){
-				isIn = drawLine(*it,accu,rectX,rectY,rectWidth,rectHeight);
-			}
-		}
+		drawRays(candidates,accu,partial,hit,rectX,rectY,rectWidth,rectHeight,threads);
 		pyrDown(accu,accuScaled);
 		multiply(accuScaled,gauss,accuScaled,1,CV_32FC1);
 
@@ -1315,379 +1139,231 @@ void detectEyeCenter(const Mat& gradX, const Mat& gradY, const Mat& mag, const M
  */
 static const int INTER_LINEAR_REPEAT = 82;
 
+/** fractional bits of the bilinear weights of a rubbersheet map **/
+static const int RUBBERSHEET_BITS = 11;
+
 /*
- * Calculates the mapped (polar) image of source using two transformation contours.
+ * Sampling positions of a rubbersheet transform, computed once per segmentation and
+ * shared by all images sampled with it. Positions are pixel indices into the source
+ * image padded by one pixel on each side (with row length srcwidth + 2), so samples
+ * overlapping the border need no special treatment. Positions out of the image are -1.
+ */
+struct RubbersheetMap {
+	int width, height; // size of the polar image
+	int srcwidth, srcheight; // size of the source image
+	vector<int> linear; // upper-left pixel of the bilinear neighbourhood
+	vector<short> wx, wy; // horizontal and vertical weights of the right and lower pixels
+	vector<int> nearest; // nearest pixel
+};
+
+/*
+ * Prepares a rubbersheet map for polar and source images of the given sizes.
+ *
+ * dstSize: size of the polar image
+ * srcSize: size of the cartesian source image
+ * sheet: sampling positions
+ */
+void rubbersheetInit(const Size& dstSize, const Size& srcSize, RubbersheetMap& sheet) {
+	sheet.width = dstSize.width;
+	sheet.height = dstSize.height;
+	sheet.srcwidth = srcSize.width;
+	sheet.srcheight = srcSize.height;
+	sheet.linear.resize(sheet.width * sheet.height);
+	sheet.wx.resize(sheet.width * sheet.height);
+	sheet.wy.resize(sheet.width * sheet.height);
+	sheet.nearest.resize(sheet.width * sheet.height);
+}
+
+/*
+ * Sets the sampling position of one polar pixel.
+ *
+ * sheet: sampling positions (prepared with rubbersheetInit)
+ * idx: index of the polar pixel (row-major)
+ * a: x-coordinate in the source image
+ * b: y-coordinate in the source image
+ */
+inline void rubbersheetSet(RubbersheetMap& sheet, const int idx, float a, float b) {
+	const float scale = 1 << RUBBERSHEET_BITS;
+	int srcwidth = sheet.srcwidth;
+	int srcheight = sheet.srcheight;
+	int pwidth = srcwidth + 2;
+	// clamp far away positions to keep the integer conversions in range
+	a = std::min(std::max(a,-2.f),srcwidth + 1.f);
+	b = std::min(std::max(b,-2.f),srcheight + 1.f);
+	int coordX = cvRound(a);
+	int coordY = cvRound(b);
+	sheet.nearest[idx] = (coordX < 0 || coordY < 0 || coordX >= srcwidth || coordY >= srcheight) ? -1 : (coordY + 1) * pwidth + coordX + 1;
+	coordX = cvFloor(a);
+	coordY = cvFloor(b);
+	if (coordX < -1 || coordY < -1 || coordX >= srcwidth || coordY >= srcheight){
+		sheet.linear[idx] = -1;
+		sheet.wx[idx] = 0;
+		sheet.wy[idx] = 0;
+	}
+	else {
+		sheet.linear[idx] = (coordY + 1) * pwidth + coordX + 1;
+		sheet.wx[idx] = (short) cvRound((a - coordX) * scale);
+		sheet.wy[idx] = (short) cvRound((b - coordY) * scale);
+	}
+}
+
+/*
+ * Computes the sampling positions of a rubbersheet transform.
  *
- * src: CV_8U (cartesian) source image (possibly multi-channel)
- * dst:	CV_8U (polar) destination image (possibly multi-channel, 2 times the col size of inner)
  * inner: CV_32FC2 inner cartesian coordinates
  * outer: CV_32FC2 outer cartesian coordinates
+ * dstSize: size of the polar image
+ * srcSize: size of the cartesian source image
+ * sheet: sampling positions
+ */
+void rubbersheetMap(const Mat& inner, const Mat& outer, const Size& dstSize, const Size& srcSize, RubbersheetMap& sheet) {
+	int dstheight = dstSize.height;
+	int dstwidth = dstSize.width;
+	rubbersheetInit(dstSize, srcSize, sheet);
+	float roffset = 1.f / dstheight;
+	float r = 0;
+	for (int y=0, idx=0; y < dstheight; y++, r+= roffset){
+		float * pinner = (float *) inner.data;
+		float * pouter = (float *) outer.data;
+		for (int x=0; x < dstwidth; x++, idx++, pinner++, pouter++){
+			float a = *pinner + r * (*pouter - *pinner);
+			pinner++; pouter++;
+			float b =  *pinner + r * (*pouter - *pinner);
+			rubbersheetSet(sheet, idx, a, b);
+		}
+	}
+}
+
+/*
+ * Samples a (polar) image from a rubbersheet sheet. The source is padded by one pixel of
+ * fill (INTER_NEAREST, INTER_LINEAR) or of its border pixels (INTER_LINEAR_REPEAT, where
+ * positions out of the image repeat the pixel of the row above).
+ *
+ * src: CV_8U (cartesian) source image (possibly multi-channel)
+ * dst: CV_8U (polar) destination image of the size of the map
+ * sheet: sampling positions
  * interpolation: interpolation mode (INTER_NEAREST, INTER_LINEAR or INTER_LINEAR_REPEAT)
  * fill: fill value for pixels out of the image
  */
-void rubbersheet(const Mat& src, Mat& dst, const Mat& inner, const Mat& outer, const int interpolation = INTER_LINEAR, const uchar fill = 0) {
+void rubbersheetRemap(const Mat& src, Mat& dst, const RubbersheetMap& sheet, const int interpolation = INTER_LINEAR, const uchar fill = 0) {
+	CV_Assert(src.depth() == CV_8U && src.type() == dst.type());
+	CV_Assert(src.cols == sheet.srcwidth && src.rows == sheet.srcheight && dst.cols == sheet.width && dst.rows == sheet.height);
 	int nChannels = src.channels();
-	int dstheight = dst.rows;
-	int dstwidth = dst.cols;
-	int srcheight = src.rows;
-	int srcwidth = src.cols;
-	uchar * pdst = dst.data;
-	int dstoffset = dst.step - dstwidth * nChannels;
-	int srcstep = src.step;
-	float roffset = 1.f / dstheight;
-	float r = 0;
-	if (interpolation == INTER_NEAREST){
-		for (int y=0; y < dstheight; y++, pdst+= dstoffset, r+=roffset){
-			float * pinner = (float *) inner.data;
-			float * pouter = (float *) outer.data;
-			for (int x=0; x < dstwidth; x++, pinner++, pouter++){
-				float a = *pinner + r * (*pouter - *pinner);
-				pinner++; pouter++;
-				float b =  *pinner + r * (*pouter - *pinner);
-				int coordX = cvRound(a);
-				int coordY = cvRound(b);
-				if (coordX < 0 || coordY < 0 || coordX >= srcwidth || coordY >= srcheight){
-					for (int i=0; i< nChannels; i++,pdst++){
-						*pdst = fill;
-					}
-				}
-				else {
-					uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-					for (int i=0; i< nChannels; i++,pdst++,psrc++){
-						*pdst = *psrc;
-					}
+	bool repeat = (interpolation != INTER_NEAREST && interpolation != INTER_LINEAR);
+	Mat padded;
+	copyMakeBorder(src,padded,1,1,1,1,(repeat) ? BORDER_REPLICATE : BORDER_CONSTANT,Scalar::all(fill));
+	const uchar * psrc = padded.data;
+	int pstep = padded.step;
+	const int half = 1 << (2 * RUBBERSHEET_BITS - 1);
+	const int one = 1 << RUBBERSHEET_BITS;
+	for (int y=0, idx=0; y < sheet.height; y++){
+		uchar * pdst = dst.ptr<uchar>(y);
+		if (interpolation == INTER_NEAREST){
+			for (int x=0; x < sheet.width; x++, idx++){
+				int pos = sheet.nearest[idx];
+				for (int i=0; i< nChannels; i++,pdst++){
+					*pdst = (pos < 0) ? fill : psrc[pos * nChannels + i];
 				}
 			}
+			continue;
 		}
-	}
-	else if (interpolation == INTER_LINEAR){
-		for (int y=0; y < dstheight; y++, pdst+= dstoffset, r+= roffset){
-			float * pinner = (float *) inner.data;
-			float * pouter = (float *) outer.data;
-			for (int x=0; x < dstwidth; x++, pinner++, pouter++){
-				float a = *pinner + r * (*pouter - *pinner);
-				pinner++; pouter++;
-				float b =  *pinner + r * (*pouter - *pinner);
-				int coordX = cvFloor(a);
-				int coordY = cvFloor(b);
-				if (coordX >= 0){
-					if (coordY >= 0){
-						if (coordX < srcwidth-1){
-							if (coordY < srcheight-1){
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(*psrc)) + dx*(float)(psrc[nChannels]))+ dy*((1-dx)*((float)(psrc[srcstep])) + dx*(float)(psrc[nChannels+srcstep])));
-								}
-							}
-							else if (coordY == srcheight-1){ // bottom out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(*psrc)) + dx*(float)(psrc[nChannels])) + dy * ((float) fill));
-								}
-							}
-							else {
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = fill;
-								}
-							}
-						}
-						else if (coordX == srcwidth-1){
-							if (coordY < srcheight-1){// right out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dx)*((1-dy)*((float)(*psrc))+ dy*((float)(psrc[srcstep]))) + dx * ((float) fill));
-								}
-							}
-							else if (coordY == srcheight-1){ // bottom right out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(*psrc)) + dx * ((float)fill)) + dy * ((float) fill));
-								}
-							}
-							else {
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = fill;
-								}
-							}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = fill;
-							}
-						}
-					}
-					else if (coordY == -1){
-						if (coordX < srcwidth-1){// top out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((dy)*((1-dx)*((float)(psrc[srcstep])) + dx*(float)(psrc[nChannels+srcstep])) + (1-dy) * ((float) fill));
-								}
-						}
-						else if (coordX == srcwidth-1){// top right out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((dy)*((1-dx)*((float)(psrc[srcstep])) + dx * ((float)fill)) + (1-dy) * ((float) fill));
-								}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = fill;
-							}
-						}
-					}
-					else {
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = fill;
-						}
-					}
-				}
-				else if (coordX == -1){
-					if (coordY >= 0){
-						if (coordY < srcheight-1){// left out
-							float dx = a-coordX;
-							float dy = b-coordY;
-							uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-							for (int i=0; i< nChannels; i++,pdst++,psrc++){
-								*pdst = saturate_cast<uchar>(dx*((1-dy)*(float)(psrc[nChannels]) + dy*(float)(psrc[nChannels+srcstep])) + (1-dx) * ((float) fill));
-							}
-						}
-						else if (coordY == srcheight-1){ // left bottom out
-							float dx = a-coordX;
-							float dy = b-coordY;
-							uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-							for (int i=0; i< nChannels; i++,pdst++,psrc++){
-								*pdst = saturate_cast<uchar>((1-dy)*((dx)*((float)(psrc[nChannels])) + (1-dx) * ((float) fill)) + dy * ((float) fill));
-							}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = fill;
-							}
-						}
-					}
-					else if (coordY == -1){ // left top out
-						float dx = a-coordX;
-						float dy = b-coordY;
-						uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-						for (int i=0; i< nChannels; i++,pdst++,psrc++){
-							*pdst = saturate_cast<uchar>((dy)*((dx)*((float)(psrc[nChannels+srcstep])) + (1-dx) * ((float) fill)) + (1-dy) * ((float) fill));
-						}
-					}
-					else {
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = fill;
-						}
-					}
-				}
-				else {
-					for (int i=0; i< nChannels; i++,pdst++){
-						*pdst = fill;
-					}
+		for (int x=0; x < sheet.width; x++, idx++){
+			int pos = sheet.linear[idx];
+			if (pos < 0){
+				for (int i=0; i< nChannels; i++,pdst++){
+					*pdst = (repeat && y > 0) ? *(pdst - dst.step) : fill; // one row above
 				}
+				continue;
+			}
+			int dx = sheet.wx[idx], dy = sheet.wy[idx];
+			int w00 = (one - dx) * (one - dy), w01 = dx * (one - dy), w10 = (one - dx) * dy, w11 = dx * dy;
+			const uchar * p = psrc + pos * nChannels;
+			for (int i=0; i< nChannels; i++,pdst++,p++){
+				*pdst = (uchar)((w00 * p[0] + w01 * p[nChannels] + w10 * p[pstep] + w11 * p[pstep + nChannels] + half) >> (2 * RUBBERSHEET_BITS));
 			}
 		}
 	}
-	else { // INTER_LINEAR_REPEAT (repeats last pixel value)
-		uchar * firstLine = pdst + dst.step;
-		int step = dst.step;
-		for (int y=0; y < dstheight; y++, pdst+= dstoffset, r+= roffset){
-			float * pinner = (float *) inner.data;
-			float * pouter = (float *) outer.data;
-			for (int x=0; x < dstwidth; x++, pinner++, pouter++){
-				float a = *pinner + r * (*pouter - *pinner);
-				pinner++; pouter++;
-				float b =  *pinner + r * (*pouter - *pinner);
-				int coordX = cvFloor(a);
-				int coordY = cvFloor(b);
-				if (coordX >= 0){
-					if (coordY >= 0){
-						if (coordX < srcwidth-1){
-							if (coordY < srcheight-1){
-								float dx = a-coordX;
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(*psrc)) + dx*(float)(psrc[nChannels]))+ dy*((1-dx)*((float)(psrc[srcstep])) + dx*(float)(psrc[nChannels+srcstep])));
-								}
-							}
-							else if (coordY == srcheight-1){ // bottom out
-								float dx = a-coordX;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>(((1-dx)*((float)(*psrc)) + dx*(float)(psrc[nChannels])));
-								}
-							}
-							else if (pdst >= firstLine){
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = *(pdst - step); // one row above
-								}
-							}
-							else {
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = fill;
-								}
-							}
-						}
-						else if (coordX == srcwidth-1){
-							if (coordY < srcheight-1){// right out
-								float dy = b-coordY;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>(((1-dy)*((float)(*psrc))+ dy*((float)(psrc[srcstep]))));
-								}
-							}
-							else if (coordY == srcheight-1){ // bottom right out
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = *psrc;
-								}
-							}
-							else if (pdst >= firstLine){
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = *(pdst - step); // one row above
-								}
-							}
-							else {
-								for (int i=0; i< nChannels; i++,pdst++){
-									*pdst = fill;
-								}
-							}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = *(pdst - step); // one row above
-							}
-						}
-					}
-					else if (coordY == -1){
-						if (coordX < srcwidth-1){// top out
-								float dx = a-coordX;
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = saturate_cast<uchar>(((1-dx)*((float)(psrc[srcstep])) + dx*(float)(psrc[nChannels+srcstep])));
-								}
-						}
-						else if (coordX == srcwidth-1){// top right out
-								uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-								for (int i=0; i< nChannels; i++,pdst++,psrc++){
-									*pdst = psrc[srcstep];
-								}
-						}
-						else if (pdst >= firstLine){
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = *(pdst - step); // one row above
-							}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = fill;
-							}
-						}
-					}
-					else if (pdst >= firstLine){
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = *(pdst - step); // one row above
-						}
-					}
-					else {
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = fill;
-						}
-					}
-				}
-				else if (coordX == -1){
-					if (coordY >= 0){
-						if (coordY < srcheight-1){// left out
-							float dy = b-coordY;
-							uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-							for (int i=0; i< nChannels; i++,pdst++,psrc++){
-								*pdst = saturate_cast<uchar>(((1-dy)*(float)(psrc[nChannels]) + dy*(float)(psrc[nChannels+srcstep])));
-							}
-						}
-						else if (coordY == srcheight-1){ // bottom left out
-							uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-							for (int i=0; i< nChannels; i++,pdst++,psrc++){
-								*pdst = psrc[nChannels];
-							}
-						}
-						else if (pdst >= firstLine){
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = *(pdst - step); // one row above
-							}
-						}
-						else {
-							for (int i=0; i< nChannels; i++,pdst++){
-								*pdst = fill;
-							}
-						}
-					}
-					else if (coordY == -1){ // top left out
-						uchar * psrc = (uchar*) (src.data+coordY*srcstep+coordX*nChannels);
-						for (int i=0; i< nChannels; i++,pdst++,psrc++){
-							*pdst = psrc[nChannels+srcstep];
-						}
-					}
-					else if (pdst >= firstLine){
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = *(pdst - step); // one row above
-						}
-					}
-					else {
-						for (int i=0; i< nChannels; i++,pdst++){
-							*pdst = fill;
-						}
-					}
-				}
-				else if (pdst >= firstLine){
-					for (int i=0; i< nChannels; i++,pdst++){
-						*pdst = *(pdst - step); // one row above
-					}
-				}
-				else {
-					for (int i=0; i< nChannels; i++,pdst++){
-						*pdst = fill;
-					}
-				}
+}
+
+/*
+ * Samples the texture (INTER_LINEAR) and the noise mask (INTER_NEAREST) of a segmentation
+ * from a rubbersheet map in one pass, pixels out of the image are 0.
+ *
+ * src: CV_8UC1 (cartesian) source image
+ * dst: CV_8UC1 (polar) texture of the size of the map
+ * mask: CV_8UC1 (cartesian) noise mask of the size of src
+ * maskDst: CV_8UC1 (polar) noise mask of the size of the map
+ * sheet: sampling positions
+ */
+void rubbersheetRemap(const Mat& src, Mat& dst, const Mat& mask, Mat& maskDst, const RubbersheetMap& sheet) {
+	CV_Assert(src.type() == CV_8UC1 && dst.type() == CV_8UC1 && mask.type() == CV_8UC1 && maskDst.type() == CV_8UC1);
+	CV_Assert(src.size() == mask.size() && dst.size() == maskDst.size());
+	CV_Assert(src.cols == sheet.srcwidth && src.rows == sheet.srcheight && dst.cols == sheet.width && dst.rows == sheet.height);
+	Mat padded, paddedMask;
+	copyMakeBorder(src,padded,1,1,1,1,BORDER_CONSTANT,Scalar::all(0));
+	copyMakeBorder(mask,paddedMask,1,1,1,1,BORDER_CONSTANT,Scalar::all(0));
+	const uchar * psrc = padded.data;
+	const uchar * pmask = paddedMask.data;
+	int pstep = padded.step;
+	const int half = 1 << (2 * RUBBERSHEET_BITS - 1);
+	const int one = 1 << RUBBERSHEET_BITS;
+	for (int y=0, idx=0; y < sheet.height; y++){
+		uchar * pdst = dst.ptr<uchar>(y);
+		uchar * pmaskdst = maskDst.ptr<uchar>(y);
+		for (int x=0; x < sheet.width; x++, idx++){
+			int npos = sheet.nearest[idx];
+			pmaskdst[x] = (npos < 0) ? 0 : pmask[npos];
+			int pos = sheet.linear[idx];
+			if (pos < 0){
+				pdst[x] = 0;
+				continue;
 			}
+			int dx = sheet.wx[idx], dy = sheet.wy[idx];
+			const uchar * p = psrc + pos;
+			pdst[x] = (uchar)(((one - dx) * (one - dy) * p[0] + dx * (one - dy) * p[1] + (one - dx) * dy * p[pstep] + dx * dy * p[pstep + 1] + half) >> (2 * RUBBERSHEET_BITS));
 		}
 	}
 }
 
+/*
+ * Calculates the mapped (polar) image of source using two transformation contours.
+ *
+ * src: CV_8U (cartesian) source image (possibly multi-channel)
+ * dst:	CV_8U (polar) destination image (possibly multi-channel, 2 times the col size of inner)
+ * inner: CV_32FC2 inner cartesian coordinates
+ * outer: CV_32FC2 outer cartesian coordinates
+ * interpolation: interpolation mode (INTER_NEAREST, INTER_LINEAR or INTER_LINEAR_REPEAT)
+ * fill: fill value for pixels out of the image
+ */
+void rubbersheet(const Mat& src, Mat& dst, const Mat& inner, const Mat& outer, const int interpolation = INTER_LINEAR, const uchar fill = 0) {
+	RubbersheetMap sheet;
+	rubbersheetMap(inner, outer, dst.size(), src.size(), sheet);
+	rubbersheetRemap(src, dst, sheet, interpolation, fill);
+}
+
 /** ------------------------------- Boundary detection ------------------------------- **/
 
 /*
- * Calculates the mapped (polar) image of source using transformation center (polar origin) and radius.
+ * Computes the sampling positions of an ellipsopolar transform, the angles of the polar rays are computed
+ * once per column.
  *
- * src: CV_8UC1 (cartesian) source image
- * dst: CV_8UC1 (polar) destination image (same size as src)
  * ellipse: unit ellipse located in the source image (size equals stretching coefficients)
  * radius: radius in pixels of the source image (to map whole image, this should be the maximum of distances between origin and corners)
- * interpolation: interpolation mode (INTER_NEAREST, INTER_LINEAR or INTER_LINEAR_REPEAT)
- * fill: fill value for pixels out of the image
+ * dstSize: size of the polar image
+ * srcSize: size of the cartesian source image
+ * sheet: sampling positions
  *
  * returning: polar resolution
  */
-float ellipsopolarTransform(const Mat& src, Mat& dst, const RotatedRect& ellipse, const float radius = -1, const int interpolation = INTER_LINEAR, const uchar fill = 0) {
+float ellipsopolarMap(const RotatedRect& ellipse, const float radius, const Size& dstSize, const Size& srcSize, RubbersheetMap& sheet) {
 	// first: translate point to origin
 	// then: rotate points against ellipse angle
 	// then: scale points' axes
 	// finally: polar transform
-	int dstheight = dst.rows;
-	int dstwidth = dst.cols;
-	int srcheight = src.rows;
-	int srcwidth = src.cols;
+	int dstheight = dstSize.height;
+	int dstwidth = dstSize.width;
+	int srcheight = srcSize.height;
+	int srcwidth = srcSize.width;
 	float rad = radius;
 	float centerX = ellipse.center.x;
 	float centerY = ellipse.center.y;
@@ -1713,246 +1389,22 @@ float ellipsopolarTransform(const Mat& src, Mat& dst, const RotatedRect& ellipse
 		const float ellBSquare = ellB*ellB;
 		rad = max(max(sqrt(x1*x1/ellASquare+y1*y1/ellBSquare),sqrt(x2*x2/ellASquare+y2*y2/ellBSquare)),max(sqrt(x3*x3/ellASquare+y3*y3/ellBSquare),sqrt(x4*x4/ellASquare+y4*y4/ellBSquare)));
 	}
-	uchar * pdst = dst.data;
-	uchar * psrc = src.data;
-	int dstoffset = dst.step - dstwidth;
-	int srcstep = src.step;
+	rubbersheetInit(dstSize, srcSize, sheet);
 	float roffset = rad/(dstheight-1);
-	float r = 0;
 	float thetaoffset = 2.f * M_PI / dstwidth;
-	if (interpolation == INTER_NEAREST){
-		for (int y=0; y < dstheight; y++, pdst+= dstoffset, r+= roffset){
-			float theta = 0;
-			for (int x=0; x < dstwidth; x++, theta += thetaoffset,pdst++){
-				float beta = (alpha <= theta) ? theta - alpha : 2 * M_PI + theta - alpha; // angle of polar ray in ellipse coords (alpha + beta = theta)
-				float s = r * ellA * cos(beta), t = r * ellB * sin(beta);
-				float a = centerX + cosAlpha * s - sinAlpha * t, b = centerY + sinAlpha * s + cosAlpha * t;
-				int coordX = cvRound(a);
-				int coordY = cvRound(b);
-				if (coordX < 0 || coordY < 0 || coordX >= srcwidth || coordY >= srcheight){
-					*pdst = fill;
-				}
-				else {
-					*pdst = psrc[coordY*srcstep+coordX];
-				}
-			}
-		}
-	}
-	else if (interpolation == INTER_LINEAR){
-		for (int y=0; y < dstheight; y++, pdst+= dstoffset, r+= roffset){
-			float theta = 0;
-			for (int x=0; x < dstwidth; x++, theta += thetaoffset,pdst++){
-				float beta = (alpha <= theta) ? theta - alpha : 2 * M_PI + theta - alpha; // angle of polar ray in ellipse coords (alpha + beta = theta)
-				float s = r * ellA * cos(beta), t = r * ellB * sin(beta);
-				float a = centerX + cosAlpha * s - sinAlpha * t, b = centerY + sinAlpha * s + cosAlpha * t;
-				int coordX = cvFloor(a);
-				int coordY = cvFloor(b);
-				if (coordX >= 0){
-					if (coordY >= 0){
-						if (coordX < srcwidth-1){
-							if (coordY < srcheight-1){
-								float dx = a-coordX;
-								float dy = b-coordY;
-								int offset = coordY*srcstep+coordX;
-								*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(psrc[offset])) + dx*(float)(psrc[offset+1]))+ dy*((1-dx)*((float)(psrc[offset+srcstep])) + dx*(float)(psrc[offset+1+srcstep])));
-							}
-							else if (coordY == srcheight-1){ // bottom out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								int offset = coordY*srcstep+coordX;
-								*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(psrc[offset])) + dx*(float)(psrc[offset+1])) + dy * ((float)fill));
-							}
-							else {
-								*pdst = fill;
-							}
-						}
-						else if (coordX == srcwidth-1){
-							if (coordY < srcheight-1){// right out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								int offset = coordY*srcstep+coordX;
-								*pdst = saturate_cast<uchar>((1-dx)*((1-dy)*((float)(psrc[offset]))+ dy*((float)(psrc[offset+srcstep]))) + dx * ((float)fill));
-							}
-							else if (coordY == srcheight-1){ // bottom right out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								int offset = coordY*srcstep+coordX;
-								*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(psrc[offset])) + dx * ((float) fill)) + dy * ((float) fill));
-							}
-							else {
-								*pdst = fill;
-							}
-						}
-						else {
-							*pdst = fill;
-						}
-					}
-					else if (coordY == -1){
-						if (coordX < srcwidth-1){// top out
-							float dx = a-coordX;
-							float dy = b-coordY;
-							int offset = coordY*srcstep+coordX;
-							*pdst = saturate_cast<uchar>((dy)*((1-dx)*((float)(psrc[offset+srcstep])) + dx*(float)(psrc[offset+1+srcstep])) + (1-dy) * ((float) fill));
-
-						}
-						else if (coordX == srcwidth-1){// top right out
-							float dx = a-coordX;
-							float dy = b-coordY;
-							int offset = coordY*srcstep+coordX;
-							*pdst = saturate_cast<uchar>((dy)*((1-dx)*((float)(psrc[offset+srcstep])) + dx * ((float)fill)) + (1-dy) * ((float) fill));
-						}
-						else {
-							*pdst = fill;
-						}
-					}
-					else {
-						*pdst = fill;
-					}
-				}
-				else if (coordX == -1){
-					if (coordY >= 0){
-						if (coordY < srcheight-1){// left out
-							float dx = a-coordX;
-							float dy = b-coordY;
-							int offset = coordY*srcstep+coordX;
-							*pdst = saturate_cast<uchar>(dx*((1-dy)*(float)(psrc[offset+1]) + dy*(float)(psrc[offset+1+srcstep])) + (1-dx) * ((float) fill));
-						}
-						else if (coordY == srcheight-1){ // bottom left out
-							float dx = a-coordX;
-							float dy = b-coordY;
-							int offset = coordY*srcstep+coordX;
-							*pdst = saturate_cast<uchar>((1-dy)*((dx)*((float)(psrc[offset+1])) + (1-dx) * ((float) fill)) + dy * ((float) fill));
-						}
-						else {
-							*pdst = fill;
-						}
-					}
-					else if (coordY == -1){ // top left out
-						float dx = a-coordX;
-						float dy = b-coordY;
-						int offset = coordY*srcstep+coordX;
-						*pdst = saturate_cast<uchar>((dy)*((dx)*((float)(psrc[offset+1+srcstep])) + (1-dx) * ((float) fill)) + (1-dy) * ((float)fill));
-					}
-					else {
-						*pdst = fill;
-					}
-				}
-				else {
-					*pdst = fill;
-				}
-			}
-		}
+	vector<float> cosBeta(dstwidth), sinBeta(dstwidth);
+	float theta = 0;
+	for (int x=0; x < dstwidth; x++, theta += thetaoffset){
+		float beta = (alpha <= theta) ? theta - alpha : 2 * M_PI + theta - alpha; // angle of polar ray in ellipse coords (alpha + beta = theta)
+		cosBeta[x] = cos(beta);
+		sinBeta[x] = sin(beta);
 	}
-	else { // INTER_LINEAR_REPEAT (repeats last pixel value)
-		uchar * firstLine = pdst + dst.step;
-		for (int y=0; y < dstheight; y++, pdst+= dstoffset, r+= roffset){
-			float theta = 0;
-			for (int x=0; x < dstwidth; x++, theta += thetaoffset,pdst++){
-				float beta = (alpha <= theta) ? theta - alpha : 2 * M_PI + theta - alpha; // angle of polar ray in ellipse coords (alpha + beta = theta)
-				float s = r * ellA * cos(beta), t = r * ellB * sin(beta);
-				float a = centerX + cosAlpha * s - sinAlpha * t, b = centerY + sinAlpha * s + cosAlpha * t;
-				int coordX = cvFloor(a);
-				int coordY = cvFloor(b);
-				if (coordX >= 0){
-					if (coordY >= 0){
-						if (coordX < srcwidth-1){
-							if (coordY < srcheight-1){
-								float dx = a-coordX;
-								float dy = b-coordY;
-								int offset = coordY*srcstep+coordX;
-								*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(psrc[offset])) + dx*(float)(psrc[offset+1]))+ dy*((1-dx)*((float)(psrc[offset+srcstep])) + dx*(float)(psrc[offset+1+srcstep])));
-							}
-							else if (coordY == srcheight-1){ // bottom out
-								float dx = a-coordX;
-								int offset = coordY*srcstep+coordX;
-								*pdst = saturate_cast<uchar>(((1-dx)*((float)(psrc[offset])) + dx*(float)(psrc[offset+1])));
-							}
-							else if (pdst >= firstLine){
-								*pdst = *(pdst - dst.step); // one row above;
-							}
-							else {
-								*pdst = fill;
-							}
-						}
-						else if (coordX == srcwidth-1){
-							if (coordY < srcheight-1){// right out
-								float dy = b-coordY;
-								int offset = coordY*srcstep+coordX;
-								*pdst = saturate_cast<uchar>(((1-dy)*((float)(psrc[offset]))+ dy*((float)(psrc[offset+srcstep]))));
-							}
-							else if (coordY == srcheight-1){ // bottom right out
-								int offset = coordY*srcstep+coordX;
-								*pdst = psrc[offset];
-							}
-							else if (pdst >= firstLine){
-								*pdst = *(pdst - dst.step); // one row above;
-							}
-							else {
-								*pdst = fill;
-							}
-						}
-						else {
-							*pdst = *(pdst - dst.step); // one row above;
-						}
-					}
-					else if (coordY == -1){
-						if (coordX < srcwidth-1){// top out
-							float dx = a-coordX;
-							int offset = coordY*srcstep+coordX;
-							*pdst = saturate_cast<uchar>(((1-dx)*((float)(psrc[offset+srcstep])) + dx*(float)(psrc[offset+1+srcstep])));
-
-						}
-						else if (coordX == srcwidth-1){// top right out
-							int offset = coordY*srcstep+coordX;
-							*pdst = psrc[offset+srcstep];
-						}
-						else if (pdst >= firstLine){
-							*pdst = *(pdst - dst.step);
-						}
-						else {
-							*pdst = fill; // one row above;
-						}
-					}
-					else {
-						*pdst = *(pdst - dst.step); // one row above;
-					}
-				}
-				else if (coordX == -1){
-					if (coordY >= 0){
-						if (coordY < srcheight-1){// left out
-							float dy = b-coordY;
-							int offset = coordY*srcstep+coordX;
-							*pdst = saturate_cast<uchar>(((1-dy)*(float)(psrc[offset+1]) + dy*(float)(psrc[offset+1+srcstep])));
-						}
-						else if (coordY == srcheight-1){ // bottom left out
-							int offset = coordY*srcstep+coordX;
-							*pdst = psrc[offset+1];
-						}
-						else if (pdst >= firstLine){
-							*pdst = *(pdst - dst.step); // one row above;
-						}
-						else {
-							*pdst = fill;
-						}
-					}
-					else if (coordY == -1){ // top left out
-						int offset = coordY*srcstep+coordX;
-						*pdst = psrc[offset+1+srcstep];
-					}
-					else if (pdst >= firstLine){
-						*pdst = *(pdst - dst.step); // one row above;
-					}
-					else {
-						*pdst = fill;
-					}
-				}
-				else if (pdst >= firstLine){
-					*pdst = *(pdst - dst.step); // one row above;
-				}
-				else {
-					*pdst = fill;
-				}
-			}
+	float r = 0;
+	for (int y=0, idx=0; y < dstheight; y++, r+= roffset){
+		for (int x=0; x < dstwidth; x++, idx++){
+			float s = r * ellA * cosBeta[x], t = r * ellB * sinBeta[x];
+			float a = centerX + cosAlpha * s - sinAlpha * t, b = centerY + sinAlpha * s + cosAlpha * t;
+			rubbersheetSet(sheet, idx, a, b);
 		}
 	}
 	return roffset;
@@ -1963,19 +1415,38 @@ float ellipsopolarTransform(const Mat& src, Mat& dst, const RotatedRect& ellipse
  *
  * src: CV_8UC1 (cartesian) source image
  * dst: CV_8UC1 (polar) destination image (same size as src)
- * centerX: x-coordinate of polar origin in (floating point) pixels of the source image
- * centerY: y-coordinate of polar origin in (floating point) pixels of the source image
+ * ellipse: unit ellipse located in the source image (size equals stretching coefficients)
  * radius: radius in pixels of the source image (to map whole image, this should be the maximum of distances between origin and corners)
  * interpolation: interpolation mode (INTER_NEAREST, INTER_LINEAR or INTER_LINEAR_REPEAT)
  * fill: fill value for pixels out of the image
  *
  * returning: polar resolution
  */
-float polarTransform(const Mat& src, Mat& dst, const float centerX = 0, const float centerY = 0, const float radius = -1, const int interpolation = INTER_LINEAR, const uchar fill = 0) {
-	int dstheight = dst.rows;
-	int dstwidth = dst.cols;
-	int srcheight = src.rows;
-	int srcwidth = src.cols;
+float ellipsopolarTransform(const Mat& src, Mat& dst, const RotatedRect& ellipse, const float radius = -1, const int interpolation = INTER_LINEAR, const uchar fill = 0) {
+	RubbersheetMap sheet;
+	float resolution = ellipsopolarMap(ellipse, radius, dst.size(), src.size(), sheet);
+	rubbersheetRemap(src, dst, sheet, interpolation, fill);
+	return resolution;
+}
+
+/*
+ * Computes the sampling positions of a polar transform, the angles of the polar rays are computed
+ * once per column.
+ *
+ * centerX: x-coordinate of polar origin in (floating point) pixels of the source image
+ * centerY: y-coordinate of polar origin in (floating point) pixels of the source image
+ * radius: radius in pixels of the source image (to map whole image, this should be the maximum of distances between origin and corners)
+ * dstSize: size of the polar image
+ * srcSize: size of the cartesian source image
+ * sheet: sampling positions
+ *
+ * returning: polar resolution
+ */
+float polarMap(const float centerX, const float centerY, const float radius, const Size& dstSize, const Size& srcSize, RubbersheetMap& sheet) {
+	int dstheight = dstSize.height;
+	int dstwidth = dstSize.width;
+	int srcheight = srcSize.height;
+	int srcwidth = srcSize.width;
 	float rad = radius;
 	if (rad < 0){
 		float dist1 = centerX*centerX;
@@ -1984,248 +1455,44 @@ float polarTransform(const Mat& src, Mat& dst, const float centerX = 0, const fl
 		float dist4 = (srcheight-centerY)*(srcheight-centerY);
 		rad = max(max(sqrt(dist1+dist2),sqrt(dist1+dist4)),max(sqrt(dist3+dist2),sqrt(dist3+dist4)));
 	}
-	uchar * pdst = dst.data;
-	uchar * psrc = src.data;
-	int dstoffset = dst.step - dstwidth;
-	int srcstep = src.step;
+	rubbersheetInit(dstSize, srcSize, sheet);
 	float roffset = rad/(dstheight-1);
-	float r = 0;
 	float thetaoffset = 2.f * M_PI / dstwidth;
-	if (interpolation == INTER_NEAREST){
-		for (int y=0; y < dstheight; y++, pdst+= dstoffset, r+= roffset){
-			float theta = 0;
-			for (int x=0; x < dstwidth; x++, theta += thetaoffset,pdst++){
-				float a = centerX + r * cos(theta);//std::cos(theta);
-				float b = centerY + r * sin(theta);//std::sin(theta);
-				int coordX = cvRound(a);
-				int coordY = cvRound(b);
-				if (coordX < 0 || coordY < 0 || coordX >= srcwidth || coordY >= srcheight){
-					*pdst = fill;
-				}
-				else {
-					*pdst = psrc[coordY*srcstep+coordX];
-				}
-			}
-		}
-	}
-	else if (interpolation == INTER_LINEAR){
-		for (int y=0; y < dstheight; y++, pdst+= dstoffset, r+= roffset){
-			float theta = 0;
-			for (int x=0; x < dstwidth; x++, theta += thetaoffset,pdst++){
-				float a = centerX + r * cos(theta);//std::cos(theta);
-				float b = centerY + r * sin(theta);//std::sin(theta);
-				int coordX = cvFloor(a);
-				int coordY = cvFloor(b);
-				if (coordX >= 0){
-					if (coordY >= 0){
-						if (coordX < srcwidth-1){
-							if (coordY < srcheight-1){
-								float dx = a-coordX;
-								float dy = b-coordY;
-								int offset = coordY*srcstep+coordX;
-								*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(psrc[offset])) + dx*(float)(psrc[offset+1]))+ dy*((1-dx)*((float)(psrc[offset+srcstep])) + dx*(float)(psrc[offset+1+srcstep])));
-							}
-							else if (coordY == srcheight-1){ // bottom out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								int offset = coordY*srcstep+coordX;
-								*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(psrc[offset])) + dx*(float)(psrc[offset+1])) + dy * ((float)fill));
-							}
-							else {
-								*pdst = fill;
-							}
-						}
-						else if (coordX == srcwidth-1){
-							if (coordY < srcheight-1){// right out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								int offset = coordY*srcstep+coordX;
-								*pdst = saturate_cast<uchar>((1-dx)*((1-dy)*((float)(psrc[offset]))+ dy*((float)(psrc[offset+srcstep]))) + dx * ((float)fill));
-							}
-							else if (coordY == srcheight-1){ // bottom right out
-								float dx = a-coordX;
-								float dy = b-coordY;
-								int offset = coordY*srcstep+coordX;
-								*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(psrc[offset])) + dx * ((float) fill)) + dy * ((float) fill));
-							}
-							else {
-								*pdst = fill;
-							}
-						}
-						else {
-							*pdst = fill;
-						}
-					}
-					else if (coordY == -1){
-						if (coordX < srcwidth-1){// top out
-							float dx = a-coordX;
-							float dy = b-coordY;
-							int offset = coordY*srcstep+coordX;
-							*pdst = saturate_cast<uchar>((dy)*((1-dx)*((float)(psrc[offset+srcstep])) + dx*(float)(psrc[offset+1+srcstep])) + (1-dy) * ((float) fill));
-
-						}
-						else if (coordX == srcwidth-1){// top right out
-							float dx = a-coordX;
-							float dy = b-coordY;
-							int offset = coordY*srcstep+coordX;
-							*pdst = saturate_cast<uchar>((dy)*((1-dx)*((float)(psrc[offset+srcstep])) + dx * ((float)fill)) + (1-dy) * ((float) fill));
-						}
-						else {
-							*pdst = fill;
-						}
-					}
-					else {
-						*pdst = fill;
-					}
-				}
-				else if (coordX == -1){
-					if (coordY >= 0){
-						if (coordY < srcheight-1){// left out
-							float dx = a-coordX;
-							float dy = b-coordY;
-							int offset = coordY*srcstep+coordX;
-							*pdst = saturate_cast<uchar>(dx*((1-dy)*(float)(psrc[offset+1]) + dy*(float)(psrc[offset+1+srcstep])) + (1-dx) * ((float) fill));
-						}
-						else if (coordY == srcheight-1){ // bottom left out
-							float dx = a-coordX;
-							float dy = b-coordY;
-							int offset = coordY*srcstep+coordX;
-							*pdst = saturate_cast<uchar>((1-dy)*((dx)*((float)(psrc[offset+1])) + (1-dx) * ((float) fill)) + dy * ((float) fill));
-						}
-						else {
-							*pdst = fill;
-						}
-					}
-					else if (coordY == -1){ // top left out
-						float dx = a-coordX;
-						float dy = b-coordY;
-						int offset = coordY*srcstep+coordX;
-						*pdst = saturate_cast<uchar>((dy)*((dx)*((float)(psrc[offset+1+srcstep])) + (1-dx) * ((float) fill)) + (1-dy) * ((float)fill));
-					}
-					else {
-						*pdst = fill;
-					}
-				}
-				else {
-					*pdst = fill;
-				}
-			}
-		}
+	vector<float> cosTheta(dstwidth), sinTheta(dstwidth);
+	float theta = 0;
+	for (int x=0; x < dstwidth; x++, theta += thetaoffset){
+		cosTheta[x] = cos(theta);
+		sinTheta[x] = sin(theta);
 	}
-	else { // INTER_LINEAR_REPEAT (repeats last pixel value)
-		uchar * firstLine = pdst + dst.step;
-		for (int y=0; y < dstheight; y++, pdst+= dstoffset, r+= roffset){
-			float theta = 0;
-			for (int x=0; x < dstwidth; x++, theta += thetaoffset,pdst++){
-				float a = centerX + r * cos(theta);//std::cos(theta);
-				float b = centerY + r * sin(theta);//std::sin(theta);
-				int coordX = cvFloor(a);
-				int coordY = cvFloor(b);
-				if (coordX >= 0){
-					if (coordY >= 0){
-						if (coordX < srcwidth-1){
-							if (coordY < srcheight-1){
-								float dx = a-coordX;
-								float dy = b-coordY;
-								int offset = coordY*srcstep+coordX;
-								*pdst = saturate_cast<uchar>((1-dy)*((1-dx)*((float)(psrc[offset])) + dx*(float)(psrc[offset+1]))+ dy*((1-dx)*((float)(psrc[offset+srcstep])) + dx*(float)(psrc[offset+1+srcstep])));
-							}
-							else if (coordY == srcheight-1){ // bottom out
-								float dx = a-coordX;
-								int offset = coordY*srcstep+coordX;
-								*pdst = saturate_cast<uchar>(((1-dx)*((float)(psrc[offset])) + dx*(float)(psrc[offset+1])));
-							}
-							else if (pdst >= firstLine){
-								*pdst = *(pdst - dst.step); // one row above;
-							}
-							else {
-								*pdst = fill;
-							}
-						}
-						else if (coordX == srcwidth-1){
-							if (coordY < srcheight-1){// right out
-								float dy = b-coordY;
-								int offset = coordY*srcstep+coordX;
-								*pdst = saturate_cast<uchar>(((1-dy)*((float)(psrc[offset]))+ dy*((float)(psrc[offset+srcstep]))));
-							}
-							else if (coordY == srcheight-1){ // bottom right out
-								int offset = coordY*srcstep+coordX;
-								*pdst = psrc[offset];
-							}
-							else if (pdst >= firstLine){
-								*pdst = *(pdst - dst.step); // one row above;
-							}
-							else {
-								*pdst = fill;
-							}
-						}
-						else {
-							*pdst = *(pdst - dst.step); // one row above;
-						}
-					}
-					else if (coordY == -1){
-						if (coordX < srcwidth-1){// top out
-							float dx = a-coordX;
-							int offset = coordY*srcstep+coordX;
-							*pdst = saturate_cast<uchar>(((1-dx)*((float)(psrc[offset+srcstep])) + dx*(float)(psrc[offset+1+srcstep])));
-
-						}
-						else if (coordX == srcwidth-1){// top right out
-							int offset = coordY*srcstep+coordX;
-							*pdst = psrc[offset+srcstep];
-						}
-						else if (pdst >= firstLine){
-							*pdst = *(pdst - dst.step);
-						}
-						else {
-							*pdst = fill; // one row above;
-						}
-					}
-					else {
-						*pdst = *(pdst - dst.step); // one row above;
-					}
-				}
-				else if (coordX == -1){
-					if (coordY >= 0){
-						if (coordY < srcheight-1){// left out
-							float dy = b-coordY;
-							int offset = coordY*srcstep+coordX;
-							*pdst = saturate_cast<uchar>(((1-dy)*(float)(psrc[offset+1]) + dy*(float)(psrc[offset+1+srcstep])));
-						}
-						else if (coordY == srcheight-1){ // bottom left out
-							int offset = coordY*srcstep+coordX;
-							*pdst = psrc[offset+1];
-						}
-						else if (pdst >= firstLine){
-							*pdst = *(pdst - dst.step); // one row above;
-						}
-						else {
-							*pdst = fill;
-						}
-					}
-					else if (coordY == -1){ // top left out
-						int offset = coordY*srcstep+coordX;
-						*pdst = psrc[offset+1+srcstep];
-					}
-					else if (pdst >= firstLine){
-						*pdst = *(pdst - dst.step); // one row above;
-					}
-					else {
-						*pdst = fill;
-					}
-				}
-				else if (pdst >= firstLine){
-					*pdst = *(pdst - dst.step); // one row above;
-				}
-				else {
-					*pdst = fill;
-				}
-			}
+	float r = 0;
+	for (int y=0, idx=0; y < dstheight; y++, r+= roffset){
+		for (int x=0; x < dstwidth; x++, idx++){
+			rubbersheetSet(sheet, idx, centerX + r * cosTheta[x], centerY + r * sinTheta[x]);
 		}
 	}
 	return roffset;
 }
 
+/*
+ * Calculates the mapped (polar) image of source using transformation center (polar origin) and radius.
+ *
+ * src: CV_8UC1 (cartesian) source image
+ * dst: CV_8UC1 (polar) destination image (same size as src)
+ * centerX: x-coordinate of polar origin in (floating point) pixels of the source image
+ * centerY: y-coordinate of polar origin in (floating point) pixels of the source image
+ * radius: radius in pixels of the source image (to map whole image, this should be the maximum of distances between origin and corners)
+ * interpolation: interpolation mode (INTER_NEAREST, INTER_LINEAR or INTER_LINEAR_REPEAT)
+ * fill: fill value for pixels out of the image
+ *
+ * returning: polar resolution
+ */
+float polarTransform(const Mat& src, Mat& dst, const float centerX = 0, const float centerY = 0, const float radius = -1, const int interpolation = INTER_LINEAR, const uchar fill = 0) {
+	RubbersheetMap sheet;
+	float resolution = polarMap(centerX, centerY, radius, dst.size(), src.size(), sheet);
+	rubbersheetRemap(src, dst, sheet, interpolation, fill);
+	return resolution;
+}
+
 /**
  * Constructs a gabor 2D kernel
  *
@@ -2767,58 +2034,90 @@ void ellipse2polar(const RotatedRect& ellipse, Mat& cont, const float centerX, c
 
 
 /**
- * Normalizes a function based on DFT by keeping the first numberCoeffs fourier coefficients only
- * f:            original signal, should be Mat (1, size, CV_32FC1);
+ * Cosine and sine of the angles 2 * PI * m / size (m = 0 .. size-1) of a contour of given size
+ */
+struct FourierTable {
+	vector<double> cosine, sine;
+};
+
+/**
+ * Returns the Fourier table of contours of given size from a process-wide cache. Tables are
+ * computed on first use and never released, so the returned reference stays valid and can be
+ * shared by all threads.
+ */
+static const FourierTable& fourierTable(const int size){
+	static mutex lock;
+	static map<int, FourierTable> tables;
+	lock_guard<mutex> guard(lock);
+	map<int, FourierTable>::iterator it = tables.find(size);
+	if (it != tables.end()) return it->second;
+	FourierTable& table = tables[size];
+	table.cosine.resize(size);
+	table.sine.resize(size);
+	for (int m=0; m < size; m++){
+		table.cosine[m] = cos(2 * M_PI * m / size);
+		table.sine[m] = sin(2 * M_PI * m / size);
+	}
+	return table;
+}
+
+/**
+ * Normalizes a function by keeping the first numberCoeffs fourier coefficients only. The coefficients
+ * are computed directly in O(size * numberCoeffs) and equal those of the DFT (supports in-place).
+ * cont:         original signal, should be Mat (1, size, CV_32FC1);
  * norm:         normalized signal, should be Mat (1, size, CV_32FC1);
- * energy:		 total energy of the first numberCoeffs Fourier coefficients
- * numberCoeffs: number of fourrier coefficients to keep
+ * energy:		 total energy (norm) of the first numberCoeffs Fourier coefficients (DC excluded, of all
+ *               coefficients if all are kept)
+ * numberCoeffs: number of fourrier coefficients to keep (all if negative)
  */
 void fourierNormalize(Mat& cont, Mat& norm, float& energy, const int numberCoeffs = -1){
 	CV_Assert(cont.size() == norm.size());
+	CV_Assert(cont.type() == CV_32FC1 && norm.type() == CV_32FC1);
 	int size = cont.cols;
-	int dftSize = getOptimalDFTSize(size);
-	if (dftSize != size){
-		printf("WARNING ERROR");
-		Mat g (1,dftSize,CV_32FC1);
-		float mean = cv::mean(cont)[0];
-		int * src = (int *) cont.data;
-		MatIterator_<float> dst = g.begin<float>();
-		double inc = ((double)size) / dftSize;
-		double idx = 0;
-		for (MatConstIterator_<float> e = g.end<float>(); dst != e; dst++, idx += inc){
-			*dst = src[min(size-1,cvRound(idx))] - mean;
+	const float * src = (const float *) cont.data;
+	double mean = 0;
+	for (int x=0; x < size; x++) mean += src[x];
+	mean /= size;
+	if (numberCoeffs < 0 || 1 + 2*numberCoeffs >= size){ // all coefficients are kept
+		// energy by Parseval (coefficients j and size-j have equal magnitudes, size/2 is real)
+		double sum = 0, nyquist = 0;
+		for (int x=0; x < size; x++){
+			double v = src[x] - mean;
+			sum += v * v;
+			nyquist += (x % 2 == 0) ? v : -v;
 		}
-		Mat gFourier (1,dftSize,CV_32FC1);
-		dft(g,gFourier,CV_DXT_FORWARD);
-		if (numberCoeffs >= 0 && (1 + 2*numberCoeffs) < dftSize){
-			Mat roi(gFourier,Rect(1 + 2*numberCoeffs,0,dftSize - (1 + 2*numberCoeffs),1));
-			roi.setTo(0);
-			roi = Mat(gFourier,Rect(1,0,2*numberCoeffs,1));
-			energy = cv::norm(roi);
-		}
-		dft(gFourier,g,CV_DXT_INV_SCALE);
-		float * isrc = (float *) g.data;
-		MatIterator_<int> idst = norm.begin<int>();
-		inc = ((double)dftSize) / size;
-		idx = 0;
-		for (MatConstIterator_<int> e = norm.end<int>(); idst != e; idst++, idx += inc){
-			*idst = saturate_cast<int>(isrc[min(dftSize-1,cvRound(idx))] + mean);
+		sum *= size;
+		if (size % 2 == 0) sum += nyquist * nyquist;
+		energy = sqrt(sum / 2);
+		if (norm.data != cont.data) cont.copyTo(norm);
+		return;
+	}
+	const FourierTable& table = fourierTable(size);
+	// project onto the kept coefficients (real and imaginary part as in the forward DFT)
+	vector<double> re(numberCoeffs+1, 0), im(numberCoeffs+1, 0);
+	double sum = 0;
+	for (int j=1; j <= numberCoeffs; j++){
+		double a = 0, b = 0;
+		for (int x=0, m=0; x < size; x++, m += j){
+			if (m >= size) m -= size;
+			double v = src[x] - mean;
+			a += v * table.cosine[m];
+			b -= v * table.sine[m];
 		}
+		re[j] = a;
+		im[j] = b;
+		sum += a*a + b*b;
 	}
-	else {
-		Mat g (1,dftSize,CV_32FC1);
-		float mean = cv::mean(cont)[0];
-		g = cont - mean;
-		Mat gFourier (1,dftSize,CV_32FC1);
-		dft(g,gFourier,CV_DXT_FORWARD);
-		if (numberCoeffs >= 0 && (1 + 2*numberCoeffs) < dftSize){
-			Mat roi(gFourier,Rect(1 + 2*numberCoeffs,0,dftSize - (1 + 2*numberCoeffs),1));
-			roi.setTo(0);
-			roi = Mat(gFourier,Rect(1,0,2*numberCoeffs,1));
-			energy = cv::norm(roi);
+	energy = sqrt(sum);
+	// reconstruct from the kept coefficients (as the scaled inverse DFT)
+	float * dst = (float *) norm.data;
+	for (int x=0; x < size; x++){
+		double v = 0;
+		for (int j=1, m=x; j <= numberCoeffs; j++, m += x){
+			if (m >= size) m %= size;
+			v += re[j] * table.cosine[m] - im[j] * table.sine[m];
 		}
-		dft(gFourier,g,CV_DXT_INV_SCALE);
-		norm = g + mean;
+		dst[x] = (float)(mean + 2 * v / size);
 	}
 }
 
@@ -3261,70 +2560,68 @@ void adjust_luminance(Mat& image, int black, int white)
 }
 
 /*
- * Make light areas lighter
+ * Make light areas lighter: each pixel is set to the sum of the cw x ch window
+ * around it (clipped to the image), saturated at 255. Column sums and the
+ * window sum are updated incrementally, so the cost does not depend on the
+ * window size.
+ * inverted: store 255 minus the result (replaces a subsequent invert)
  */
-void cumulate(const Mat& image, Mat& result, int cw, int ch)
+void cumulate(const Mat& image, Mat& result, int cw, int ch, bool inverted = false)
 {
 	CV_Assert(image.size() == result.size());
 
     int w = image.cols;
     int h = image.rows;
-    int step = image.step;
-    uchar* data = image.data;
-    uchar* a = result.data;
     int ox = cw / 2;
     int oy = ch / 2;
-    for (int y = 0; y < h; y++)
+    /* sums of the window rows y - oy .. y - oy + ch - 1 for each column */
+    vector<int> cols(w, 0);
+    for (int j = 0; j < ch - oy - 1 && j < h; j++)
     {
-        int ay, by;
-        if (y < oy)
-        {
-            ay = oy - y;
-        }
-        else
+        const uchar* row = image.ptr<uchar>(j);
+        for (int x = 0; x < w; x++)
         {
-            ay = 0;
+            cols[x] += row[x];
         }
-        if (y + ch - oy > h)
+    }
+    for (int y = 0; y < h; y++)
+    {
+        int enter = y - oy + ch - 1;
+        if (enter >= 0 && enter < h)
         {
-            by = h + oy - y;
+            const uchar* row = image.ptr<uchar>(enter);
+            for (int x = 0; x < w; x++)
+            {
+                cols[x] += row[x];
+            }
         }
-        else
+        uchar* a = result.ptr<uchar>(y);
+        int sum = 0;
+        for (int i = 0; i < cw - ox - 1 && i < w; i++)
         {
-            by = ch;
+            sum += cols[i];
         }
         for (int x = 0; x < w; x++)
         {
-            int sum = 0;
-            int ax, bx;
-            if (x < ox)
-            {
-                ax = ox - x;
-            }
-            else
+            if (x - ox + cw - 1 < w)
             {
-                ax = 0;
+                sum += cols[x - ox + cw - 1];
             }
-            if (x + cw - ox > w)
+            int v = (sum > 255) ? 255 : sum;
+            a[x] = (inverted) ? 255 - v : v;
+            if (x - ox >= 0)
             {
-                bx = w + ox - x;
+                sum -= cols[x - ox];
             }
-            else
-            {
-                bx = cw;
-            }
-            for (int j = ay; j < by; j++)
-            {
-                for (int i = ax; i < bx; i++)
-                {
-                    sum += data[(y + j - oy) * step + (x + i - ox)];
-                }
-            }
-            if (sum > 255)
+        }
+        int leave = y - oy;
+        if (leave >= 0)
+        {
+            const uchar* row = image.ptr<uchar>(leave);
+            for (int x = 0; x < w; x++)
             {
-                sum = 255;
+                cols[x] -= row[x];
             }
-            a[y * step + x] = sum;
         }
     }
 }
@@ -3453,27 +2750,79 @@ void convolution_brute(const Mat& image, Mat& res, const Mat& kernel)
 
 /*
  * Returns a new image of size w times h with the result of a gaussian
- * smoothing operation.
- * TODO: Should do this in frequency domain, especially for big radius.
+ * smoothing operation. The 2D kernel is the product of two 1D kernels, so the
+ * image is convolved row-wise and then column-wise (2 * size instead of
+ * size * size multiply-adds per pixel). As in convolution_brute, taps outside
+ * the image are replaced by the center row or column; only pixels near the
+ * border check the tap positions. tests/gaussian_smooth.h compares the result
+ * to the 2D convolution.
  */
 void gaussian_smooth(Mat& image, Mat& res, double sigma, int size)
 {
     double sigma2 = sigma * sigma;
-    int kw = size;
-    int kh = size;
-    Mat kernel(kh,kw,CV_32FC1);
-    float *pos = (float *) kernel.data;
-    int off = (kernel.step / sizeof(float)) - kernel.cols;
+    int w = image.cols;
+    int h = image.rows;
     int o = -size / 2;
-    for (int j = o; j < kh + o; j++, pos+=off)
+    /* factors of exp(-(i * i + j * j) / (2 * sigma2)) / (2 * M_PI * sigma2) */
+    vector<float> kx(size), ky(size);
+    for (int i = 0; i < size; i++)
+    {
+        double g = exp(-((i + o) * (i + o)) / (2 * sigma2));
+        kx[i] = g;
+        ky[i] = g / (2 * M_PI * sigma2);
+    }
+    /* pixels [x0,x1) of a row have all horizontal taps inside the image */
+    int x0 = std::min(-o, w);
+    int x1 = std::max(x0, w - size + 1 - o);
+    Mat temp(h, w, CV_32FC1);
+    for (int y = 0; y < h; y++)
     {
-        for (int i = o; i < kw + o; i++, pos++)
-        /* This is 2D (for 1D, sqrt the factor) */
+        const float *src = image.ptr<float>(y);
+        float *dst = temp.ptr<float>(y);
+        for (int x = 0; x < w; x++)
+        {
+            dst[x] = 0;
+        }
+        for (int i = 0; i < size; i++)
+        {
+            float k = kx[i];
+            const float *s = src + i + o;
+            for (int x = x0; x < x1; x++)
+            {
+                dst[x] += k * s[x];
+            }
+        }
+        for (int x = 0; x < w; x++)
         {
-            *pos = exp(-(i * i + j * j) / (2 * sigma2)) / (2 * M_PI * sigma2);
+            if (x == x0) x = x1;
+            if (x >= w) break;
+            float sum = 0;
+            for (int i = 0; i < size; i++)
+            {
+                int xi = x + i + o;
+                sum += kx[i] * src[(xi >= 0 && xi < w) ? xi : x];
+            }
+            dst[x] = sum;
+        }
+    }
+    for (int y = 0; y < h; y++)
+    {
+        float *dst = res.ptr<float>(y);
+        for (int x = 0; x < w; x++)
+        {
+            dst[x] = 0;
+        }
+        for (int j = 0; j < size; j++)
+        {
+            int yj = y + j + o;
+            float k = ky[j];
+            const float *s = temp.ptr<float>((yj >= 0 && yj < h) ? yj : y);
+            for (int x = 0; x < w; x++)
+            {
+                dst[x] += k * s[x];
+            }
         }
     }
-    convolution_brute(image, res, kernel);
 }
 
 /*
@@ -4123,6 +3472,20 @@ void mask_lids(const Mat& orig_image, Mat& mask, int px, int py, int pr, int ix,
 }
 
 
+/** ------------------------------- Segmentation workspace ------------------------------- **/
+
+/*
+ * Images and tables of one segmentation which are kept from one input file to the next, one
+ * workspace per worker thread. Mat::create only reallocates if size or type change, so a batch of
+ * equally sized images reuses the same memory and threads do not compete for the allocator.
+ */
+struct Workspace {
+	Mat img, orig, mask, gradX, gradY, mag, boundaryEdges;
+	Mat polar, polarMask, polarGrad, ellipsopolar, ellipsopolarMask, ellipsopolarGrad;
+	Mat imask, bw, out, maskout;
+	RubbersheetMap polarSheet, sheet;
+};
+
 /** ------------------------------- commandline functions ------------------------------- **/
 
 /**
@@ -4535,7 +3898,7 @@ int main(int argc, char *argv[])
     	else mode = MODE_MAIN;
     	if (mode == MODE_MAIN){
 			// validate command line
-			cmdCheckOpts(cmd,"-i|-o|-s|-e|-q|-t|-m|-rm|-rr|-em|-gr|-ic|-po|-fb|-ep|-ib|-ob|-sr|-bm|-lt|-tu|-so|-si|-tr|-l|-noscale");
+			cmdCheckOpts(cmd,"-i|-o|-s|-e|-q|-t|-m|-rm|-rr|-em|-gr|-ic|-po|-fb|-ep|-ib|-ob|-sr|-bm|-lt|-tu|-so|-si|-tr|-l|-noscale|-j|-prof");
 			cmdCheckOptExists(cmd,"-i");
 			cmdCheckOptSize(cmd,"-i",1);
 			string inFiles = cmdGetPar(cmd,"-i");
@@ -4673,6 +4036,20 @@ int main(int argc, char *argv[])
                 cmdCheckOptSize(cmd, "-tr", 1);
                 translate = cmdGetParFloat(cmd, "-tr", 0);
             }
+			int jobs = 1;
+			if (cmdGetOpt(cmd,"-j") != 0){
+				cmdCheckOptSize(cmd,"-j",1);
+				jobs = cmdGetParInt(cmd,"-j");
+				CV_Assert(jobs >= 1);
+			}
+			// reflection masking, gradients, center detection and the boundary candidates run single-threaded when
+			// several files are processed at once
+			int stageThreads = (jobs > 1) ? 1 : 0;
+			Profile profile;
+			if (cmdGetOpt(cmd,"-prof") != 0){
+				cmdCheckOptSize(cmd,"-prof",1);
+				profile.open(cmdGetPar(cmd,"-prof"));
+			}
 			ofstream logFile;
 			if (cmdGetOpt(cmd,"-l") != 0){
 				cmdCheckOptSize(cmd,"-l",1);
@@ -4704,13 +4081,17 @@ int main(int argc, char *argv[])
 			patternToFiles(inFiles,files);
 			CV_Assert(files.size() > 0);
 			timing.total = files.size();
-			for (vector<string>::iterator inFile = files.begin(); inFile != files.end(); ++inFile, timing.progress++){
-				if (!quiet) printf("Loading image '%s' ...\n", (*inFile).c_str());;
+			vector<Workspace> workspaces(jobs);
+			auto processFile = [&](const string& inFile, int worker, ostream& logLines){
+				Workspace& ws = workspaces[worker];
+				ProfileTimer timer(profile, inFile);
+				timer.stage("load");
+				if (!quiet) printf("Loading image '%s' ...\n", inFile.c_str());;
 				// MODIFICATION TB, June 3rd, 2014
 				// additional conversion step to enable direct JP2K processing (Bug in CV)
 				// Loading of JP2k in color is supported, loading as grayscale, however, not
-				Mat imgCol = imread(*inFile, CV_LOAD_IMAGE_COLOR);			
-				Mat img;			
+				Mat imgCol = imread(inFile, CV_LOAD_IMAGE_COLOR);			
+				Mat& img = ws.img;
 				cvtColor(imgCol,img,CV_BGR2GRAY);
 				CV_Assert(img.data != 0);
                 if( downscale){
@@ -4729,44 +4110,45 @@ int main(int argc, char *argv[])
                     } 
                     else printf(" seems fine.\n");
                 }
-				Mat orig;
+				Mat& orig = ws.orig;
 				if (!segresFiles.empty()) img.copyTo(orig);
 				int width = img.cols;
 				int height = img.rows;
 				int cx1 = 0, cy1 = 0, cr1 = 0;
 				int cx2 = 0, cy2 = 0, cr2 = 0;
 				int cx3 = 0, cy3 = 0, cr3 = 0;
+				timer.stage("reflections");
 				if (!quiet) printf("Removing reflections ...\n");
-				Mat mask(height,width,CV_8UC1);
-				createReflectionMask(img, mask);
+				Mat& mask = ws.mask;
+				mask.create(height,width,CV_8UC1);
+				createReflectionMask(img, mask, 20, 3, 11, 1, stageThreads);
 				if (!rmaskFiles.empty()){
 					string rmaskFile;
-					patternFileRename(inFiles,rmaskFiles,*inFile,rmaskFile);
+					patternFileRename(inFiles,rmaskFiles,inFile,rmaskFile);
 					if (!quiet) printf("Storing reflection mask '%s' ...\n",rmaskFile.c_str());
 					if (!imwrite(rmaskFile,mask)) CV_Error(CV_StsError,"Could not save image '" + rmaskFile + "'");
 				}
 				inpaint(img,mask,img,10,INPAINT_NS);
 				if (!rremovFiles.empty()){
 					string nonreflectFile;
-					patternFileRename(inFiles,rremovFiles,*inFile,nonreflectFile);
+					patternFileRename(inFiles,rremovFiles,inFile,nonreflectFile);
 					if (!quiet) printf("Storing reflection-removed image '%s' ...\n",nonreflectFile.c_str());
 					if (!imwrite(nonreflectFile,img)) CV_Error(CV_StsError,"Could not save image '" + nonreflectFile + "'");
 				}
+				timer.stage("gradient");
 				if (!quiet) printf("Estimating gradient information ...\n");
-				Mat gradX(height,width,CV_32FC1);
-				Mat gradY(height,width,CV_32FC1);
-				Mat mag(height,width,CV_32FC1);
-				Sobel(img,gradX,gradX.depth(),1,0,7);
-				Sobel(img,gradY,gradY.depth(),0,1,7);
-				maskValue(gradX,gradX,mask,255,0);
-				maskValue(gradY,gradY,mask,255,0);
-				magnitude(gradX,gradY,mag);
+				Mat& gradX = ws.gradX;
+				Mat& gradY = ws.gradY;
+				Mat& mag = ws.mag;
+				float maxMag = 0;
+				gradientMagnitude(img,mask,gradX,gradY,mag,maxMag,stageThreads);
 				
 				if (tune && suppresslid){
 					Mat upperMag(mag,Rect(0,0,mag.cols,mag.rows/3));
 					Mat lowerMag(mag,Rect(0,mag.rows*2/3,mag.cols,mag.rows/3));
 					upperMag.setTo(0);
 					lowerMag.setTo(0);				
+					maxMag = -1; // recomputed from the remaining pixels
 				}
 
 				if (!gradFiles.empty()){
@@ -4783,21 +4165,24 @@ int main(int argc, char *argv[])
 					merge(planes,visual);
 					cvtColor(visual,visual,CV_HSV2BGR);
 					string gradFile;
-					patternFileRename(inFiles,gradFiles,*inFile,gradFile);
+					patternFileRename(inFiles,gradFiles,inFile,gradFile);
 					if (!quiet) printf("Storing gradient image '%s' ...\n",gradFile.c_str());
 					if (!imwrite(gradFile,visual)) CV_Error(CV_StsError,"Could not save image '" + gradFile + "'");
 				}
-				Mat boundaryEdges(height,width,CV_8UC1);
-				createBoundaryMask(img,boundaryEdges,gradX,gradY,mag);
+				timer.stage("boundary edges");
+				Mat& boundaryEdges = ws.boundaryEdges;
+				boundaryEdges.create(height,width,CV_8UC1);
+				createBoundaryMask(img,boundaryEdges,gradX,gradY,mag,maxMag);
 				if (!emaskFiles.empty()){
 					string emaskFile;
-					patternFileRename(inFiles,emaskFiles,*inFile,emaskFile);
+					patternFileRename(inFiles,emaskFiles,inFile,emaskFile);
 					if (!quiet) printf("Storing edges mask '%s' ...\n",emaskFile.c_str());
 					if (!imwrite(emaskFile,boundaryEdges)) CV_Error(CV_StsError,"Could not save image '" + emaskFile + "'");
 				}
+				timer.stage("eye center");
 				if (!quiet) printf("Detecting initial center ...\n");
 				float centerX, centerY;
-				detectEyeCenter(gradX,gradY,mag,boundaryEdges,centerX, centerY,.5f,101);
+				detectEyeCenter(gradX,gradY,mag,boundaryEdges,centerX, centerY,.5f,101,stageThreads);
 				if (centerX < 0 || centerY < 0 || centerX >= width || centerY >= height){
 					if (!quiet) printf("Warning: Center not in bounds, correcting to image center.\n");
 					centerX = width/2;
@@ -4812,27 +4197,34 @@ int main(int argc, char *argv[])
 					line(visual,Point2f(centerX,0),Point2f(centerX,img.rows),Scalar(0,0,255,0),lt);
 					line(visual,Point2f(0,centerY),Point2f(img.cols,centerY),Scalar(0,0,255,0),lt);
 					string icentFile;
-					patternFileRename(inFiles,icentFiles,*inFile,icentFile);
+					patternFileRename(inFiles,icentFiles,inFile,icentFile);
 					if (!quiet) printf("Storing initial center '%s' ...\n", icentFile.c_str());
 					if (!imwrite(icentFile,visual)) CV_Error(CV_StsError,"Could not save image '" + icentFile + "'");
 				}
+				timer.stage("first boundary");
 				if (!quiet) printf("Detecting first boundary ...\n");
 				int polarWidth = outWidth;
 				int polarHeight = cvRound(polarWidth * height / ((float)(width)));
-				Mat polar (polarHeight,polarWidth,CV_8UC1);
-				Mat polarMask (polarHeight,polarWidth,CV_8UC1);
-				Mat polarGrad (polarHeight,polarWidth,CV_32FC1);
+				Mat& polar = ws.polar;
+				polar.create(polarHeight,polarWidth,CV_8UC1);
+				Mat& polarMask = ws.polarMask;
+				polarMask.create(polarHeight,polarWidth,CV_8UC1);
+				Mat& polarGrad = ws.polarGrad;
+				polarGrad.create(polarHeight,polarWidth,CV_32FC1);
 				Mat cont(1,polarWidth,CV_32FC1);
 				Mat cart (1,polarWidth,CV_32FC2);
 				Mat sub;
-				float resolution = polarTransform(img,polar,centerX,centerY,-1,INTER_LINEAR_REPEAT);
+				// image and mask are sampled at the same positions
+				RubbersheetMap& polarSheet = ws.polarSheet;
+				float resolution = polarMap(centerX,centerY,-1,polar.size(),img.size(),polarSheet);
+				rubbersheetRemap(img,polar,polarSheet,INTER_LINEAR_REPEAT);
 				if (!polarFiles.empty()){
 					string polarFile;
-					patternFileRename(inFiles,polarFiles,*inFile,polarFile);
+					patternFileRename(inFiles,polarFiles,inFile,polarFile);
 					if (!quiet) printf("Storing polar image '%s' ...\n", polarFile.c_str());
 					if (!imwrite(polarFile,polar)) CV_Error(CV_StsError,"Could not save image '" + polarFile + "'");
 				}
-				polarTransform(mask,polarMask,centerX,centerY,-1,INTER_NEAREST);
+				rubbersheetRemap(mask,polarMask,polarSheet,INTER_NEAREST);
 				findHorizontalEdges(polar,polarMask,polarGrad);
 				initContour(polarGrad,cont,12,polarHeight); // CHANGED, REMOVE 115 15
 				gradientFit(cont,polarGrad,15);
@@ -4849,7 +4241,7 @@ int main(int argc, char *argv[])
 						line(visual,Point2f(i,*it),Point2f(i+1, it[1]),Scalar(0,0,255,0),lt);
 					}
 					string fboundFile;
-					patternFileRename(inFiles,fboundFiles,*inFile,fboundFile);
+					patternFileRename(inFiles,fboundFiles,inFile,fboundFile);
 					if (!quiet) printf("Storing first boundary image '%s' ...\n", fboundFile.c_str());
 					if (!imwrite(fboundFile,visual)) CV_Error(CV_StsError,"Could not save image '" + fboundFile + "'");
 				}
@@ -4882,17 +4274,21 @@ int main(int argc, char *argv[])
 				if (abs(boundary.size.width) < 0.0001 || abs(boundary.size.height) < 0.0001){
 					boundary.size.width = 1; boundary.size.height = 1;
 				}
+				timer.stage("ellipsopolar");
 				if (!quiet) printf("Ellipsopolar transform and image enhancement ...\n");
-				Mat ellipsopolar (polarHeight,polarWidth,CV_8UC1);
-				Mat ellipsopolarMask (polarHeight,polarWidth,CV_8UC1);
-				float ellResolution = ellipsopolarTransform(img,ellipsopolar,boundary,-1,INTER_LINEAR_REPEAT);
+				Mat& ellipsopolar = ws.ellipsopolar;
+				ellipsopolar.create(polarHeight,polarWidth,CV_8UC1);
+				Mat& ellipsopolarMask = ws.ellipsopolarMask;
+				ellipsopolarMask.create(polarHeight,polarWidth,CV_8UC1);
+				float ellResolution = ellipsopolarMap(boundary,-1,ellipsopolar.size(),img.size(),polarSheet);
+				rubbersheetRemap(img,ellipsopolar,polarSheet,INTER_LINEAR_REPEAT);
 				if (!ellpolFiles.empty()){
 					string ellpolFile;
-					patternFileRename(inFiles,ellpolFiles,*inFile,ellpolFile);
+					patternFileRename(inFiles,ellpolFiles,inFile,ellpolFile);
 					if (!quiet) printf("Storing polar image '%s' ...\n", ellpolFile.c_str());
 					if (!imwrite(ellpolFile,ellipsopolar)) CV_Error(CV_StsError,"Could not save image '" + ellpolFile + "'");
 				}
-				ellipsopolarTransform(mask,ellipsopolarMask,boundary,-1,INTER_NEAREST);
+				rubbersheetRemap(mask,ellipsopolarMask,polarSheet,INTER_NEAREST);
 				// enhance images and refer to subimages for inner/outer boundary detection
 				int heightInner = max(0,cvRound(1.f/ellResolution));
 				int heightOuter = polarHeight - heightInner;
@@ -4901,48 +4297,87 @@ int main(int argc, char *argv[])
 				equalizeHist(ellipsopolarInner,ellipsopolarInner);
 				clahe(ellipsopolarOuter,ellipsopolarOuter,polarWidth,min(heightOuter, heightInner * 3));
 				// calculate gradient
-				Mat ellipsopolarGrad (polarHeight,polarWidth,CV_32FC1);
+				Mat& ellipsopolarGrad = ws.ellipsopolarGrad;
+				ellipsopolarGrad.create(polarHeight,polarWidth,CV_32FC1);
 				findHorizontalEdges(ellipsopolar,ellipsopolarMask,ellipsopolarGrad);
 				RotatedRect innerEll, outerEll;
 				float enInner = - FLT_MAX, enOuter = - FLT_MAX;
 				Mat cartInner (1,polarWidth,CV_32FC2);
 				Mat cartOuter (1,polarWidth,CV_32FC2);
-				if (!quiet) printf("Detecting inner boundary candidate ...\n");
+				timer.stage("boundary candidates");
 				// detect boundary candidates
 				double myInner = heightInner * 0.66;//.66
 				double sigmaInner = heightInner * 0.4;//.4
+				double myOuter = heightInner * 2.5;//2.5
+				double sigmaOuter = heightInner * 1;// 1
 				if (tune) {
 					myInner = pixelsacrosspupil / 2.f / resolution;
 					sigmaInner = pixelsacrosspupil_stdev / 2.f / resolution;
+					myOuter = pixelsacrossiris / 2.f / resolution;
+					sigmaOuter = pixelsacrossiris_stdev / 2.f / resolution;
+				}
+				double minyInner = 21, maxyInner = heightInner-21;
+				double minyOuter = heightInner+21, maxyOuter = polarHeight-21;
+				bool hasInner = (minyInner < maxyInner), hasOuter = (minyOuter < maxyOuter);
+				Mat contInner (1,polarWidth,CV_32FC1);
+				Mat contOuter (1,polarWidth,CV_32FC1);
+				// fits a boundary candidate between rows miny and maxy of the ellipsopolar gradient (read-only,
+				// so the inner and outer candidate can be searched concurrently)
+				auto findCandidate = [&](Mat& candCont, Mat& candCart, RotatedRect& candEll, float& energy, const double miny, const double maxy, const bool useSectors, const double sigma, const double my){
+					Mat candPolarCart (1,polarWidth,CV_32FC2);
+					float candFeng = 0;
+					initContour(ellipsopolarGrad,candCont,miny,maxy,useSectors,sigma,my);// was sigmaouter
+					gradientFit(candCont,ellipsopolarGrad,15,miny,maxy);
+					fourierNormalize(candCont,candCont,candFeng,1);
+					gradientFit(candCont,ellipsopolarGrad,5,miny,maxy);
+					fourierNormalize(candCont,candCont,candFeng,3);
+					ellipsopolar2Cart(candCont, candPolarCart, boundary, ellResolution);
+					//cartSectors(candPolarCart,sub); // this usually took a different sector
+					//candEll = fitEllipse(sub);
+					candEll = fitEllipse(candPolarCart);
+					ellipse2Cart(candCart,candEll);
+					energy = boundaryEnergyWeighted(mag,candCart,boundary,ellResolution,my,sigma);//boundaryEnergy(mag,candCart);//
+				};
+				if (hasInner && hasOuter && stageThreads != 1 && thread::hardware_concurrency() > 1){
+					exception_ptr outerError;
+					thread outerTask([&](){
+						try {
+							findCandidate(contOuter,cartOuter,outerEll,enOuter,minyOuter,maxyOuter,true,sigmaOuter,myOuter);
+						}
+						catch (...){
+							outerError = current_exception();
+						}
+					});
+					try {
+						findCandidate(contInner,cartInner,innerEll,enInner,minyInner,maxyInner,false,sigmaInner,myInner);
+					}
+					catch (...){
+						outerTask.join();
+						throw;
+					}
+					outerTask.join();
+					if (outerError) rethrow_exception(outerError);
+				}
+				else {
+					if (hasInner) findCandidate(contInner,cartInner,innerEll,enInner,minyInner,maxyInner,false,sigmaInner,myInner);
+					if (hasOuter) findCandidate(contOuter,cartOuter,outerEll,enOuter,minyOuter,maxyOuter,true,sigmaOuter,myOuter);
 				}
-				double miny = 21;
-				double maxy = heightInner-21;
                 RotatedRect fromInner, fromOuter; // keep the source of the inner and outer iris for printout
-				if (miny < maxy){
-					initContour(ellipsopolarGrad,cont,miny,maxy,false,sigmaInner,myInner);// was sigmaouter
-					gradientFit(cont,ellipsopolarGrad,15,miny,maxy);
-					fourierNormalize(cont,cont,feng,1);
-					gradientFit(cont,ellipsopolarGrad,5,miny,maxy);
-					fourierNormalize(cont,cont,feng,3);
+				if (!quiet) printf("Detecting inner boundary candidate ...\n");
+				if (hasInner){
 					if (!iboundFiles.empty()){
 						Mat visual;
 						cvtColor(ellipsopolar,visual,CV_GRAY2BGR);
 						MatIterator_<float> it, ite;
 						int i=0;
-						for (it = cont.begin<float>(), ite = (cont.end<float>()-1); it < ite; it++, i++){
+						for (it = contInner.begin<float>(), ite = (contInner.end<float>()-1); it < ite; it++, i++){
 							line(visual,Point2f(i,*it),Point2f(i+1, it[1]),Scalar(0,0,255,0),lt);
 						}
 						string iboundFile;
-						patternFileRename(inFiles,iboundFiles,*inFile,iboundFile);
+						patternFileRename(inFiles,iboundFiles,inFile,iboundFile);
 						if (!quiet) printf("Storing i border image '%s' ...\n", iboundFile.c_str());
 						if (!imwrite(iboundFile,visual)) CV_Error(CV_StsError,"Could not save image '" + iboundFile + "'");
 					}
-					ellipsopolar2Cart(cont, cart, boundary, ellResolution);
-					//cartSectors(cart,sub); // this usually took a different sector
-					//innerEll = fitEllipse(sub);
-					innerEll = fitEllipse(cart);
-					ellipse2Cart(cartInner,innerEll);
-					enInner = boundaryEnergyWeighted(mag,cartInner,boundary,ellResolution,myInner, sigmaInner);//boundaryEnergy(mag,cartInner);//
 					if (!quiet) printf("Inner boundary candidate found with energy: %f\n", enInner);
 					RotatedRect innerEll_scale = innerEll;
                     innerEll_scale.center.x += translate_from_outer_ref;
@@ -4955,39 +4390,20 @@ int main(int argc, char *argv[])
 					cr2 = (innerEll_scale.size.width + innerEll_scale.size.height) / 2;
 				}
 				if (!quiet) printf("Detecting outer boundary candidate ...\n");
-				double myOuter = heightInner * 2.5;//2.5
-				double sigmaOuter = heightInner * 1;// 1
-				if (tune) {
-					myOuter = pixelsacrossiris / 2.f / resolution;
-					sigmaOuter = pixelsacrossiris_stdev / 2.f / resolution;
-				}
-				miny = heightInner+21;
-				maxy = polarHeight-21;
-				if (miny < maxy){
-					initContour(ellipsopolarGrad,cont,miny,maxy,true,sigmaOuter,myOuter);// was sigmaouter
-					gradientFit(cont,ellipsopolarGrad,15,miny,maxy);
-					fourierNormalize(cont,cont,feng,1);
-					gradientFit(cont,ellipsopolarGrad,5,miny,maxy);
-					fourierNormalize(cont,cont,feng,3);
+				if (hasOuter){
 					if (!oboundFiles.empty()){
 						Mat visual;
 						cvtColor(ellipsopolar,visual,CV_GRAY2BGR);
 						MatIterator_<float> it, ite;
 						int i=0;
-						for (it = cont.begin<float>(), ite = (cont.end<float>()-1); it < ite; it++, i++){
+						for (it = contOuter.begin<float>(), ite = (contOuter.end<float>()-1); it < ite; it++, i++){
 							line(visual,Point2f(i,*it),Point2f(i+1, it[1]),Scalar(0,0,255,0),lt);
 						}
 						string oboundFile;
-						patternFileRename(inFiles,oboundFiles,*inFile,oboundFile);
+						patternFileRename(inFiles,oboundFiles,inFile,oboundFile);
 						if (!quiet) printf("Storing border image '%s' ...\n", oboundFile.c_str());
 						if (!imwrite(oboundFile,visual)) CV_Error(CV_StsError,"Could not save image '" + oboundFile + "'");
 					}
-					ellipsopolar2Cart(cont, cart, boundary, ellResolution);
-					//cartSectors(cart,sub); // this usually took a different sector
-					//outerEll = fitEllipse(sub);
-					outerEll = fitEllipse(cart);
-					ellipse2Cart(cartOuter,outerEll);
-					enOuter = boundaryEnergyWeighted(mag,cartOuter,boundary,ellResolution,myOuter, sigmaOuter);//boundaryEnergy(mag,cartInner);//
 					if (!quiet) printf("Outer boundary candidate found with energy: %f\n", enOuter);
                     //scaling outer boundary
 					RotatedRect outerEll_scale = outerEll;
@@ -5000,6 +4416,7 @@ int main(int argc, char *argv[])
 					cy3 = outerEll_scale.center.y;
 					cr3 = (outerEll_scale.size.width + outerEll_scale.size.height) / 2;
 				}
+				timer.stage("select boundary");
 				if (!quiet) printf("Selecting better candidate ...\n");
 				int px = 0, py = 0, pr = 0, ix = 0, iy = 0, ir = 0;
 				if (borderweight != 0) {
@@ -5032,12 +4449,14 @@ int main(int argc, char *argv[])
 					iy = cy3;
 					ir = cr3;
 				}
-				Mat imask;
+				timer.stage("mask lids");
+				Mat& imask = ws.imask;
 				if (!maskFiles.empty()){
 					imask.create(height,width,CV_8UC1);
 					mask_lids(img, imask, px, py, pr, ix, iy, ir);
 					threshold(imask,imask,1,255,CV_THRESH_BINARY_INV);
 				}
+				timer.stage("visualization");
 				if (!segresFiles.empty()){
 					Mat visual;
 					cvtColor(orig,visual,CV_GRAY2BGR);
@@ -5048,12 +4467,14 @@ int main(int argc, char *argv[])
 						line(visual,Point2f(*it,it[1]),Point2f(it[2], it[3]),Scalar(0,255,0,0),lt);
 					}
 					string vsegmentfile;
-					patternFileRename(inFiles,segresFiles,*inFile,vsegmentfile);
+					patternFileRename(inFiles,segresFiles,inFile,vsegmentfile);
 					if (!quiet) printf("Storing segmentation image '%s' ...\n", vsegmentfile.c_str());
 					if (!imwrite(vsegmentfile,visual)) CV_Error(CV_StsError,"Could not save image '" + vsegmentfile + "'");
 				}
 				if (!binmaskFiles.empty()){
-					Mat bw(height, width, CV_8UC1, Scalar(0));
+					Mat& bw = ws.bw;
+					bw.create(height, width, CV_8UC1);
+					bw.setTo(0);
 					vector<Point> iris_points;
 					float * it = (float *)cartOuter.data;
 					for (int i = 0; i < outWidth; i++){
@@ -5072,17 +4493,19 @@ int main(int argc, char *argv[])
 					fillPoly(bw, pupilp, &outWidth, 1, Scalar(0, 0, 0));
 					if (!binmaskFiles.empty()) {
 						string binmaskFile;
-						patternFileRename(inFiles, binmaskFiles, *inFile, binmaskFile);
+						patternFileRename(inFiles, binmaskFiles, inFile, binmaskFile);
 						if (!quiet) printf("Storing binary mask '%s' ...\n", binmaskFile.c_str());
 						if (!imwrite(binmaskFile, bw)) CV_Error(CV_StsError, "Could not save image '" + binmaskFile + "'");
 					}
 				}
+				timer.stage("rubbersheet");
 				if (!quiet) printf("Creating final texture ...\n");
-				Mat out (outHeight,outWidth,CV_8UC1);
+				Mat& out = ws.out;
+				out.create(outHeight,outWidth,CV_8UC1);
                 if (!quiet) printf("Inner RotatedRect at (%f,%f) size (%f,%f) angle (%f)\n", fromInner.center.x, fromInner.center.y, fromInner.size.width, fromInner.size.height, fromInner.angle);
                 if (!quiet) printf("Outer RotatedRect at (%f,%f) size (%f,%f) angle (%f)\n", fromOuter.center.x, fromOuter.center.y, fromOuter.size.width, fromOuter.size.height, fromOuter.angle);
                 if( logFile.is_open()){ 
-                    logFile << inFile->c_str() << ", " 
+                    logLines << inFile.c_str() << ", " 
                             << fromInner.center.x << ", " 
                             << fromInner.center.y << ", " 
                             << fromInner.size.width << ", " 
@@ -5094,26 +4517,38 @@ int main(int argc, char *argv[])
                             << fromOuter.size.height << ", "
                             << fromOuter.angle << endl;
                 }
-				rubbersheet(img, out, cartInner, cartOuter, INTER_LINEAR);
+				RubbersheetMap& sheet = ws.sheet;
+				rubbersheetMap(cartInner, cartOuter, out.size(), img.size(), sheet);
+				Mat& maskout = ws.maskout;
+				if (!maskFiles.empty()){
+					maskout.create(outHeight,outWidth,CV_8UC1);
+					rubbersheetRemap(img, out, imask, maskout, sheet);
+				}
+				else rubbersheetRemap(img, out, sheet, INTER_LINEAR);
+				timer.stage("clahe");
 				if (enhance){
 					if (!quiet) printf("Enhancing texture ...\n");
 					clahe(out,out,width/8,height/2);
 				}
+				timer.stage("write");
 				if (!maskFiles.empty()){
-					Mat maskout (outHeight,outWidth,CV_8UC1);
-					rubbersheet(imask, maskout, cartInner, cartOuter, INTER_NEAREST);
 					string maskfile;
-					patternFileRename(inFiles,maskFiles,*inFile,maskfile);
+					patternFileRename(inFiles,maskFiles,inFile,maskfile);
 					if (!quiet) printf("Storing mask image '%s' ...\n", maskfile.c_str());
 					if (!imwrite(maskfile,maskout)) CV_Error(CV_StsError,"Could not save image '" + maskfile + "'");
 				}
 				string outfile;
-				patternFileRename(inFiles,outFiles,*inFile,outfile);
+				patternFileRename(inFiles,outFiles,inFile,outfile);
 				if (!quiet) printf("Storing image '%s' ...\n", outfile.c_str());
 				if (!imwrite(outfile,out)) CV_Error(CV_StsError,"Could not save image '" + outfile + "'");
+			};
+			batchProcess(files, jobs, processFile, [&](const string& logLines){
+				if (logFile.is_open()) logFile << logLines;
 				if (time && timing.update()) timing.print();
-			}
+				timing.progress++;
+			});
 			if (time && quiet) timing.clear();
+			profile.summary(quiet);
     	}
     	else if (mode == MODE_HELP){
 			// validate command line